@@ -0,0 +1,96 @@
+
+/*
+ * Copyright (C) Serope.com
+ * 
+ * The bundled SQLite build. When the module is configured with
+ * SQLITELOG_AMALGAMATION set to a directory that holds SQLite's amalgamation
+ * (sqlite3.c and sqlite3.h), SQLite is compiled into the module from this file
+ * instead of being linked from the system's libsqlite3 (see config).
+ * Otherwise, this file is empty.
+ * 
+ * The options below tune SQLite for the module's workload, i.e. many small
+ * inserts, each connection used by one thread at a time:
+ * 
+ * DEFAULT_MEMSTATUS=0          no memory statistics, which otherwise take a
+ *                              global mutex on every allocation
+ * DEFAULT_WAL_SYNCHRONOUS=1    synchronous=NORMAL in WAL mode, which is
+ *                              still durable across process crashes
+ * THREADSAFE=2                 no mutexes on connections, since a connection
+ *                              is only ever used by one thread at a time
+ *                              (or 0, without thread pools)
+ * OMIT_DEPRECATED              no deprecated interfaces
+ * OMIT_SHARED_CACHE            no shared cache, which the module never uses
+ * OMIT_LOAD_EXTENSION          no loadable extensions, nor libdl
+ * OMIT_PROGRESS_CALLBACK       no progress handler checks in the VDBE loop
+ * LIKE_DOESNT_MATCH_BLOBS      no LIKE or GLOB on BLOB values
+ * MAX_EXPR_DEPTH=0             no expression depth checks
+ * USE_ALLOCA                   alloca() for some temporary allocations
+ * 
+ * Any of them can be overridden by defining it in --with-cc-opt.
+ */
+
+
+#include <ngx_auto_config.h>
+
+
+#if (NGX_HTTP_SQLITELOG_AMALGAMATION)
+
+#ifndef SQLITE_DEFAULT_MEMSTATUS
+#define SQLITE_DEFAULT_MEMSTATUS            0
+#endif
+
+#ifndef SQLITE_DEFAULT_WAL_SYNCHRONOUS
+#define SQLITE_DEFAULT_WAL_SYNCHRONOUS      1
+#endif
+
+#ifndef SQLITE_THREADSAFE
+#if (NGX_THREADS)
+#define SQLITE_THREADSAFE                   2
+#else
+#define SQLITE_THREADSAFE                   0
+#endif
+#endif
+
+#ifndef SQLITE_MAX_EXPR_DEPTH
+#define SQLITE_MAX_EXPR_DEPTH               0
+#endif
+
+#define SQLITE_OMIT_DEPRECATED              1
+#define SQLITE_OMIT_SHARED_CACHE            1
+#define SQLITE_OMIT_LOAD_EXTENSION          1
+#define SQLITE_OMIT_PROGRESS_CALLBACK       1
+#define SQLITE_LIKE_DOESNT_MATCH_BLOBS      1
+#define SQLITE_USE_ALLOCA                   1
+
+
+/*
+ * Nginx builds with -Werror, and SQLite doesn't promise to be free of the
+ * warnings that -W -Wall enables, so they're not errors in SQLite's code.
+ */
+#if defined(__clang__)
+#pragma clang diagnostic ignored "-Wunknown-warning-option"
+#pragma clang diagnostic ignored "-Wsign-compare"
+#pragma clang diagnostic ignored "-Wunused-parameter"
+#pragma clang diagnostic ignored "-Wunused-function"
+#pragma clang diagnostic ignored "-Wunused-variable"
+#pragma clang diagnostic ignored "-Wunused-but-set-variable"
+#pragma clang diagnostic ignored "-Wimplicit-fallthrough"
+#pragma clang diagnostic ignored "-Wmissing-field-initializers"
+#pragma clang diagnostic ignored "-Wcast-function-type"
+#elif defined(__GNUC__)
+#pragma GCC diagnostic ignored "-Wpragmas"
+#pragma GCC diagnostic ignored "-Wsign-compare"
+#pragma GCC diagnostic ignored "-Wunused-parameter"
+#pragma GCC diagnostic ignored "-Wunused-function"
+#pragma GCC diagnostic ignored "-Wunused-variable"
+#pragma GCC diagnostic ignored "-Wunused-but-set-variable"
+#pragma GCC diagnostic ignored "-Wimplicit-fallthrough"
+#pragma GCC diagnostic ignored "-Wmissing-field-initializers"
+#pragma GCC diagnostic ignored "-Wcast-function-type"
+#pragma GCC diagnostic ignored "-Wmisleading-indentation"
+#endif
+
+
+#include "sqlite3.c"
+
+#endif
@@ -0,0 +1,448 @@
+
+/*
+ * Copyright (C) Serope.com
+ */
+
+
+#include <ngx_core.h>
+#include <sqlite3.h>
+
+
+#include "ngx_http_sqlitelog_batch.h"
+#include "ngx_http_sqlitelog_col.h"
+#include "ngx_http_sqlitelog_db.h"
+#include "ngx_http_sqlitelog_fmt.h"
+#include "ngx_http_sqlitelog_sqlite3.h"
+#include "ngx_http_sqlitelog_util.h"
+
+
+/*
+ * ngx_http_sqlitelog_batch_vtab_t is a batch virtual table.
+ * 
+ * base     the SQLite virtual table
+ * db       the database whose current batch is read
+ * table    the index of the table's format in the database's formats
+ * fmt      the table's format
+ */
+typedef struct {
+    sqlite3_vtab                 base;
+    ngx_http_sqlitelog_db_t     *db;
+    ngx_uint_t                   table;
+    ngx_http_sqlitelog_fmt_t    *fmt;
+} ngx_http_sqlitelog_batch_vtab_t;
+
+
+/*
+ * ngx_http_sqlitelog_batch_cursor_t is a position in the current batch.
+ * 
+ * base     the SQLite virtual table cursor
+ * part     the list part of the current log entry, or NULL at the end
+ * i        the index of the current log entry in part
+ * rowid    the amount of log entries returned so far
+ */
+typedef struct {
+    sqlite3_vtab_cursor          base;
+    ngx_list_part_t             *part;
+    ngx_uint_t                   i;
+    sqlite3_int64                rowid;
+} ngx_http_sqlitelog_batch_cursor_t;
+
+
+static int ngx_http_sqlitelog_batch_connect(sqlite3 *conn, void *aux,
+    int argc, const char *const *argv, sqlite3_vtab **vtab, char **err);
+static int ngx_http_sqlitelog_batch_best_index(sqlite3_vtab *vtab,
+    sqlite3_index_info *info);
+static int ngx_http_sqlitelog_batch_disconnect(sqlite3_vtab *vtab);
+static int ngx_http_sqlitelog_batch_open(sqlite3_vtab *vtab,
+    sqlite3_vtab_cursor **cursor);
+static int ngx_http_sqlitelog_batch_close(sqlite3_vtab_cursor *cursor);
+static int ngx_http_sqlitelog_batch_filter(sqlite3_vtab_cursor *cursor,
+    int idx_num, const char *idx_str, int argc, sqlite3_value **argv);
+static int ngx_http_sqlitelog_batch_next(sqlite3_vtab_cursor *cursor);
+static int ngx_http_sqlitelog_batch_eof(sqlite3_vtab_cursor *cursor);
+static int ngx_http_sqlitelog_batch_column(sqlite3_vtab_cursor *cursor,
+    sqlite3_context *ctx, int n);
+static int ngx_http_sqlitelog_batch_rowid(sqlite3_vtab_cursor *cursor,
+    sqlite3_int64 *rowid);
+static void ngx_http_sqlitelog_batch_seek(
+    ngx_http_sqlitelog_batch_cursor_t *cur);
+
+
+static sqlite3_module  ngx_http_sqlitelog_batch_module = {
+    0,                                          /* iVersion */
+    ngx_http_sqlitelog_batch_connect,           /* xCreate */
+    ngx_http_sqlitelog_batch_connect,           /* xConnect */
+    ngx_http_sqlitelog_batch_best_index,        /* xBestIndex */
+    ngx_http_sqlitelog_batch_disconnect,        /* xDisconnect */
+    ngx_http_sqlitelog_batch_disconnect,        /* xDestroy */
+    ngx_http_sqlitelog_batch_open,              /* xOpen */
+    ngx_http_sqlitelog_batch_close,             /* xClose */
+    ngx_http_sqlitelog_batch_filter,            /* xFilter */
+    ngx_http_sqlitelog_batch_next,              /* xNext */
+    ngx_http_sqlitelog_batch_eof,               /* xEof */
+    ngx_http_sqlitelog_batch_column,            /* xColumn */
+    ngx_http_sqlitelog_batch_rowid,             /* xRowid */
+    NULL,                                       /* xUpdate */
+    NULL,                                       /* xBegin */
+    NULL,                                       /* xSync */
+    NULL,                                       /* xCommit */
+    NULL,                                       /* xRollback */
+    NULL,                                       /* xFindFunction */
+    NULL,                                       /* xRename */
+    NULL,                                       /* xSavepoint */
+    NULL,                                       /* xRelease */
+    NULL,                                       /* xRollbackTo */
+#if (SQLITE_VERSION_NUMBER >= 3026000)
+    NULL,                                       /* xShadowName */
+#endif
+#if (SQLITE_VERSION_NUMBER >= 3044000)
+    NULL,                                       /* xIntegrity */
+#endif
+};
+
+
+/**
+ * Register the sqlitelog_batch module on a database connection and create a
+ * batch virtual table for each of the database's tables.
+ * 
+ * @param   db      a database struct with an open connection
+ * @param   log     an Nginx log for writing errors
+ * @return          a SQLite3 status code
+ */
+int
+ngx_http_sqlitelog_batch_init(ngx_http_sqlitelog_db_t *db, ngx_log_t *log)
+{
+    int                         rc_create;
+    int                         rc_module;
+    ngx_uint_t                  i;
+    ngx_http_sqlitelog_fmt_t  **fmt;
+    
+    db->batch = NULL;
+    
+    rc_module = sqlite3_create_module(db->conn, "sqlitelog_batch",
+                                      &ngx_http_sqlitelog_batch_module, db);
+    if (rc_module != SQLITE_OK) {
+        ngx_log_error(NGX_LOG_ERR, log, 0,
+                      "sqlitelog: failed to register batch module on "
+                      "database \"%V\"", &db->filename);
+        return rc_module;
+    }
+    
+    fmt = db->formats.elts;
+    for (i = 0; i < db->formats.nelts; i++) {
+        rc_create = ngx_http_sqlitelog_sqlite3_exec(db->conn,
+                                         fmt[i]->sql_batch_create, NULL, NULL,
+                                         NULL, log);
+        if (rc_create != SQLITE_OK) {
+            return rc_create;
+        }
+    }
+    
+    return SQLITE_OK;
+}
+
+
+/**
+ * Create or connect to a batch virtual table. Its only argument is the name
+ * of the table that it belongs to, and it has one column per column of that
+ * table.
+ * 
+ * @param   conn    the database connection
+ * @param   aux     the database struct
+ * @param   argc    the amount of arguments
+ * @param   argv    the module name, schema name, table name, and arguments
+ * @param   vtab    a pointer in which to return the virtual table
+ * @param   err     a pointer in which to return an error message
+ * @return          a SQLite3 status code
+ */
+static int
+ngx_http_sqlitelog_batch_connect(sqlite3 *conn, void *aux, int argc,
+    const char *const *argv, sqlite3_vtab **vtab, char **err)
+{
+    int                               rc;
+    u_char                           *p;
+    u_char                           *sql;
+    ngx_str_t                         name;
+    ngx_uint_t                        i;
+    ngx_uint_t                        table;
+    ngx_http_sqlitelog_db_t          *db;
+    ngx_http_sqlitelog_fmt_t        **fmt;
+    ngx_http_sqlitelog_batch_vtab_t  *batch;
+    
+    db = aux;
+    
+    if (argc != 4) {
+        *err = sqlite3_mprintf("sqlitelog_batch requires a table name");
+        return SQLITE_ERROR;
+    }
+    
+    /* Find table */
+    name.data = (u_char *) argv[3];
+    name.len = ngx_strlen(argv[3]);
+    
+    fmt = db->formats.elts;
+    for (table = 0; table < db->formats.nelts; table++) {
+        if (ngx_str_eq(&fmt[table]->name, &name)) {
+            break;
+        }
+    }
+    if (table == db->formats.nelts) {
+        *err = sqlite3_mprintf("sqlitelog_batch: unknown table \"%s\"",
+                               argv[3]);
+        return SQLITE_ERROR;
+    }
+    
+    /* CREATE TABLE x(c0,c1,...) */
+    sql = sqlite3_malloc(sizeof("CREATE TABLE x()")
+                         + fmt[table]->columns.nelts * (NGX_INT_T_LEN + 2));
+    if (sql == NULL) {
+        return SQLITE_NOMEM;
+    }
+    
+    p = ngx_cpymem(sql, "CREATE TABLE x(", ngx_strlen("CREATE TABLE x("));
+    for (i = 0; i < fmt[table]->columns.nelts; i++) {
+        p = ngx_sprintf(p, i ? ",c%ui" : "c%ui", i);
+    }
+    *p++ = ')';
+    *p = '\0';
+    
+    rc = sqlite3_declare_vtab(conn, (char *) sql);
+    sqlite3_free(sql);
+    if (rc != SQLITE_OK) {
+        return rc;
+    }
+    
+    /* Virtual table */
+    batch = sqlite3_malloc(sizeof(ngx_http_sqlitelog_batch_vtab_t));
+    if (batch == NULL) {
+        return SQLITE_NOMEM;
+    }
+    ngx_memzero(batch, sizeof(ngx_http_sqlitelog_batch_vtab_t));
+    
+    batch->db = db;
+    batch->table = table;
+    batch->fmt = fmt[table];
+    
+    *vtab = &batch->base;
+    return SQLITE_OK;
+}
+
+
+/**
+ * Plan a query on a batch virtual table. The only plan is a full scan.
+ * 
+ * @param   vtab    the virtual table
+ * @param   info    the query's constraints and the plan
+ * @return          SQLITE_OK
+ */
+static int
+ngx_http_sqlitelog_batch_best_index(sqlite3_vtab *vtab,
+    sqlite3_index_info *info)
+{
+    info->estimatedCost = 1000;
+    
+    return SQLITE_OK;
+}
+
+
+/**
+ * Disconnect from or destroy a batch virtual table.
+ * 
+ * @param   vtab    the virtual table
+ * @return          SQLITE_OK
+ */
+static int
+ngx_http_sqlitelog_batch_disconnect(sqlite3_vtab *vtab)
+{
+    sqlite3_free(vtab);
+    
+    return SQLITE_OK;
+}
+
+
+/**
+ * Open a cursor on a batch virtual table.
+ * 
+ * @param   vtab    the virtual table
+ * @param   cursor  a pointer in which to return the cursor
+ * @return          a SQLite3 status code
+ */
+static int
+ngx_http_sqlitelog_batch_open(sqlite3_vtab *vtab,
+    sqlite3_vtab_cursor **cursor)
+{
+    ngx_http_sqlitelog_batch_cursor_t  *cur;
+    
+    cur = sqlite3_malloc(sizeof(ngx_http_sqlitelog_batch_cursor_t));
+    if (cur == NULL) {
+        return SQLITE_NOMEM;
+    }
+    ngx_memzero(cur, sizeof(ngx_http_sqlitelog_batch_cursor_t));
+    
+    *cursor = &cur->base;
+    return SQLITE_OK;
+}
+
+
+/**
+ * Close a cursor.
+ * 
+ * @param   cursor  the cursor
+ * @return          SQLITE_OK
+ */
+static int
+ngx_http_sqlitelog_batch_close(sqlite3_vtab_cursor *cursor)
+{
+    sqlite3_free(cursor);
+    
+    return SQLITE_OK;
+}
+
+
+/**
+ * Start a scan at the first of the table's log entries in the current batch.
+ * 
+ * @param   cursor  the cursor
+ * @param   idx_num unused
+ * @param   idx_str unused
+ * @param   argc    unused
+ * @param   argv    unused
+ * @return          SQLITE_OK
+ */
+static int
+ngx_http_sqlitelog_batch_filter(sqlite3_vtab_cursor *cursor, int idx_num,
+    const char *idx_str, int argc, sqlite3_value **argv)
+{
+    ngx_http_sqlitelog_batch_vtab_t    *batch;
+    ngx_http_sqlitelog_batch_cursor_t  *cur;
+    
+    batch = (ngx_http_sqlitelog_batch_vtab_t *) cursor->pVtab;
+    cur = (ngx_http_sqlitelog_batch_cursor_t *) cursor;
+    
+    cur->part = batch->db->batch ? &batch->db->batch->part : NULL;
+    cur->i = 0;
+    cur->rowid = 0;
+    
+    ngx_http_sqlitelog_batch_seek(cur);
+    
+    return SQLITE_OK;
+}
+
+
+/**
+ * Advance to the table's next log entry.
+ * 
+ * @param   cursor  the cursor
+ * @return          SQLITE_OK
+ */
+static int
+ngx_http_sqlitelog_batch_next(sqlite3_vtab_cursor *cursor)
+{
+    ngx_http_sqlitelog_batch_cursor_t  *cur;
+    
+    cur = (ngx_http_sqlitelog_batch_cursor_t *) cursor;
+    cur->i++;
+    cur->rowid++;
+    
+    ngx_http_sqlitelog_batch_seek(cur);
+    
+    return SQLITE_OK;
+}
+
+
+/**
+ * Check whether a scan is done.
+ * 
+ * @param   cursor  the cursor
+ * @return          1 if there are no more log entries, or 0 otherwise
+ */
+static int
+ngx_http_sqlitelog_batch_eof(sqlite3_vtab_cursor *cursor)
+{
+    return ((ngx_http_sqlitelog_batch_cursor_t *) cursor)->part == NULL;
+}
+
+
+/**
+ * Get a column of the current log entry. The value is returned the same way
+ * it would be bound to the table's INSERT statement.
+ * 
+ * @param   cursor  the cursor
+ * @param   ctx     the context in which to return the value
+ * @param   n       the column's index
+ * @return          SQLITE_OK
+ */
+static int
+ngx_http_sqlitelog_batch_column(sqlite3_vtab_cursor *cursor,
+    sqlite3_context *ctx, int n)
+{
+    ngx_http_sqlitelog_col_t           *col;
+    ngx_http_sqlitelog_entry_t         *entry;
+    ngx_http_sqlitelog_batch_vtab_t    *batch;
+    ngx_http_sqlitelog_batch_cursor_t  *cur;
+    
+    batch = (ngx_http_sqlitelog_batch_vtab_t *) cursor->pVtab;
+    cur = (ngx_http_sqlitelog_batch_cursor_t *) cursor;
+    
+    col = batch->fmt->columns.elts;
+    entry = cur->part->elts;
+    entry += cur->i;
+    
+    col[n].result(ctx, entry->elts[n]);
+    
+    return SQLITE_OK;
+}
+
+
+/**
+ * Get the rowid of the current log entry, i.e. its position in the scan.
+ * 
+ * @param   cursor  the cursor
+ * @param   rowid   a pointer in which to return the rowid
+ * @return          SQLITE_OK
+ */
+static int
+ngx_http_sqlitelog_batch_rowid(sqlite3_vtab_cursor *cursor,
+    sqlite3_int64 *rowid)
+{
+    *rowid = ((ngx_http_sqlitelog_batch_cursor_t *) cursor)->rowid;
+    
+    return SQLITE_OK;
+}
+
+
+/**
+ * Move a cursor forward to the next log entry that belongs to its table,
+ * starting with the current one. Entries with the wrong width (i.e. left in
+ * the buffer by a previous configuration) are skipped.
+ * 
+ * @param   cur     the cursor
+ */
+static void
+ngx_http_sqlitelog_batch_seek(ngx_http_sqlitelog_batch_cursor_t *cur)
+{
+    ngx_http_sqlitelog_entry_t       *entry;
+    ngx_http_sqlitelog_batch_vtab_t  *batch;
+    
+    batch = (ngx_http_sqlitelog_batch_vtab_t *) cur->base.pVtab;
+    
+    while (cur->part) {
+    
+        if (cur->i >= cur->part->nelts) {
+            cur->part = cur->part->next;
+            cur->i = 0;
+            continue;
+        }
+    
+        entry = cur->part->elts;
+        entry += cur->i;
+    
+        if (entry->table == batch->table
+            && entry->nelts == batch->fmt->columns.nelts)
+        {
+            return;
+        }
+    
+        cur->i++;
+    }
+}
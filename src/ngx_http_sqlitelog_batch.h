@@ -0,0 +1,30 @@
+
+/*
+ * Copyright (C) Serope.com
+ * 
+ * The batch virtual table exposes the log entries of a buffered transaction
+ * to SQLite, so that each table's share of the transaction is inserted by a
+ * single statement:
+ * 
+ *  INSERT INTO name SELECT * FROM temp.sqlitelog_batch_name
+ * 
+ * This replaces a bind, step, and reset per log entry with a loop inside
+ * SQLite's VM. Every connection registers the sqlitelog_batch module and
+ * creates one virtual table per format in its temp schema, which only that
+ * connection can see. A virtual table reads whichever list of log entries is
+ * set as the database's current batch, and skips the entries of other tables.
+ */
+
+
+#pragma once
+
+
+#include <ngx_core.h>
+#include <sqlite3.h>
+
+
+#include "ngx_http_sqlitelog_db.h"
+
+
+int ngx_http_sqlitelog_batch_init(ngx_http_sqlitelog_db_t *db,
+    ngx_log_t *log);
@@ -10,15 +10,30 @@
 
 #include "ngx_http_sqlitelog_buf.h"
 #include "ngx_http_sqlitelog_db.h"
+#include "ngx_http_sqlitelog_journal.h"
 #include "ngx_http_sqlitelog_node.h"
 #include "ngx_http_sqlitelog_thread.h"
 
 
+static ngx_http_sqlitelog_buf_shard_t *ngx_http_sqlitelog_buf_shard(
+    ngx_http_sqlitelog_buf_t *buf);
 static ngx_int_t ngx_http_sqlitelog_buf_move_locked(
     ngx_http_sqlitelog_buf_t *buf, ngx_list_t *list);
+static ngx_int_t ngx_http_sqlitelog_buf_copy_node(
+    ngx_http_sqlitelog_node_t *node, ngx_list_t *list);
 
+static ngx_int_t ngx_http_sqlitelog_buf_max(ngx_http_sqlitelog_buf_t *buf);
+static ngx_msec_t ngx_http_sqlitelog_buf_flush_time(
+    ngx_http_sqlitelog_buf_t *buf);
+static void ngx_http_sqlitelog_buf_adapt(ngx_http_sqlitelog_buf_t *buf,
+    ngx_uint_t rows, ngx_msec_t duration, ngx_log_t *log);
+static ngx_msec_t ngx_http_sqlitelog_buf_msec(void);
+static ngx_flag_t ngx_http_sqlitelog_buf_lease(ngx_http_sqlitelog_buf_t *buf);
 static void ngx_http_sqlitelog_buf_flush(ngx_http_sqlitelog_buf_t *buf,
     ngx_http_sqlitelog_db_t *db, ngx_log_t *log);
+static ngx_int_t ngx_http_sqlitelog_buf_drain_once(
+    ngx_http_sqlitelog_buf_t *buf, ngx_http_sqlitelog_db_t *db,
+    ngx_log_t *log);
 #if (NGX_THREADS)
 static void ngx_http_sqlitelog_buf_flush_async(ngx_http_sqlitelog_buf_t *buf,
     ngx_http_sqlitelog_db_t *db, ngx_log_t *log);
@@ -26,38 +41,471 @@ static void ngx_http_sqlitelog_buf_flush_async(ngx_http_sqlitelog_buf_t *buf,
 
 
 /**
- * Push a log entry to the buffer.
+ * Divide a new buffer's shared memory zone into shards, one per worker
+ * process, each with a pool and mutex of its own.
  * 
- * @param   buf     the buffer in question
- * @param   entry   the log entry in question
+ * One part of the zone is left to the zone's pool for the rollup. If the zone
+ * is too small for every worker process to get a shard of at least
+ * NGX_HTTP_SQLITELOG_BUF_SHARD_MIN pages, there are fewer shards; if it's too
+ * small for two, or if mutexes need lock files (i.e. there are no atomic
+ * operations), there's a single shard that uses the zone's pool.
+ * 
+ * @param   ctx         the buffer's shared context
+ * @param   shpool      the zone's pool
+ * @param   workers     the amount of worker processes
+ * @param   log         a log for writing error messages
+ * @return              NGX_OK on success, or
+ *                      NGX_ERROR on failure
+ */
+ngx_int_t
+ngx_http_sqlitelog_buf_init_shctx(ngx_http_sqlitelog_buf_shctx_t *ctx,
+    ngx_slab_pool_t *shpool, ngx_uint_t workers, ngx_log_t *log)
+{
+    size_t                           size;
+    u_char                          *p;
+    ngx_uint_t                       i;
+    ngx_uint_t                       n;
+    ngx_slab_pool_t                 *sp;
+    ngx_http_sqlitelog_buf_shard_t  *shards;
+    
+    n = 1;
+    size = 0;
+    
+#if (NGX_HAVE_ATOMIC_OPS)
+    /* One part per shard, plus one for the rollup */
+    size = (size_t) (shpool->end - shpool->start);
+    n = size / (NGX_HTTP_SQLITELOG_BUF_SHARD_MIN * ngx_pagesize);
+    n = (n > 2) ? ngx_min(n - 1, ngx_max(workers, 1)) : 1;
+    size = (size / (n + 1)) & ~(ngx_pagesize - 1);
+#endif
+    
+    shards = ngx_slab_calloc(shpool,
+                             n * sizeof(ngx_http_sqlitelog_buf_shard_t));
+    if (shards == NULL) {
+        return NGX_ERROR;
+    }
+    
+    /* Shard pools, as Nginx initializes a zone's pool */
+    for (i = 0; n > 1 && i < n; i++) {
+        p = ngx_slab_calloc(shpool, size);
+        if (p == NULL) {
+            break;
+        }
+        
+        sp = (ngx_slab_pool_t *) p;
+        sp->end = p + size;
+        sp->min_shift = 3;
+        sp->addr = p;
+        
+        if (ngx_shmtx_create(&sp->mutex, &sp->lock, NULL) != NGX_OK) {
+            ngx_slab_free(shpool, p);
+            break;
+        }
+        
+        ngx_slab_init(sp);
+        shards[i].shpool = sp;
+    }
+    
+    /* Single shard */
+    if (i < 2) {
+        while (i) {
+            ngx_slab_free(shpool, shards[--i].shpool);
+        }
+        shards[0].shpool = shpool;
+        i = 1;
+    }
+    
+    for (n = 0; n < i; n++) {
+        ngx_queue_init(&shards[n].queue);
+    }
+    
+    ctx->shards = shards;
+    ctx->nshards = i;
+    
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, log, 0,
+                   "sqlitelog: buf init, shards: %ui, size: %uz", i, size);
+    
+    return NGX_OK;
+}
+
+
+/**
+ * Advise the kernel to back a buffer's shared memory zone with transparent
+ * huge pages, so that walking the buffer's nodes takes fewer TLB misses.
+ * 
+ * Only the whole huge pages within the zone are advised. Shared memory only
+ * gets huge pages if /sys/kernel/mm/transparent_hugepage/shmem_enabled is
+ * advise, within_size, or always; otherwise, or on systems without
+ * MADV_HUGEPAGE, the zone keeps its regular pages.
+ * 
+ * @param   shm     the zone's shared memory
+ */
+void
+ngx_http_sqlitelog_buf_hugepages(ngx_shm_t *shm)
+{
+#if (NGX_LINUX) && defined(MADV_HUGEPAGE)
+    u_char  *end;
+    u_char  *start;
+    
+    start = ngx_align_ptr(shm->addr, NGX_HTTP_SQLITELOG_BUF_HUGEPAGE);
+    end = (u_char *) ((uintptr_t) (shm->addr + shm->size)
+                      & ~((uintptr_t) NGX_HTTP_SQLITELOG_BUF_HUGEPAGE - 1));
+    
+    if (end <= start) {
+        ngx_log_error(NGX_LOG_NOTICE, shm->log, 0,
+                      "sqlitelog: zone \"%V\" is too small for huge pages",
+                      &shm->name);
+        return;
+    }
+    
+    if (madvise(start, end - start, MADV_HUGEPAGE) == -1) {
+        ngx_log_error(NGX_LOG_NOTICE, shm->log, ngx_errno,
+                      "sqlitelog: madvise(MADV_HUGEPAGE) failed for zone "
+                      "\"%V\", using regular pages", &shm->name);
+        return;
+    }
+    
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, shm->log, 0,
+                   "sqlitelog: buf hugepages, zone: \"%V\", size: %uz",
+                   &shm->name, (size_t) (end - start));
+#else
+    ngx_log_error(NGX_LOG_NOTICE, shm->log, 0,
+                  "sqlitelog: huge pages aren't supported, zone \"%V\" "
+                  "uses regular pages", &shm->name);
+#endif
+}
+
+
+/**
+ * Open a new persistent buffer's journal, and push the log entries that it
+ * recovers to the buffer, in their original order.
+ * 
+ * The recovered log entries are journaled again as they're pushed. Those
+ * that no longer fit in the buffer (i.e. it was made smaller), or whose
+ * tables have changed since, are lost.
+ * 
+ * @param   buf     the buffer in question, whose zone is initialized
  * @param   log     a log for writing error messages
  * @return          NGX_OK on success, or
- *                  NGX_DONE on success and the buffer reaching its max, or
  *                  NGX_ERROR on failure
  */
 ngx_int_t
-ngx_http_sqlitelog_buf_push(ngx_http_sqlitelog_buf_t *buf, ngx_array_t *entry,
-    ngx_log_t *log)
+ngx_http_sqlitelog_buf_persist(ngx_http_sqlitelog_buf_t *buf, ngx_log_t *log)
+{
+    size_t                               size;
+    ngx_int_t                            rc_push;
+    ngx_int_t                            rc_recover;
+    ngx_uint_t                           i;
+    ngx_uint_t                           lost;
+    ngx_pool_t                          *pool;
+    ngx_array_t                          entries;
+    ngx_array_t                          values;
+    ngx_http_sqlitelog_buf_shctx_t      *ctx;
+    ngx_http_sqlitelog_journal_t        *journal;
+    ngx_http_sqlitelog_journal_entry_t  *e;
+    
+    ctx = buf->shm_zone->data;
+    size = buf->shm_zone->shm.size;
+    
+    journal = ngx_http_sqlitelog_journal_open(&buf->persist, size, log);
+    if (journal == NULL) {
+        return NGX_ERROR;
+    }
+    
+    pool = ngx_create_pool(NGX_DEFAULT_POOL_SIZE, log);
+    if (pool == NULL) {
+        return NGX_ERROR;
+    }
+    
+    rc_recover = ngx_http_sqlitelog_journal_recover(journal, size, pool,
+                                                    &entries, log);
+    if (rc_recover != NGX_OK) {
+        ngx_destroy_pool(pool);
+        return NGX_ERROR;
+    }
+    
+    ctx->journal = journal;
+    
+    /* Push */
+    e = entries.elts;
+    lost = 0;
+    for (i = 0; i < entries.nelts; i++) {
+        if (e[i].sig != buf->sig) {
+            lost++;
+            continue;
+        }
+        
+        values.elts = e[i].entry.elts;
+        values.nelts = e[i].entry.nelts;
+        values.size = sizeof(ngx_str_t);
+        values.nalloc = e[i].entry.nelts;
+        values.pool = pool;
+        
+        rc_push = ngx_http_sqlitelog_buf_push(buf, e[i].entry.table, &values,
+                                              log);
+        if (rc_push == NGX_ERROR) {
+            lost++;
+        }
+    }
+    
+    if (entries.nelts) {
+        ngx_log_error(NGX_LOG_NOTICE, log, 0,
+                      "sqlitelog: recovered %ui log entries from journal "
+                      "\"%V\"", entries.nelts - lost, &buf->persist);
+        ctx->recovered = (entries.nelts > lost);
+    }
+    if (lost) {
+        ngx_log_error(NGX_LOG_WARN, log, 0,
+                      "sqlitelog: lost %ui log entries from journal \"%V\" "
+                      "that don't fit in the buffer or whose tables changed",
+                      lost, &buf->persist);
+    }
+    
+    ngx_destroy_pool(pool);
+    return NGX_OK;
+}
+
+
+/**
+ * Move the log entries of the previous configuration's zone into a new
+ * buffer's zone, when Nginx reloads with another buffer size. This is done
+ * by the master process, once the configuration has been loaded
+ * successfully.
+ * 
+ * Only the log entries that were pushed by a configuration with the same
+ * tables are moved, in order; the rest, along with any that don't fit, are
+ * left for the old worker processes to commit when they exit. A persistent
+ * zone is left as it is, since its journal still holds its log entries.
+ * 
+ * @param   buf         the new buffer, whose zone is initialized
+ * @param   old_zone    the previous configuration's zone
+ * @param   log         a log for writing error messages
+ * @return              NGX_OK on success, or
+ *                      NGX_ERROR on failure
+ */
+ngx_int_t
+ngx_http_sqlitelog_buf_migrate(ngx_http_sqlitelog_buf_t *buf,
+    ngx_shm_zone_t *old_zone, ngx_log_t *log)
+{
+    ngx_uint_t                       i;
+    ngx_uint_t                       moved;
+    ngx_array_t                      values;
+    ngx_queue_t                     *q;
+    ngx_http_sqlitelog_buf_t         old;
+    ngx_http_sqlitelog_node_t       *node;
+    ngx_http_sqlitelog_node_t       *first;
+    ngx_http_sqlitelog_node_t       *copy;
+    ngx_http_sqlitelog_buf_shard_t  *shard;
+    ngx_http_sqlitelog_buf_shard_t  *from;
+    ngx_http_sqlitelog_buf_shctx_t  *ctx;
+    ngx_http_sqlitelog_buf_shctx_t  *old_ctx;
+    
+    ctx = buf->shm_zone->data;
+    old_ctx = old_zone->data;
+    
+    if (old_ctx->journal) {
+        return NGX_OK;
+    }
+    
+    ngx_memzero(&old, sizeof(ngx_http_sqlitelog_buf_t));
+    old.shm_zone = old_zone;
+    
+    shard = ngx_http_sqlitelog_buf_shard(buf);
+    moved = 0;
+    
+    ngx_http_sqlitelog_buf_lock(&old);
+    ngx_shmtx_lock(&shard->shpool->mutex);
+    
+    ctx->seq = old_ctx->seq;
+    
+    /* Move, taking the earliest of the shards' first nodes each time */
+    for ( ;; ) {
+        first = NULL;
+        from = NULL;
+        
+        for (i = 0; i < old_ctx->nshards; i++) {
+            for (q = ngx_queue_head(&old_ctx->shards[i].queue);
+                 q != ngx_queue_sentinel(&old_ctx->shards[i].queue);
+                 q = ngx_queue_next(q))
+            {
+                node = ngx_queue_data(q, ngx_http_sqlitelog_node_t, link);
+                if (node->sig != buf->sig) {
+                    continue;
+                }
+                if (first == NULL
+                    || (ngx_atomic_int_t) (node->seq - first->seq) < 0)
+                {
+                    first = node;
+                    from = &old_ctx->shards[i];
+                }
+                break;
+            }
+        }
+        
+        if (first == NULL) {
+            break;
+        }
+        
+        values.elts = first->elts;
+        values.nelts = first->nelts;
+        values.size = sizeof(ngx_str_t);
+        values.nalloc = first->nelts;
+        values.pool = NULL;
+        
+        copy = ngx_http_sqlitelog_node_create_locked(first->table, &values,
+                                                     shard->shpool, log);
+        if (copy == NULL) {
+            break;
+        }
+        copy->seq = first->seq;
+        copy->sig = first->sig;
+        ngx_queue_insert_tail(&shard->queue, &copy->link);
+        ctx->queue_len++;
+        
+        ngx_queue_remove(&first->link);
+        ngx_http_sqlitelog_node_destroy_locked(first, from->shpool);
+        old_ctx->queue_len--;
+        moved++;
+    }
+    
+    ngx_shmtx_unlock(&shard->shpool->mutex);
+    ngx_http_sqlitelog_buf_unlock(&old);
+    
+    if (moved) {
+        ngx_log_error(NGX_LOG_NOTICE, log, 0,
+                      "sqlitelog: moved %ui log entries to the resized zone "
+                      "\"%V\"", moved, &buf->shm_zone->shm.name);
+    }
+    
+    return NGX_OK;
+}
+
+
+/**
+ * Mark a buffer's configuration as the newest one that's running, so that
+ * the previous configuration's worker processes leave the log entries in
+ * the zone to this one's when they exit.
+ * 
+ * This is done by the master process, once the configuration has been
+ * loaded successfully.
+ * 
+ * @param   buf     the buffer in question
+ */
+void
+ngx_http_sqlitelog_buf_adopt(ngx_http_sqlitelog_buf_t *buf)
+{
+    ngx_http_sqlitelog_buf_shctx_t  *ctx;
+    
+    ctx = buf->shm_zone->data;
+    
+    ctx->sig = buf->sig;
+    ngx_memory_barrier();
+    ctx->live = buf->cycle;
+}
+
+
+/**
+ * Check whether a newer configuration with the same tables has taken over a
+ * buffer's zone, in which case its worker processes commit the log entries
+ * that are left in the buffer.
+ * 
+ * @param   buf     the buffer in question
+ * @return          1 if the zone was taken over, or 0 if not
+ */
+ngx_flag_t
+ngx_http_sqlitelog_buf_adopted(ngx_http_sqlitelog_buf_t *buf)
 {
-    ngx_int_t          rc_push;
-    ngx_slab_pool_t   *shpool;
+    ngx_http_sqlitelog_buf_shctx_t  *ctx;
+    
+    ctx = buf->shm_zone->data;
+    
+    if (ctx->live == buf->cycle) {
+        return 0;
+    }
+    
+    ngx_memory_barrier();
+    return (ctx->sig == buf->sig);
+}
+
+
+/**
+ * Lock the buffer as a whole, i.e. the zone's pool and then every shard.
+ * 
+ * @param   buf     the buffer in question
+ */
+void
+ngx_http_sqlitelog_buf_lock(ngx_http_sqlitelog_buf_t *buf)
+{
+    ngx_uint_t                       i;
+    ngx_slab_pool_t                 *shpool;
+    ngx_http_sqlitelog_buf_shctx_t  *ctx;
     
     shpool = (ngx_slab_pool_t *) buf->shm_zone->shm.addr;
+    ctx = buf->shm_zone->data;
     
     ngx_shmtx_lock(&shpool->mutex);
-    rc_push = ngx_http_sqlitelog_buf_push_locked(buf, entry, log);
+    
+    for (i = 0; i < ctx->nshards; i++) {
+        if (ctx->shards[i].shpool != shpool) {
+            ngx_shmtx_lock(&ctx->shards[i].shpool->mutex);
+        }
+    }
+}
+
+
+/**
+ * Unlock the buffer as a whole, in the reverse order of
+ * ngx_http_sqlitelog_buf_lock().
+ * 
+ * @param   buf     the buffer in question
+ */
+void
+ngx_http_sqlitelog_buf_unlock(ngx_http_sqlitelog_buf_t *buf)
+{
+    ngx_uint_t                       i;
+    ngx_slab_pool_t                 *shpool;
+    ngx_http_sqlitelog_buf_shctx_t  *ctx;
+    
+    shpool = (ngx_slab_pool_t *) buf->shm_zone->shm.addr;
+    ctx = buf->shm_zone->data;
+    
+    for (i = ctx->nshards; i > 0; i--) {
+        if (ctx->shards[i - 1].shpool != shpool) {
+            ngx_shmtx_unlock(&ctx->shards[i - 1].shpool->mutex);
+        }
+    }
+    
     ngx_shmtx_unlock(&shpool->mutex);
+}
+
+
+/**
+ * Get this worker process's shard of the buffer.
+ * 
+ * @param   buf     the buffer in question
+ * @return          the shard
+ */
+static ngx_http_sqlitelog_buf_shard_t *
+ngx_http_sqlitelog_buf_shard(ngx_http_sqlitelog_buf_t *buf)
+{
+    ngx_http_sqlitelog_buf_shctx_t  *ctx;
     
-    return rc_push;
+    ctx = buf->shm_zone->data;
+    
+    return &ctx->shards[ngx_worker % ctx->nshards];
 }
 
 
 /**
  * Push a log entry to the buffer.
  * 
- * The shared pool must be locked.
+ * Only this worker process's shard is locked, so the push doesn't wait for
+ * other workers' pushes. If the shard is full, the log entry goes to the
+ * next shard that has room, one shard locked at a time, so that a single busy
+ * worker can fill the whole buffer before it overflows.
  * 
  * @param   buf     the buffer in question
+ * @param   table   the index of the log entry's table in the database
  * @param   entry   the log entry in question
  * @param   log     a log for writing error messages
  * @return          NGX_OK on success, or
@@ -65,27 +513,84 @@ ngx_http_sqlitelog_buf_push(ngx_http_sqlitelog_buf_t *buf, ngx_array_t *entry,
  *                  NGX_ERROR on failure
  */
 ngx_int_t
+ngx_http_sqlitelog_buf_push(ngx_http_sqlitelog_buf_t *buf, ngx_uint_t table,
+    ngx_array_t *entry, ngx_log_t *log)
+{
+    ngx_int_t                        rc_push;
+    ngx_uint_t                       i;
+    ngx_http_sqlitelog_buf_shard_t  *shard;
+    ngx_http_sqlitelog_buf_shctx_t  *shctx;
+    
+    shctx = buf->shm_zone->data;
+    shard = ngx_http_sqlitelog_buf_shard(buf);
+    
+    for (i = 1; /* void */; i++) {
+        ngx_shmtx_lock(&shard->shpool->mutex);
+        rc_push = ngx_http_sqlitelog_buf_push_locked(buf, shard, table, entry,
+                                                     log);
+        ngx_shmtx_unlock(&shard->shpool->mutex);
+        
+        if (rc_push != NGX_ERROR || i == shctx->nshards) {
+            break;
+        }
+        
+        shard = &shctx->shards[(ngx_worker + i) % shctx->nshards];
+    }
+    
+    if (rc_push == NGX_ERROR) {
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, log, 0,
+                       "sqlitelog: buffer overflow, len: %d",
+                       (ngx_int_t) shctx->queue_len);
+    }
+    
+    return rc_push;
+}
+
+
+/**
+ * Push a log entry to one shard of the buffer.
+ * 
+ * The shard must be locked, either on its own or by
+ * ngx_http_sqlitelog_buf_lock().
+ * 
+ * @param   buf     the buffer in question
+ * @param   shard   the shard in question
+ * @param   table   the index of the log entry's table in the database
+ * @param   entry   the log entry in question
+ * @param   log     a log for writing error messages
+ * @return          NGX_OK on success, or
+ *                  NGX_DONE on success and the buffer reaching its max, or
+ *                  NGX_ERROR on failure (e.g. the shard is full)
+ */
+ngx_int_t
 ngx_http_sqlitelog_buf_push_locked(ngx_http_sqlitelog_buf_t *buf,
+    ngx_http_sqlitelog_buf_shard_t *shard, ngx_uint_t table,
     ngx_array_t *entry, ngx_log_t *log)
 {
-    ngx_slab_pool_t                 *shpool;
+    ngx_int_t                        len;
+    ngx_int_t                        max;
     ngx_http_sqlitelog_node_t       *node;
     ngx_http_sqlitelog_buf_shctx_t  *shctx;
     
-    shpool = (ngx_slab_pool_t *) buf->shm_zone->shm.addr;
     shctx = buf->shm_zone->data;
     
-    node = ngx_http_sqlitelog_node_create_locked(entry, shpool, log);
+    node = ngx_http_sqlitelog_node_create_locked(table, entry, shard->shpool,
+                                                 log);
     if (node == NULL) {
-        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, log, 0,
-                       "sqlitelog: buffer overflow, len: %d", shctx->queue_len);
         return NGX_ERROR;
     }
     
-    ngx_queue_insert_tail(&shctx->queue, &node->link);
-    shctx->queue_len += 1;
+    node->seq = ngx_atomic_fetch_add(&shctx->seq, 1);
+    node->sig = buf->sig;
+    ngx_queue_insert_tail(&shard->queue, &node->link);
+    len = ngx_atomic_fetch_add(&shctx->queue_len, 1) + 1;
     
-    if (buf->max && shctx->queue_len >= buf->max) {
+    if (shctx->journal) {
+        (void) ngx_http_sqlitelog_journal_append(shctx->journal, node, log);
+    }
+    
+    max = ngx_http_sqlitelog_buf_max(buf);
+    if (max && len >= max) {
         return NGX_DONE;
     }
     
@@ -97,6 +602,7 @@ ngx_http_sqlitelog_buf_push_locked(ngx_http_sqlitelog_buf_t *buf,
  * Put a log entry at the beginning of the buffer.
  * 
  * @param   buf     the buffer in question
+ * @param   table   the index of the log entry's table in the database
  * @param   entry   the log entry in question
  * @param   log     a log for writing error messages
  * @return          NGX_OK on success, or
@@ -104,204 +610,562 @@ ngx_http_sqlitelog_buf_push_locked(ngx_http_sqlitelog_buf_t *buf,
  */
 ngx_int_t
 ngx_http_sqlitelog_buf_unshift(ngx_http_sqlitelog_buf_t *buf,
-    ngx_array_t *entry, ngx_log_t *log)
+    ngx_uint_t table, ngx_array_t *entry, ngx_log_t *log)
+{
+    ngx_int_t  rc_unshift;
+    
+    ngx_http_sqlitelog_buf_lock(buf);
+    rc_unshift = ngx_http_sqlitelog_buf_unshift_locked(buf, table, entry,
+                                                       log);
+    ngx_http_sqlitelog_buf_unlock(buf);
+    
+    return rc_unshift;
+}
+
+
+/**
+ * Put a log entry at the beginning of the buffer, i.e. before the first log
+ * entry of every shard.
+ * 
+ * The buffer must be locked by ngx_http_sqlitelog_buf_lock().
+ * 
+ * @param   buf     the buffer in question
+ * @param   table   the index of the log entry's table in the database
+ * @param   entry   the log entry in question
+ * @param   log     a log for writing error messages
+ * @return          NGX_OK on success, or
+ *                  NGX_ERROR on failure
+ */
+ngx_int_t
+ngx_http_sqlitelog_buf_unshift_locked(ngx_http_sqlitelog_buf_t *buf,
+    ngx_uint_t table, ngx_array_t *entry, ngx_log_t *log)
+{
+    ngx_uint_t                       i;
+    ngx_flag_t                       empty;
+    ngx_atomic_uint_t                seq;
+    ngx_http_sqlitelog_node_t       *head;
+    ngx_http_sqlitelog_node_t       *node;
+    ngx_http_sqlitelog_buf_shard_t  *shard;
+    ngx_http_sqlitelog_buf_shctx_t  *shctx;
+    
+    shctx = buf->shm_zone->data;
+    shard = ngx_http_sqlitelog_buf_shard(buf);
+    
+    node = ngx_http_sqlitelog_node_create_locked(table, entry, shard->shpool,
+                                                 log);
+    if (node == NULL) {
+        return NGX_ERROR;
+    }
+    
+    /* One less than the earliest sequence number */
+    empty = 1;
+    seq = 0;
+    for (i = 0; i < shctx->nshards; i++) {
+        if (ngx_queue_empty(&shctx->shards[i].queue)) {
+            continue;
+        }
+        head = ngx_queue_data(ngx_queue_head(&shctx->shards[i].queue),
+                              ngx_http_sqlitelog_node_t, link);
+        if (empty || (ngx_atomic_int_t) (head->seq - seq) < 0) {
+            seq = head->seq;
+            empty = 0;
+        }
+    }
+    
+    node->seq = empty ? ngx_atomic_fetch_add(&shctx->seq, 1) : seq - 1;
+    node->sig = buf->sig;
+    ngx_queue_insert_head(&shard->queue, &node->link);
+    ngx_atomic_fetch_add(&shctx->queue_len, 1);
+    
+    if (shctx->journal) {
+        (void) ngx_http_sqlitelog_journal_append(shctx->journal, node, log);
+    }
+    
+    return NGX_OK;
+}
+
+
+/**
+ * Move the buffer's contents from shared memory to local memory, clearing
+ * the queue contents in the process.
+ * 
+ * The shards' queues are merged by sequence number, so that the log entries
+ * are listed in the order they were pushed. Log entries pushed by a
+ * configuration with other tables (i.e. before a reload) are left in the
+ * buffer for that configuration's worker processes.
+ * 
+ * The buffer must be locked by ngx_http_sqlitelog_buf_lock().
+ * 
+ * @param   buf     the buffer in question
+ * @param   list    an initialized list in local memory to hold the contents
+ *                  (ngx_http_sqlitelog_entry_t)
+ * @return          NGX_OK on success, or
+ *                  NGX_ERROR on failure
+ */
+static ngx_int_t
+ngx_http_sqlitelog_buf_move_locked(ngx_http_sqlitelog_buf_t *buf,
+    ngx_list_t *list)
+{
+    ngx_int_t                        rc_copy;
+    ngx_uint_t                       i;
+    ngx_uint_t                       next;
+    ngx_uint_t                       moved;
+    ngx_queue_t                     *q;
+    ngx_queue_t                     *qn;
+    ngx_queue_t                    **heads;
+    ngx_http_sqlitelog_node_t       *node;
+    ngx_http_sqlitelog_node_t       *first;
+    ngx_http_sqlitelog_buf_shard_t  *shard;
+    ngx_http_sqlitelog_buf_shctx_t  *ctx;
+    
+    ctx = buf->shm_zone->data;
+    
+    heads = ngx_palloc(list->pool, ctx->nshards * sizeof(ngx_queue_t *));
+    if (heads == NULL) {
+        return NGX_ERROR;
+    }
+    
+    for (i = 0; i < ctx->nshards; i++) {
+        heads[i] = ngx_queue_head(&ctx->shards[i].queue);
+    }
+    
+    /* Copy, taking the earliest of the shards' next nodes each time */
+    for ( ;; ) {
+        first = NULL;
+        next = 0;
+        
+        for (i = 0; i < ctx->nshards; i++) {
+            for ( ;; ) {
+                if (heads[i] == ngx_queue_sentinel(&ctx->shards[i].queue)) {
+                    node = NULL;
+                    break;
+                }
+                node = ngx_queue_data(heads[i], ngx_http_sqlitelog_node_t,
+                                      link);
+                if (node->sig == buf->sig) {
+                    break;
+                }
+                heads[i] = ngx_queue_next(heads[i]);
+            }
+            
+            if (node == NULL) {
+                continue;
+            }
+            if (first == NULL
+                || (ngx_atomic_int_t) (node->seq - first->seq) < 0)
+            {
+                first = node;
+                next = i;
+            }
+        }
+        
+        if (first == NULL) {
+            break;
+        }
+        
+        rc_copy = ngx_http_sqlitelog_buf_copy_node(first, list);
+        if (rc_copy != NGX_OK) {
+            return NGX_ERROR;
+        }
+        
+        heads[next] = ngx_queue_next(heads[next]);
+    }
+    
+    /* Clear */
+    moved = 0;
+    for (i = 0; i < ctx->nshards; i++) {
+        shard = &ctx->shards[i];
+        
+        q = ngx_queue_head(&shard->queue);
+        while (q != ngx_queue_sentinel(&shard->queue)) {
+            qn = ngx_queue_next(q);
+            node = ngx_queue_data(q, ngx_http_sqlitelog_node_t, link);
+            if (node->sig == buf->sig) {
+                ngx_queue_remove(q);
+                ngx_http_sqlitelog_node_destroy_locked(node, shard->shpool);
+                moved++;
+            }
+            q = qn;
+        }
+    }
+    
+    ctx->queue_len -= moved;
+    
+    return NGX_OK;
+}
+
+
+/**
+ * Copy a node from shared memory to a list in local memory.
+ * 
+ * @param   node    the node in question
+ * @param   list    the list to hold the copy (ngx_http_sqlitelog_entry_t)
+ * @return          NGX_OK on success, or
+ *                  NGX_ERROR on failure
+ */
+static ngx_int_t
+ngx_http_sqlitelog_buf_copy_node(ngx_http_sqlitelog_node_t *node,
+    ngx_list_t *list)
 {
-    ngx_int_t          rc_unshift;
-    ngx_slab_pool_t   *shpool;
+    size_t                       sbuf_size;
+    u_char                      *sbuf;
+    ngx_str_t                   *elt;
+    ngx_str_t                   *s;
+    ngx_uint_t                   i;
+    ngx_http_sqlitelog_entry_t  *entry;
+    
+    elt = node->elts;
+    
+    entry = ngx_list_push(list);
+    if (entry == NULL) {
+        return NGX_ERROR;
+    }
+    
+    entry->table = node->table;
+    entry->nelts = node->nelts;
+    entry->elts = ngx_palloc(list->pool, node->nelts * sizeof(ngx_str_t));
+    if (entry->elts == NULL) {
+        return NGX_ERROR;
+    }
+    
+    for (i = 0; i < node->nelts; i++) {
+        
+        s = &entry->elts[i];
+        
+        if (elt->data == NULL) {
+            s->data = NULL;
+            s->len = 0;
+        }
+        
+        else {
+            sbuf_size = elt->len;
+            sbuf = ngx_pcalloc(list->pool, sbuf_size * sizeof(u_char));
+            if (sbuf == NULL) {
+                return NGX_ERROR;
+            }
+            ngx_memcpy(sbuf, elt->data, elt->len);
+            s->data = sbuf;
+            s->len = elt->len;
+        }
+        
+        elt++;
+    }
+    
+    return NGX_OK;
+}
+
+
+/**
+ * Move the buffer's contents from shared memory to local memory, clearing
+ * the queue contents in the process.
+ * 
+ * This is similar to ngx_http_sqlitelog_buffer_move(), except the list is
+ * initialized in the given pool.
+ * 
+ * @param   buf     the buffer in question
+ * @param   pool    a pool in which to initialize the list
+ * @param   list    an uninitialized list to hold the contents
+ * @param   rollup  an uninitialized array to hold the rollup groups
+ * @param   half    a pointer for storing the journal's half in use, to be
+ *                  passed to ngx_http_sqlitelog_buf_commit()
+ * @return          NGX_OK on success, or
+ *                  NGX_ERROR on failure
+ */
+ngx_int_t
+ngx_http_sqlitelog_buf_list(ngx_http_sqlitelog_buf_t *buf, ngx_pool_t *pool,
+    ngx_list_t *list, ngx_array_t *rollup, ngx_uint_t *half)
+{
+    ngx_int_t  rc_list;
+    
+    ngx_http_sqlitelog_buf_lock(buf);
+    rc_list = ngx_http_sqlitelog_buf_list_locked(buf, pool, list, rollup,
+                                                 half);
+    ngx_http_sqlitelog_buf_unlock(buf);
+    
+    return rc_list;
+}
+
+
+/**
+ * Move the buffer's contents from shared memory to local memory, clearing
+ * the queue contents in the process.
+ * 
+ * This is similar to ngx_http_sqlitelog_buffer_move(), except the list is
+ * initialized in the given pool.
+ * 
+ * If the buffer has a rollup, its groups are moved as well; otherwise, the
+ * rollup array is left empty.
+ * 
+ * If the buffer is persistent, the journal's active half is marked as in use
+ * until the transaction is committed.
+ * 
+ * The buffer must be locked by ngx_http_sqlitelog_buf_lock().
+ * 
+ * @param   buf     the buffer in question
+ * @param   pool    a pool in which to initialize the list
+ * @param   list    an uninitialized list to hold the contents
+ *                  (ngx_http_sqlitelog_entry_t)
+ * @param   rollup  an uninitialized array to hold the rollup groups
+ * @param   half    a pointer for storing the journal's half in use, to be
+ *                  passed to ngx_http_sqlitelog_buf_commit()
+ * @return          NGX_OK on success, or
+ *                  NGX_ERROR on failure
+ */
+ngx_int_t
+ngx_http_sqlitelog_buf_list_locked(ngx_http_sqlitelog_buf_t *buf,
+    ngx_pool_t *pool, ngx_list_t *list, ngx_array_t *rollup,
+    ngx_uint_t *half)
+{
+    ngx_int_t                        rc_init;
+    ngx_int_t                        rc_move;
+    ngx_slab_pool_t                 *shpool;
+    ngx_http_sqlitelog_buf_shctx_t  *ctx;
+    
+    ngx_memzero(rollup, sizeof(ngx_array_t));
+    ctx = buf->shm_zone->data;
+    *half = 0;
+    
+    rc_init = ngx_list_init(list, pool, 16, sizeof(ngx_http_sqlitelog_entry_t));
+    if (rc_init != NGX_OK) {
+        return NGX_ERROR;
+    }
+    
+    rc_move = ngx_http_sqlitelog_buf_move_locked(buf, list);
+    if (rc_move != NGX_OK) {
+        return NGX_ERROR;
+    }
+    
+    if (buf->rollup) {
+        shpool = (ngx_slab_pool_t *) buf->shm_zone->shm.addr;
+        rc_move = ngx_http_sqlitelog_rollup_move_locked(buf->rollup,
+                                                        &ctx->rollup, shpool,
+                                                        buf->sig, pool,
+                                                        rollup);
+        if (rc_move != NGX_OK) {
+            return NGX_ERROR;
+        }
+    }
+    
+    if (ctx->journal) {
+        *half = ngx_http_sqlitelog_journal_switch(ctx->journal);
+    }
+    
+    return NGX_OK;
+}
+
+
+/**
+ * Insert log entries that were moved out of the buffer, in one transaction.
+ * If the buffer is adaptive, the commit is measured.
+ * 
+ * If the buffer is persistent, the journal's half is released afterwards,
+ * whether the transaction succeeded or not; the log entries of a failed
+ * transaction are lost either way.
+ * 
+ * @param   buf     the buffer in question
+ * @param   db      the database to be written to
+ * @param   list    the log entries (ngx_http_sqlitelog_entry_t)
+ * @param   rollup  the rollup groups
+ * @param   half    the journal's half returned by
+ *                  ngx_http_sqlitelog_buf_list_locked()
+ * @param   log     a log for writing error messages
+ * @return          a SQLite3 return code
+ */
+int
+ngx_http_sqlitelog_buf_commit(ngx_http_sqlitelog_buf_t *buf,
+    ngx_http_sqlitelog_db_t *db, ngx_list_t *list, ngx_array_t *rollup,
+    ngx_uint_t half, ngx_log_t *log)
+{
+    int                              rc_insert;
+    ngx_msec_t                       start;
+    ngx_uint_t                       rows;
+    ngx_list_part_t                 *part;
+    ngx_http_sqlitelog_buf_shctx_t  *ctx;
+    
+    ctx = buf->shm_zone->data;
+    start = buf->adaptive ? ngx_http_sqlitelog_buf_msec() : 0;
+    rc_insert = ngx_http_sqlitelog_db_insert_list(db, list, rollup, log);
+    
+    if (ctx->journal) {
+        ngx_http_sqlitelog_buf_lock(buf);
+        ngx_http_sqlitelog_journal_done(ctx->journal, half,
+                                        ctx->queue_len == 0);
+        ngx_http_sqlitelog_buf_unlock(buf);
+    }
+    
+    if (buf->adaptive && rc_insert == SQLITE_OK) {
+        rows = 0;
+        for (part = &list->part; part; part = part->next) {
+            rows += part->nelts;
+        }
+        ngx_http_sqlitelog_buf_adapt(buf, rows,
+                                     ngx_http_sqlitelog_buf_msec() - start,
+                                     log);
+    }
+    
+    return rc_insert;
+}
+
+
+/**
+ * Adjust an adaptive buffer's effective max and flush time after a commit.
+ * 
+ * The max aims for commits that take an eighth of the adaptive time, given
+ * the rows per millisecond of the last commit, and moves halfway there each
+ * time. The flush time leaves room for two average commits within the
+ * adaptive time, but is never less than a quarter of it.
+ * 
+ * @param   buf         the buffer in question
+ * @param   rows        the log entries in the commit
+ * @param   duration    the duration of the commit, in msec
+ * @param   log         a log for writing debug messages
+ */
+static void
+ngx_http_sqlitelog_buf_adapt(ngx_http_sqlitelog_buf_t *buf, ngx_uint_t rows,
+    ngx_msec_t duration, ngx_log_t *log)
+{
+    ngx_uint_t                       max;
+    ngx_uint_t                       target;
+    ngx_msec_t                       commit;
+    ngx_msec_t                       flush;
+    ngx_slab_pool_t                 *shpool;
+    ngx_http_sqlitelog_buf_shctx_t  *ctx;
+    
+    shpool = (ngx_slab_pool_t *) buf->shm_zone->shm.addr;
+    ctx = buf->shm_zone->data;
+    
+    ngx_shmtx_lock(&shpool->mutex);
+    
+    /* Average commit */
+    if (ctx->commit) {
+        commit = (3 * ctx->commit + duration) / 4;
+    } else {
+        commit = duration;
+    }
+    
+    /* Max */
+    max = ctx->max ? ctx->max : (ngx_uint_t) buf->max;
+    if (rows) {
+        if (commit) {
+            target = rows * (buf->adaptive / 8) / commit;
+        } else {
+            target = buf->max;
+        }
+        max = (max + target) / 2;
+    }
+    max = ngx_max(max, NGX_HTTP_SQLITELOG_BUF_ADAPTIVE_MIN);
+    max = ngx_min(max, (ngx_uint_t) buf->max);
+    
+    /* Flush time */
+    flush = 0;
+    if (buf->adaptive > 2 * commit) {
+        flush = buf->adaptive - 2 * commit;
+    }
+    flush = ngx_max(flush, buf->adaptive / 4);
+    flush = ngx_min(flush, buf->flush);
     
-    shpool = (ngx_slab_pool_t *) buf->shm_zone->shm.addr;
+    ctx->commit = commit;
+    ctx->max = max;
+    ctx->flush = flush;
     
-    ngx_shmtx_lock(&shpool->mutex);
-    rc_unshift = ngx_http_sqlitelog_buf_unshift_locked(buf, entry, log);
     ngx_shmtx_unlock(&shpool->mutex);
     
-    return rc_unshift;
+    ngx_log_debug5(NGX_LOG_DEBUG_HTTP, log, 0,
+                   "sqlitelog: buf adapt, rows: %ui, duration: %M, "
+                   "commit: %M, max: %ui, flush: %M",
+                   rows, duration, commit, max, flush);
 }
 
 
 /**
- * Put a log entry at the beginning of the buffer.
- * 
- * The shared pool must be locked.
+ * Get a buffer's effective max.
  * 
  * @param   buf     the buffer in question
- * @param   entry   the log entry in question
- * @param   log     a log for writing error messages
- * @return          NGX_OK on success, or
- *                  NGX_ERROR on failure
+ * @return          the max node count, or 0 if there's none
  */
-ngx_int_t
-ngx_http_sqlitelog_buf_unshift_locked(ngx_http_sqlitelog_buf_t *buf,
-    ngx_array_t *entry, ngx_log_t *log)
+static ngx_int_t
+ngx_http_sqlitelog_buf_max(ngx_http_sqlitelog_buf_t *buf)
 {
-    ngx_slab_pool_t                 *shpool;
-    ngx_http_sqlitelog_node_t       *node;
-    ngx_http_sqlitelog_buf_shctx_t  *shctx;
+    ngx_http_sqlitelog_buf_shctx_t  *ctx;
     
-    shpool = (ngx_slab_pool_t *) buf->shm_zone->shm.addr;
+    ctx = buf->shm_zone->data;
     
-    node = ngx_http_sqlitelog_node_create_locked(entry, shpool, log);
-    if (node == NULL) {
-        return NGX_ERROR;
+    if (buf->adaptive && ctx->max) {
+        return ngx_min((ngx_int_t) ctx->max, buf->max);
     }
     
-    shctx = buf->shm_zone->data;
-    ngx_queue_insert_head(&shctx->queue, &node->link);
-    shctx->queue_len += 1;
-    
-    return NGX_OK;
+    return buf->max;
 }
 
 
 /**
- * Move the buffer's contents from shared memory to local memory, clearing
- * the queue contents in the process.
- * 
- * The shared pool must be locked.
+ * Get a buffer's effective flush time.
  * 
  * @param   buf     the buffer in question
- * @param   list    an initialized list in local memory to hold the contents
- * @return          NGX_OK on success, or
- *                  NGX_ERROR on failure
+ * @return          the flush time, or 0 if there's none
  */
-static ngx_int_t
-ngx_http_sqlitelog_buf_move_locked(ngx_http_sqlitelog_buf_t *buf,
-    ngx_list_t *list)
+static ngx_msec_t
+ngx_http_sqlitelog_buf_flush_time(ngx_http_sqlitelog_buf_t *buf)
 {
-    size_t                           sbuf_size;
-    u_char                          *sbuf;
-    ngx_str_t                       *elt;
-    ngx_str_t                       *s;
-    ngx_uint_t                       i;
-    ngx_queue_t                     *q;
-    ngx_slab_pool_t                 *shpool;
-    ngx_http_sqlitelog_node_t       *node;
     ngx_http_sqlitelog_buf_shctx_t  *ctx;
     
-    shpool = (ngx_slab_pool_t*) buf->shm_zone->shm.addr;
     ctx = buf->shm_zone->data;
     
-    /* Copy */
-    for (q = ngx_queue_head(&ctx->queue);
-         q != ngx_queue_sentinel(&ctx->queue);
-         q = ngx_queue_next(q))
-    {
-        node = ngx_queue_data(q, ngx_http_sqlitelog_node_t, link);
-        elt = node->elts;
-        
-        for (i = 0; i < node->nelts; i++) {
-            
-            s = ngx_list_push(list);
-            if (s == NULL) {
-                return NGX_ERROR;
-            }
-            
-            else if (elt->data == NULL) {
-                s->data = NULL;
-                s->len = 0;
-            }
-            
-            else {
-                sbuf_size = elt->len;
-                sbuf = ngx_pcalloc(list->pool, sbuf_size * sizeof(u_char));
-                if (sbuf == NULL) {
-                    return NGX_ERROR;
-                }
-                ngx_memcpy(sbuf, elt->data, elt->len);
-                s->data = sbuf;
-                s->len = elt->len;
-            }
-            
-            elt++;
-        }
-    }
-    
-    /* Clear */
-    for (q = ngx_queue_head(&ctx->queue);
-         q != ngx_queue_sentinel(&ctx->queue);
-         q = ngx_queue_next(q))
-    {
-        node = ngx_queue_data(q, ngx_http_sqlitelog_node_t, link);
-        ngx_http_sqlitelog_node_destroy_locked(node, shpool);
+    if (buf->adaptive && ctx->flush) {
+        return ngx_min((ngx_msec_t) ctx->flush, buf->flush);
     }
     
-    ctx->queue_len = 0;
-    ngx_queue_init(&ctx->queue);
-    
-    return NGX_OK;
+    return buf->flush;
 }
 
 
 /**
- * Move the buffer's contents from shared memory to local memory, clearing
- * the queue contents in the process.
+ * Get the current time in milliseconds. Unlike ngx_current_msec, this is
+ * also up to date in worker threads.
  * 
- * This is similar to ngx_http_sqlitelog_buffer_move(), except the list is
- * initialized in the given pool.
- * 
- * @param   buf     the buffer in question
- * @param   pool    a pool in which to initialize the list
- * @param   n       the amount of elements per list part (log format columns)
- * @param   list    an uninitialized list to hold the contents
- * @return          NGX_OK on success, or
- *                  NGX_ERROR on failure
+ * @return          the current time, in msec
  */
-ngx_int_t
-ngx_http_sqlitelog_buf_list(ngx_http_sqlitelog_buf_t *buf, ngx_pool_t *pool,
-    ngx_uint_t n, ngx_list_t *list)
+static ngx_msec_t
+ngx_http_sqlitelog_buf_msec(void)
 {
-    ngx_int_t         rc_list;
-    ngx_slab_pool_t  *shpool;
-    
-    shpool = (ngx_slab_pool_t *) buf->shm_zone->shm.addr;
+    struct timeval  tv;
     
-    ngx_shmtx_lock(&shpool->mutex);
-    rc_list = ngx_http_sqlitelog_buf_list_locked(buf, pool, n, list);
-    ngx_shmtx_unlock(&shpool->mutex);
+    ngx_gettimeofday(&tv);
     
-    return rc_list;
+    return (ngx_msec_t) tv.tv_sec * 1000 + tv.tv_usec / 1000;
 }
 
 
 /**
- * Move the buffer's contents from shared memory to local memory, clearing
- * the queue contents in the process.
- * 
- * This is similar to ngx_http_sqlitelog_buffer_move(), except the list is
- * initialized in the given pool.
- * 
- * The shared pool must be locked.
+ * Add the current request to the buffer's rollup, if any.
  * 
  * @param   buf     the buffer in question
- * @param   pool    a pool in which to initialize the list
- * @param   n       the amount of elements per list part (log format columns)
- * @param   list    an uninitialized list to hold the contents
+ * @param   r       the current request
  * @return          NGX_OK on success, or
  *                  NGX_ERROR on failure
  */
 ngx_int_t
-ngx_http_sqlitelog_buf_list_locked(ngx_http_sqlitelog_buf_t *buf,
-    ngx_pool_t *pool, ngx_uint_t n, ngx_list_t *list)
+ngx_http_sqlitelog_buf_rollup(ngx_http_sqlitelog_buf_t *buf,
+    ngx_http_request_t *r)
 {
-    ngx_int_t  rc_init;
-    ngx_int_t  rc_move;
+    ngx_slab_pool_t                 *shpool;
+    ngx_http_sqlitelog_buf_shctx_t  *ctx;
     
-    rc_init = ngx_list_init(list, pool, n, sizeof(ngx_str_t));
-    if (rc_init != NGX_OK) {
-        return NGX_ERROR;
+    if (buf->rollup == NULL) {
+        return NGX_OK;
     }
     
-    rc_move = ngx_http_sqlitelog_buf_move_locked(buf, list);
-    if (rc_move != NGX_OK) {
-        return NGX_ERROR;
-    }
+    shpool = (ngx_slab_pool_t *) buf->shm_zone->shm.addr;
+    ctx = buf->shm_zone->data;
     
-    return NGX_OK;
+    return ngx_http_sqlitelog_rollup_add(buf->rollup, &ctx->rollup, shpool,
+                                         buf->sig, r);
 }
 
 
 /**
- * Get the buffer's current length.
+ * Get the buffer's current length. Without the lock, the length may change
+ * right after it's read.
  * 
  * @param   buf     the buffer in question
  * @return          the buffer's current length
@@ -309,23 +1173,18 @@ ngx_http_sqlitelog_buf_list_locked(ngx_http_sqlitelog_buf_t *buf,
 ngx_int_t
 ngx_http_sqlitelog_buf_get_len(ngx_http_sqlitelog_buf_t *buf)
 {
-    ngx_int_t         len;
-    ngx_slab_pool_t  *shpool;
-    
-    shpool = (ngx_slab_pool_t*) buf->shm_zone->shm.addr;
+    ngx_http_sqlitelog_buf_shctx_t  *ctx;
     
-    ngx_shmtx_lock(&shpool->mutex);
-    len = ngx_http_sqlitelog_buf_get_len_locked(buf);
-    ngx_shmtx_unlock(&shpool->mutex);
+    ctx = buf->shm_zone->data;
     
-    return len;
+    return (ngx_int_t) ctx->queue_len;
 }
 
 
 /**
  * Get the buffer's current length.
  * 
- * The shared pool must be locked.
+ * The buffer must be locked by ngx_http_sqlitelog_buf_lock().
  * 
  * @param   buf     the buffer in question
  * @return          the buffer's current length
@@ -337,7 +1196,7 @@ ngx_http_sqlitelog_buf_get_len_locked(ngx_http_sqlitelog_buf_t *buf)
     
     ctx = buf->shm_zone->data;
     
-    return ctx->queue_len;
+    return (ngx_int_t) ctx->queue_len;
 }
 
 
@@ -355,15 +1214,24 @@ ngx_http_sqlitelog_buf_timer_reset(ngx_http_sqlitelog_buf_t *buf)
 
 
 /**
- * Start a buffer's flush timer.
+ * Start a buffer's flush timer. While another worker process holds the flush
+ * lease, this worker only needs to wake up once per lease.
  * 
  * @param   buf     the buffer in question
  */
 void
 ngx_http_sqlitelog_buf_timer_start(ngx_http_sqlitelog_buf_t *buf)
 {
+    ngx_msec_t                       timer;
+    ngx_http_sqlitelog_buf_shctx_t  *ctx;
+    
     if (buf->flush && buf->event && buf->event->timer_set == 0) {
-        ngx_add_timer(buf->event, buf->flush);
+        ctx = buf->shm_zone->data;
+        timer = ngx_http_sqlitelog_buf_flush_time(buf);
+        if (!buf->flusher && ctx->flusher != 0) {
+            timer *= NGX_HTTP_SQLITELOG_BUF_LEASE;
+        }
+        ngx_add_timer(buf->event, timer);
     }
 }
 
@@ -382,9 +1250,101 @@ ngx_http_sqlitelog_buf_timer_stop(ngx_http_sqlitelog_buf_t *buf)
 }
 
 
+/**
+ * Take or renew a buffer's flush lease.
+ * 
+ * A worker process takes the lease if no other worker holds it, or if its
+ * holder hasn't renewed it in time (i.e. the holder is gone). Two workers
+ * that try to take the lease at once can't both succeed, since the holder is
+ * replaced by compare-and-swap.
+ * 
+ * A worker process of an older configuration whose zone was taken over by a
+ * newer one never takes or renews the lease, and releases it if it holds it,
+ * since it only flushes its own configuration's log entries. Those are left
+ * to ngx_http_sqlitelog_buf_drain() when it exits.
+ * 
+ * @param   buf     the buffer in question
+ * @return          1 if this worker process holds the lease, or 0 if not
+ */
+static ngx_flag_t
+ngx_http_sqlitelog_buf_lease(ngx_http_sqlitelog_buf_t *buf)
+{
+    ngx_msec_t                       now;
+    ngx_atomic_uint_t                flusher;
+    ngx_http_sqlitelog_buf_shctx_t  *ctx;
+    
+    ctx = buf->shm_zone->data;
+    
+    /* Taken over by a newer configuration */
+    if (ctx->live != buf->cycle) {
+        if (buf->flusher) {
+            ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                           "sqlitelog: flush lease released, "
+                           "zone taken over");
+        }
+        ngx_http_sqlitelog_buf_release(buf);
+        return 0;
+    }
+    
+    now = ngx_current_msec;
+    flusher = ctx->flusher;
+    
+    if (flusher != (ngx_atomic_uint_t) ngx_pid) {
+        
+        /* Held by another worker */
+        if (flusher != 0 && (ngx_msec_int_t) (ctx->lease - now) > 0) {
+            buf->flusher = 0;
+            return 0;
+        }
+        
+        /* Released or expired */
+        if (!ngx_atomic_cmp_set(&ctx->flusher, flusher,
+                                (ngx_atomic_uint_t) ngx_pid))
+        {
+            buf->flusher = 0;
+            return 0;
+        }
+        
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                       "sqlitelog: flush lease taken, previous: %uA",
+                       flusher);
+    }
+    
+    ctx->lease = now + buf->flush * NGX_HTTP_SQLITELOG_BUF_LEASE;
+    buf->flusher = 1;
+    
+    return 1;
+}
+
+
+/**
+ * Release a buffer's flush lease, if this worker process holds it, so that
+ * another worker can take over. This is called when a worker process exits,
+ * or when a newer configuration has taken over the zone.
+ * 
+ * @param   buf     the buffer in question
+ */
+void
+ngx_http_sqlitelog_buf_release(ngx_http_sqlitelog_buf_t *buf)
+{
+    ngx_http_sqlitelog_buf_shctx_t  *ctx;
+    
+    if (!buf->flusher) {
+        return;
+    }
+    
+    ctx = buf->shm_zone->data;
+    ngx_atomic_cmp_set(&ctx->flusher, (ngx_atomic_uint_t) ngx_pid, 0);
+    buf->flusher = 0;
+}
+
+
 /**
  * Perform a buffer flush. This is called when the flush timer has elapsed.
  * 
+ * Only the worker process that holds the flush lease flushes the buffer. The
+ * others restart their timers without touching the buffer.
+ * 
  * @param   ev      the flush event
  */
 void
@@ -397,6 +1357,13 @@ ngx_http_sqlitelog_buf_flush_handler(ngx_event_t *ev)
     ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ev->log, 0,
                    "sqlitelog: flush handler");
     
+    if (!ngx_http_sqlitelog_buf_lease(ctx->buf)) {
+        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ev->log, 0,
+                       "sqlitelog: flush handler, not the flusher");
+        ngx_http_sqlitelog_buf_timer_start(ctx->buf);
+        return;
+    }
+    
 #if (NGX_THREADS)
     if (*(ctx->tp)) {
         ngx_http_sqlitelog_buf_flush_async(ctx->buf, ctx->db, ev->log);
@@ -407,6 +1374,162 @@ ngx_http_sqlitelog_buf_flush_handler(ngx_event_t *ev)
 }
 
 
+/**
+ * Commit the log entries that were recovered from a persistent buffer's
+ * journal, if no other worker process has done so yet.
+ * 
+ * The commit is synchronous, so that it's done before the worker process
+ * begins to handle requests.
+ * 
+ * @param   buf     the buffer in question
+ * @param   db      the database to be written to
+ * @param   log     a log for writing error messages
+ */
+void
+ngx_http_sqlitelog_buf_replay(ngx_http_sqlitelog_buf_t *buf,
+    ngx_http_sqlitelog_db_t *db, ngx_log_t *log)
+{
+    ngx_http_sqlitelog_buf_shctx_t  *ctx;
+    
+    ctx = buf->shm_zone->data;
+    
+    if (!ngx_atomic_cmp_set(&ctx->recovered, 1, 0)) {
+        return;
+    }
+    
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, log, 0, "sqlitelog: buf replay");
+    ngx_http_sqlitelog_buf_flush(buf, db, log);
+}
+
+
+/**
+ * Drain the buffer when a worker process exits, unless another exiting worker
+ * is already draining it.
+ * 
+ * The drainer claims the buffer by compare-and-swap, and keeps committing
+ * until the buffer is empty, checking it again after giving up its claim. So
+ * the log entries of a worker that found the buffer claimed are committed by
+ * the drainer instead. A claim expires after the given timeout, in case its
+ * drainer died.
+ * 
+ * @param   buf         the buffer to be drained
+ * @param   db          the database to be written to
+ * @param   timeout     the time after which the claim expires, in msec
+ * @param   log         a log for writing error messages
+ * @return              NGX_OK if this worker process drained the buffer,
+ *                      NGX_DECLINED if there was nothing for it to drain, or
+ *                      NGX_ERROR on failure
+ */
+ngx_int_t
+ngx_http_sqlitelog_buf_drain(ngx_http_sqlitelog_buf_t *buf,
+    ngx_http_sqlitelog_db_t *db, ngx_msec_t timeout, ngx_log_t *log)
+{
+    ngx_int_t                        rc;
+    ngx_int_t                        rc_drain;
+    ngx_msec_t                       now;
+    ngx_atomic_uint_t                drainer;
+    ngx_http_sqlitelog_buf_shctx_t  *ctx;
+    
+    ctx = buf->shm_zone->data;
+    rc = NGX_DECLINED;
+    
+    while (ngx_http_sqlitelog_buf_get_len(buf) > 0) {
+        
+        /* Claimed by another worker */
+        now = ngx_http_sqlitelog_buf_msec();
+        drainer = ctx->drainer;
+        if (drainer != 0 && (ngx_msec_int_t) (ctx->drain - now) > 0) {
+            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, log, 0,
+                           "sqlitelog: buf drain, claimed by %uA", drainer);
+            break;
+        }
+        if (!ngx_atomic_cmp_set(&ctx->drainer, drainer,
+                                (ngx_atomic_uint_t) ngx_pid))
+        {
+            break;
+        }
+        ctx->drain = now + timeout;
+        
+        rc_drain = ngx_http_sqlitelog_buf_drain_once(buf, db, log);
+        ngx_atomic_cmp_set(&ctx->drainer, (ngx_atomic_uint_t) ngx_pid, 0);
+        
+        if (rc_drain != NGX_OK) {
+            return (rc_drain == NGX_ERROR) ? NGX_ERROR : rc;
+        }
+        rc = NGX_OK;
+    }
+    
+    return rc;
+}
+
+
+/**
+ * Commit everything in the buffer in one transaction, without touching the
+ * flush timer.
+ * 
+ * @param   buf     the buffer to be drained
+ * @param   db      the database to be written to
+ * @param   log     a log for writing error messages
+ * @return          NGX_OK if log entries were committed,
+ *                  NGX_DECLINED if none could be listed (e.g. they belong to
+ *                  another configuration), or
+ *                  NGX_ERROR on failure
+ */
+static ngx_int_t
+ngx_http_sqlitelog_buf_drain_once(ngx_http_sqlitelog_buf_t *buf,
+    ngx_http_sqlitelog_db_t *db, ngx_log_t *log)
+{
+    int                       rc_insert;
+    ngx_int_t                 rc;
+    ngx_int_t                 rc_list;
+    ngx_uint_t                half;
+    ngx_list_t                list;
+    ngx_array_t               rollup;
+    ngx_pool_t               *pool;
+    
+    pool = ngx_create_pool(NGX_DEFAULT_POOL_SIZE, log);
+    if (pool == NULL) {
+        return NGX_ERROR;
+    }
+    
+    /* 1. Lock */
+    ngx_http_sqlitelog_buf_lock(buf);
+    
+    /* 2. List */
+    rc_list = ngx_http_sqlitelog_buf_list_locked(buf, pool, &list, &rollup,
+                                                 &half);
+    if (rc_list != NGX_OK) {
+        ngx_log_error(NGX_LOG_ERR, log, 0,
+                      "sqlitelog: buffer drain failed to create list "
+                      "for database \"%V\"", &db->filename);
+        ngx_http_sqlitelog_buf_unlock(buf);
+        ngx_destroy_pool(pool);
+        return NGX_ERROR;
+    }
+    
+    /* 3. Unlock */
+    ngx_http_sqlitelog_buf_unlock(buf);
+    
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, log, 0,
+                   "sqlitelog: buf drain, len: %ui", list.part.nelts);
+    
+    /* 4. Insert */
+    rc = (list.part.nelts || rollup.nelts) ? NGX_OK : NGX_DECLINED;
+    rc_insert = ngx_http_sqlitelog_buf_commit(buf, db, &list, &rollup, half,
+                                              log);
+    if (rc_insert != SQLITE_OK) {
+        ngx_log_error(NGX_LOG_ERR, log, 0,
+                      "sqlitelog: buffer drain failed to insert list "
+                      "into database \"%V\"", &db->filename);
+        rc = NGX_ERROR;
+    }
+    
+    ngx_destroy_pool(pool);
+    
+    return rc;
+}
+
+
 /**
  * Flush the buffer.
  * 
@@ -421,19 +1544,15 @@ ngx_http_sqlitelog_buf_flush(ngx_http_sqlitelog_buf_t *buf,
     int                       rc_insert;
     ngx_int_t                 buf_len;
     ngx_int_t                 rc_list;
+    ngx_uint_t                half;
     ngx_list_t                list;
-    ngx_uint_t                n;
+    ngx_array_t               rollup;
     ngx_pool_t               *pool;
-    ngx_slab_pool_t          *shpool;
     
     pool = NULL;
-    shpool = (ngx_slab_pool_t *) buf->shm_zone->shm.addr;
-    n = db->fmt->columns.nelts;
     
     /* Buffer length */
-    ngx_shmtx_lock(&shpool->mutex);
-    buf_len = ngx_http_sqlitelog_buf_get_len_locked(buf);
-    ngx_shmtx_unlock(&shpool->mutex);
+    buf_len = ngx_http_sqlitelog_buf_get_len(buf);
     ngx_log_debug1(NGX_LOG_DEBUG_HTTP, log, 0,
                    "sqlitelog: buf flush, len: %d", buf_len);
     
@@ -444,14 +1563,14 @@ ngx_http_sqlitelog_buf_flush(ngx_http_sqlitelog_buf_t *buf,
     }
     
     /* 1. Lock */
-    ngx_shmtx_lock(&shpool->mutex);
+    ngx_http_sqlitelog_buf_lock(buf);
     buf_len = ngx_http_sqlitelog_buf_get_len_locked(buf);
     if (buf_len == 0) {
         ngx_log_debug1(NGX_LOG_DEBUG_HTTP, log, 0,
                        "sqlitelog: buf flush, len: 0, previously %d but "
                        "another worker process already flushed", buf_len);
         ngx_http_sqlitelog_buf_timer_reset(buf);
-        ngx_shmtx_unlock(&shpool->mutex);
+        ngx_http_sqlitelog_buf_unlock(buf);
         goto failed;
     }
     
@@ -461,15 +1580,16 @@ ngx_http_sqlitelog_buf_flush(ngx_http_sqlitelog_buf_t *buf,
         ngx_log_error(NGX_LOG_ERR, log, 0,
                       "sqlitelog: buffer flush failed to create pool of %z "
                       "bytes", NGX_DEFAULT_POOL_SIZE);
-        ngx_shmtx_unlock(&shpool->mutex);
+        ngx_http_sqlitelog_buf_unlock(buf);
         goto failed;
     }
-    rc_list = ngx_http_sqlitelog_buf_list_locked(buf, pool, n, &list);
+    rc_list = ngx_http_sqlitelog_buf_list_locked(buf, pool, &list, &rollup,
+                                                 &half);
     if (rc_list != NGX_OK) {
         ngx_log_error(NGX_LOG_ERR, log, 0,
                       "sqlitelog: buffer flush failed to create list "
                       "for database \"%V\"", &db->filename);
-        ngx_shmtx_unlock(&shpool->mutex);
+        ngx_http_sqlitelog_buf_unlock(buf);
         goto failed;
     }
     
@@ -479,10 +1599,11 @@ ngx_http_sqlitelog_buf_flush(ngx_http_sqlitelog_buf_t *buf,
     ngx_http_sqlitelog_buf_timer_reset(buf);
     
     /* 4. Unlock */
-    ngx_shmtx_unlock(&shpool->mutex);
+    ngx_http_sqlitelog_buf_unlock(buf);
     
     /* 5. Insert */
-    rc_insert = ngx_http_sqlitelog_db_insert_list(db, &list, log);
+    rc_insert = ngx_http_sqlitelog_buf_commit(buf, db, &list, &rollup, half,
+                                              log);
     if (rc_insert != SQLITE_OK) {
         ngx_log_error(NGX_LOG_ERR, log, 0,
                       "sqlitelog: buffer flush failed to insert list "
@@ -511,20 +1632,11 @@ ngx_http_sqlitelog_buf_flush_async(ngx_http_sqlitelog_buf_t *buf,
 {
     ngx_int_t                         rc_post;
     ngx_uint_t                        buf_len;
-    ngx_pool_t                       *pool;
-    ngx_slab_pool_t                  *shpool;
     ngx_thread_task_t                *task;
-    ngx_http_sqlitelog_buf_flctx_t   *flctx;
     ngx_http_sqlitelog_thread_ctx_t  *thctx;
     
-    pool = NULL;
-    shpool = (ngx_slab_pool_t *) buf->shm_zone->shm.addr;
-    flctx = buf->event->data;
-    
     /* Buffer length */
-    ngx_shmtx_lock(&shpool->mutex);
-    buf_len = ngx_http_sqlitelog_buf_get_len_locked(buf);
-    ngx_shmtx_unlock(&shpool->mutex);
+    buf_len = ngx_http_sqlitelog_buf_get_len(buf);
     ngx_log_debug1(NGX_LOG_DEBUG_HTTP, log, 0,
                    "sqlitelog: buf flush async, len: %d", buf_len);
     
@@ -534,51 +1646,28 @@ ngx_http_sqlitelog_buf_flush_async(ngx_http_sqlitelog_buf_t *buf,
         return;
     }
     
-    /* Create pool */
-    pool = ngx_create_pool(NGX_DEFAULT_POOL_SIZE, log);
-    if (pool == NULL) {
-        ngx_log_error(NGX_LOG_ERR, log, 0,
-                      "sqlitelog: async buffer flush failed to create pool of "
-                      "%z bytes", NGX_DEFAULT_POOL_SIZE);
-        goto failed;
-    }
-    
     /* Create thread task */
-    task = ngx_thread_task_alloc(pool, sizeof(ngx_http_sqlitelog_thread_ctx_t));
+    task = ngx_http_sqlitelog_thread_task(db, log);
     if (task == NULL) {
         ngx_log_error(NGX_LOG_ERR, log, 0,
                       "sqlitelog: async buffer flush failed to create thread "
                       "task");
-        goto failed;
+        return;
     }
     
     /* Set async context */
     thctx = task->ctx;
-    thctx->log_entry = NULL;
     thctx->buf = buf;
-    thctx->pool = pool;
     
     task->handler = ngx_http_sqlitelog_thread_flush_handler;
-    task->event.handler = ngx_http_sqlitelog_thread_completed_handler;
-    task->event.data = thctx;
-    task->event.log = ngx_cycle->log;
     
     /* Begin */
-    rc_post = ngx_thread_task_post(*(flctx->tp), task);
+    rc_post = ngx_http_sqlitelog_thread_post(db, task);
     if (rc_post != NGX_OK) {
         ngx_log_error(NGX_LOG_ERR, log, 0,
                       "sqlitelog: async buffer flush failed to post thread "
                       "task");
-        goto failed;
-    }
-    else {
-        return;
-    }
-    
-failed:
-
-    if (pool) {
-        ngx_destroy_pool(pool);
+        ngx_http_sqlitelog_thread_task_free(db, task);
     }
 }
 #endif
@@ -9,9 +9,11 @@
  * This is easier said than done for a few reasons.
  * 
  *  1. The buffer holds its contents in a shared memory zone. Each Nginx worker
- *     process pushes its log entries to the zone. The shared pool mutex must be
- *     carefully locked and unlocked by the workers to avoid race conditions and
- *     to keep the log entries in order.
+ *     process pushes its log entries to its own shard of the zone, so pushes
+ *     only contend with the transaction, not with other workers, until the
+ *     shard is full and the worker pushes to the others. The transaction
+ *     locks every shard (via ngx_http_sqlitelog_buf_lock() ) and merges their
+ *     log entries by sequence number to keep them in order.
  *  2. Performing disk I/O (i.e. using SQLite) while the mutex is locked is
  *     discouraged. In order to actually perform the database write, we must
  *     first transfer the log entries *out* of the shared memory queue and
@@ -19,7 +21,7 @@
  * 
  * The basic sequence for executing the transaction is:
  * 
- *  1. Lock
+ *  1. Lock (via ngx_http_sqlitelog_buf_lock() )
  *  2. List (via ngx_http_sqlitelog_buffer_list_locked() )
  *  5. Reset (flush timer)
  *  4. Unlock
@@ -28,6 +30,11 @@
  * An additional step, "Unshift", takes place if the execution is occuring
  * because the module attempted to push a new node to the buffer, but failed
  * due to a size overflow.
+ * 
+ * A persistent buffer also appends every log entry to a journal file, which
+ * is read back when Nginx starts (see ngx_http_sqlitelog_journal.h). The
+ * journal's half that a transaction listed is returned by the List step and
+ * released by ngx_http_sqlitelog_buf_commit().
  */
 
 
@@ -40,34 +47,146 @@
 
 #include "ngx_http_sqlitelog_db.h"
 #include "ngx_http_sqlitelog_fmt.h"
+#include "ngx_http_sqlitelog_journal.h"
+#include "ngx_http_sqlitelog_rollup.h"
+
+
+/* Flush intervals that the flush lease lasts without being renewed */
+#define NGX_HTTP_SQLITELOG_BUF_LEASE         3
+
+/* Bounds of an adaptive buffer's max, unless max is given */
+#define NGX_HTTP_SQLITELOG_BUF_ADAPTIVE_MIN  16
+#define NGX_HTTP_SQLITELOG_BUF_ADAPTIVE_MAX  65536
+
+/* Pages that each shard of the buffer holds at least */
+#define NGX_HTTP_SQLITELOG_BUF_SHARD_MIN     8
+
+/* Size of a transparent huge page */
+#define NGX_HTTP_SQLITELOG_BUF_HUGEPAGE      (2 * 1024 * 1024)
 
 
 /*
- * ngx_http_sqlitelog_buf_t represents the transaction buffer.
+ * ngx_http_sqlitelog_buf_t represents the transaction buffer. There is one
+ * buffer per database file, shared by all of the file's tables.
  * 
  * shm_zone     the shared memory zone for holding the buffer contents
  * max          the max node count for the queue
  * flush        the flush timer, if set
  * event        the flush event
+ * rollup       an optional rollup table accumulated in the buffer
+ * flusher      a flag set to 1 if this worker process holds the flush lease
+ * adaptive     the time within which a log entry should be committed, if the
+ *              buffer is adaptive, or 0
+ * ccf          the core configuration, whose worker process count is the
+ *              buffer's shard count
+ * hugepages    a flag set to 1 if the zone should be backed by huge pages
+ * persist      the full path of the journal file, if the buffer is persistent
+ * sig          the signature of the database's tables in this configuration
+ * cycle        the number of this configuration among those that have used
+ *              the zone
+ * old_zone     the previous configuration's zone, whose log entries are moved
+ *              to this one once the configuration is loaded, or NULL
+ * 
+ * An adaptive buffer measures each of its commits, and adjusts its effective
+ * max and flush time so that entries are committed within the adaptive time
+ * while each commit takes as many of them as possible. The max and flush
+ * parameters are then the upper bounds of the effective values.
+ * 
+ * When Nginx reloads with the same buffer size, the new configuration takes
+ * over the zone, and the old worker processes leave its log entries to the
+ * new ones, unless the tables changed. A log entry is only listed by a
+ * configuration with the same signature, so the old workers still commit
+ * their own entries in that case. When the size changes, the new zone takes
+ * the old zone's log entries instead (see ngx_http_sqlitelog_buf_migrate() ).
+ * 
+ * Only the worker process that holds the flush lease flushes the buffer when
+ * the flush time elapses. The other workers' timers only check, once per
+ * lease, whether the lease has been released or has expired, so that one of
+ * them takes over when the flusher exits. Once a newer configuration has
+ * taken over the zone, the old worker processes give up the lease, since they
+ * only list their own configuration's log entries, and leave those to be
+ * committed when they exit.
+ * 
+ * Likewise, only one exiting worker process drains the buffer at a time. The
+ * others leave their log entries to it, since it drains the buffer until it's
+ * empty (see ngx_http_sqlitelog_buf_drain() ).
+ */
+struct ngx_http_sqlitelog_buf_s {
+    ngx_shm_zone_t                *shm_zone;
+    ngx_int_t                      max;
+    ngx_msec_t                     flush;
+    ngx_event_t                   *event;
+    ngx_http_sqlitelog_rollup_t   *rollup;
+    ngx_flag_t                     flusher;
+    ngx_msec_t                     adaptive;
+    ngx_core_conf_t               *ccf;
+    ngx_flag_t                     hugepages;
+    ngx_str_t                      persist;
+    uint32_t                       sig;
+    ngx_atomic_uint_t              cycle;
+    ngx_shm_zone_t                *old_zone;
+};
+
+
+/*
+ * ngx_http_sqlitelog_buf_shard_t is one worker process's share of the buffer
+ * in shared memory. Its pool has its own mutex, which guards the queue.
+ * 
+ * shpool       the pool in which the queue's nodes are allocated
+ * queue        the queue where log entry nodes are stored
  */
 typedef struct {
-    ngx_shm_zone_t            *shm_zone;
-    ngx_int_t                  max;
-    ngx_msec_t                 flush;
-    ngx_event_t               *event;
-} ngx_http_sqlitelog_buf_t;
+    ngx_slab_pool_t               *shpool;
+    ngx_queue_t                    queue;
+} ngx_http_sqlitelog_buf_shard_t;
 
 
 /*
  * ngx_http_sqlitelog_buf_shctx_t is the buffer data stored in shared memory
  * to be read and written by multiple workers.
  * 
- * queue        the queue where log entry nodes are stored
- * queue_len    the queue's current length
+ * shards       the shards, one per worker process if the zone is large
+ *              enough, each carved out of the zone's pool as a pool of its own;
+ *              otherwise, a single shard that uses the zone's pool
+ * nshards      the length of shards
+ * seq          the sequence number of the next log entry
+ * queue_len    the total length of the shards' queues
+ * rollup       the rollup groups accumulated since the last transaction
+ * flusher      the process ID of the worker that holds the flush lease, or 0
+ * lease        the time at which the flush lease expires, in msec
+ * max          the effective max of an adaptive buffer, or 0 until its first
+ *              commit
+ * flush        the effective flush time of an adaptive buffer, or 0 until its
+ *              first commit
+ * commit       the average duration of an adaptive buffer's commits, in msec
+ * journal      the journal of a persistent buffer, or NULL
+ * recovered    a flag set to 1 if log entries were recovered from the journal
+ *              and have yet to be committed
+ * cycles       the amount of configurations that have used the zone
+ * live         the cycle of the newest configuration that's running
+ * sig          the signature of the newest configuration that's running
+ * drainer      the process ID of the exiting worker that drains the buffer,
+ *              or 0
+ * drain        the time at which the drainer's claim expires, in msec
  */
 typedef struct {
-    ngx_queue_t               queue;
-    ngx_int_t                 queue_len;
+    ngx_http_sqlitelog_buf_shard_t      *shards;
+    ngx_uint_t                           nshards;
+    ngx_atomic_t                         seq;
+    ngx_atomic_t                         queue_len;
+    ngx_http_sqlitelog_rollup_shctx_t    rollup;
+    ngx_atomic_t                         flusher;
+    ngx_atomic_t                         lease;
+    ngx_atomic_t                         max;
+    ngx_atomic_t                         flush;
+    ngx_atomic_t                         commit;
+    ngx_http_sqlitelog_journal_t        *journal;
+    ngx_atomic_t                         recovered;
+    ngx_atomic_t                         cycles;
+    ngx_atomic_t                         live;
+    ngx_atomic_t                         sig;
+    ngx_atomic_t                         drainer;
+    ngx_atomic_t                         drain;
 } ngx_http_sqlitelog_buf_shctx_t;
 
 
@@ -91,20 +210,49 @@ typedef struct {
 } ngx_http_sqlitelog_buf_flctx_t;
 
 
+ngx_int_t ngx_http_sqlitelog_buf_init_shctx(
+    ngx_http_sqlitelog_buf_shctx_t *ctx, ngx_slab_pool_t *shpool,
+    ngx_uint_t workers, ngx_log_t *log);
+
+void ngx_http_sqlitelog_buf_hugepages(ngx_shm_t *shm);
+ngx_int_t ngx_http_sqlitelog_buf_persist(ngx_http_sqlitelog_buf_t *buf,
+    ngx_log_t *log);
+ngx_int_t ngx_http_sqlitelog_buf_migrate(ngx_http_sqlitelog_buf_t *buf,
+    ngx_shm_zone_t *old_zone, ngx_log_t *log);
+void ngx_http_sqlitelog_buf_adopt(ngx_http_sqlitelog_buf_t *buf);
+ngx_flag_t ngx_http_sqlitelog_buf_adopted(ngx_http_sqlitelog_buf_t *buf);
+
+void ngx_http_sqlitelog_buf_lock(ngx_http_sqlitelog_buf_t *buf);
+void ngx_http_sqlitelog_buf_unlock(ngx_http_sqlitelog_buf_t *buf);
+
 ngx_int_t ngx_http_sqlitelog_buf_push(ngx_http_sqlitelog_buf_t *buf,
-    ngx_array_t *entry, ngx_log_t *log);
+    ngx_uint_t table, ngx_array_t *entry, ngx_log_t *log);
 ngx_int_t ngx_http_sqlitelog_buf_push_locked( ngx_http_sqlitelog_buf_t *buf,
+    ngx_http_sqlitelog_buf_shard_t *shard, ngx_uint_t table,
     ngx_array_t *entry, ngx_log_t *log);
 
 ngx_int_t ngx_http_sqlitelog_buf_unshift(ngx_http_sqlitelog_buf_t *buf,
-    ngx_array_t *entry, ngx_log_t *log);
+    ngx_uint_t table, ngx_array_t *entry, ngx_log_t *log);
 ngx_int_t ngx_http_sqlitelog_buf_unshift_locked(ngx_http_sqlitelog_buf_t *buf,
-    ngx_array_t *entry, ngx_log_t *log);
+    ngx_uint_t table, ngx_array_t *entry, ngx_log_t *log);
 
 ngx_int_t ngx_http_sqlitelog_buf_list(ngx_http_sqlitelog_buf_t *buf,
-    ngx_pool_t *pool, ngx_uint_t n, ngx_list_t *list);
+    ngx_pool_t *pool, ngx_list_t *list, ngx_array_t *rollup,
+    ngx_uint_t *half);
 ngx_int_t ngx_http_sqlitelog_buf_list_locked(ngx_http_sqlitelog_buf_t *buf,
-    ngx_pool_t *pool, ngx_uint_t n, ngx_list_t *list);
+    ngx_pool_t *pool, ngx_list_t *list, ngx_array_t *rollup,
+    ngx_uint_t *half);
+
+int ngx_http_sqlitelog_buf_commit(ngx_http_sqlitelog_buf_t *buf,
+    ngx_http_sqlitelog_db_t *db, ngx_list_t *list, ngx_array_t *rollup,
+    ngx_uint_t half, ngx_log_t *log);
+void ngx_http_sqlitelog_buf_replay(ngx_http_sqlitelog_buf_t *buf,
+    ngx_http_sqlitelog_db_t *db, ngx_log_t *log);
+ngx_int_t ngx_http_sqlitelog_buf_drain(ngx_http_sqlitelog_buf_t *buf,
+    ngx_http_sqlitelog_db_t *db, ngx_msec_t timeout, ngx_log_t *log);
+
+ngx_int_t ngx_http_sqlitelog_buf_rollup(ngx_http_sqlitelog_buf_t *buf,
+    ngx_http_request_t *r);
 
 ngx_int_t ngx_http_sqlitelog_buf_get_len(ngx_http_sqlitelog_buf_t *buf);
 ngx_int_t ngx_http_sqlitelog_buf_get_len_locked(ngx_http_sqlitelog_buf_t *buf);
@@ -112,5 +260,6 @@ ngx_int_t ngx_http_sqlitelog_buf_get_len_locked(ngx_http_sqlitelog_buf_t *buf);
 void ngx_http_sqlitelog_buf_timer_reset(ngx_http_sqlitelog_buf_t *buf);
 void ngx_http_sqlitelog_buf_timer_start(ngx_http_sqlitelog_buf_t *buf);
 void ngx_http_sqlitelog_buf_timer_stop(ngx_http_sqlitelog_buf_t *buf);
+void ngx_http_sqlitelog_buf_release(ngx_http_sqlitelog_buf_t *buf);
 
 void ngx_http_sqlitelog_buf_flush_handler(ngx_event_t *ev);
@@ -0,0 +1,237 @@
+
+/*
+ * Copyright (C) Serope.com
+ */
+
+
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+
+#include "ngx_http_sqlitelog_ckpt.h"
+#include "ngx_http_sqlitelog_db.h"
+#include "ngx_http_sqlitelog_thread.h"
+
+
+static void ngx_http_sqlitelog_ckpt_handler(ngx_event_t *ev);
+static void ngx_http_sqlitelog_ckpt_schedule(ngx_http_sqlitelog_ckpt_t *ckpt,
+    ngx_log_t *log);
+
+#if (NGX_THREADS)
+static void ngx_http_sqlitelog_ckpt_thread_handler(void *data,
+    ngx_log_t *log);
+static void ngx_http_sqlitelog_ckpt_completed_handler(ngx_event_t *ev);
+#endif
+
+
+/**
+ * Start the checkpoint timer for a database.
+ * 
+ * Checkpoints only run in worker process 0, since one checkpoint covers the
+ * whole file, whichever connection executes it. Calling this more than once
+ * for the same database has no effect.
+ * 
+ * @param   ckpt    the checkpoint policy
+ * @param   db      the database, with its connection already open
+ * @param   cycle   the current cycle
+ * @return          NGX_OK on success, or
+ *                  NGX_ERROR on failure
+ */
+ngx_int_t
+ngx_http_sqlitelog_ckpt_start(ngx_http_sqlitelog_ckpt_t *ckpt,
+    ngx_http_sqlitelog_db_t *db, ngx_cycle_t *cycle)
+{
+    if (ngx_worker != 0 || ckpt->db != NULL) {
+        return NGX_OK;
+    }
+    
+    ckpt->db = db;
+    ckpt->rc = SQLITE_OK;
+    ckpt->busy_timeout = 0;
+    ckpt->waited = 0;
+    ckpt->busy = 0;
+    
+#if (NGX_THREADS)
+    if (*(ckpt->tp)) {
+        ckpt->task = ngx_thread_task_alloc(cycle->pool, 0);
+        if (ckpt->task == NULL) {
+            ckpt->db = NULL;
+            return NGX_ERROR;
+        }
+        ckpt->task->handler = ngx_http_sqlitelog_ckpt_thread_handler;
+        ckpt->task->ctx = ckpt;
+        ckpt->task->event.handler = ngx_http_sqlitelog_ckpt_completed_handler;
+        ckpt->task->event.data = ckpt;
+        ckpt->task->event.log = cycle->log;
+    }
+#endif
+    
+    ngx_memzero(&ckpt->event, sizeof(ngx_event_t));
+    ckpt->event.handler = ngx_http_sqlitelog_ckpt_handler;
+    ckpt->event.data = ckpt;
+    ckpt->event.log = cycle->log;
+    ckpt->event.cancelable = 1;
+    
+    ngx_add_timer(&ckpt->event, NGX_HTTP_SQLITELOG_CKPT_START);
+    
+    return NGX_OK;
+}
+
+
+/**
+ * Stop the checkpoint timer for a database.
+ * 
+ * @param   ckpt    the checkpoint policy
+ */
+void
+ngx_http_sqlitelog_ckpt_stop(ngx_http_sqlitelog_ckpt_t *ckpt)
+{
+    if (ckpt->db == NULL) {
+        return;
+    }
+    
+    if (ckpt->event.timer_set) {
+        ngx_del_timer(&ckpt->event);
+    }
+    
+    ckpt->db = NULL;
+}
+
+
+/**
+ * Attempt a checkpoint. This is called when the checkpoint timer has elapsed.
+ * 
+ * @param   ev      the checkpoint event
+ */
+static void
+ngx_http_sqlitelog_ckpt_handler(ngx_event_t *ev)
+{
+    ngx_http_sqlitelog_ckpt_t  *ckpt;
+    
+#if (NGX_THREADS)
+    ngx_int_t                   rc_post;
+#endif
+    
+    ckpt = ev->data;
+    
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ev->log, 0,
+                   "sqlitelog: ckpt handler, waited: %M", ckpt->waited);
+    
+    if (ckpt->db == NULL || ckpt->busy) {
+        return;
+    }
+    
+#if (NGX_THREADS)
+    if (ckpt->task) {
+        ckpt->busy = 1;
+        rc_post = ngx_http_sqlitelog_thread_post(ckpt->db, ckpt->task);
+        if (rc_post == NGX_OK) {
+            return;
+        }
+        ngx_log_error(NGX_LOG_ERR, ev->log, 0,
+                      "sqlitelog: checkpoint failed to post thread task");
+        ckpt->busy = 0;
+    }
+#endif
+    
+    ckpt->rc = ngx_http_sqlitelog_db_checkpoint_once(ckpt->db,
+                                                     &ckpt->busy_timeout,
+                                                     ev->log);
+    ngx_http_sqlitelog_ckpt_schedule(ckpt, ev->log);
+}
+
+
+/**
+ * Restart the checkpoint timer after an attempt: shortly if the file was
+ * busy and the busy timeout hasn't passed yet, or after the interval
+ * otherwise.
+ * 
+ * @param   ckpt    the checkpoint policy
+ * @param   log     a log for writing error messages
+ */
+static void
+ngx_http_sqlitelog_ckpt_schedule(ngx_http_sqlitelog_ckpt_t *ckpt,
+    ngx_log_t *log)
+{
+    ngx_msec_t  timer;
+    
+    if (ckpt->db == NULL || ngx_exiting || ngx_terminate || ngx_quit) {
+        return;
+    }
+    
+    /* Busy, so try again later */
+    if (ckpt->rc == SQLITE_BUSY
+        && ckpt->waited < (ngx_msec_t) ckpt->busy_timeout)
+    {
+        timer = NGX_HTTP_SQLITELOG_CKPT_AGAIN + ngx_random() % 101;
+        ckpt->waited += timer;
+        ngx_add_timer(&ckpt->event, timer);
+        return;
+    }
+    
+    /*
+     * As with the checkpoint at exit, another worker's connection may still
+     * have checkpointed the file, so a checkpoint that stayed busy isn't
+     * called a failure.
+     */
+    if (ckpt->rc == SQLITE_BUSY) {
+        ngx_log_error(NGX_LOG_ERR, log, 0,
+                      "sqlitelog: periodic checkpoint of database \"%V\" "
+                      "concluded with SQLITE_BUSY, total waited: %M ms, "
+                      "busy timeout: %d ms",
+                      &ckpt->db->filename, ckpt->waited, ckpt->busy_timeout);
+    }
+    else if (ckpt->rc != SQLITE_OK) {
+        ngx_log_error(NGX_LOG_ERR, log, 0,
+                      "sqlitelog: failed to execute periodic WAL checkpoint "
+                      "on database \"%V\"", &ckpt->db->filename);
+    }
+    
+    ckpt->waited = 0;
+    ngx_add_timer(&ckpt->event, ckpt->interval);
+}
+
+
+#if (NGX_THREADS)
+/**
+ * Attempt a checkpoint in a worker thread.
+ * 
+ * @param   data    the checkpoint policy
+ * @param   log     a log for writing error messages
+ */
+static void
+ngx_http_sqlitelog_ckpt_thread_handler(void *data, ngx_log_t *log)
+{
+    ngx_http_sqlitelog_ckpt_t  *ckpt;
+    
+    ckpt = data;
+    
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, log, 0,
+                   "sqlitelog: ckpt thread handler");
+    
+    ckpt->rc = ngx_http_sqlitelog_db_checkpoint_once(ckpt->db,
+                                                     &ckpt->busy_timeout, log);
+}
+
+
+/**
+ * Restart the checkpoint timer once the worker thread is done.
+ * 
+ * @param   ev      the thread task's event
+ */
+static void
+ngx_http_sqlitelog_ckpt_completed_handler(ngx_event_t *ev)
+{
+    ngx_http_sqlitelog_ckpt_t  *ckpt;
+    
+    ckpt = ev->data;
+    ckpt->busy = 0;
+    
+    ngx_http_sqlitelog_thread_next(ckpt->db, ev->log);
+    
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ev->log, 0,
+                   "sqlitelog: ckpt completed handler");
+    
+    ngx_http_sqlitelog_ckpt_schedule(ckpt, ev->log);
+}
+#endif
@@ -0,0 +1,70 @@
+
+/*
+ * Copyright (C) Serope.com
+ * 
+ * Periodic checkpoints keep the WAL file of a database in WAL mode from
+ * growing between reloads. They run on a timer in a single worker process,
+ * which checkpoints the file on behalf of all the others.
+ * 
+ * A checkpoint is never waited for. Each attempt runs with the connection's
+ * busy handler turned off, so it returns at once, and while other connections
+ * prevent it (SQLITE_BUSY), it's attempted again on a short timer, until it
+ * succeeds or the connection's busy timeout has passed. So a busy file never
+ * stalls the worker's event loop, and with a thread pool, the attempts
+ * themselves run in worker threads.
+ */
+
+
+#pragma once
+
+
+#include <ngx_core.h>
+#include <ngx_thread_pool.h>
+
+
+#include "ngx_http_sqlitelog_db.h"
+
+
+/* Delay before the first checkpoint */
+#define NGX_HTTP_SQLITELOG_CKPT_START       1000
+
+/* Delay between attempts while the file is busy, plus up to 100 ms */
+#define NGX_HTTP_SQLITELOG_CKPT_AGAIN       50
+
+
+/*
+ * ngx_http_sqlitelog_ckpt_t is the checkpoint policy of a database and the
+ * state of its timer.
+ * 
+ * interval     the time between checkpoints, in msec
+ * db           the database to checkpoint
+ * event        the checkpoint timer
+ * rc           the SQLite3 return code of the last attempt
+ * busy_timeout the connection's busy timeout, in msec, as of the last attempt
+ * waited       the time spent retrying the current checkpoint, in msec
+ * busy         a flag set to 1 while an attempt is in a worker thread
+ * tp           an optional thread pool
+ * task         a thread task for running asynchronously
+ */
+struct ngx_http_sqlitelog_ckpt_s {
+    ngx_msec_t                 interval;
+    ngx_http_sqlitelog_db_t   *db;
+    ngx_event_t                event;
+    int                        rc;
+    int                        busy_timeout;
+    ngx_msec_t                 waited;
+    ngx_flag_t                 busy;
+
+#if (NGX_THREADS)
+    ngx_thread_pool_t        **tp;
+    ngx_thread_task_t         *task;
+#else
+    void                     **tp;
+    void                      *task;
+#endif
+};
+
+
+ngx_int_t ngx_http_sqlitelog_ckpt_start(ngx_http_sqlitelog_ckpt_t *ckpt,
+    ngx_http_sqlitelog_db_t *db, ngx_cycle_t *cycle);
+void ngx_http_sqlitelog_ckpt_stop(ngx_http_sqlitelog_ckpt_t *ckpt);
@@ -13,6 +13,17 @@
 #include "ngx_http_sqlitelog_util.h"
 
 
+static int ngx_http_sqlitelog_col_bind_inet(sqlite3 *db, sqlite3_stmt *stmt,
+    int position, ngx_str_t val, sqlite3_destructor_type val_destructor,
+    ngx_log_t *log);
+static void ngx_http_sqlitelog_col_result_blob(sqlite3_context *ctx,
+    ngx_str_t val);
+static void ngx_http_sqlitelog_col_result_inet(sqlite3_context *ctx,
+    ngx_str_t val);
+static ngx_uint_t ngx_http_sqlitelog_col_inet(ngx_str_t *val,
+    sqlite3_int64 *n);
+
+
 /**
  * Initialize a column object.
  * 
@@ -48,12 +59,155 @@ ngx_http_sqlitelog_col_init(ngx_http_sqlitelog_col_t *col, ngx_conf_t *cf,
     }
     col->op = *op;
     
-    /* Bind function */
+    /* Integer timestamps are declared as INTEGER */
+    col->epoch = 0;
+    if (ngx_str_eq_cs(&type, "EPOCH_MS")) {
+        ngx_str_set(&col->type, "INTEGER");
+        col->epoch = 1000;
+    }
+    else if (ngx_str_eq_cs(&type, "EPOCH_US")) {
+        ngx_str_set(&col->type, "INTEGER");
+        col->epoch = 1000000;
+    }
+    
+    /* Bind and result functions */
     if (ngx_str_eq_cs(&type, "BLOB")) {
         col->bind = ngx_http_sqlitelog_sqlite3_bind_blob;
+        col->result = ngx_http_sqlitelog_col_result_blob;
+    } else if (ngx_str_eq_cs(&type, "INET")) {
+        col->bind = ngx_http_sqlitelog_col_bind_inet;
+        col->result = ngx_http_sqlitelog_col_result_inet;
     } else {
         col->bind = ngx_http_sqlitelog_sqlite3_bind_text;
+        col->result = ngx_http_sqlitelog_col_result_text;
     }
     
     return NGX_OK;
 }
+
+
+/**
+ * Bind an address to an INET column.
+ * 
+ * @param   db              a database connection
+ * @param   stmt            the SQLite3 statement to bind to
+ * @param   position        the position to bind to
+ * @param   val             the address, in network byte order
+ * @param   val_destructor  a destructor function to call on val after binding,
+ *                          or SQLITE_STATIC to not take any action
+ * @param   log             an Nginx log for writing errors
+ * @return                  the return code of the sqlite3_bind function
+ */
+static int
+ngx_http_sqlitelog_col_bind_inet(sqlite3 *db, sqlite3_stmt *stmt,
+    int position, ngx_str_t val, sqlite3_destructor_type val_destructor,
+    ngx_log_t *log)
+{
+    sqlite3_int64  n;
+    
+    switch (ngx_http_sqlitelog_col_inet(&val, &n)) {
+    
+    case 4:
+        return ngx_http_sqlitelog_sqlite3_bind_int64(db, stmt, position, n,
+                                                     log);
+    
+    case 16:
+        return ngx_http_sqlitelog_sqlite3_bind_blob(db, stmt, position, val,
+                                                    val_destructor, log);
+    
+    default:
+        return ngx_http_sqlitelog_sqlite3_bind_null(db, stmt, position, log);
+    }
+}
+
+
+/**
+ * Return a value of a TEXT (or any other non-BLOB) column.
+ * 
+ * @param   ctx     the virtual table's column context
+ * @param   val     the value, or a string with NULL data for NULL
+ */
+void
+ngx_http_sqlitelog_col_result_text(sqlite3_context *ctx, ngx_str_t val)
+{
+    sqlite3_result_text(ctx, (char *) val.data, val.len, SQLITE_STATIC);
+}
+
+
+/**
+ * Return a value of a BLOB column.
+ * 
+ * @param   ctx     the virtual table's column context
+ * @param   val     the value, or a string with NULL data for NULL
+ */
+static void
+ngx_http_sqlitelog_col_result_blob(sqlite3_context *ctx, ngx_str_t val)
+{
+    if (val.data == NULL) {
+        sqlite3_result_null(ctx);
+        return;
+    }
+    
+    sqlite3_result_blob(ctx, val.data, val.len, SQLITE_STATIC);
+}
+
+
+/**
+ * Return a value of an INET column.
+ * 
+ * @param   ctx     the virtual table's column context
+ * @param   val     the address, in network byte order
+ */
+static void
+ngx_http_sqlitelog_col_result_inet(sqlite3_context *ctx, ngx_str_t val)
+{
+    sqlite3_int64  n;
+    
+    switch (ngx_http_sqlitelog_col_inet(&val, &n)) {
+    
+    case 4:
+        sqlite3_result_int64(ctx, n);
+        break;
+    
+    case 16:
+        sqlite3_result_blob(ctx, val.data, val.len, SQLITE_STATIC);
+        break;
+    
+    default:
+        sqlite3_result_null(ctx);
+    }
+}
+
+
+/**
+ * Classify the value of an INET column. IPv4 addresses, including IPv4-mapped
+ * IPv6 addresses, are stored as integers, and IPv6 addresses as 16-byte blobs.
+ * Anything else is stored as NULL.
+ * 
+ * @param   val     the address, in network byte order
+ * @param   n       the address as an integer, if it's IPv4
+ * @return          4 for IPv4, 16 for IPv6, or 0 for NULL
+ */
+static ngx_uint_t
+ngx_http_sqlitelog_col_inet(ngx_str_t *val, sqlite3_int64 *n)
+{
+    u_char         *p;
+    
+    static u_char   mapped[12] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff };
+    
+    p = val->data;
+    
+    if (val->len == 16 && ngx_memcmp(p, mapped, 12) == 0) {
+        p += 12;
+    }
+    else if (val->len == 16) {
+        return 16;
+    }
+    else if (val->len != 4) {
+        return 0;
+    }
+    
+    *n = (sqlite3_int64) p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+    
+    return 4;
+}
@@ -19,6 +19,10 @@ typedef int (*ngx_http_sqlitelog_col_bind_pt) (sqlite3 *db, sqlite3_stmt* stmt,
     int position, ngx_str_t val, sqlite3_destructor_type val_destructor,
     ngx_log_t *log);
 
+/* Result function, for returning a value from a virtual table */
+typedef void (*ngx_http_sqlitelog_col_result_pt) (sqlite3_context *ctx,
+    ngx_str_t val);
+
 
 /*
  * ngx_http_sqlitelog_col_t represents a column in the database's logging
@@ -28,13 +32,22 @@ typedef int (*ngx_http_sqlitelog_col_bind_pt) (sqlite3 *db, sqlite3_stmt* stmt,
  * type     the column type
  * op       the operation for this column's variable
  * bind     a pointer to a function for binding a value to this column
+ * result   a pointer to a function for returning a value of this column from
+ *          the batch virtual table (see ngx_http_sqlitelog_batch.h)
+ * value    the index of this column's value in the request's value cache
+ * epoch    for EPOCH_MS and EPOCH_US columns, the values per second (1000 or
+ *          1000000); otherwise 0
  */
 typedef struct {
     ngx_str_t                        name;
     ngx_str_t                        type;
     ngx_http_sqlitelog_op_t          op;
     ngx_http_sqlitelog_col_bind_pt   bind;
+    ngx_http_sqlitelog_col_result_pt result;
+    ngx_uint_t                       value;
+    ngx_uint_t                       epoch;
 } ngx_http_sqlitelog_col_t;
 
 ngx_int_t ngx_http_sqlitelog_col_init(ngx_http_sqlitelog_col_t *col,
     ngx_conf_t *cf, ngx_str_t name, ngx_str_t type);
+void ngx_http_sqlitelog_col_result_text(sqlite3_context *ctx, ngx_str_t val);
@@ -8,29 +8,34 @@
 #include <sqlite3.h>
 
 
+#include "ngx_http_sqlitelog_batch.h"
 #include "ngx_http_sqlitelog_col.h"
 #include "ngx_http_sqlitelog_db.h"
 #include "ngx_http_sqlitelog_fmt.h"
+#include "ngx_http_sqlitelog_inet.h"
 #include "ngx_http_sqlitelog_node.h"
+#include "ngx_http_sqlitelog_rollup.h"
 #include "ngx_http_sqlitelog_sqlite3.h"
 #include "ngx_http_sqlitelog_util.h"
 
 
 static int ngx_http_sqlitelog_db_try_insert(ngx_http_sqlitelog_db_t *db,
-    ngx_str_t *elts, ngx_uint_t nelts, ngx_log_t *log);
+    ngx_http_sqlitelog_fmt_t *fmt, ngx_str_t *elts, ngx_uint_t nelts,
+    ngx_log_t *log);
 static int ngx_http_sqlitelog_db_try_insert_list(ngx_http_sqlitelog_db_t *db,
-    ngx_list_t *list, ngx_log_t *log);
+    ngx_list_t *list, ngx_array_t *rollup, ngx_log_t *log);
+static int ngx_http_sqlitelog_db_try_upsert(ngx_http_sqlitelog_db_t *db,
+    ngx_http_sqlitelog_rollup_row_t *row, ngx_log_t *log);
 static int ngx_http_sqlitelog_db_is_wal(ngx_http_sqlitelog_db_t *db,
     ngx_flag_t *is, ngx_log_t *log);
-static int ngx_http_sqlitelog_db_get_busy_timeout(ngx_http_sqlitelog_db_t *db,
-    int *ms, ngx_log_t *log);
 
 
 /**
  * Initialize a database connection.
  * 
- * The database's filename, format, and init script (if any) must be set before
- * calling this function.
+ * The database's filename, formats, and init scripts (if any) must be set
+ * before calling this function. Indexes are created too, unless they're
+ * deferred.
  * 
  * @param   db      a database struct
  * @param   log     an Nginx log for writing errors
@@ -40,16 +45,24 @@ int
 ngx_http_sqlitelog_db_init(ngx_http_sqlitelog_db_t *db, ngx_log_t *log)
 {
     int             filemode;
+    int             rc_batch;
     int             rc_close;
+    int             rc_index;
+    int             rc_inet;
     int             rc_open;
     int             rc_script;
     int             rc_table;
     int             rc_timeout;
+    int             rc_vacuum;
     int             timeout;
     char          **error_message_ptr;
     void           *callback;
     void           *callback_data;
     const char     *vfs_module;
+    ngx_str_t       sql_vacuum;
+    ngx_str_t      *script;
+    ngx_uint_t      i;
+    ngx_http_sqlitelog_fmt_t  **fmt;
     
     /* If necessary, close existing connection */
     if (db->conn) {
@@ -79,19 +92,72 @@ ngx_http_sqlitelog_db_init(ngx_http_sqlitelog_db_t *db, ngx_log_t *log)
         return rc_timeout;
     }
     
-    /* Create table */
+    /* SQL functions for INET columns */
+    rc_inet = ngx_http_sqlitelog_inet_register(db->conn);
+    if (rc_inet != SQLITE_OK) {
+        ngx_log_error(NGX_LOG_ERR, log, 0,
+                      "sqlitelog: failed to register inet functions on "
+                      "database \"%V\"", &db->filename);
+        return rc_inet;
+    }
+    
     callback = NULL;
     callback_data = NULL;
     error_message_ptr = NULL;
-    rc_table = ngx_http_sqlitelog_sqlite3_exec(db->conn, db->fmt->sql_create,
+    
+    /*
+     * Enable incremental vacuum. This has to happen before the first table is
+     * created, so it only takes effect on new databases; an existing database
+     * keeps its auto_vacuum mode until it's rebuilt with VACUUM.
+     * https://www.sqlite.org/pragma.html#pragma_auto_vacuum
+     */
+    if (db->vacuum) {
+        ngx_str_set(&sql_vacuum, "PRAGMA auto_vacuum = INCREMENTAL");
+        rc_vacuum = ngx_http_sqlitelog_sqlite3_exec(db->conn, sql_vacuum,
+                               callback, callback_data, error_message_ptr, log);
+        if (rc_vacuum != SQLITE_OK) {
+            return rc_vacuum;
+        }
+    }
+    
+    /* Create tables */
+    fmt = db->formats.elts;
+    for (i = 0; i < db->formats.nelts; i++) {
+        rc_table = ngx_http_sqlitelog_sqlite3_exec(db->conn, fmt[i]->sql_create,
                                callback, callback_data, error_message_ptr, log);
-    if (rc_table != SQLITE_OK) {
-        return rc_table;
+        if (rc_table != SQLITE_OK) {
+            return rc_table;
+        }
+    }
+    
+    /* Create batch virtual tables */
+    rc_batch = ngx_http_sqlitelog_batch_init(db, log);
+    if (rc_batch != SQLITE_OK) {
+        return rc_batch;
+    }
+    
+    /* Create rollup table */
+    if (db->rollup) {
+        rc_table = ngx_http_sqlitelog_sqlite3_exec(db->conn,
+                               db->rollup->sql_create, callback, callback_data,
+                               error_message_ptr, log);
+        if (rc_table != SQLITE_OK) {
+            return rc_table;
+        }
     }
     
-    /* Execute init script */
-    if (db->init_sql.data) {
-        rc_script = ngx_http_sqlitelog_sqlite3_exec(db->conn, db->init_sql,
+    /* Create indexes */
+    if (db->deferred != 1) {
+        rc_index = ngx_http_sqlitelog_db_index(db, log);
+        if (rc_index != SQLITE_OK) {
+            return rc_index;
+        }
+    }
+    
+    /* Execute init scripts */
+    script = db->scripts.elts;
+    for (i = 0; i < db->scripts.nelts; i++) {
+        rc_script = ngx_http_sqlitelog_sqlite3_exec(db->conn, script[i],
                                callback, callback_data, error_message_ptr, log);
         if (rc_script != SQLITE_OK) {
             return rc_script;
@@ -104,9 +170,6 @@ ngx_http_sqlitelog_db_init(ngx_http_sqlitelog_db_t *db, ngx_log_t *log)
 /**
  * Close a database connection.
  * 
- * The database's format and init script (if any) must be set before calling
- * this function.
- * 
  * @param   db      a database struct
  * @param   log     an Nginx log for writing errors
  * @return          a SQLite3 status code
@@ -130,7 +193,7 @@ ngx_http_sqlitelog_db_close(ngx_http_sqlitelog_db_t *db, ngx_log_t *log)
 /**
  * Initialize an in-memory database connection.
  * 
- * The database's format and init script (if any) must be set before calling
+ * The database's formats and init scripts (if any) must be set before calling
  * this function.
  * 
  * @param   db      a database struct
@@ -144,10 +207,10 @@ ngx_http_sqlitelog_db_test(ngx_http_sqlitelog_db_t db, ngx_log_t *log)
     int                       rc_init;
     ngx_http_sqlitelog_db_t   memdb;
     
-    ngx_memzero(&memdb, sizeof(ngx_http_sqlitelog_db_t));
+    memdb = db;
+    memdb.conn = NULL;
+    memdb.deferred = 0;
     ngx_str_set(&memdb.filename, ":memory:");
-    memdb.fmt = db.fmt;
-    memdb.init_sql = db.init_sql;
     
     rc_init = ngx_http_sqlitelog_db_init(&memdb, log);
     rc_close = ngx_http_sqlitelog_db_close(&memdb, log);
@@ -159,27 +222,147 @@ ngx_http_sqlitelog_db_test(ngx_http_sqlitelog_db_t db, ngx_log_t *log)
 }
 
 
+/**
+ * Create the indexes of every table in the database.
+ * 
+ * This is done when the connection is initialized, unless the indexes are
+ * deferred, in which case it's done once the database is no longer written
+ * to (i.e. when Nginx stops). Creating an index on a large table can take a
+ * while, but it only happens once since the statements use IF NOT EXISTS.
+ * 
+ * @param   db      a database struct with an open connection
+ * @param   log     an Nginx log for writing errors
+ * @return          a SQLite3 status code
+ */
+int
+ngx_http_sqlitelog_db_index(ngx_http_sqlitelog_db_t *db, ngx_log_t *log)
+{
+    int                           rc_index;
+    ngx_uint_t                    i;
+    ngx_uint_t                    j;
+    ngx_http_sqlitelog_fmt_t    **fmt;
+    ngx_http_sqlitelog_index_t   *index;
+    
+    fmt = db->formats.elts;
+    
+    for (i = 0; i < db->formats.nelts; i++) {
+        index = fmt[i]->indexes.elts;
+        for (j = 0; j < fmt[i]->indexes.nelts; j++) {
+            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, log, 0,
+                           "sqlitelog: db index \"%V\"", &index[j].name);
+            rc_index = ngx_http_sqlitelog_sqlite3_exec(db->conn,
+                                                       index[j].sql_create,
+                                                       NULL, NULL, NULL, log);
+            if (rc_index != SQLITE_OK) {
+                return rc_index;
+            }
+        }
+    }
+    
+    return SQLITE_OK;
+}
+
+
+/**
+ * Get the table index of a format in the database, adding the format to the
+ * database if necessary.
+ * 
+ * @param   db          a database struct
+ * @param   fmt         the format
+ * @param   table       a pointer for storing the table index
+ * @return              NGX_OK on success, or
+ *                      NGX_ERROR on failure
+ */
+ngx_int_t
+ngx_http_sqlitelog_db_table(ngx_http_sqlitelog_db_t *db,
+    ngx_http_sqlitelog_fmt_t *fmt, ngx_uint_t *table)
+{
+    ngx_uint_t                  i;
+    ngx_http_sqlitelog_fmt_t  **f;
+    
+    f = db->formats.elts;
+    for (i = 0; i < db->formats.nelts; i++) {
+        if (f[i] == fmt) {
+            *table = i;
+            return NGX_OK;
+        }
+    }
+    
+    f = ngx_array_push(&db->formats);
+    if (f == NULL) {
+        return NGX_ERROR;
+    }
+    *f = fmt;
+    *table = db->formats.nelts - 1;
+    
+    return NGX_OK;
+}
+
+
+/**
+ * Get the signature of the database's tables, i.e. a CRC32 of their CREATE
+ * TABLE statements in table order, followed by the rollup's CREATE TABLE
+ * statement and interval, if any.
+ * 
+ * Log entries and rollup groups carry the signature of the configuration
+ * that made them, so that they're only inserted by a configuration whose
+ * tables lay them out the same way.
+ * 
+ * @param   db      a database struct whose formats are all set
+ * @return          the signature
+ */
+uint32_t
+ngx_http_sqlitelog_db_sig(ngx_http_sqlitelog_db_t *db)
+{
+    uint32_t                    sig;
+    ngx_uint_t                  i;
+    ngx_http_sqlitelog_fmt_t  **fmt;
+    
+    fmt = db->formats.elts;
+    
+    ngx_crc32_init(sig);
+    for (i = 0; i < db->formats.nelts; i++) {
+        ngx_crc32_update(&sig, fmt[i]->sql_create.data,
+                         fmt[i]->sql_create.len + 1);
+    }
+    if (db->rollup) {
+        ngx_crc32_update(&sig, db->rollup->sql_create.data,
+                         db->rollup->sql_create.len + 1);
+        ngx_crc32_update(&sig, (u_char *) &db->rollup->interval,
+                         sizeof(time_t));
+    }
+    ngx_crc32_final(sig);
+    
+    return sig;
+}
+
+
 /**
  * Insert a record into the database, recreating the file if faced with
  * SQLITE_READONLY_DBMOVED.
  * 
  * @param   db          a database struct
+ * @param   table       the index of the record's format in the database
  * @param   elts        a C-style array of Nginx strings for each column
  * @param   nelts       the length of elts
  * @param   log         an Nginx log to write errors to
  * @return              a SQLite3 return code
  */
 int
-ngx_http_sqlitelog_db_insert(ngx_http_sqlitelog_db_t *db, ngx_str_t *elts,
-    ngx_uint_t nelts, ngx_log_t *log)
+ngx_http_sqlitelog_db_insert(ngx_http_sqlitelog_db_t *db, ngx_uint_t table,
+    ngx_str_t *elts, ngx_uint_t nelts, ngx_log_t *log)
 {
-    int  rc_extended;
-    int  rc_init;
-    int  rc_insert;
+    int                         rc_extended;
+    int                         rc_init;
+    int                         rc_insert;
+    ngx_http_sqlitelog_fmt_t  **fmt;
+    
+    fmt = db->formats.elts;
     
     ngx_log_debug0(NGX_LOG_DEBUG_HTTP, log, 0, "sqlitelog: db insert");
     
-    rc_insert = ngx_http_sqlitelog_db_try_insert(db, elts, nelts, log);
+    rc_insert = ngx_http_sqlitelog_db_try_insert(db, fmt[table], elts, nelts,
+                                                 log);
     
     ngx_log_debug1(NGX_LOG_DEBUG_HTTP, log, 0,
                    "sqlitelog: db insert, rc_insert: %d", rc_insert);
@@ -193,7 +376,8 @@ ngx_http_sqlitelog_db_insert(ngx_http_sqlitelog_db_t *db, ngx_str_t *elts,
             if (rc_init != SQLITE_OK) {
                 return rc_init;
             }
-            rc_insert = ngx_http_sqlitelog_db_try_insert(db, elts, nelts, log);
+            rc_insert = ngx_http_sqlitelog_db_try_insert(db, fmt[table], elts,
+                                                         nelts, log);
         }
     }
     return rc_insert;
@@ -205,14 +389,16 @@ ngx_http_sqlitelog_db_insert(ngx_http_sqlitelog_db_t *db, ngx_str_t *elts,
  * code if an error occurs.
  * 
  * @param   db          a database struct
+ * @param   fmt         the record's format
  * @param   elts        a C-style array of Nginx strings for each column
  * @param   nelts       the length of elts
  * @param   log         an Nginx log to write errors to
  * @return              a SQLite3 return code
  */
 static int
-ngx_http_sqlitelog_db_try_insert(ngx_http_sqlitelog_db_t *db, ngx_str_t *elts,
-    ngx_uint_t nelts, ngx_log_t *log)
+ngx_http_sqlitelog_db_try_insert(ngx_http_sqlitelog_db_t *db,
+    ngx_http_sqlitelog_fmt_t *fmt, ngx_str_t *elts, ngx_uint_t nelts,
+    ngx_log_t *log)
 {
     int                        rc_bind;
     int                        rc_finalize;
@@ -224,7 +410,7 @@ ngx_http_sqlitelog_db_try_insert(ngx_http_sqlitelog_db_t *db, ngx_str_t *elts,
     sqlite3_stmt              *stmt;
     ngx_http_sqlitelog_col_t  *col;
     
-    col = db->fmt->columns.elts; /* typecast from void* */
+    col = fmt->columns.elts;     /* typecast from void* */
     rc_step = SQLITE_OK;         /* to stop gcc "might be unitialized" warnings */
     rc_bind = SQLITE_OK;
 
@@ -235,7 +421,7 @@ ngx_http_sqlitelog_db_try_insert(ngx_http_sqlitelog_db_t *db, ngx_str_t *elts,
                    "sqlitelog: db try insert, prepare");
     stmt = NULL;
     rc_prepare = ngx_http_sqlitelog_sqlite3_prepare_v2(db->conn,
-                                         db->fmt->sql_insert, &stmt, NULL, log);
+                                         fmt->sql_insert, &stmt, NULL, log);
     if (rc_prepare != SQLITE_OK) {
         goto finalize;
     }
@@ -316,19 +502,21 @@ finalize:
  * with SQLITE_READONLY_DBMOVED.
  * 
  * @param   db          a database struct
- * @param   list        a list of log entries
+ * @param   list        a list of log entries (ngx_http_sqlitelog_entry_t)
+ * @param   rollup      an optional array of rollup groups to upsert in the
+ *                      same transaction (ngx_http_sqlitelog_rollup_row_t)
  * @param   log         an Nginx log to write errors to
  * @return              a SQLite3 return code
  */
 int
 ngx_http_sqlitelog_db_insert_list(ngx_http_sqlitelog_db_t *db, ngx_list_t *list,
-    ngx_log_t *log)
+    ngx_array_t *rollup, ngx_log_t *log)
 {
     int  rc_extended;
     int  rc_init;
     int  rc_list;
     
-    rc_list = ngx_http_sqlitelog_db_try_insert_list(db, list, log);
+    rc_list = ngx_http_sqlitelog_db_try_insert_list(db, list, rollup, log);
    
     if (rc_list != SQLITE_OK) {
         rc_extended = sqlite3_extended_errcode(db->conn);
@@ -339,7 +527,7 @@ ngx_http_sqlitelog_db_insert_list(ngx_http_sqlitelog_db_t *db, ngx_list_t *list,
             if (rc_init != SQLITE_OK) {
                 return rc_init;
             }
-            rc_list = ngx_http_sqlitelog_db_try_insert_list(db, list, log);
+            rc_list = ngx_http_sqlitelog_db_try_insert_list(db, list, rollup, log);
         }
     }
     
@@ -351,24 +539,66 @@ ngx_http_sqlitelog_db_insert_list(ngx_http_sqlitelog_db_t *db, ngx_list_t *list,
  * Try to insert a list of log entries into the database, returning the
  * appropriate error code if an error occurs.
  * 
+ * The list is set as the database's current batch, and each table's entries
+ * are copied from its batch virtual table by a single INSERT ... SELECT.
+ * Entries whose table doesn't match one of the database's formats (i.e. left
+ * in the buffer by a previous configuration) are skipped.
+ * 
  * @param   db          a database struct
- * @param   queue       a list of log entries
+ * @param   list        a list of log entries (ngx_http_sqlitelog_entry_t)
+ * @param   rollup      an optional array of rollup groups
  * @param   log         an Nginx log to write errors to
  * @return              a SQLite3 return code
  */
 static int
 ngx_http_sqlitelog_db_try_insert_list(ngx_http_sqlitelog_db_t *db,
-    ngx_list_t *list, ngx_log_t *log)
+    ngx_list_t *list, ngx_array_t *rollup, ngx_log_t *log)
 {
-    int               rc_begin;
-    int               rc_end;
-    int               rc_insert;
-    char            **error_message_ptr;
-    void             *callback;
-    void             *callback_data;
-    ngx_str_t         sql_begin;
-    ngx_str_t         sql_end;
-    ngx_list_part_t  *part;
+    int                               rc_begin;
+    int                               rc_end;
+    int                               rc_insert;
+    char                            **error_message_ptr;
+    void                             *callback;
+    void                             *callback_data;
+    ngx_str_t                         sql_begin;
+    ngx_str_t                         sql_end;
+    ngx_uint_t                        i;
+    ngx_uint_t                        skipped;
+    ngx_list_part_t                  *part;
+    ngx_http_sqlitelog_fmt_t        **fmt;
+    ngx_http_sqlitelog_entry_t       *entry;
+    ngx_http_sqlitelog_rollup_row_t  *row;
+    
+    fmt = db->formats.elts;
+    rc_insert = SQLITE_OK;
+    
+    /* Find entries that no table will take */
+    skipped = 0;
+    part = &list->part;
+    entry = part->elts;
+    for (i = 0; /* void */ ; i++) {
+        
+        if (i >= part->nelts) {
+            if (part->next == NULL) {
+                break;
+            }
+            part = part->next;
+            entry = part->elts;
+            i = 0;
+        }
+        
+        if (entry[i].table >= db->formats.nelts
+            || entry[i].nelts != fmt[entry[i].table]->columns.nelts)
+        {
+            skipped++;
+        }
+    }
+    
+    if (skipped) {
+        ngx_log_error(NGX_LOG_WARN, log, 0,
+                      "sqlitelog: skipped %ui log entries with unknown table "
+                      "for database \"%V\"", skipped, &db->filename);
+    }
     
     /*
      * Begin transaction
@@ -391,19 +621,35 @@ ngx_http_sqlitelog_db_try_insert_list(ngx_http_sqlitelog_db_t *db,
         return rc_begin;
     }
     
-    /* Loop */
-    part = &list->part;
-    while (part) {
-        rc_insert = ngx_http_sqlitelog_db_try_insert(db, part->elts, 
-                                                     part->nelts, log);
+    /* Insert each table's entries */
+    db->batch = list;
+    
+    for (i = 0; i < db->formats.nelts; i++) {
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, log, 0,
+                       "sqlitelog: db try insert list, %V", &fmt[i]->name);
+        rc_insert = ngx_http_sqlitelog_sqlite3_exec(db->conn,
+                                         fmt[i]->sql_batch_insert, callback,
+                                         callback_data, error_message_ptr, log);
         if (rc_insert != SQLITE_OK) {
             goto end;
         }
-        part = part->next;
+    }
+    
+    /* Rollup */
+    if (db->rollup && rollup && rollup->nelts) {
+        row = rollup->elts;
+        for (i = 0; i < rollup->nelts; i++) {
+            rc_insert = ngx_http_sqlitelog_db_try_upsert(db, &row[i], log);
+            if (rc_insert != SQLITE_OK) {
+                goto end;
+            }
+        }
     }
     
     /* End */
 end:
+    db->batch = NULL;
+    
     if (rc_insert == SQLITE_OK) {
         ngx_str_set(&sql_end, "COMMIT");
     } else {
@@ -423,6 +669,97 @@ end:
 }
 
 
+/**
+ * Try to merge a rollup group into the rollup table.
+ * 
+ * @param   db          a database struct
+ * @param   row         the group
+ * @param   log         an Nginx log to write errors to
+ * @return              a SQLite3 return code
+ */
+static int
+ngx_http_sqlitelog_db_try_upsert(ngx_http_sqlitelog_db_t *db,
+    ngx_http_sqlitelog_rollup_row_t *row, ngx_log_t *log)
+{
+    int            rc_bind;
+    int            rc_finalize;
+    int            rc_prepare;
+    int            rc_step;
+    int            param;
+    double         val;
+    ngx_uint_t     i;
+    sqlite3_stmt  *stmt;
+    
+    rc_bind = SQLITE_OK;
+    rc_step = SQLITE_DONE;
+    
+    /* Prepare */
+    stmt = NULL;
+    rc_prepare = ngx_http_sqlitelog_sqlite3_prepare_v2(db->conn,
+                                      db->rollup->sql_upsert, &stmt, NULL, log);
+    if (rc_prepare != SQLITE_OK) {
+        goto finalize;
+    }
+    
+    /* Bucket */
+    param = 1;
+    rc_bind = ngx_http_sqlitelog_sqlite3_bind_int64(db->conn, stmt, param++,
+                                         (sqlite3_int64) row->bucket, log);
+    if (rc_bind != SQLITE_OK) {
+        goto finalize;
+    }
+    
+    /* Groups */
+    for (i = 0; i < db->rollup->groups.nelts; i++) {
+        rc_bind = ngx_http_sqlitelog_sqlite3_bind_text(db->conn, stmt, param++,
+                                         row->groups[i], SQLITE_STATIC, log);
+        if (rc_bind != SQLITE_OK) {
+            goto finalize;
+        }
+    }
+    
+    /* Count */
+    rc_bind = ngx_http_sqlitelog_sqlite3_bind_int64(db->conn, stmt, param++,
+                                         (sqlite3_int64) row->count, log);
+    if (rc_bind != SQLITE_OK) {
+        goto finalize;
+    }
+    
+    /* Aggregates */
+    for (i = 0; i < db->rollup->aggs.nelts; i++) {
+        val = row->vals[i];
+        if (val != val) {
+            /* NaN, i.e. no value for min or max yet */
+            rc_bind = ngx_http_sqlitelog_sqlite3_bind_null(db->conn, stmt,
+                                                           param++, log);
+        } else {
+            rc_bind = ngx_http_sqlitelog_sqlite3_bind_double(db->conn, stmt,
+                                                             param++, val, log);
+        }
+        if (rc_bind != SQLITE_OK) {
+            goto finalize;
+        }
+    }
+    
+    /* Step */
+    rc_step = ngx_http_sqlitelog_sqlite3_step(db->conn, stmt, log);
+    
+finalize:
+    rc_finalize = ngx_http_sqlitelog_sqlite3_finalize(db->conn, stmt, log);
+    
+    if (rc_prepare != SQLITE_OK) {
+        return rc_prepare;
+    }
+    else if (rc_bind != SQLITE_OK) {
+        return rc_bind;
+    }
+    else if (rc_step != SQLITE_DONE) {
+        return rc_step;
+    }
+    return rc_finalize;
+}
+
+
 /**
  * Determine if a database has WAL mode enabled.
  * 
@@ -499,7 +836,7 @@ finalize:
  * @param   log     a log for writing error messages
  * @return          a SQLite3 return code
  */
-static int
+int
 ngx_http_sqlitelog_db_get_busy_timeout(ngx_http_sqlitelog_db_t *db, int *ms,
     ngx_log_t *log)
 {
@@ -554,27 +891,36 @@ finalize:
 
 
 /**
- * Execute a WAL checkpoint.
+ * Attempt a WAL checkpoint once, without waiting for other connections.
  * 
- * @param   db      a database connection
- * @param   log     a log for writing error messages
- * @return          a SQLite3 return code
+ * A TRUNCATE checkpoint calls the connection's busy handler while other
+ * connections use the file, so the busy timeout is set to 0 for the
+ * attempt, and restored afterwards. This never blocks the worker process for
+ * longer than the checkpoint itself, so it's also used by periodic
+ * checkpoints (see ngx_http_sqlitelog_ckpt.h).
+ * 
+ * @param   db              a database connection
+ * @param   busy_timeout    a pointer for storing the connection's busy
+ *                          timeout, in msec, or NULL
+ * @param   log             a log for writing error messages
+ * @return                  SQLITE_OK if the checkpoint succeeded or the
+ *                          database isn't in WAL mode,
+ *                          SQLITE_BUSY if another connection prevented it,
+ *                          or another SQLite3 return code on failure
  */
 int
-ngx_http_sqlitelog_db_checkpoint(ngx_http_sqlitelog_db_t *db, ngx_log_t *log)
+ngx_http_sqlitelog_db_checkpoint_once(ngx_http_sqlitelog_db_t *db,
+    int *busy_timeout, ngx_log_t *log)
 {
-    int          busy_timeout;
     int          emode;
+    int          ms;
     int         *pn_log;
     int         *pn_ckpt;
     int          rc_ckpt;
     int          rc_timeout;
     int          rc_wal;
-    int          sleep_dur;
-    int          total_slept;
     const char  *zdb;
     ngx_flag_t   is_wal;
-    ngx_uint_t   r;
     
     /* WAL check */
     is_wal = 0;
@@ -590,30 +936,82 @@ ngx_http_sqlitelog_db_checkpoint(ngx_http_sqlitelog_db_t *db, ngx_log_t *log)
     }
     
     /* Get busy timeout */
-    busy_timeout = 0;
-    rc_timeout = ngx_http_sqlitelog_db_get_busy_timeout(db, &busy_timeout, log);
+    ms = 0;
+    rc_timeout = ngx_http_sqlitelog_db_get_busy_timeout(db, &ms, log);
     if (rc_timeout != SQLITE_OK) {
         ngx_log_error(NGX_LOG_ERR, log, 0,
                       "sqlitelog: failed to get busy timeout prior to "
                       "WAL checkpoint");
         return rc_timeout;
     }
+    if (busy_timeout) {
+        *busy_timeout = ms;
+    }
     
-    /* First attempt */
+    /* Turn off busy handler */
+    rc_timeout = ngx_http_sqlitelog_sqlite3_busy_timeout(db->conn, 0, log);
+    if (rc_timeout != SQLITE_OK) {
+        return rc_timeout;
+    }
+    
+    /* Attempt */
     zdb = NULL,
     emode = SQLITE_CHECKPOINT_TRUNCATE;
     pn_log = NULL;
     pn_ckpt = NULL;
+    
     rc_ckpt = ngx_http_sqlitelog_sqlite3_wal_checkpoint_v2(db->conn, zdb, emode,
-                                                          pn_log, pn_ckpt, log);
+                                                           pn_log, pn_ckpt,
+                                                           log);
+    
+    /* Restore busy handler */
+    rc_timeout = ngx_http_sqlitelog_sqlite3_busy_timeout(db->conn, ms, log);
+    if (rc_timeout != SQLITE_OK) {
+        return rc_timeout;
+    }
+    
+    return rc_ckpt;
+}
+
+
+/**
+ * Execute a WAL checkpoint when the worker process exits.
+ * 
+ * While other connections use the file, the checkpoint is retried for up to
+ * the busy timeout or the given timeout, whichever is less. The retries sleep,
+ * which is only acceptable because the worker's event loop has already
+ * stopped. With a timeout of 0, it's only attempted once, and SQLITE_BUSY
+ * isn't an error: the last connection to close the file checkpoints it anyway.
+ * 
+ * @param   db          a database connection
+ * @param   timeout     the maximum time to wait for other connections, in msec
+ * @param   log         a log for writing error messages
+ * @return              a SQLite3 return code
+ */
+int
+ngx_http_sqlitelog_db_checkpoint(ngx_http_sqlitelog_db_t *db,
+    ngx_msec_t timeout, ngx_log_t *log)
+{
+    int          busy_timeout;
+    int          rc_ckpt;
+    int          sleep_dur;
+    int          total_slept;
+    ngx_uint_t   r;
+    
+    /* First attempt */
+    busy_timeout = 0;
+    rc_ckpt = ngx_http_sqlitelog_db_checkpoint_once(db, &busy_timeout, log);
+    if ((ngx_msec_t) busy_timeout < timeout) {
+        timeout = busy_timeout;
+    }
     
     /*
-     * This loop serves as an application-level busy handler for
-     * sqlite3_wal_checkpoint_v2() because the function, for whatever reason,
-     * doesn't abide by busy timeouts set by sqlite3_busy_timeout().
+     * This loop serves as an application-level busy handler, since each
+     * attempt returns at once rather than call the connection's busy handler
+     * (see ngx_http_sqlitelog_db_checkpoint_once() ).
      */
     total_slept = 0;
-    while (rc_ckpt == SQLITE_BUSY) {
+    while (rc_ckpt == SQLITE_BUSY && (ngx_msec_t) total_slept < timeout) {
         r = ngx_random();
         while (r > 100) {
             r = r/10;
@@ -623,11 +1021,7 @@ ngx_http_sqlitelog_db_checkpoint(ngx_http_sqlitelog_db_t *db, ngx_log_t *log)
         ngx_msleep(sleep_dur);
         total_slept += sleep_dur;
         
-        rc_ckpt = ngx_http_sqlitelog_sqlite3_wal_checkpoint_v2(db->conn, zdb,
-                                                   emode, pn_log, pn_ckpt, log);
-        if (total_slept >= busy_timeout) {
-            break;
-        }
+        rc_ckpt = ngx_http_sqlitelog_db_checkpoint_once(db, NULL, log);
     }
     ngx_log_debug1(NGX_LOG_DEBUG_HTTP, log, 0,
                    "sqlitelog: checkpoint loop, slept %d ms", total_slept);
@@ -639,13 +1033,108 @@ ngx_http_sqlitelog_db_checkpoint(ngx_http_sqlitelog_db_t *db, ngx_log_t *log)
      * SQLITE_OK, since an explicit "sqlitelog: failed to..." message could be
      * misleading.
      */
+    if (rc_ckpt == SQLITE_BUSY && timeout == 0) {
+        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, log, 0,
+                       "sqlitelog: checkpoint busy, left to the last "
+                       "connection");
+        return SQLITE_OK;
+    }
     if (rc_ckpt == SQLITE_BUSY) {
         ngx_log_error(NGX_LOG_ERR, log, 0,
                       "sqlitelog: checkpoint loop concluded with SQLITE_BUSY, "
-                      "total slept: %d ms, busy timeout: %d ms",
-                      total_slept, busy_timeout);
+                      "total slept: %d ms, timeout: %M ms",
+                      total_slept, timeout);
         return SQLITE_OK;
     }
     
     return rc_ckpt;
 }
+
+
+/**
+ * Execute a DELETE statement with a single integer parameter.
+ * 
+ * @param   db          a database connection
+ * @param   sql         the statement to execute
+ * @param   param       the value of parameter 1
+ * @param   changes     a pointer for storing the amount of deleted rows
+ * @param   log         a log for writing error messages
+ * @return              a SQLite3 return code
+ */
+int
+ngx_http_sqlitelog_db_delete(ngx_http_sqlitelog_db_t *db, ngx_str_t sql,
+    sqlite3_int64 param, ngx_uint_t *changes, ngx_log_t *log)
+{
+    int            rc_bind;
+    int            rc_finalize;
+    int            rc_prepare;
+    int            rc_step;
+    sqlite3_stmt  *stmt;
+    
+    stmt = NULL;
+    rc_bind = SQLITE_OK;
+    rc_step = SQLITE_DONE;
+    *changes = 0;
+    
+    rc_prepare = ngx_http_sqlitelog_sqlite3_prepare_v2(db->conn, sql, &stmt,
+                                                       NULL, log);
+    if (rc_prepare != SQLITE_OK) {
+        goto finalize;
+    }
+    
+    rc_bind = ngx_http_sqlitelog_sqlite3_bind_int64(db->conn, stmt, 1, param,
+                                                    log);
+    if (rc_bind != SQLITE_OK) {
+        goto finalize;
+    }
+    
+    rc_step = ngx_http_sqlitelog_sqlite3_step(db->conn, stmt, log);
+    if (rc_step != SQLITE_DONE) {
+        goto finalize;
+    }
+    
+    *changes = sqlite3_changes(db->conn);
+    
+finalize:
+    rc_finalize = ngx_http_sqlitelog_sqlite3_finalize(db->conn, stmt, log);
+    if (rc_prepare != SQLITE_OK) {
+        return rc_prepare;
+    }
+    if (rc_bind != SQLITE_OK) {
+        return rc_bind;
+    }
+    if (rc_step != SQLITE_DONE) {
+        return rc_step;
+    }
+    
+    return rc_finalize;
+}
+
+
+/**
+ * Release up to the given amount of free pages to the filesystem.
+ * 
+ * This has no effect unless the database uses incremental auto vacuum.
+ * 
+ * @param   db          a database connection
+ * @param   pages       the maximum amount of pages to release
+ * @param   log         a log for writing error messages
+ * @return              a SQLite3 return code
+ */
+int
+ngx_http_sqlitelog_db_incremental_vacuum(ngx_http_sqlitelog_db_t *db,
+    ngx_uint_t pages, ngx_log_t *log)
+{
+    u_char      buf[sizeof("PRAGMA incremental_vacuum()") + NGX_INT_T_LEN];
+    u_char     *last;
+    ngx_str_t   sql;
+    
+    last = ngx_sprintf(buf, "PRAGMA incremental_vacuum(%ui)", pages);
+    *last = '\0';
+    
+    sql.data = buf;
+    sql.len = last - buf;
+    
+    return ngx_http_sqlitelog_sqlite3_exec(db->conn, sql, NULL, NULL, NULL,
+                                           log);
+}
@@ -8,16 +8,30 @@
 
 
 #include <ngx_core.h>
+#include <ngx_thread_pool.h>
 #include <sqlite3.h>
 
 
 #include "ngx_http_sqlitelog_fmt.h"
+#include "ngx_http_sqlitelog_rollup.h"
+
+
+/* The transaction buffer (see ngx_http_sqlitelog_buf.h) */
+typedef struct ngx_http_sqlitelog_buf_s  ngx_http_sqlitelog_buf_t;
+
+/* The periodic checkpoint (see ngx_http_sqlitelog_ckpt.h) */
+typedef struct ngx_http_sqlitelog_ckpt_s  ngx_http_sqlitelog_ckpt_t;
 
 
 /*
  * ngx_http_sqlitelog_db_t contains the database connection and all of the
  * necessary data for manipulating it.
  * 
+ * There is one ngx_http_sqlitelog_db_t per database file, shared by every
+ * sqlitelog that writes to that file, whatever its format or context. Each
+ * format is a table in the database, and log entries refer to their table by
+ * its index in the formats array.
+ * 
  * Note that each Nginx worker process has its own individual connection to
  * the database. It's impossible to share a single database connection among
  * multiple processes. When SQLite opens a database via sqlite3_open_v2(), it
@@ -28,22 +42,96 @@
  * 
  * conn         the database connection
  * filename     the database filename
- * fmt          the log format
- * init_sql     the contents of the SQL file set by init=script
+ * formats      the log formats (ngx_http_sqlitelog_fmt_t *), one per table
+ * scripts      the contents of the SQL files set by init=script (ngx_str_t)
+ * vacuum       a flag set to 1 if new databases use incremental auto vacuum
+ * deferred     a flag set to 1 if indexes are only built when Nginx stops,
+ *              or NGX_CONF_UNSET if no sqlitelog set index_mode
+ * rollup       an optional rollup table
+ * buf          an optional transaction buffer for all of the tables
+ * ckpt         an optional periodic checkpoint
+ * batch        the list of log entries being inserted, which is read by the
+ *              batch virtual tables (see ngx_http_sqlitelog_batch.h)
+ * enabled      a flag set to 1 if at least one sqlitelog uses the database
+ * tp           the thread pool, or NULL if sqlitelog_async is off
+ * writing      the thread task that is using the connection, if any
+ * waiting      the first of the thread tasks that are waiting to use the
+ *              connection, linked by their next fields
+ * last         the last of the waiting thread tasks
+ * pending      the waiting insert task, which still takes log entries until
+ *              it's posted
+ * free         the completed thread tasks that are kept for reuse, linked by
+ *              their next fields
+ * nfree        the amount of tasks in free
+ * 
+ * Only one thread task at a time may use the connection (see
+ * ngx_http_sqlitelog_thread.h).
  */
 typedef struct {
-    sqlite3                   *conn;
-    ngx_str_t                  filename;
-    ngx_http_sqlitelog_fmt_t  *fmt;
-    ngx_str_t                  init_sql;
+    sqlite3                       *conn;
+    ngx_str_t                      filename;
+    ngx_array_t                    formats;
+    ngx_array_t                    scripts;
+    ngx_flag_t                     vacuum;
+    ngx_flag_t                     deferred;
+    ngx_http_sqlitelog_rollup_t   *rollup;
+    ngx_http_sqlitelog_buf_t      *buf;
+    ngx_http_sqlitelog_ckpt_t     *ckpt;
+    ngx_list_t                    *batch;
+    ngx_flag_t                     enabled;
+
+#if (NGX_THREADS)
+    ngx_thread_pool_t             *tp;
+    ngx_thread_task_t             *writing;
+    ngx_thread_task_t             *waiting;
+    ngx_thread_task_t             *last;
+    ngx_thread_task_t             *pending;
+    ngx_thread_task_t             *free;
+#else
+    void                          *tp;
+    void                          *writing;
+    void                          *waiting;
+    void                          *last;
+    void                          *pending;
+    void                          *free;
+#endif
+    ngx_uint_t                     nfree;
 } ngx_http_sqlitelog_db_t;
 
+
+/*
+ * ngx_http_sqlitelog_entry_t is a log entry that has been moved out of the
+ * transaction buffer, ready to be inserted.
+ * 
+ * table        the index of the entry's format in the database's formats
+ * elts         a C-style array of strings, one per column
+ * nelts        the length of elts
+ */
+typedef struct {
+    ngx_uint_t                     table;
+    ngx_str_t                     *elts;
+    ngx_uint_t                     nelts;
+} ngx_http_sqlitelog_entry_t;
+
+
 int ngx_http_sqlitelog_db_init(ngx_http_sqlitelog_db_t *db, ngx_log_t *log);
 int ngx_http_sqlitelog_db_close(ngx_http_sqlitelog_db_t *db, ngx_log_t *log);
 int ngx_http_sqlitelog_db_test(ngx_http_sqlitelog_db_t db, ngx_log_t *log);
-int ngx_http_sqlitelog_db_insert(ngx_http_sqlitelog_db_t *db, ngx_str_t *elts,
-    ngx_uint_t nelts, ngx_log_t *log);
+int ngx_http_sqlitelog_db_index(ngx_http_sqlitelog_db_t *db, ngx_log_t *log);
+ngx_int_t ngx_http_sqlitelog_db_table(ngx_http_sqlitelog_db_t *db,
+    ngx_http_sqlitelog_fmt_t *fmt, ngx_uint_t *table);
+uint32_t ngx_http_sqlitelog_db_sig(ngx_http_sqlitelog_db_t *db);
+int ngx_http_sqlitelog_db_insert(ngx_http_sqlitelog_db_t *db, ngx_uint_t table,
+    ngx_str_t *elts, ngx_uint_t nelts, ngx_log_t *log);
 int ngx_http_sqlitelog_db_insert_list(ngx_http_sqlitelog_db_t *db,
-    ngx_list_t* list, ngx_log_t *log);
+    ngx_list_t* list, ngx_array_t *rollup, ngx_log_t *log);
+int ngx_http_sqlitelog_db_get_busy_timeout(ngx_http_sqlitelog_db_t *db,
+    int *ms, ngx_log_t *log);
+int ngx_http_sqlitelog_db_checkpoint_once(ngx_http_sqlitelog_db_t *db,
+    int *busy_timeout, ngx_log_t *log);
 int ngx_http_sqlitelog_db_checkpoint(ngx_http_sqlitelog_db_t *db,
-    ngx_log_t *log);
+    ngx_msec_t timeout, ngx_log_t *log);
+int ngx_http_sqlitelog_db_delete(ngx_http_sqlitelog_db_t *db, ngx_str_t sql,
+    sqlite3_int64 param, ngx_uint_t *changes, ngx_log_t *log);
+int ngx_http_sqlitelog_db_incremental_vacuum(ngx_http_sqlitelog_db_t *db,
+    ngx_uint_t pages, ngx_log_t *log);
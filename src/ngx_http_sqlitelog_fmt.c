@@ -10,11 +10,17 @@
 
 #include "ngx_http_sqlitelog_col.h"
 #include "ngx_http_sqlitelog_fmt.h"
+#include "ngx_http_sqlitelog_op.h"
 #include "ngx_http_sqlitelog_sql.h"
+#include "ngx_http_sqlitelog_sqlite3.h"
 #include "ngx_http_sqlitelog_util.h"
 
 
 static ngx_str_t ngx_http_sqlitelog_fmt_col_type(ngx_str_t col_name);
+static ngx_int_t ngx_http_sqlitelog_fmt_init_id(ngx_conf_t *cf,
+    ngx_array_t *columns);
+static ngx_str_t ngx_http_sqlitelog_fmt_key(ngx_conf_t *cf,
+    ngx_array_t *columns, ngx_str_t list);
 
 
 static char * ngx_http_sqlitelog_fmt_col_types[] = {
@@ -47,6 +53,13 @@ static char * ngx_http_sqlitelog_fmt_col_types[] = {
 /**
  * Initialize a format with the given arguments.
  * 
+ * Any arguments between the table name and the first variable are table
+ * options:
+ * 
+ *  strict              create a STRICT table
+ *  id                  add an id column that is filled in automatically
+ *  without_rowid=$a,$b create a WITHOUT ROWID table clustered on $a, $b
+ * 
  * @param   cf      the current Nginx configuration
  * @param   args    the current sqlitelog_format line in the config file
  * @param   fmt     a pointer to a format to be initialized
@@ -59,11 +72,16 @@ ngx_http_sqlitelog_fmt_init(ngx_conf_t *cf, ngx_array_t *args,
 {
     ngx_str_t                 col_name;
     ngx_str_t                 col_type;
+    ngx_str_t                 key;
     ngx_str_t                 table_name;
     ngx_str_t                *next;
     ngx_str_t                 sql_create;
     ngx_str_t                 sql_insert;
+    ngx_str_t                 without_rowid;
     ngx_str_t                *value;
+    ngx_flag_t                id;
+    ngx_flag_t                strict;
+    ngx_flag_t                vars;
     ngx_uint_t                i;
     ngx_uint_t                j;
     ngx_uint_t                n;
@@ -72,10 +90,15 @@ ngx_http_sqlitelog_fmt_init(ngx_conf_t *cf, ngx_array_t *args,
     
     value = args->elts;
     next = value + 1;
+    ngx_str_null(&without_rowid);
+    id = 0;
+    strict = 0;
+    vars = 0;
     
     /* Columns array */
     n = ngx_http_sqlitelog_fmt_n_variables(args);
-    if (ngx_array_init(&columns, cf->pool, n, sizeof(ngx_http_sqlitelog_col_t))
+    if (ngx_array_init(&columns, cf->pool, n + 1,
+                       sizeof(ngx_http_sqlitelog_col_t))
         != NGX_OK)
     {
         return NGX_ERROR;
@@ -94,9 +117,37 @@ ngx_http_sqlitelog_fmt_init(ngx_conf_t *cf, ngx_array_t *args,
             table_name.len = value->len;
         }
         
+        /* Table options come before the first variable */
+        else if (!vars && value->data[0] != '$') {
+            if (ngx_str_eq_cs(value, "strict")) {
+                strict = 1;
+            }
+            else if (ngx_str_eq_cs(value, "id")) {
+                if (!id && ngx_http_sqlitelog_fmt_init_id(cf, &columns)
+                           != NGX_OK)
+                {
+                    return NGX_ERROR;
+                }
+                id = 1;
+            }
+            else if (value->len > 14
+                     && ngx_strncmp(value->data, "without_rowid=", 14) == 0)
+            {
+                without_rowid.data = value->data + 14;
+                without_rowid.len = value->len - 14;
+            }
+            else {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "unknown table option \"%V\"", value);
+                return NGX_ERROR;
+            }
+        }
+        
         else {
             /* Column */
             if (value->data[0] == '$') {
+                vars = 1;
+                
                 /* Push */
                 col = ngx_array_push(&columns);
                 if (col == NULL) {
@@ -139,23 +190,75 @@ ngx_http_sqlitelog_fmt_init(ngx_conf_t *cf, ngx_array_t *args,
         next++;
     }
     
+    /* STRICT tables only allow a few types; INET holds integers and blobs */
+    if (strict) {
+        col = columns.elts;
+        for (i = 0; i < columns.nelts; i++) {
+            if (ngx_str_eq_cs(&col[i].type, "INET")) {
+                ngx_str_set(&col[i].type, "ANY");
+            }
+        }
+    }
+    
+    /* Primary key */
+    if (without_rowid.data) {
+        key = ngx_http_sqlitelog_fmt_key(cf, &columns, without_rowid);
+        if (key.data == NULL) {
+            return NGX_ERROR;
+        }
+        
+        /* The id column can't be a second PRIMARY KEY */
+        if (id) {
+            col = columns.elts;
+            ngx_str_set(&col->type, "INTEGER NOT NULL");
+        }
+    }
+    else {
+        ngx_str_null(&key);
+    }
+    
     /* CREATE TABLE IF NOT EXISTS table (...) */
-    sql_create = ngx_http_sqlitelog_sql_create_table(table_name, columns, 
-                                                     cf->pool);
+    sql_create = ngx_http_sqlitelog_sql_create_table(table_name, columns, key,
+                                                     strict, cf->pool);
     if (sql_create.data == NULL || sql_create.len == 0) {
         return NGX_ERROR;
     }
     
     /* INSERT INTO table VALUES (?,?,?) */
-    sql_insert = ngx_http_sqlitelog_sql_insert(table_name, n, cf->pool);
+    sql_insert = ngx_http_sqlitelog_sql_insert(table_name, columns.nelts,
+                                               cf->pool);
     if (sql_insert.data == NULL || sql_insert.len == 0) {
         return NGX_ERROR;
     }
     
+    /* Batch virtual table */
+    if (ngx_http_sqlitelog_sql_batch(table_name, &fmt->sql_batch_create,
+                                     &fmt->sql_batch_insert, cf->pool)
+        != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+    
+    /* Indexes are added later by sqlitelog_index */
+    if (ngx_array_init(&fmt->indexes, cf->pool, 1,
+                       sizeof(ngx_http_sqlitelog_index_t))
+        != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+    
     /* Finalize */
     fmt->name = table_name;
     fmt->columns = columns;
     fmt->sql_create = sql_create;
+    
+    if (key.data) {
+        fmt->key = key;
+    }
+    else {
+        ngx_str_set(&fmt->key, "rowid");
+    }
+    
     fmt->sql_insert = sql_insert;
     
     return NGX_OK;
@@ -211,6 +314,113 @@ ngx_http_sqlitelog_fmt_init_combined(ngx_conf_t *cf,
 }
 
 
+/**
+ * Add an id column to a format. Its values are generated by
+ * ngx_http_sqlitelog_op_run_id() rather than taken from a variable.
+ * 
+ * @param   cf          the current Nginx configuration
+ * @param   columns     the format's columns, which must still be empty
+ * @return              NGX_OK on success, or
+ *                      NGX_ERROR on failure
+ */
+static ngx_int_t
+ngx_http_sqlitelog_fmt_init_id(ngx_conf_t *cf, ngx_array_t *columns)
+{
+    ngx_http_sqlitelog_col_t  *col;
+    
+    col = ngx_array_push(columns);
+    if (col == NULL) {
+        return NGX_ERROR;
+    }
+    
+    ngx_str_set(&col->name, "id");
+    ngx_str_set(&col->type, "INTEGER PRIMARY KEY");
+    col->op.getlen = ngx_http_sqlitelog_op_getlen_id;
+    col->op.run = ngx_http_sqlitelog_op_run_id;
+    col->op.index = NGX_ERROR;
+    col->epoch = 0;
+    col->bind = ngx_http_sqlitelog_sqlite3_bind_text;
+    col->result = ngx_http_sqlitelog_col_result_text;
+    
+    return NGX_OK;
+}
+
+
+/**
+ * Build the primary key of a WITHOUT ROWID table from the without_rowid table
+ * option.
+ * 
+ * @param   cf          the current Nginx configuration
+ * @param   columns     the format's columns
+ * @param   list        a comma-separated list of variables, e.g. "$msec,$pid"
+ * @return              a comma-separated list of column names, e.g.
+ *                      "msec, pid", or a string with NULL data on failure
+ */
+static ngx_str_t
+ngx_http_sqlitelog_fmt_key(ngx_conf_t *cf, ngx_array_t *columns,
+    ngx_str_t list)
+{
+    u_char                    *p;
+    u_char                    *last;
+    u_char                    *end;
+    ngx_str_t                  key;
+    ngx_str_t                  name;
+    ngx_uint_t                 i;
+    ngx_http_sqlitelog_col_t  *col;
+    
+    /* "$a,$b" becomes "a, b", which is never longer */
+    key.data = ngx_pnalloc(cf->pool, list.len);
+    if (key.data == NULL) {
+        return NGX_NULL_STRING;
+    }
+    key.len = 0;
+    
+    p = list.data;
+    last = list.data + list.len;
+    
+    while (p < last) {
+        end = ngx_strlchr(p, last, ',');
+        if (end == NULL) {
+            end = last;
+        }
+        
+        if (end - p < 2 || *p != '$') {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid without_rowid key \"%V\"", &list);
+            return NGX_NULL_STRING;
+        }
+        
+        name.data = p + 1;
+        name.len = end - p - 1;
+        
+        /* Find column */
+        col = columns->elts;
+        for (i = 0; i < columns->nelts; i++) {
+            if (ngx_str_eq(&col[i].name, &name)) {
+                break;
+            }
+        }
+        if (i == columns->nelts) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "without_rowid key \"%V\" is not a column",
+                               &name);
+            return NGX_NULL_STRING;
+        }
+        
+        if (key.len) {
+            key.data[key.len++] = ',';
+            key.data[key.len++] = ' ';
+        }
+        ngx_memcpy(key.data + key.len, name.data, name.len);
+        key.len += name.len;
+        
+        p = end + 1;
+    }
+    
+    return key;
+}
+
+
 /**
  * Get this column's hardcoded column type if available.
  *
@@ -10,20 +10,44 @@
 #include <ngx_core.h>
 
 
+/*
+ * ngx_http_sqlitelog_index_t represents an index defined by the
+ * sqlitelog_index directive.
+ * 
+ * name         the index's name
+ * sql_create   "CREATE INDEX IF NOT EXISTS name ON table (...) [WHERE ...]"
+ */
+typedef struct {
+    ngx_str_t    name;
+    ngx_str_t    sql_create;
+} ngx_http_sqlitelog_index_t;
+
+
 /*
  * ngx_http_sqlitelog_fmt_t represents a log format (i.e. the SQLite table
  * where records are stored).
  * 
  * name         the table's name
  * columns      the table's columns
- * sql_create   "CREATE TABLE IF NOT EXISTS name (...)"
+ * indexes      the table's indexes
+ * key          the table's primary key, either "rowid" or the comma-separated
+ *              columns given by the without_rowid option
+ * sql_create   "CREATE TABLE IF NOT EXISTS name (...) [options]"
  * sql_insert   "INSERT INTO name VALUES (?,?,?)"
+ * sql_batch_create
+ *              a statement that creates the table's batch virtual table
+ * sql_batch_insert
+ *              "INSERT INTO name SELECT * FROM temp.sqlitelog_batch_name"
  */
 typedef struct {
     ngx_str_t    name;
     ngx_array_t  columns;       /* array of ngx_http_sqlitelog_col_t */
+    ngx_array_t  indexes;       /* array of ngx_http_sqlitelog_index_t */
+    ngx_str_t    key;
     ngx_str_t    sql_create;
     ngx_str_t    sql_insert;
+    ngx_str_t    sql_batch_create;
+    ngx_str_t    sql_batch_insert;
 } ngx_http_sqlitelog_fmt_t;
 
 
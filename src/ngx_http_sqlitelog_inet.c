@@ -0,0 +1,320 @@
+
+/*
+ * Copyright (C) Serope.com
+ */
+
+
+#if (NGX_HTTP_SQLITELOG_INET_EXTENSION)
+#include <sqlite3ext.h>
+SQLITE_EXTENSION_INIT1
+#else
+#include <sqlite3.h>
+#endif
+
+#include <arpa/inet.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+#include "ngx_http_sqlitelog_inet.h"
+
+
+static int ngx_http_sqlitelog_inet_value(sqlite3_value *value,
+    unsigned char *addr);
+static int ngx_http_sqlitelog_inet_parse(const char *text, int len,
+    unsigned char *addr);
+static void ngx_http_sqlitelog_inet_ntop(sqlite3_context *ctx, int argc,
+    sqlite3_value **argv);
+static void ngx_http_sqlitelog_inet_pton(sqlite3_context *ctx, int argc,
+    sqlite3_value **argv);
+static void ngx_http_sqlitelog_inet_in_cidr(sqlite3_context *ctx, int argc,
+    sqlite3_value **argv);
+
+
+/* The first 12 bytes of an IPv4-mapped IPv6 address */
+static const unsigned char ngx_http_sqlitelog_inet_mapped[12] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff
+};
+
+
+/**
+ * Register the INET functions on a database connection.
+ * 
+ * @param   db      a database connection
+ * @return          SQLITE_OK on success, or
+ *                  the return code of sqlite3_create_function() on failure
+ */
+int
+ngx_http_sqlitelog_inet_register(sqlite3 *db)
+{
+    int  rc;
+    int  flags;
+    
+    flags = SQLITE_UTF8 | SQLITE_DETERMINISTIC;
+    
+    rc = sqlite3_create_function(db, "inet_ntop", 1, flags, NULL,
+                                 ngx_http_sqlitelog_inet_ntop, NULL, NULL);
+    if (rc != SQLITE_OK) {
+        return rc;
+    }
+    
+    rc = sqlite3_create_function(db, "inet_pton", 1, flags, NULL,
+                                 ngx_http_sqlitelog_inet_pton, NULL, NULL);
+    if (rc != SQLITE_OK) {
+        return rc;
+    }
+    
+    return sqlite3_create_function(db, "inet_in_cidr", 2, flags, NULL,
+                                   ngx_http_sqlitelog_inet_in_cidr, NULL, NULL);
+}
+
+
+#if (NGX_HTTP_SQLITELOG_INET_EXTENSION)
+/**
+ * Entry point of the loadable extension, which is found automatically when
+ * the extension is named sqlitelog_inet.so.
+ * 
+ * @param   db          a database connection
+ * @param   errmsg      unused
+ * @param   api         SQLite's API routines
+ * @return              SQLITE_OK on success, or an error code
+ */
+int
+sqlite3_sqliteloginet_init(sqlite3 *db, char **errmsg,
+    const sqlite3_api_routines *api)
+{
+    SQLITE_EXTENSION_INIT2(api);
+    
+    return ngx_http_sqlitelog_inet_register(db);
+}
+#endif
+
+
+/**
+ * Get the address held by an SQL value: an integer (IPv4), a 4- or 16-byte
+ * blob, or text. IPv4-mapped IPv6 addresses are returned as IPv4.
+ * 
+ * @param   value   the SQL value
+ * @param   addr    a buffer of 16 bytes in which to write the address
+ * @return          4 for IPv4, 16 for IPv6, or 0 if there's no valid address
+ */
+static int
+ngx_http_sqlitelog_inet_value(sqlite3_value *value, unsigned char *addr)
+{
+    int            len;
+    sqlite3_int64  n;
+    
+    switch (sqlite3_value_type(value)) {
+    
+    case SQLITE_INTEGER:
+        n = sqlite3_value_int64(value);
+        if (n < 0 || n > 0xffffffff) {
+            return 0;
+        }
+        addr[0] = (unsigned char) (n >> 24);
+        addr[1] = (unsigned char) (n >> 16);
+        addr[2] = (unsigned char) (n >> 8);
+        addr[3] = (unsigned char) n;
+        return 4;
+    
+    case SQLITE_BLOB:
+        len = sqlite3_value_bytes(value);
+        if (len != 4 && len != 16) {
+            return 0;
+        }
+        memcpy(addr, sqlite3_value_blob(value), len);
+        break;
+    
+    case SQLITE_TEXT:
+        len = ngx_http_sqlitelog_inet_parse(
+                              (const char *) sqlite3_value_text(value),
+                              sqlite3_value_bytes(value), addr);
+        break;
+    
+    default:
+        return 0;
+    }
+    
+    if (len == 16 && memcmp(addr, ngx_http_sqlitelog_inet_mapped, 12) == 0) {
+        memmove(addr, addr + 12, 4);
+        len = 4;
+    }
+    
+    return len;
+}
+
+
+/**
+ * Parse an IPv4 or IPv6 address.
+ * 
+ * @param   text    the address as text
+ * @param   len     the length of the text
+ * @param   addr    a buffer of 16 bytes in which to write the address
+ * @return          4 for IPv4, 16 for IPv6, or 0 if the text isn't valid
+ */
+static int
+ngx_http_sqlitelog_inet_parse(const char *text, int len, unsigned char *addr)
+{
+    char  buf[INET6_ADDRSTRLEN];
+    
+    if (text == NULL || len <= 0 || len >= INET6_ADDRSTRLEN) {
+        return 0;
+    }
+    
+    memcpy(buf, text, len);
+    buf[len] = '\0';
+    
+    if (inet_pton(AF_INET, buf, addr) == 1) {
+        return 4;
+    }
+    
+    if (inet_pton(AF_INET6, buf, addr) == 1) {
+        return 16;
+    }
+    
+    return 0;
+}
+
+
+/**
+ * inet_ntop(addr): get an address as text, or NULL if it isn't an address.
+ * 
+ * @param   ctx     the function's context
+ * @param   argc    the amount of arguments (1)
+ * @param   argv    the arguments
+ */
+static void
+ngx_http_sqlitelog_inet_ntop(sqlite3_context *ctx, int argc,
+    sqlite3_value **argv)
+{
+    int            len;
+    char           buf[INET6_ADDRSTRLEN];
+    unsigned char  addr[16];
+    
+    len = ngx_http_sqlitelog_inet_value(argv[0], addr);
+    if (len == 0) {
+        sqlite3_result_null(ctx);
+        return;
+    }
+    
+    if (inet_ntop(len == 4 ? AF_INET : AF_INET6, addr, buf, sizeof(buf))
+        == NULL)
+    {
+        sqlite3_result_null(ctx);
+        return;
+    }
+    
+    sqlite3_result_text(ctx, buf, -1, SQLITE_TRANSIENT);
+}
+
+
+/**
+ * inet_pton(text): get an address as it's stored in an INET column, i.e. an
+ * integer for IPv4 or a 16-byte blob for IPv6, or NULL if it isn't an address.
+ * 
+ * @param   ctx     the function's context
+ * @param   argc    the amount of arguments (1)
+ * @param   argv    the arguments
+ */
+static void
+ngx_http_sqlitelog_inet_pton(sqlite3_context *ctx, int argc,
+    sqlite3_value **argv)
+{
+    int            len;
+    unsigned char  addr[16];
+    
+    len = ngx_http_sqlitelog_inet_value(argv[0], addr);
+    
+    if (len == 4) {
+        sqlite3_result_int64(ctx, (sqlite3_int64) addr[0] << 24
+                                  | (sqlite3_int64) addr[1] << 16
+                                  | (sqlite3_int64) addr[2] << 8
+                                  | (sqlite3_int64) addr[3]);
+    }
+    else if (len == 16) {
+        sqlite3_result_blob(ctx, addr, 16, SQLITE_TRANSIENT);
+    }
+    else {
+        sqlite3_result_null(ctx);
+    }
+}
+
+
+/**
+ * inet_in_cidr(addr, cidr): check whether an address is in a network given in
+ * CIDR notation. A network without a prefix length is a single address.
+ * 
+ * @param   ctx     the function's context
+ * @param   argc    the amount of arguments (2)
+ * @param   argv    the arguments
+ */
+static void
+ngx_http_sqlitelog_inet_in_cidr(sqlite3_context *ctx, int argc,
+    sqlite3_value **argv)
+{
+    int             bits;
+    int             i;
+    int             len;
+    int             net_len;
+    char           *end;
+    const char     *cidr;
+    const char     *slash;
+    unsigned char   addr[16];
+    unsigned char   mask;
+    unsigned char   net[16];
+    
+    len = ngx_http_sqlitelog_inet_value(argv[0], addr);
+    cidr = (const char *) sqlite3_value_text(argv[1]);
+    
+    if (len == 0 || cidr == NULL) {
+        sqlite3_result_null(ctx);
+        return;
+    }
+    
+    /* Network and prefix length */
+    slash = strchr(cidr, '/');
+    net_len = ngx_http_sqlitelog_inet_parse(cidr,
+                                  slash ? (int) (slash - cidr)
+                                        : (int) strlen(cidr),
+                                  net);
+    if (net_len == 0) {
+        sqlite3_result_error(ctx, "inet_in_cidr: invalid network", -1);
+        return;
+    }
+    
+    bits = net_len * 8;
+    if (slash) {
+        bits = (int) strtol(slash + 1, &end, 10);
+        if (end == slash + 1 || *end != '\0' || bits < 0
+            || bits > net_len * 8)
+        {
+            sqlite3_result_error(ctx, "inet_in_cidr: invalid prefix length",
+                                 -1);
+            return;
+        }
+    }
+    
+    /* IPv4 networks don't contain IPv6 addresses, and vice versa */
+    if (len != net_len) {
+        sqlite3_result_int(ctx, 0);
+        return;
+    }
+    
+    /* Compare whole bytes, then the remaining bits */
+    for (i = 0; bits >= 8; i++, bits -= 8) {
+        if (addr[i] != net[i]) {
+            sqlite3_result_int(ctx, 0);
+            return;
+        }
+    }
+    
+    if (bits) {
+        mask = (unsigned char) (0xff << (8 - bits));
+        if ((addr[i] & mask) != (net[i] & mask)) {
+            sqlite3_result_int(ctx, 0);
+            return;
+        }
+    }
+    
+    sqlite3_result_int(ctx, 1);
+}
@@ -0,0 +1,30 @@
+
+/*
+ * Copyright (C) Serope.com
+ * 
+ * SQL functions for INET columns, which hold IPv4 addresses as integers and
+ * IPv6 addresses as 16-byte blobs:
+ * 
+ *  inet_ntop(addr)             the address as text, e.g. '192.168.0.1'
+ *  inet_pton(text)             the address as it's stored in an INET column
+ *  inet_in_cidr(addr, cidr)    1 if the address is in the given network,
+ *                              e.g. '10.0.0.0/8' or '2001:db8::/32'
+ * 
+ * The functions are registered on every connection that the module opens.
+ * The same source file also builds as a loadable extension for reading logs
+ * with the sqlite3 shell or any other program:
+ * 
+ *  cc -shared -fPIC -DNGX_HTTP_SQLITELOG_INET_EXTENSION=1 \
+ *     -o sqlitelog_inet.so src/ngx_http_sqlitelog_inet.c
+ * 
+ * This file doesn't depend on Nginx, so that it can be built on its own.
+ */
+
+
+#pragma once
+
+
+#include <sqlite3.h>
+
+
+int ngx_http_sqlitelog_inet_register(sqlite3 *db);
@@ -0,0 +1,498 @@
+/*
+ * Copyright (C) Serope.com
+ */
+
+
+#include <ngx_core.h>
+
+
+#include "ngx_http_sqlitelog_journal.h"
+
+
+/* Marks a NULL element in a record's lengths */
+#define NGX_HTTP_SQLITELOG_JOURNAL_NULL  0xffffffff
+
+
+static u_char *ngx_http_sqlitelog_journal_half(
+    ngx_http_sqlitelog_journal_t *journal, ngx_uint_t half);
+static void ngx_http_sqlitelog_journal_clear(
+    ngx_http_sqlitelog_journal_t *journal, ngx_uint_t half);
+static ngx_int_t ngx_http_sqlitelog_journal_read(
+    ngx_http_sqlitelog_journal_t *journal, ngx_uint_t half, ngx_pool_t *pool,
+    ngx_array_t *entries);
+static uint32_t ngx_http_sqlitelog_journal_crc(
+    ngx_http_sqlitelog_journal_rec_t *rec);
+static int ngx_libc_cdecl ngx_http_sqlitelog_journal_cmp(const void *one,
+    const void *two);
+
+
+/**
+ * Open the journal file, creating it or growing it as needed, and map it
+ * into memory.
+ * 
+ * The file is only closed after it's mapped, so the mapping lasts as long as
+ * the process (and the worker processes that it forks). If the file's header
+ * doesn't describe halves that fit in the file, its magic number is cleared,
+ * so that ngx_http_sqlitelog_journal_recover() doesn't read it.
+ * 
+ * @param   path    the journal file's full path
+ * @param   size    the size of each half
+ * @param   log     a log for writing error messages
+ * @return          the mapped journal,
+ *                  or NULL if an error occurs
+ */
+ngx_http_sqlitelog_journal_t *
+ngx_http_sqlitelog_journal_open(ngx_str_t *path, size_t size, ngx_log_t *log)
+{
+    off_t                          file_size;
+    size_t                         map_size;
+    u_char                        *addr;
+    ngx_fd_t                       fd;
+    ngx_file_info_t                fi;
+    ngx_http_sqlitelog_journal_t  *journal;
+    
+    addr = NULL;
+    map_size = NGX_HTTP_SQLITELOG_JOURNAL_HEADER + 2 * size;
+    
+    /* Open */
+    fd = ngx_open_file(path->data, NGX_FILE_RDWR, NGX_FILE_CREATE_OR_OPEN,
+                       NGX_FILE_DEFAULT_ACCESS);
+    if (fd == NGX_INVALID_FILE) {
+        ngx_log_error(NGX_LOG_EMERG, log, ngx_errno,
+                      "sqlitelog: failed to open journal \"%V\"", path);
+        return NULL;
+    }
+    
+    /* Size */
+    if (ngx_fd_info(fd, &fi) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_EMERG, log, ngx_errno,
+                      "sqlitelog: failed to stat journal \"%V\"", path);
+        goto close;
+    }
+    file_size = ngx_file_size(&fi);
+    
+    if (file_size < (off_t) map_size) {
+        if (ftruncate(fd, map_size) == -1) {
+            ngx_log_error(NGX_LOG_EMERG, log, ngx_errno,
+                          "sqlitelog: failed to resize journal \"%V\" to "
+                          "%uz bytes", path, map_size);
+            goto close;
+        }
+    }
+    else {
+        map_size = file_size;
+    }
+    
+    /* Map */
+    addr = mmap(NULL, map_size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    if (addr == MAP_FAILED) {
+        ngx_log_error(NGX_LOG_EMERG, log, ngx_errno,
+                      "sqlitelog: failed to map journal \"%V\"", path);
+        addr = NULL;
+        goto close;
+    }
+    
+    /* Header */
+    journal = (ngx_http_sqlitelog_journal_t *) addr;
+    if (journal->magic == NGX_HTTP_SQLITELOG_JOURNAL_MAGIC
+        && (journal->version != NGX_HTTP_SQLITELOG_JOURNAL_VERSION
+            || journal->size > (map_size - NGX_HTTP_SQLITELOG_JOURNAL_HEADER)
+                               / 2))
+    {
+        ngx_log_error(NGX_LOG_WARN, log, 0,
+                      "sqlitelog: journal \"%V\" is invalid and will be "
+                      "overwritten", path);
+        journal->magic = 0;
+    }
+    
+close:
+    if (ngx_close_file(fd) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+                      "sqlitelog: failed to close journal \"%V\"", path);
+    }
+    
+    return (ngx_http_sqlitelog_journal_t *) addr;
+}
+
+
+/**
+ * Read the log entries left in the journal, then clear the journal for a
+ * buffer whose halves are of the given size.
+ * 
+ * Each half's records are read up to its offset, and a record is skipped if
+ * its magic number, generation, length, or CRC doesn't check out. The search
+ * for the next record then resumes 8 bytes later, since a record that was
+ * never completed may be followed by ones that were.
+ * 
+ * @param   journal     the journal in question
+ * @param   size        the size of each half from now on
+ * @param   pool        a pool in which to copy the log entries
+ * @param   entries     an uninitialized array to hold the log entries
+ *                      (ngx_http_sqlitelog_journal_entry_t), sorted by
+ *                      sequence number
+ * @param   log         a log for writing error messages
+ * @return              NGX_OK on success, or
+ *                      NGX_ERROR on failure
+ */
+ngx_int_t
+ngx_http_sqlitelog_journal_recover(ngx_http_sqlitelog_journal_t *journal,
+    size_t size, ngx_pool_t *pool, ngx_array_t *entries, ngx_log_t *log)
+{
+    ngx_uint_t  h;
+    
+    if (ngx_array_init(entries, pool, 64,
+                       sizeof(ngx_http_sqlitelog_journal_entry_t))
+        != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+    
+    /* Read */
+    if (journal->magic == NGX_HTTP_SQLITELOG_JOURNAL_MAGIC) {
+        for (h = 0; h < 2; h++) {
+            if (ngx_http_sqlitelog_journal_read(journal, h, pool, entries)
+                != NGX_OK)
+            {
+                ngx_log_error(NGX_LOG_ERR, log, 0,
+                              "sqlitelog: failed to read journal");
+                return NGX_ERROR;
+            }
+        }
+    
+        ngx_qsort(entries->elts, entries->nelts,
+                  sizeof(ngx_http_sqlitelog_journal_entry_t),
+                  ngx_http_sqlitelog_journal_cmp);
+    }
+    
+    /* A journal that was never valid starts at the first generation */
+    else {
+        ngx_memzero(journal, sizeof(ngx_http_sqlitelog_journal_t));
+    }
+    
+    /* Clear */
+    journal->magic = NGX_HTTP_SQLITELOG_JOURNAL_MAGIC;
+    journal->version = NGX_HTTP_SQLITELOG_JOURNAL_VERSION;
+    journal->size = size;
+    journal->active = 0;
+    
+    for (h = 0; h < 2; h++) {
+        journal->busy[h] = 0;
+        ngx_http_sqlitelog_journal_clear(journal, h);
+    }
+    
+    return NGX_OK;
+}
+
+
+/**
+ * Read the valid records of one of the journal's halves.
+ * 
+ * @param   journal     the journal in question
+ * @param   half        the index of the half
+ * @param   pool        a pool in which to copy the log entries
+ * @param   entries     an array to hold the log entries
+ *                      (ngx_http_sqlitelog_journal_entry_t)
+ * @return              NGX_OK on success, or
+ *                      NGX_ERROR on failure
+ */
+static ngx_int_t
+ngx_http_sqlitelog_journal_read(ngx_http_sqlitelog_journal_t *journal,
+    ngx_uint_t half, ngx_pool_t *pool, ngx_array_t *entries)
+{
+    size_t                               end;
+    size_t                               off;
+    size_t                               len;
+    u_char                              *base;
+    u_char                              *data;
+    uint32_t                            *lens;
+    ngx_uint_t                           i;
+    ngx_http_sqlitelog_journal_rec_t    *rec;
+    ngx_http_sqlitelog_journal_entry_t  *e;
+    
+    base = ngx_http_sqlitelog_journal_half(journal, half);
+    end = ngx_min(journal->off[half], journal->size);
+    
+    for (off = 0;
+         off + sizeof(ngx_http_sqlitelog_journal_rec_t) <= end;
+         off += 8)
+    {
+        rec = (ngx_http_sqlitelog_journal_rec_t *) (base + off);
+    
+        if (rec->magic != NGX_HTTP_SQLITELOG_JOURNAL_RECORD
+            || rec->gen != journal->gen[half]
+            || rec->len % 8
+            || rec->len < sizeof(ngx_http_sqlitelog_journal_rec_t)
+            || rec->len > end - off
+            || rec->nelts > (rec->len - sizeof(*rec)) / sizeof(uint32_t)
+            || rec->crc != ngx_http_sqlitelog_journal_crc(rec))
+        {
+            continue;
+        }
+    
+        /* Lengths must add up to no more than the data */
+        lens = (uint32_t *) (rec + 1);
+        data = (u_char *) (lens + rec->nelts);
+        len = 0;
+        for (i = 0; i < rec->nelts; i++) {
+            if (lens[i] != NGX_HTTP_SQLITELOG_JOURNAL_NULL) {
+                len += lens[i];
+            }
+        }
+        if (len > (size_t) ((u_char *) rec + rec->len - data)) {
+            continue;
+        }
+    
+        /* Copy */
+        e = ngx_array_push(entries);
+        if (e == NULL) {
+            return NGX_ERROR;
+        }
+        e->seq = rec->seq;
+        e->sig = rec->sig;
+        e->entry.table = rec->table;
+        e->entry.nelts = rec->nelts;
+        e->entry.elts = ngx_palloc(pool, rec->nelts * sizeof(ngx_str_t) + len);
+        if (e->entry.elts == NULL) {
+            return NGX_ERROR;
+        }
+    
+        ngx_memcpy(e->entry.elts + rec->nelts, data, len);
+        data = (u_char *) (e->entry.elts + rec->nelts);
+    
+        for (i = 0; i < rec->nelts; i++) {
+            if (lens[i] == NGX_HTTP_SQLITELOG_JOURNAL_NULL) {
+                e->entry.elts[i].data = NULL;
+                e->entry.elts[i].len = 0;
+                continue;
+            }
+            e->entry.elts[i].data = data;
+            e->entry.elts[i].len = lens[i];
+            data += lens[i];
+        }
+    
+        off += rec->len - 8;
+    }
+    
+    return NGX_OK;
+}
+
+
+/**
+ * Append a log entry to the journal's active half.
+ * 
+ * The record's space is reserved atomically, so appends from different
+ * shards can run at the same time. The active half must not be switched
+ * meanwhile, i.e. the shard that's pushing the log entry must be locked.
+ * 
+ * Once a log entry doesn't fit, the half stays full until it's cleared, and
+ * a warning is written only the first time.
+ * 
+ * @param   journal     the journal in question
+ * @param   node        the log entry's node in the buffer
+ * @param   log         a log for writing error messages
+ * @return              NGX_OK on success, or
+ *                      NGX_DECLINED if the log entry doesn't fit
+ */
+ngx_int_t
+ngx_http_sqlitelog_journal_append(ngx_http_sqlitelog_journal_t *journal,
+    ngx_http_sqlitelog_node_t *node, ngx_log_t *log)
+{
+    size_t                             len;
+    size_t                             off;
+    u_char                            *data;
+    uint32_t                          *lens;
+    ngx_str_t                         *elts;
+    ngx_uint_t                         h;
+    ngx_uint_t                         i;
+    ngx_http_sqlitelog_journal_rec_t  *rec;
+    
+    elts = node->elts;
+    
+    /* Length */
+    len = sizeof(ngx_http_sqlitelog_journal_rec_t)
+          + node->nelts * sizeof(uint32_t);
+    for (i = 0; i < node->nelts; i++) {
+        if (elts[i].data) {
+            len += elts[i].len;
+        }
+    }
+    len = ngx_align(len, 8);
+    
+    /* Reserve */
+    h = journal->active;
+    off = ngx_atomic_fetch_add(&journal->off[h], len);
+    if (off + len > journal->size) {
+        if (off <= journal->size) {
+            ngx_log_error(NGX_LOG_WARN, log, 0,
+                          "sqlitelog: journal is full, log entries are not "
+                          "persisted until the next commit");
+        }
+        return NGX_DECLINED;
+    }
+    
+    rec = (ngx_http_sqlitelog_journal_rec_t *)
+          (ngx_http_sqlitelog_journal_half(journal, h) + off);
+    
+    /* Incomplete until the magic number is written */
+    rec->magic = 0;
+    ngx_memory_barrier();
+    
+    rec->gen = journal->gen[h];
+    rec->seq = node->seq;
+    rec->len = len;
+    rec->table = node->table;
+    rec->nelts = node->nelts;
+    rec->sig = node->sig;
+    
+    lens = (uint32_t *) (rec + 1);
+    data = (u_char *) (lens + node->nelts);
+    for (i = 0; i < node->nelts; i++) {
+        if (elts[i].data == NULL) {
+            lens[i] = NGX_HTTP_SQLITELOG_JOURNAL_NULL;
+            continue;
+        }
+        lens[i] = elts[i].len;
+        data = ngx_cpymem(data, elts[i].data, elts[i].len);
+    }
+    ngx_memzero(data, (u_char *) rec + len - data);
+    
+    rec->crc = ngx_http_sqlitelog_journal_crc(rec);
+    ngx_memory_barrier();
+    rec->magic = NGX_HTTP_SQLITELOG_JOURNAL_RECORD;
+    
+    return NGX_OK;
+}
+
+
+/**
+ * Mark the active half as in use by a transaction that's taking every log
+ * entry from the buffer, and make the other half active if it's no longer in
+ * use.
+ * 
+ * The buffer must be locked by ngx_http_sqlitelog_buf_lock().
+ * 
+ * @param   journal     the journal in question
+ * @return              the index of the half that the transaction is using,
+ *                      to be passed to ngx_http_sqlitelog_journal_done()
+ */
+ngx_uint_t
+ngx_http_sqlitelog_journal_switch(ngx_http_sqlitelog_journal_t *journal)
+{
+    ngx_uint_t  h;
+    
+    h = journal->active;
+    journal->busy[h]++;
+    
+    if (journal->busy[h ^ 1] == 0) {
+        ngx_http_sqlitelog_journal_clear(journal, h ^ 1);
+        journal->active = h ^ 1;
+    }
+    
+    return h;
+}
+
+
+/**
+ * Mark a transaction that was using a half as committed, and clear the half
+ * if no other transaction is using it and it holds no log entries that are
+ * still in the buffer.
+ * 
+ * The buffer must be locked by ngx_http_sqlitelog_buf_lock().
+ * 
+ * @param   journal     the journal in question
+ * @param   half        the half returned by ngx_http_sqlitelog_journal_switch()
+ * @param   empty       a flag set to 1 if the buffer is empty
+ */
+void
+ngx_http_sqlitelog_journal_done(ngx_http_sqlitelog_journal_t *journal,
+    ngx_uint_t half, ngx_flag_t empty)
+{
+    if (journal->busy[half] == 0) {
+        return;
+    }
+    
+    journal->busy[half]--;
+    
+    if (journal->busy[half] == 0 && (half != journal->active || empty)) {
+        ngx_http_sqlitelog_journal_clear(journal, half);
+    }
+}
+
+
+/**
+ * Get the start of one of the journal's halves.
+ * 
+ * @param   journal     the journal in question
+ * @param   half        the index of the half
+ * @return              the address of the half's first record
+ */
+static u_char *
+ngx_http_sqlitelog_journal_half(ngx_http_sqlitelog_journal_t *journal,
+    ngx_uint_t half)
+{
+    return (u_char *) journal + NGX_HTTP_SQLITELOG_JOURNAL_HEADER
+           + half * journal->size;
+}
+
+
+/**
+ * Clear one of the journal's halves, by moving on to the next generation so
+ * that its records no longer count.
+ * 
+ * @param   journal     the journal in question
+ * @param   half        the index of the half
+ */
+static void
+ngx_http_sqlitelog_journal_clear(ngx_http_sqlitelog_journal_t *journal,
+    ngx_uint_t half)
+{
+    journal->gen[half]++;
+    ngx_memory_barrier();
+    journal->off[half] = 0;
+}
+
+
+/**
+ * Compute a record's CRC, which covers the record from its generation to the
+ * end of its padding.
+ * 
+ * @param   rec     the record in question
+ * @return          the CRC32
+ */
+static uint32_t
+ngx_http_sqlitelog_journal_crc(ngx_http_sqlitelog_journal_rec_t *rec)
+{
+    uint32_t  crc;
+    
+    ngx_crc32_init(crc);
+    ngx_crc32_update(&crc, (u_char *) &rec->gen,
+                     rec->len - offsetof(ngx_http_sqlitelog_journal_rec_t,
+                                         gen));
+    ngx_crc32_final(crc);
+    
+    return crc;
+}
+
+
+/**
+ * Compare two log entries read from the journal by sequence number, which
+ * may have wrapped around.
+ * 
+ * @param   one     the first log entry (ngx_http_sqlitelog_journal_entry_t)
+ * @param   two     the second log entry (ngx_http_sqlitelog_journal_entry_t)
+ * @return          a negative number, 0, or a positive number if the first
+ *                  log entry comes before, with, or after the second
+ */
+static int ngx_libc_cdecl
+ngx_http_sqlitelog_journal_cmp(const void *one, const void *two)
+{
+    ngx_atomic_int_t                           d;
+    const ngx_http_sqlitelog_journal_entry_t  *a;
+    const ngx_http_sqlitelog_journal_entry_t  *b;
+    
+    a = one;
+    b = two;
+    d = (ngx_atomic_int_t) (ngx_atomic_uint_t) (a->seq - b->seq);
+    
+    return (d > 0) - (d < 0);
+}
@@ -0,0 +1,136 @@
+
+/*
+ * Copyright (C) Serope.com
+ * 
+ * The journal keeps a copy of a persistent buffer's log entries in a file, so
+ * that the entries that are still in the buffer when Nginx crashes or is
+ * killed aren't lost. The file is mapped into memory by the master process,
+ * and its mapping is shared by the worker processes it forks.
+ * 
+ * The file has a header and two halves, each as large as the buffer's zone.
+ * Every log entry that's pushed to the buffer is also appended to the active
+ * half as a record:
+ * 
+ *  magic | crc | gen | seq | len | table | nelts | sig | lengths... | data...
+ * 
+ * The magic number is written last, and the CRC covers the rest of the
+ * record, so that a record that was being written when its process died is
+ * ignored. A record only counts if its gen matches the half's, which is
+ * incremented every time the half is cleared, so that records left over from
+ * before the half was cleared are ignored too.
+ * 
+ * When the buffer is listed for a transaction, the other half becomes the
+ * active half, if it's not still in use. A half is cleared once every
+ * transaction that took log entries from it has committed, and it's no
+ * longer active (or the buffer is empty). So, at any time, the journal holds
+ * every log entry that's in the buffer or in an uncommitted transaction.
+ * 
+ * When Nginx starts, the master process reads the valid records of both
+ * halves, clears the journal, and pushes the records back to the buffer in
+ * order of their sequence numbers. The first worker process then commits
+ * them.
+ */
+
+
+#pragma once
+
+
+#include <ngx_core.h>
+
+
+#include "ngx_http_sqlitelog_db.h"
+#include "ngx_http_sqlitelog_node.h"
+
+
+/* "SQLJ" and "SQLR", the file's and the records' magic numbers */
+#define NGX_HTTP_SQLITELOG_JOURNAL_MAGIC     0x4a4c5153
+#define NGX_HTTP_SQLITELOG_JOURNAL_RECORD    0x524c5153
+#define NGX_HTTP_SQLITELOG_JOURNAL_VERSION   2
+
+/* Size reserved for the file's header, ahead of the halves */
+#define NGX_HTTP_SQLITELOG_JOURNAL_HEADER    4096
+
+
+/*
+ * ngx_http_sqlitelog_journal_t is the header at the start of the journal
+ * file, which is shared by all worker processes through the mapping.
+ * 
+ * magic        NGX_HTTP_SQLITELOG_JOURNAL_MAGIC
+ * version      NGX_HTTP_SQLITELOG_JOURNAL_VERSION
+ * size         the size of each half
+ * active       the index of the half to which records are appended
+ * off          the offset at which each half's next record is appended,
+ *              which may exceed the size once the half is full
+ * busy         the amount of uncommitted transactions that took log entries
+ *              from each half
+ * gen          the generation of each half's records
+ * 
+ * Appends to the active half reserve their space atomically, so they only
+ * need their shard to be locked. Everything else requires the whole buffer
+ * to be locked.
+ */
+typedef struct {
+    uint32_t                       magic;
+    uint32_t                       version;
+    uint64_t                       size;
+    ngx_atomic_t                   active;
+    ngx_atomic_t                   off[2];
+    ngx_atomic_t                   busy[2];
+    ngx_atomic_t                   gen[2];
+} ngx_http_sqlitelog_journal_t;
+
+
+/*
+ * ngx_http_sqlitelog_journal_rec_t is the header of a record, which is
+ * followed by a 32-bit length per element (0xffffffff for NULL) and then by
+ * the elements' data. Records are padded to a multiple of 8 bytes.
+ * 
+ * magic        NGX_HTTP_SQLITELOG_JOURNAL_RECORD
+ * crc          the CRC32 of the record, from gen to the end of the data
+ * gen          the generation of the half when the record was appended
+ * seq          the log entry's sequence number in the buffer
+ * len          the record's length, including its header and padding
+ * table        the index of the log entry's table in the database
+ * nelts        the amount of elements
+ * sig          the signature of the tables of the configuration that pushed
+ *              the log entry
+ */
+typedef struct {
+    uint32_t                       magic;
+    uint32_t                       crc;
+    uint64_t                       gen;
+    uint64_t                       seq;
+    uint32_t                       len;
+    uint32_t                       table;
+    uint32_t                       nelts;
+    uint32_t                       sig;
+} ngx_http_sqlitelog_journal_rec_t;
+
+
+/*
+ * ngx_http_sqlitelog_journal_entry_t is a log entry read from the journal.
+ * 
+ * seq          the log entry's sequence number
+ * sig          the signature of the log entry's tables
+ * entry        the log entry, in local memory
+ */
+typedef struct {
+    uint64_t                       seq;
+    uint32_t                       sig;
+    ngx_http_sqlitelog_entry_t     entry;
+} ngx_http_sqlitelog_journal_entry_t;
+
+
+ngx_http_sqlitelog_journal_t *ngx_http_sqlitelog_journal_open(ngx_str_t *path,
+    size_t size, ngx_log_t *log);
+ngx_int_t ngx_http_sqlitelog_journal_recover(
+    ngx_http_sqlitelog_journal_t *journal, size_t size, ngx_pool_t *pool,
+    ngx_array_t *entries, ngx_log_t *log);
+
+ngx_int_t ngx_http_sqlitelog_journal_append(
+    ngx_http_sqlitelog_journal_t *journal, ngx_http_sqlitelog_node_t *node,
+    ngx_log_t *log);
+ngx_uint_t ngx_http_sqlitelog_journal_switch(
+    ngx_http_sqlitelog_journal_t *journal);
+void ngx_http_sqlitelog_journal_done(ngx_http_sqlitelog_journal_t *journal,
+    ngx_uint_t half, ngx_flag_t empty);
@@ -0,0 +1,345 @@
+
+/*
+ * Copyright (C) Serope.com
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <sqlite3.h>
+
+
+#include "ngx_http_sqlitelog_mem.h"
+
+
+/* Size of the header in front of each allocation, which holds its size */
+#define NGX_HTTP_SQLITELOG_MEM_HDR           8
+
+
+static void *ngx_http_sqlitelog_mem_malloc(int n);
+static void ngx_http_sqlitelog_mem_free(void *p);
+static void *ngx_http_sqlitelog_mem_realloc(void *p, int n);
+static int ngx_http_sqlitelog_mem_size(void *p);
+static int ngx_http_sqlitelog_mem_roundup(int n);
+static int ngx_http_sqlitelog_mem_start(void *data);
+static void ngx_http_sqlitelog_mem_stop(void *data);
+static ngx_int_t ngx_http_sqlitelog_mem_reserve(size_t size);
+static void ngx_http_sqlitelog_mem_release(size_t size);
+
+
+/* Bytes allocated through the module's allocator in this process */
+static ngx_atomic_t   ngx_http_sqlitelog_mem_in_use;
+
+/* The allocator's limit, in bytes */
+static size_t         ngx_http_sqlitelog_mem_limit;
+
+/* A flag set to 1 once SQLite uses the module's allocator */
+static ngx_flag_t     ngx_http_sqlitelog_mem_enabled;
+
+
+static sqlite3_mem_methods  ngx_http_sqlitelog_mem_methods = {
+    ngx_http_sqlitelog_mem_malloc,
+    ngx_http_sqlitelog_mem_free,
+    ngx_http_sqlitelog_mem_realloc,
+    ngx_http_sqlitelog_mem_size,
+    ngx_http_sqlitelog_mem_roundup,
+    ngx_http_sqlitelog_mem_start,
+    ngx_http_sqlitelog_mem_stop,
+    NULL
+};
+
+
+/**
+ * Configure SQLite's memory for this worker process: its allocator, its page
+ * cache, and the lookaside buffers of its connections.
+ * 
+ * If this fails, SQLite keeps the configuration that succeeded so far, and
+ * its defaults for the rest.
+ * 
+ * @param   mem     the memory configuration
+ * @param   log     an Nginx log for writing errors
+ * @return          NGX_OK on success, or
+ *                  NGX_ERROR on failure
+ */
+ngx_int_t
+ngx_http_sqlitelog_mem_init(ngx_http_sqlitelog_mem_t *mem, ngx_log_t *log)
+{
+    int      rc_config;
+    int      hdrsz;
+    void    *pool;
+    size_t   slot;
+    size_t   n;
+    
+    /* SQLite was initialized by the master process, before the fork */
+    rc_config = sqlite3_shutdown();
+    if (rc_config != SQLITE_OK) {
+        goto failed;
+    }
+    
+    /* Allocator */
+    ngx_http_sqlitelog_mem_limit = mem->limit;
+    
+    rc_config = sqlite3_config(SQLITE_CONFIG_MALLOC,
+                               &ngx_http_sqlitelog_mem_methods);
+    if (rc_config != SQLITE_OK) {
+        goto failed;
+    }
+    ngx_http_sqlitelog_mem_enabled = 1;
+    
+    rc_config = sqlite3_config(SQLITE_CONFIG_MEMSTATUS, 0);
+    if (rc_config != SQLITE_OK) {
+        goto failed;
+    }
+    
+    /* Page cache */
+    if (mem->pagecache) {
+        rc_config = sqlite3_config(SQLITE_CONFIG_PCACHE_HDRSZ, &hdrsz);
+        if (rc_config != SQLITE_OK) {
+            goto failed;
+        }
+    
+        slot = ngx_align(NGX_HTTP_SQLITELOG_MEM_PAGE + hdrsz, 8);
+        n = mem->pagecache / slot;
+    
+        pool = ngx_alloc(n * slot, log);
+        if (pool == NULL) {
+            return NGX_ERROR;
+        }
+    
+        rc_config = sqlite3_config(SQLITE_CONFIG_PAGECACHE, pool, (int) slot,
+                                   (int) n);
+        if (rc_config != SQLITE_OK) {
+            ngx_free(pool);
+            goto failed;
+        }
+    }
+    
+    /* Lookaside */
+    if (mem->lookaside_n != NGX_CONF_UNSET_UINT) {
+        rc_config = sqlite3_config(SQLITE_CONFIG_LOOKASIDE,
+                                   (int) mem->lookaside_size,
+                                   (int) mem->lookaside_n);
+        if (rc_config != SQLITE_OK) {
+            goto failed;
+        }
+    }
+    
+    rc_config = sqlite3_initialize();
+    if (rc_config != SQLITE_OK) {
+        goto failed;
+    }
+    
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, log, 0,
+                   "sqlitelog: memory limit %uz, page cache %uz, "
+                   "lookaside %ui", mem->limit, mem->pagecache,
+                   mem->lookaside_n);
+    
+    return NGX_OK;
+    
+failed:
+    
+    ngx_log_error(NGX_LOG_ERR, log, 0,
+                  "sqlitelog: failed to configure SQLite's memory due to "
+                  "\"%s\" (%d)", sqlite3_errstr(rc_config), rc_config);
+    return NGX_ERROR;
+}
+
+
+/**
+ * Get the amount of memory that SQLite has allocated from the heap in this
+ * process.
+ * 
+ * Without sqlitelog_memory, this is SQLite's own statistic, which is 0 if
+ * SQLite was built without memory statistics.
+ * 
+ * @return  the amount of memory in use, in bytes
+ */
+size_t
+ngx_http_sqlitelog_mem_used(void)
+{
+    if (ngx_http_sqlitelog_mem_enabled) {
+        return ngx_http_sqlitelog_mem_in_use;
+    }
+    return (size_t) sqlite3_memory_used();
+}
+
+
+/**
+ * Allocate memory for SQLite (xMalloc).
+ * 
+ * @param   n   the size of the allocation, already rounded up
+ * @return      a pointer to the memory, or
+ *              NULL if the limit is reached or the allocation fails
+ */
+static void *
+ngx_http_sqlitelog_mem_malloc(int n)
+{
+    u_char  *p;
+    size_t   size;
+    
+    size = (size_t) ngx_http_sqlitelog_mem_roundup(n);
+    
+    if (ngx_http_sqlitelog_mem_reserve(size) != NGX_OK) {
+        return NULL;
+    }
+    
+    p = ngx_alloc(size + NGX_HTTP_SQLITELOG_MEM_HDR, ngx_cycle->log);
+    if (p == NULL) {
+        ngx_http_sqlitelog_mem_release(size);
+        return NULL;
+    }
+    
+    *(size_t *) p = size;
+    return p + NGX_HTTP_SQLITELOG_MEM_HDR;
+}
+
+
+/**
+ * Free memory allocated for SQLite (xFree).
+ * 
+ * @param   p   a pointer returned by the allocator
+ */
+static void
+ngx_http_sqlitelog_mem_free(void *p)
+{
+    u_char  *h;
+    
+    h = (u_char *) p - NGX_HTTP_SQLITELOG_MEM_HDR;
+    
+    ngx_http_sqlitelog_mem_release(*(size_t *) h);
+    ngx_free(h);
+}
+
+
+/**
+ * Resize memory allocated for SQLite (xRealloc).
+ * 
+ * @param   p   a pointer returned by the allocator
+ * @param   n   the new size of the allocation, already rounded up
+ * @return      a pointer to the resized memory, or
+ *              NULL if the limit is reached or the allocation fails, in which
+ *              case the original memory is left as it was
+ */
+static void *
+ngx_http_sqlitelog_mem_realloc(void *p, int n)
+{
+    u_char  *h;
+    size_t   old;
+    size_t   size;
+    
+    h = (u_char *) p - NGX_HTTP_SQLITELOG_MEM_HDR;
+    old = *(size_t *) h;
+    size = (size_t) ngx_http_sqlitelog_mem_roundup(n);
+    
+    if (size > old
+        && ngx_http_sqlitelog_mem_reserve(size - old) != NGX_OK)
+    {
+        return NULL;
+    }
+    
+    h = realloc(h, size + NGX_HTTP_SQLITELOG_MEM_HDR);
+    if (h == NULL) {
+        if (size > old) {
+            ngx_http_sqlitelog_mem_release(size - old);
+        }
+        return NULL;
+    }
+    
+    if (size < old) {
+        ngx_http_sqlitelog_mem_release(old - size);
+    }
+    
+    *(size_t *) h = size;
+    return h + NGX_HTTP_SQLITELOG_MEM_HDR;
+}
+
+
+/**
+ * Get the size of memory allocated for SQLite (xSize).
+ * 
+ * @param   p   a pointer returned by the allocator
+ * @return      the size of the allocation
+ */
+static int
+ngx_http_sqlitelog_mem_size(void *p)
+{
+    return (int) *(size_t *) ((u_char *) p - NGX_HTTP_SQLITELOG_MEM_HDR);
+}
+
+
+/**
+ * Round up the size of an allocation (xRoundup).
+ * 
+ * @param   n   the requested size
+ * @return      the size rounded up to a multiple of 8
+ */
+static int
+ngx_http_sqlitelog_mem_roundup(int n)
+{
+    return (n + 7) & ~7;
+}
+
+
+/**
+ * Start the allocator (xInit). It has nothing to set up.
+ * 
+ * @param   data    unused
+ * @return          SQLITE_OK
+ */
+static int
+ngx_http_sqlitelog_mem_start(void *data)
+{
+    return SQLITE_OK;
+}
+
+
+/**
+ * Stop the allocator (xShutdown). It has nothing to tear down.
+ * 
+ * @param   data    unused
+ */
+static void
+ngx_http_sqlitelog_mem_stop(void *data)
+{
+    /* void */
+}
+
+
+/**
+ * Count an allocation against the limit.
+ * 
+ * The size is added first and taken back if it exceeds the limit, so that
+ * concurrent allocations in worker threads can't exceed the limit together.
+ * 
+ * @param   size    the size of the allocation
+ * @return          NGX_OK if the allocation is within the limit, or
+ *                  NGX_DECLINED if not
+ */
+static ngx_int_t
+ngx_http_sqlitelog_mem_reserve(size_t size)
+{
+    ngx_atomic_uint_t  old;
+    
+    old = ngx_atomic_fetch_add(&ngx_http_sqlitelog_mem_in_use,
+                               (ngx_atomic_int_t) size);
+    
+    if (old + size > ngx_http_sqlitelog_mem_limit) {
+        ngx_http_sqlitelog_mem_release(size);
+        return NGX_DECLINED;
+    }
+    
+    return NGX_OK;
+}
+
+
+/**
+ * Stop counting an allocation against the limit.
+ * 
+ * @param   size    the size of the allocation
+ */
+static void
+ngx_http_sqlitelog_mem_release(size_t size)
+{
+    (void) ngx_atomic_fetch_add(&ngx_http_sqlitelog_mem_in_use,
+                                -(ngx_atomic_int_t) size);
+}
@@ -0,0 +1,57 @@
+
+/*
+ * Copyright (C) Serope.com
+ * 
+ * With the sqlitelog_memory directive, each worker process configures SQLite's
+ * memory before opening its databases:
+ * 
+ * 1. Heap allocations go through the module's allocator, which counts the
+ *    bytes in use with an atomic counter and fails allocations beyond the
+ *    limit. SQLite's own memory statistics are turned off, since they're kept
+ *    under a global mutex that every allocation of every thread would take.
+ * 2. The page cache draws its pages from a pool of fixed-size slots, which is
+ *    allocated once per worker process. Pages that don't fit in the pool come
+ *    from the heap.
+ * 3. Every connection gets a lookaside buffer of the given size, from which
+ *    SQLite takes the small, short-lived objects of its statements.
+ * 
+ * SQLite is configured by shutting it down and initializing it again, which is
+ * only possible while no connection is open. So this must happen when the
+ * worker process starts, before the first connection is opened.
+ */
+
+
+#pragma once
+
+
+#include <ngx_core.h>
+
+
+/* Smallest memory limit accepted by the sqlitelog_memory directive */
+#define NGX_HTTP_SQLITELOG_MEM_MIN           (1024 * 1024)
+
+/* Page size that the page cache's slots are sized for, SQLite's default */
+#define NGX_HTTP_SQLITELOG_MEM_PAGE          4096
+
+
+/*
+ * ngx_http_sqlitelog_mem_t is the memory configuration of the worker
+ * processes, set by the sqlitelog_memory directive.
+ * 
+ * limit            the most memory SQLite may allocate from the heap, in bytes
+ * pagecache        the size of the page cache's pool, in bytes, or 0 for none
+ * lookaside_size   the size of each lookaside slot, in bytes
+ * lookaside_n      the number of lookaside slots per connection, or
+ *                  NGX_CONF_UNSET_UINT to keep SQLite's default
+ */
+typedef struct {
+    size_t                     limit;
+    size_t                     pagecache;
+    size_t                     lookaside_size;
+    ngx_uint_t                 lookaside_n;
+} ngx_http_sqlitelog_mem_t;
+
+
+ngx_int_t ngx_http_sqlitelog_mem_init(ngx_http_sqlitelog_mem_t *mem,
+    ngx_log_t *log);
+size_t ngx_http_sqlitelog_mem_used(void);
@@ -11,108 +11,220 @@
 #include <stdio.h>
 
 #include "ngx_http_sqlitelog_buf.h"
+#include "ngx_http_sqlitelog_ckpt.h"
 #include "ngx_http_sqlitelog_col.h"
 #include "ngx_http_sqlitelog_db.h"
 #include "ngx_http_sqlitelog_file.h"
 #include "ngx_http_sqlitelog_fmt.h"
+#include "ngx_http_sqlitelog_mem.h"
 #include "ngx_http_sqlitelog_op.h"
+#include "ngx_http_sqlitelog_retention.h"
+#include "ngx_http_sqlitelog_rollup.h"
 #include "ngx_http_sqlitelog_sql.h"
 #include "ngx_http_sqlitelog_thread.h"
 #include "ngx_http_sqlitelog_util.h"
 
 
+/* Default time that an exiting worker process may spend on its databases */
+#define NGX_HTTP_SQLITELOG_DRAIN_TIMEOUT     10000
+
+
 /*
  * ngx_http_sqlitelog_main_conf_t holds all defined log formats (including the
- * predefined combined format) and the thread pool named by sqlitelog_async,
- * if given.
+ * predefined combined format), the thread pool named by sqlitelog_async, if
+ * given, the deadline for draining the databases when a worker exits, and
+ * SQLite's memory configuration, if set by sqlitelog_memory.
  * 
  * formats          an array of log formats (ngx_http_sqlitelog_fmt_t)
+ * rollups          an array of rollup tables (ngx_http_sqlitelog_rollup_t)
+ * dbs              an array of all database files (ngx_http_sqlitelog_db_t *)
+ * logs             an array of all sqlitelogs (ngx_http_sqlitelog_t *)
+ * nvalues          the number of distinct column operations in all formats
  * combined_init    a flag set to 1 if "combined" format has been initialized
  * tp               a thread pool set by sqlitelog_async
+ * drain_timeout    the time that an exiting worker process may spend on its
+ *                  databases, in msec, or 0 for no limit
+ * mem              SQLite's memory configuration, or NULL to keep SQLite's
+ *                  defaults
  */
 typedef struct {
     ngx_array_t                 formats;
+    ngx_array_t                 rollups;
+    ngx_array_t                 dbs;
+    ngx_array_t                 logs;
+    ngx_uint_t                  nvalues;
     ngx_flag_t                  combined_init;
 #if (NGX_THREADS)
     ngx_thread_pool_t          *tp;
 #else
     void                       *tp; /* unused */
 #endif
+    ngx_msec_t                  drain_timeout;
+    ngx_http_sqlitelog_mem_t   *mem;
 } ngx_http_sqlitelog_main_conf_t;
 
 
 /*
- * ngx_http_sqlitelog_srv_conf_t represents an instance of the sqlitelog
- * directive. This configuration can exist in both http contexts and server
- * contexts.
+ * ngx_http_sqlitelog_t represents an instance of the sqlitelog directive.
+ * Contexts that inherit a sqlitelog share the same instance.
+ * 
+ * Every sqlitelog that writes to the same file shares that file's database,
+ * and therefore its connection, its transaction buffer, and its rollup. The
+ * database's enabled flag is set to 1 during merging if at least one context
+ * logs to it, and reset to 0 for the worker process if a SQLite error occurs.
+ * 
+ * db            the database associated with this sqlitelog
+ * fmt           the log format, i.e. the table written to
+ * table         the index of the table in the database
+ * rollup        a flag set to 1 if this sqlitelog feeds the database's rollup
+ * filter        a logging condition
+ * retention     an optional policy for deleting old log entries
+ * sample        the sampling rate of successful requests, in 1/10000ths
+ * sample_errors the sampling rate of 4xx and 5xx requests, in 1/10000ths
+ */
+typedef struct {
+    ngx_http_sqlitelog_db_t          *db;
+    ngx_http_sqlitelog_fmt_t         *fmt;
+    ngx_uint_t                        table;
+    ngx_flag_t                        rollup;
+    ngx_http_complex_value_t         *filter;
+    ngx_http_sqlitelog_retention_t   *retention;
+    ngx_uint_t                        sample;
+    ngx_uint_t                        sample_errors;
+} ngx_http_sqlitelog_t;
+
+
+/*
+ * ngx_http_sqlitelog_loc_conf_t holds the sqlitelogs of an http, server, or
+ * location context.
  * 
  * The enabled flag has a value of either 0, 1, or NGX_CONF_UNSET to indicate
  * that the sqlitelog directive is off, on, or unused in the current context,
- * respectively.
+ * respectively. A context where it's unused, and that has no sqlitelog to
+ * inherit, stays NGX_CONF_UNSET after merging, so that its locations can still
+ * define their own; only an explicit "sqlitelog off" disables them.
  * 
  * enabled       a flag set to 0, 1, or NGX_CONF_UNSET
- * db            the database associated with this sqlitelog
- * buf           a buffer for holding multiple log entries
- * filter        a logging condition
+ * logs          the sqlitelogs used by this context (ngx_http_sqlitelog_t *)
+ */
+typedef struct {
+    ngx_flag_t                        enabled;
+    ngx_array_t                      *logs;
+} ngx_http_sqlitelog_loc_conf_t;
+
+
+/*
+ * ngx_http_sqlitelog_values_t caches the variable values of the current
+ * request, so that a variable used by several sqlitelogs is only evaluated
+ * once. Each column refers to its value by its value field.
+ * 
+ * values        one value per distinct column operation (ngx_str_t)
+ * done          one flag per value, set to 1 once it has been evaluated
+ * n             the number of values
  */
 typedef struct {
-    ngx_flag_t                  enabled; 
-    ngx_http_sqlitelog_db_t     db;
-    ngx_http_sqlitelog_buf_t   *buf;
-    ngx_http_complex_value_t   *filter;
-} ngx_http_sqlitelog_srv_conf_t;
+    ngx_str_t                        *values;
+    u_char                           *done;
+    ngx_uint_t                        n;
+} ngx_http_sqlitelog_values_t;
 
 #if (NGX_THREADS)
 static char* ngx_http_sqlitelog_async(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
 static ngx_int_t ngx_http_sqlitelog_handle_1_async(ngx_http_request_t *r,
-    ngx_array_t *log_entry, ngx_pool_t *pool);
+    ngx_http_sqlitelog_t *slog, ngx_array_t *log_entry, ngx_pool_t *pool);
 static ngx_int_t ngx_http_sqlitelog_handle_n_async(ngx_http_request_t *r,
-    ngx_array_t *log_entry, ngx_pool_t *pool);
+    ngx_http_sqlitelog_t *slog, ngx_array_t *log_entry, ngx_pool_t *pool);
 #endif
 
 static char* ngx_http_sqlitelog(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
-static char* ngx_http_sqlitelog_opt_format(ngx_conf_t *cf, ngx_str_t arg);
+static char* ngx_http_sqlitelog_opt_format(ngx_conf_t *cf, ngx_str_t arg,
+    ngx_http_sqlitelog_fmt_t **fmtp);
 static char* ngx_http_sqlitelog_opt_buffer(ngx_conf_t *cf, ngx_str_t arg,
     ssize_t *sizep);
 static char* ngx_http_sqlitelog_opt_max(ngx_conf_t *cf, ngx_str_t arg,
     ngx_int_t *max);
 static char* ngx_http_sqlitelog_opt_flush(ngx_conf_t *cf, ngx_str_t arg,
     ngx_msec_t *flush);
-static char* ngx_http_sqlitelog_opt_init(ngx_conf_t *cf, ngx_str_t arg);
-static char* ngx_http_sqlitelog_opt_if(ngx_conf_t *cf, ngx_str_t arg);
+static char* ngx_http_sqlitelog_opt_adaptive(ngx_conf_t *cf, ngx_str_t arg,
+    ngx_msec_t *adaptive);
+static char* ngx_http_sqlitelog_opt_init(ngx_conf_t *cf, ngx_str_t arg,
+    ngx_str_t *sqlp);
+static char* ngx_http_sqlitelog_opt_if(ngx_conf_t *cf, ngx_str_t arg,
+    ngx_http_complex_value_t **filter);
+static char* ngx_http_sqlitelog_opt_retention(ngx_conf_t *cf, ngx_str_t arg,
+    time_t *ttl);
+static char* ngx_http_sqlitelog_opt_retention_column(ngx_conf_t *cf,
+    ngx_str_t arg, ngx_str_t *column);
+static char* ngx_http_sqlitelog_opt_rollup(ngx_conf_t *cf, ngx_str_t arg,
+    ngx_http_sqlitelog_rollup_t **rollup);
+static char* ngx_http_sqlitelog_opt_sample(ngx_conf_t *cf, ngx_str_t arg,
+    ngx_uint_t *rate);
+static char* ngx_http_sqlitelog_opt_index_mode(ngx_conf_t *cf, ngx_str_t arg,
+    ngx_flag_t *deferred);
+static char* ngx_http_sqlitelog_opt_persist(ngx_conf_t *cf, ngx_str_t arg,
+    ngx_str_t *path);
+static char* ngx_http_sqlitelog_opt_checkpoint(ngx_conf_t *cf, ngx_str_t arg,
+    ngx_msec_t *interval);
 static char* ngx_http_sqlitelog_format(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
+static char* ngx_http_sqlitelog_rollup(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+static char* ngx_http_sqlitelog_rollup_var(ngx_conf_t *cf, ngx_str_t arg,
+    ngx_array_t *vars, ngx_uint_t type);
+static char* ngx_http_sqlitelog_index(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+static char* ngx_http_sqlitelog_memory(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+static char* ngx_http_sqlitelog_opt_lookaside(ngx_conf_t *cf, ngx_str_t arg,
+    ngx_http_sqlitelog_mem_t *mem);
 
 static ngx_int_t ngx_http_sqlitelog_handler(ngx_http_request_t *r);
+static ngx_int_t ngx_http_sqlitelog_log(ngx_http_request_t *r,
+    ngx_http_sqlitelog_t *slog, ngx_http_sqlitelog_values_t *values);
+static ngx_flag_t ngx_http_sqlitelog_sampled(ngx_http_request_t *r,
+    ngx_http_sqlitelog_t *slog);
 static ngx_array_t *ngx_http_sqlitelog_log_entry(ngx_http_request_t *r,
-    ngx_array_t columns, ngx_pool_t *pool);
+    ngx_array_t columns, ngx_http_sqlitelog_values_t *values,
+    ngx_pool_t *pool);
 static ngx_int_t ngx_http_sqlitelog_handle_1(ngx_http_request_t *r,
-    ngx_array_t *log_entry, ngx_pool_t *pool);
+    ngx_http_sqlitelog_t *slog, ngx_array_t *log_entry, ngx_pool_t *pool);
 static ngx_int_t ngx_http_sqlitelog_handle_n(ngx_http_request_t *r,
-    ngx_array_t *log_entry, ngx_pool_t *pool);
+    ngx_http_sqlitelog_t *slog, ngx_array_t *log_entry, ngx_pool_t *pool);
+
+static ngx_http_sqlitelog_db_t *ngx_http_sqlitelog_add_db(ngx_conf_t *cf,
+    ngx_str_t filename);
 
 static void *ngx_http_sqlitelog_create_main_conf(ngx_conf_t *cf);
-static void *ngx_http_sqlitelog_create_srv_conf(ngx_conf_t *cf);
-static char *ngx_http_sqlitelog_merge_srv_conf(ngx_conf_t *cf, void *parent,
+static char *ngx_http_sqlitelog_init_main_conf(ngx_conf_t *cf, void *conf);
+static void *ngx_http_sqlitelog_create_loc_conf(ngx_conf_t *cf);
+static char *ngx_http_sqlitelog_merge_loc_conf(ngx_conf_t *cf, void *parent,
     void *child);
 static ngx_shm_zone_t *ngx_http_sqlitelog_shm_zone(ngx_conf_t *cf, ssize_t size,
-    ngx_str_t format, ngx_str_t filename);
+    ngx_str_t filename);
 static ngx_int_t ngx_http_sqlitelog_init_shm_zone(ngx_shm_zone_t *shm_zone,
     void *old_data);
+static ngx_shm_zone_t *ngx_http_sqlitelog_old_shm_zone(
+    ngx_shm_zone_t *shm_zone);
 
+static ngx_int_t ngx_http_sqlitelog_add_variables(ngx_conf_t *cf);
+static ngx_int_t ngx_http_sqlitelog_variable_mem_used(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data);
 static ngx_int_t ngx_http_sqlitelog_init(ngx_conf_t *cf);
+static ngx_int_t ngx_http_sqlitelog_init_module(ngx_cycle_t *cycle);
 static ngx_int_t ngx_http_sqlitelog_init_worker(ngx_cycle_t *cycle);
 static void ngx_http_sqlitelog_exit_worker(ngx_cycle_t *cycle);
+static ngx_msec_t ngx_http_sqlitelog_drain_left(
+    ngx_http_sqlitelog_main_conf_t *lmcf, ngx_msec_t deadline);
 static void ngx_http_sqlitelog_exit_master(ngx_cycle_t *cycle);
 
 
 static ngx_command_t  ngx_http_sqlitelog_commands[] = {
     { ngx_string("sqlitelog"),
-      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_CONF_1MORE,
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_1MORE,
       ngx_http_sqlitelog,
-      NGX_HTTP_SRV_CONF_OFFSET,
+      NGX_HTTP_LOC_CONF_OFFSET,
       0,
       NULL },
     
@@ -123,6 +235,34 @@ static ngx_command_t  ngx_http_sqlitelog_commands[] = {
       0,
       NULL },
     
+    { ngx_string("sqlitelog_rollup"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_1MORE,
+      ngx_http_sqlitelog_rollup,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      0,
+      NULL },
+    
+    { ngx_string("sqlitelog_index"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_2MORE,
+      ngx_http_sqlitelog_index,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      0,
+      NULL },
+    
+    { ngx_string("sqlitelog_drain_timeout"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_msec_slot,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      offsetof(ngx_http_sqlitelog_main_conf_t, drain_timeout),
+      NULL },
+    
+    { ngx_string("sqlitelog_memory"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_1MORE,
+      ngx_http_sqlitelog_memory,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      0,
+      NULL },
+    
 #if (NGX_THREADS)
     { ngx_string("sqlitelog_async"),
       NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE1,
@@ -136,18 +276,27 @@ static ngx_command_t  ngx_http_sqlitelog_commands[] = {
 };
 
 
+static ngx_http_variable_t  ngx_http_sqlitelog_variables[] = {
+    { ngx_string("sqlitelog_mem_used"), NULL,
+      ngx_http_sqlitelog_variable_mem_used, 0,
+      NGX_HTTP_VAR_NOCACHEABLE, 0 },
+    
+      ngx_http_null_variable
+};
+
+
 static ngx_http_module_t  ngx_http_sqlitelog_module_ctx = {
-    NULL,                                  /* preconfiguration */
+    ngx_http_sqlitelog_add_variables,      /* preconfiguration */
     ngx_http_sqlitelog_init,               /* postconfiguration */
 
     ngx_http_sqlitelog_create_main_conf,   /* create main configuration */
-    NULL,                                  /* init main configuration */
+    ngx_http_sqlitelog_init_main_conf,     /* init main configuration */
 
-    ngx_http_sqlitelog_create_srv_conf,    /* create server configuration */
-    ngx_http_sqlitelog_merge_srv_conf,     /* merge server configuration */
+    NULL,                                  /* create server configuration */
+    NULL,                                  /* merge server configuration */
 
-    NULL,                                  /* create location configuration */
-    NULL                                   /* merge location configuration */
+    ngx_http_sqlitelog_create_loc_conf,    /* create location configuration */
+    ngx_http_sqlitelog_merge_loc_conf      /* merge location configuration */
 };
 
 
@@ -157,7 +306,7 @@ ngx_module_t  ngx_http_sqlitelog_module = {
     ngx_http_sqlitelog_commands,           /* module directives */
     NGX_HTTP_MODULE,                       /* module type */
     NULL,                                  /* init master */
-    NULL,                                  /* init module */
+    ngx_http_sqlitelog_init_module,        /* init module */
     ngx_http_sqlitelog_init_worker,        /* init process */
     NULL,                                  /* init thread */
     NULL,                                  /* exit thread */
@@ -167,6 +316,63 @@ ngx_module_t  ngx_http_sqlitelog_module = {
 };
 
 
+/**
+ * Add this module's variables.
+ * 
+ * @param   cf  the current Nginx configuration file
+ * @return      NGX_OK on success,
+ *              NGX_ERROR on error
+ */
+static ngx_int_t
+ngx_http_sqlitelog_add_variables(ngx_conf_t *cf)
+{
+    ngx_http_variable_t  *var;
+    ngx_http_variable_t  *v;
+    
+    for (v = ngx_http_sqlitelog_variables; v->name.len; v++) {
+        var = ngx_http_add_variable(cf, &v->name, v->flags);
+        if (var == NULL) {
+            return NGX_ERROR;
+        }
+        var->get_handler = v->get_handler;
+        var->data = v->data;
+    }
+    
+    return NGX_OK;
+}
+
+
+/**
+ * Get the value of $sqlitelog_mem_used, the amount of memory that SQLite has
+ * allocated from the heap in the current worker process, in bytes.
+ * 
+ * @param   r       the current request
+ * @param   v       the variable's value
+ * @param   data    unused
+ * @return          NGX_OK on success,
+ *                  NGX_ERROR on error
+ */
+static ngx_int_t
+ngx_http_sqlitelog_variable_mem_used(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data)
+{
+    u_char  *p;
+    
+    p = ngx_pnalloc(r->pool, NGX_SIZE_T_LEN);
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+    
+    v->len = ngx_sprintf(p, "%uz", ngx_http_sqlitelog_mem_used()) - p;
+    v->valid = 1;
+    v->no_cacheable = 0;
+    v->not_found = 0;
+    v->data = p;
+    
+    return NGX_OK;
+}
+
+
 /**
  * Initialize the module.
  * 
@@ -180,8 +386,67 @@ ngx_module_t  ngx_http_sqlitelog_module = {
 static ngx_int_t
 ngx_http_sqlitelog_init(ngx_conf_t *cf)
 {
+    ngx_uint_t                       i;
+    ngx_uint_t                       j;
+    ngx_uint_t                       k;
+    ngx_array_t                      ops;
     ngx_http_handler_pt             *h;
+    ngx_http_sqlitelog_op_t        **op;
+    ngx_http_sqlitelog_db_t        **dbp;
+    ngx_http_sqlitelog_col_t        *col;
+    ngx_http_sqlitelog_fmt_t        *fmt;
     ngx_http_core_main_conf_t       *cmc;
+    ngx_http_sqlitelog_main_conf_t  *lmcf;
+    
+    lmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_sqlitelog_module);
+    fmt = lmcf->formats.elts;
+    dbp = lmcf->dbs.elts;
+    
+    /*
+     * Number the distinct column operations across all formats, so that the
+     * handler can cache their values per request. Two columns share a value if
+     * they get the same variable in the same way. The combined format is
+     * skipped unless it's been initialized.
+     */
+    if (ngx_array_init(&ops, cf->temp_pool, 8,
+                       sizeof(ngx_http_sqlitelog_op_t *))
+        != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+    
+    for (i = (lmcf->combined_init ? 0 : 1); i < lmcf->formats.nelts; i++) {
+        col = fmt[i].columns.elts;
+        for (j = 0; j < fmt[i].columns.nelts; j++) {
+            op = ops.elts;
+            for (k = 0; k < ops.nelts; k++) {
+                if (op[k]->getlen == col[j].op.getlen
+                    && op[k]->run == col[j].op.run
+                    && op[k]->index == col[j].op.index)
+                {
+                    break;
+                }
+            }
+            
+            if (k == ops.nelts) {
+                op = ngx_array_push(&ops);
+                if (op == NULL) {
+                    return NGX_ERROR;
+                }
+                *op = &col[j].op;
+            }
+            
+            col[j].value = k;
+        }
+    }
+    lmcf->nvalues = ops.nelts;
+    
+    /* Buffered log entries are signed with their tables' layout */
+    for (i = 0; i < lmcf->dbs.nelts; i++) {
+        if (dbp[i]->buf) {
+            dbp[i]->buf->sig = ngx_http_sqlitelog_db_sig(dbp[i]);
+        }
+    }
     
     cmc = ngx_http_conf_get_module_main_conf(cf, ngx_http_core_module);
     h = ngx_array_push(&cmc->phases[NGX_HTTP_LOG_PHASE].handlers);
@@ -204,30 +469,73 @@ ngx_http_sqlitelog_init(ngx_conf_t *cf)
 static ngx_int_t
 ngx_http_sqlitelog_handler(ngx_http_request_t *r)
 {
-    int                              rc_close;
-    ngx_int_t                      (*handle_entry) (ngx_http_request_t *r,
-                                     ngx_array_t *log_entry, ngx_pool_t *pool);
-    ngx_str_t                        condition;
-    ngx_pool_t                      *pool;
-    ngx_array_t                     *log_entry;
-    ngx_http_sqlitelog_srv_conf_t   *lscf;
+    ngx_int_t                        rc;
+    ngx_uint_t                       i;
+    ngx_http_sqlitelog_t           **slogp;
+    ngx_http_sqlitelog_values_t      values;
+    ngx_http_sqlitelog_loc_conf_t   *llcf;
     ngx_http_sqlitelog_main_conf_t  *lmcf;
     
-    lscf = ngx_http_get_module_srv_conf(r, ngx_http_sqlitelog_module);
+    llcf = ngx_http_get_module_loc_conf(r, ngx_http_sqlitelog_module);
     lmcf = ngx_http_get_module_main_conf(r, ngx_http_sqlitelog_module);
-    handle_entry = NULL;
+    rc = NGX_OK;
     
     /* Enabled check */
-    if (lscf->enabled == 0) {
+    if (llcf->enabled != 1) {
         return NGX_OK;
     }
     ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
                    "sqlitelog: handler, server=\"%V\", request=\"%V\"",
                    &r->headers_in.server, &r->request_line);
     
+    /* Variable values are evaluated on demand, and at most once */
+    values.values = NULL;
+    values.done = NULL;
+    values.n = lmcf->nvalues;
+    
+    /* Log to each destination */
+    slogp = llcf->logs->elts;
+    for (i = 0; i < llcf->logs->nelts; i++) {
+        if (slogp[i]->db->enabled == 0) {
+            continue;
+        }
+        if (ngx_http_sqlitelog_log(r, slogp[i], &values) != NGX_OK) {
+            rc = NGX_ERROR;
+        }
+    }
+    
+    return rc;
+}
+
+
+/**
+ * Write the current web request to one of the sqlitelogs in its context.
+ * 
+ * @param   r       the current request
+ * @param   slog    the sqlitelog
+ * @param   values  the request's variable values, shared by all sqlitelogs
+ * @return          NGX_OK on success,
+ *                  NGX_ERROR if an error occurs
+ */
+static ngx_int_t
+ngx_http_sqlitelog_log(ngx_http_request_t *r, ngx_http_sqlitelog_t *slog,
+    ngx_http_sqlitelog_values_t *values)
+{
+    int                              rc_close;
+    ngx_int_t                      (*handle_entry) (ngx_http_request_t *r,
+                                     ngx_http_sqlitelog_t *slog,
+                                     ngx_array_t *log_entry, ngx_pool_t *pool);
+    ngx_str_t                        condition;
+    ngx_pool_t                      *pool;
+    ngx_array_t                     *log_entry;
+    ngx_http_sqlitelog_main_conf_t  *lmcf;
+    
+    lmcf = ngx_http_get_module_main_conf(r, ngx_http_sqlitelog_module);
+    handle_entry = NULL;
+    
     /* Condition */
-    if (lscf->filter) {
-        if (ngx_http_complex_value(r, lscf->filter, &condition) != NGX_OK) {
+    if (slog->filter) {
+        if (ngx_http_complex_value(r, slog->filter, &condition) != NGX_OK) {
             return NGX_ERROR;
         }
         if (ngx_str_is_false(&condition)) {
@@ -239,27 +547,32 @@ ngx_http_sqlitelog_handler(ngx_http_request_t *r)
                        "sqlitelog: condition passed");
     }
     
-    /*
-     * Choose a pool for allocating the log entry. If async is on, we must
-     * create a new pool because r->pool is unreliable (Nginx might destroy r
-     * before our thread handler has a chance to read from it).
-     */
-# if (NGX_THREADS)
-    if (lmcf->tp) {
-        pool = ngx_create_pool(NGX_DEFAULT_POOL_SIZE, r->connection->log);
-        if (pool == NULL) {
+    /* Rollup; it counts every request, whether it's sampled or not */
+    if (slog->rollup) {
+        if (ngx_http_sqlitelog_buf_rollup(slog->db->buf, r) != NGX_OK) {
             ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
-                          "sqlitelog: failed to allocate %z bytes for pool "
-                          "during request handler", NGX_DEFAULT_POOL_SIZE);
-            return NGX_ERROR;
+                          "sqlitelog: failed to add request to rollup \"%V\"",
+                          &slog->db->rollup->name);
         }
     }
-    else
-#endif
+    
+    /* Sampling */
+    if (!ngx_http_sqlitelog_sampled(r, slog)) {
+        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "sqlitelog: not sampled");
+        return NGX_OK;
+    }
+    
+    /*
+     * The log entry is allocated in the request's pool. If async is on, Nginx
+     * might destroy r before our thread handler has a chance to read from it,
+     * so the entry is copied into shared memory or into its thread task.
+     */
     pool = r->pool;
     
     /* Get log entry */
-    log_entry = ngx_http_sqlitelog_log_entry(r, lscf->db.fmt->columns, pool);
+    log_entry = ngx_http_sqlitelog_log_entry(r, slog->fmt->columns, values,
+                                             pool);
     if (log_entry == NULL) {
         ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
                       "sqlitelog: failed to get log entry for request, ",
@@ -273,7 +586,7 @@ ngx_http_sqlitelog_handler(ngx_http_request_t *r)
     /* Choose function for handling log entry */
     if (lmcf->tp) {
 #if (NGX_THREADS)
-        if (lscf->buf) {
+        if (slog->db->buf) {
             handle_entry = ngx_http_sqlitelog_handle_n_async;
         } else {
             handle_entry = ngx_http_sqlitelog_handle_1_async;
@@ -281,7 +594,7 @@ ngx_http_sqlitelog_handler(ngx_http_request_t *r)
 #endif
     }
     else {
-        if (lscf->buf) {
+        if (slog->db->buf) {
             handle_entry = ngx_http_sqlitelog_handle_n;
         } else {
             handle_entry = ngx_http_sqlitelog_handle_1;
@@ -292,10 +605,10 @@ ngx_http_sqlitelog_handler(ngx_http_request_t *r)
     ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
                    "sqlitelog: handler, handle log entry...");
     
-    if (handle_entry(r, log_entry, pool) != NGX_OK) {
+    if (handle_entry(r, slog, log_entry, pool) != NGX_OK) {
         ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
                       "sqlitelog: failed to handle log entry "
-                      "for database \"%V\"", &lscf->db.filename);
+                      "for database \"%V\"", &slog->db->filename);
         goto failed;
     }
     
@@ -308,21 +621,59 @@ failed:
     ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
                   "sqlitelog: handler disabled for worker process %d",
                   ngx_getpid());
-    rc_close = ngx_http_sqlitelog_db_close(&lscf->db, r->connection->log);
+    rc_close = ngx_http_sqlitelog_db_close(slog->db, r->connection->log);
     if (rc_close != SQLITE_OK) {
         ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
                       "sqlitelog: handler failed to close database \"%V\"",
-                      &lscf->db.filename);
+                      &slog->db->filename);
     }
-    lscf->enabled = 0;
+    slog->db->enabled = 0;
+    
+    return NGX_ERROR;
+}
 
-#if (NGX_THREAD)
-    if (lmcf->tp) {
-        ngx_destroy_pool(pool);
+
+/**
+ * Decide whether the current request is sampled.
+ * 
+ * The decision is a hash of the connection's serial number and the request's
+ * position in the connection, so it's consistent for a given request and
+ * costs no string building. 4xx and 5xx responses use their own rate.
+ * 
+ * @param   r       the current request
+ * @param   slog    the sqlitelog
+ * @return          1 if the request should be logged, or 0 if not
+ */
+static ngx_flag_t
+ngx_http_sqlitelog_sampled(ngx_http_request_t *r, ngx_http_sqlitelog_t *slog)
+{
+    uint64_t    x;
+    ngx_uint_t  rate;
+    ngx_uint_t  status;
+    
+    if (r->err_status) {
+        status = r->err_status;
+    } else {
+        status = r->headers_out.status;
     }
-#endif
     
-    return NGX_ERROR;
+    rate = (status >= 400) ? slog->sample_errors : slog->sample;
+    
+    if (rate >= 10000) {
+        return 1;
+    }
+    if (rate == 0) {
+        return 0;
+    }
+    
+    /* splitmix64 finalizer */
+    x = ((uint64_t) r->connection->number << 32) ^ r->connection->requests;
+    x += 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    x = x ^ (x >> 31);
+    
+    return (x % 10000) < rate;
 }
 
 
@@ -330,27 +681,25 @@ failed:
  * Handle the current web request without a transaction queue.
  * 
  * @param   r           the current web request
+ * @param   slog        the sqlitelog
  * @param   log_entry   values to write to the database
  * @param   pool        a pool for object allocations
  * @return              NGX_OK on success,
  *                      NGX_ERROR if an error occurs
  */
 static ngx_int_t
-ngx_http_sqlitelog_handle_1(ngx_http_request_t *r, ngx_array_t *log_entry,
-    ngx_pool_t *pool)
+ngx_http_sqlitelog_handle_1(ngx_http_request_t *r, ngx_http_sqlitelog_t *slog,
+    ngx_array_t *log_entry, ngx_pool_t *pool)
 {
     int                             rc_insert;
-    ngx_http_sqlitelog_srv_conf_t  *lscf;
     
-    lscf = ngx_http_get_module_srv_conf(r, ngx_http_sqlitelog_module);
-    
-    rc_insert = ngx_http_sqlitelog_db_insert(&lscf->db, log_entry->elts,
-                                             log_entry->nelts,
+    rc_insert = ngx_http_sqlitelog_db_insert(slog->db, slog->table,
+                                             log_entry->elts, log_entry->nelts,
                                              r->connection->log);
     if (rc_insert != SQLITE_OK) {
         ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
                       "sqlitelog: handle 1 failed to insert record into "
-                      "database \"%V\"", &lscf->db.filename);
+                      "database \"%V\"", &slog->db->filename);
         return NGX_ERROR;
     }
     
@@ -362,72 +711,89 @@ ngx_http_sqlitelog_handle_1(ngx_http_request_t *r, ngx_array_t *log_entry,
  * Handle the current web request without a transaction queue in a worker
  * thread.
  * 
+ * The log entry is copied into the insert task that's waiting for the
+ * database's connection, or into a new one if there isn't one or it's full,
+ * so that the entries that arrive while a commit is in progress share the
+ * next commit.
+ * 
+ * Since the task owns its copy, the request isn't blocked: it's finalized
+ * right away, without waiting for the commit.
+ * 
  * @param   r           the current web request
+ * @param   slog        the sqlitelog
  * @param   log_entry   values to write to the database
- * @param   pool        a pool for object allocations
+ * @param   pool        the request's pool
  * @return              NGX_OK on success,
  *                      NGX_ERROR if an error occurs
  */
 #if (NGX_THREADS)
 static ngx_int_t
-ngx_http_sqlitelog_handle_1_async(ngx_http_request_t *r, ngx_array_t *log_entry,
-    ngx_pool_t *pool)
+ngx_http_sqlitelog_handle_1_async(ngx_http_request_t *r,
+    ngx_http_sqlitelog_t *slog, ngx_array_t *log_entry, ngx_pool_t *pool)
 {
     ngx_int_t                         rc_post;
     ngx_thread_task_t                *task;
-    ngx_http_sqlitelog_srv_conf_t    *lscf;
-    ngx_http_sqlitelog_main_conf_t   *lmcf;
+    ngx_http_sqlitelog_db_t          *db;
     ngx_http_sqlitelog_thread_ctx_t  *ctx;
     
-    lscf = ngx_http_get_module_srv_conf(r, ngx_http_sqlitelog_module);
-    lmcf = ngx_http_get_module_main_conf(r, ngx_http_sqlitelog_module);
+    db = slog->db;
     
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "sqlitelog: handle 1 async, log entry fields: %d",
-                   log_entry->nelts);
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "sqlitelog: handle 1 async, log_entry: %p",
-                   log_entry);
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "sqlitelog: handle 1 async, log entry fields: %d, "
+                   "pending: %p", log_entry->nelts, db->pending);
+    
+    /* Join the waiting insert, unless it's full */
+    if (db->pending) {
+        ctx = db->pending->ctx;
+        if (ctx->n < NGX_HTTP_SQLITELOG_THREAD_GROUP) {
+            if (ngx_http_sqlitelog_thread_push(ctx, slog->table, log_entry)
+                != NGX_OK)
+            {
+                return NGX_ERROR;
+            }
+            return NGX_OK;
+        }
+    }
     
-    task = ngx_thread_task_alloc(pool, sizeof(ngx_http_sqlitelog_thread_ctx_t));
+    /* Create a new insert, which waits behind the full one, if any */
+    task = ngx_http_sqlitelog_thread_task(db, r->connection->log);
     if (task == NULL) {
         return NGX_ERROR;
     }
     
     ctx = task->ctx;
-    ctx->db = lscf->db;
-    ctx->log_entry = log_entry;
-    ctx->buf = NULL;
-    ctx->pool = pool;
+    ctx->table = slog->table;
+    ctx->list = ngx_list_create(ctx->pool, 16,
+                                sizeof(ngx_http_sqlitelog_entry_t));
+    if (ctx->list == NULL) {
+        goto failed;
+    }
     
-    task->handler = ngx_http_sqlitelog_thread_insert_1_handler;
-    task->event.handler = ngx_http_sqlitelog_thread_completed_handler;
-    task->event.data = ctx;
-    task->event.log = ngx_cycle->log;
+    if (ngx_http_sqlitelog_thread_push(ctx, slog->table, log_entry) != NGX_OK) {
+        goto failed;
+    }
     
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "sqlitelog: handle 1 async, ctx->log_entry: %p",
-                   ctx->log_entry);
+    task->handler = ngx_http_sqlitelog_thread_insert_1_handler;
     
-    rc_post = ngx_thread_task_post(lmcf->tp, task);
+    db->pending = task;
+    rc_post = ngx_http_sqlitelog_thread_post(db, task);
     
     if (rc_post != NGX_OK) {
         ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
                       "sqlitelog: handle 1 async, rc_post: %d", rc_post);
-        return rc_post;
+        db->pending = NULL;
+        goto failed;
     }
     
-    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "sqlitelog: handle 1 async, rc_post: %d, task: %p, "
-                   "task->next: %p", rc_post, task, task->next);
-    
-    r->main->blocked++;
-    
-    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "sqlitelog: handle 1 async, r: %p, r->blocked: %d, "
-                   "r->main->blocked: %d", r, r->blocked, r->main->blocked);
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "sqlitelog: handle 1 async, rc_post: %d, task: %p",
+                   rc_post, task);
     
     return NGX_OK;
+    
+failed:
+    ngx_http_sqlitelog_thread_task_free(db, task);
+    return NGX_ERROR;
 }
 #endif
 
@@ -437,6 +803,7 @@ ngx_http_sqlitelog_handle_1_async(ngx_http_request_t *r, ngx_array_t *log_entry,
  * thread.
  * 
  * @param   r           the current web request
+ * @param   slog        the sqlitelog
  * @param   log_entry   values to write to the database
  * @param   pool        a pool for object allocations
  * @return              NGX_OK on success,
@@ -444,19 +811,16 @@ ngx_http_sqlitelog_handle_1_async(ngx_http_request_t *r, ngx_array_t *log_entry,
  */
 #if (NGX_THREADS)
 static ngx_int_t
-ngx_http_sqlitelog_handle_n_async(ngx_http_request_t *r, ngx_array_t *log_entry,
-    ngx_pool_t *pool)
+ngx_http_sqlitelog_handle_n_async(ngx_http_request_t *r,
+    ngx_http_sqlitelog_t *slog, ngx_array_t *log_entry, ngx_pool_t *pool)
 {
+    ngx_int_t                         rc_post;
     ngx_int_t                         rc_push;
     ngx_thread_task_t                *task;
-    ngx_http_sqlitelog_srv_conf_t    *lscf;
-    ngx_http_sqlitelog_main_conf_t   *lmcf;
     ngx_http_sqlitelog_thread_ctx_t  *ctx;
     
-    lscf = ngx_http_get_module_srv_conf(r, ngx_http_sqlitelog_module);
-    lmcf = ngx_http_get_module_main_conf(r, ngx_http_sqlitelog_module);
-    rc_push = ngx_http_sqlitelog_buf_push(lscf->buf, log_entry,
-                                          r->connection->log);
+    rc_push = ngx_http_sqlitelog_buf_push(slog->db->buf, slog->table,
+                                          log_entry, r->connection->log);
     
     /* Push success - nothing else to do */
     if (rc_push == NGX_OK) {
@@ -464,46 +828,48 @@ ngx_http_sqlitelog_handle_n_async(ngx_http_request_t *r, ngx_array_t *log_entry,
     }
     
     /* Create thread task */
-    task = ngx_thread_task_alloc(pool, sizeof(ngx_http_sqlitelog_thread_ctx_t));
+    task = ngx_http_sqlitelog_thread_task(slog->db, r->connection->log);
     if (task == NULL) {
         return NGX_ERROR;
     }
     
     /* Set async context */
     ctx = task->ctx;
-    ctx->db = lscf->db;
-    ctx->log_entry = log_entry;
-    ctx->buf = lscf->buf;
-    ctx->pool = pool;
+    ctx->table = slog->table;
+    ctx->buf = slog->db->buf;
     
     /*
      * Set ctx->log_entry depending on the push return code.
      * 
      * If we got NGX_DONE, it means the push was successful and, additionally,
      * the buffer has reached its max node count, so the transaction is ready
-     * to be executed. We set the log_entry to null to indicate that no action
+     * to be executed. We leave the log_entry null to indicate that no action
      * is to be taken after execution.
      * 
      * However, if we got NGX_ERROR, it means the push failed, most likely
      * because the buffer's size has been overflowed. In that case, we need to
      * execute the transaction in order to empty out the buffer, and then we
-     * can add the current log entry again (unshift). So, we set the log_entry
-     * field to this log entry, indicating that we want to add it after
-     * execution.
+     * can add the current log entry again (unshift). So, we keep a copy of
+     * this log entry in the task, since the request may be gone by the time
+     * the task runs, indicating that we want to add it after execution.
      */
-    if (rc_push == NGX_DONE) {
-        ctx->log_entry = NULL;
-    }
-    else if (rc_push == NGX_ERROR) {
-        ctx->log_entry = log_entry;
+    if (rc_push == NGX_ERROR) {
+        if (ngx_http_sqlitelog_thread_keep(ctx, slog->table, log_entry)
+            != NGX_OK)
+        {
+            ngx_http_sqlitelog_thread_task_free(slog->db, task);
+            return NGX_ERROR;
+        }
     }
     
     task->handler = ngx_http_sqlitelog_thread_insert_n_handler;
-    task->event.handler = ngx_http_sqlitelog_thread_completed_handler;
-    task->event.data = ctx;
-    task->event.log = ngx_cycle->log;
     
-    return ngx_thread_task_post(lmcf->tp, task);
+    rc_post = ngx_http_sqlitelog_thread_post(slog->db, task);
+    if (rc_post != NGX_OK) {
+        ngx_http_sqlitelog_thread_task_free(slog->db, task);
+    }
+    
+    return rc_post;
 }
 #endif
 
@@ -512,39 +878,32 @@ ngx_http_sqlitelog_handle_n_async(ngx_http_request_t *r, ngx_array_t *log_entry,
  * Handle the current web request with a transaction buffer.
  * 
  * @param   r           the current web request
+ * @param   slog        the sqlitelog
  * @param   log_entry   values to write to the database
  * @param   pool        a pool for object allocations
  * @return              NGX_OK on success,
  *                      NGX_ERROR if an error occurs
  */
 static ngx_int_t
-ngx_http_sqlitelog_handle_n(ngx_http_request_t *r, ngx_array_t *log_entry,
-    ngx_pool_t *pool)
+ngx_http_sqlitelog_handle_n(ngx_http_request_t *r, ngx_http_sqlitelog_t *slog,
+    ngx_array_t *log_entry, ngx_pool_t *pool)
 {
     ngx_int_t                        rc_insert;
     ngx_int_t                        rc_list;
     ngx_int_t                        rc_push;
     ngx_int_t                        rc_unshift;
+    ngx_uint_t                       half;
     ngx_list_t                       list;
-    ngx_slab_pool_t                 *shpool;
+    ngx_array_t                      rollup;
     ngx_http_sqlitelog_buf_t        *buf;
-    ngx_http_sqlitelog_srv_conf_t   *lscf;
     
-    lscf = ngx_http_get_module_srv_conf(r, ngx_http_sqlitelog_module);
-    buf = lscf->buf;
-    shpool = (ngx_slab_pool_t *) buf->shm_zone->shm.addr;
-    
-    /* 1. Lock */
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "sqlitelog: handle n, step 1: lock");
-    ngx_shmtx_lock(&shpool->mutex);
+    buf = slog->db->buf;
     
     /* 
-     * Push node to buffer.
+     * Push node to buffer, which only locks this worker's shard.
      * 
      * If the return code is NGX_OK, it means the node was successfully pushed
-     * and we don't need to take any further action; we unlock the mutex and
-     * return.
+     * and we don't need to take any further action.
      * 
      * If the return code is NGX_DONE, it means the buffer has reached its max
      * node count and we must execute the transaction.
@@ -553,23 +912,33 @@ ngx_http_sqlitelog_handle_n(ngx_http_request_t *r, ngx_array_t *log_entry,
      * due to a size overflow and we have to empty the buffer (i.e. execute the
      * transaction) before trying to insert (unshift) the node again.
      */
-    rc_push = ngx_http_sqlitelog_buf_push_locked(buf, log_entry,
-                                                 r->connection->log);
+    rc_push = ngx_http_sqlitelog_buf_push(buf, slog->table, log_entry,
+                                          r->connection->log);
     if (rc_push == NGX_OK) {
-        ngx_shmtx_unlock(&shpool->mutex);
+        return NGX_OK;
+    }
+    
+    /* 1. Lock */
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "sqlitelog: handle n, step 1: lock");
+    ngx_http_sqlitelog_buf_lock(buf);
+    if (rc_push == NGX_DONE && ngx_http_sqlitelog_buf_get_len_locked(buf) == 0)
+    {
+        /* Another worker process executed it between the push and lock */
+        ngx_http_sqlitelog_buf_unlock(buf);
         return NGX_OK;
     }
     
     /* 2. List */
     ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
                    "sqlitelog: handle n, step 2: list");
-    rc_list = ngx_http_sqlitelog_buf_list_locked(buf, pool,
-                                                 log_entry->nelts, &list);
+    rc_list = ngx_http_sqlitelog_buf_list_locked(buf, pool, &list, &rollup,
+                                                 &half);
     if (rc_list != NGX_OK) {
         ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
                       "sqlitelog: handle n failed to create list after buffer "
-                      "push on database \"%V\"", &lscf->db.filename);
-        ngx_shmtx_unlock(&shpool->mutex);
+                      "push on database \"%V\"", &slog->db->filename);
+        ngx_http_sqlitelog_buf_unlock(buf);
         goto failed;
     }
     
@@ -581,28 +950,29 @@ ngx_http_sqlitelog_handle_n(ngx_http_request_t *r, ngx_array_t *log_entry,
     /* 4. Unlock */
     ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
                    "sqlitelog: handle n, step 4: unlock");
-    ngx_shmtx_unlock(&shpool->mutex);
+    ngx_http_sqlitelog_buf_unlock(buf);
     
     /* 5. Insert */
     ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
                    "sqlitelog: handle n, step 5: insert");
-    rc_insert = ngx_http_sqlitelog_db_insert_list(&lscf->db, &list,
-                                                  r->connection->log);
+    rc_insert = ngx_http_sqlitelog_buf_commit(buf, slog->db, &list, &rollup,
+                                              half, r->connection->log);
     if (rc_insert != SQLITE_OK) {
         ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
                       "sqlitelog: handle n failed to insert list "
-                      "into database \"%V\"", &lscf->db.filename);
+                      "into database \"%V\"", &slog->db->filename);
         goto failed;
     }
     
     /* Unshift */
     if (rc_push == NGX_ERROR) {
-        rc_unshift = ngx_http_sqlitelog_buf_unshift(buf, log_entry,
+        rc_unshift = ngx_http_sqlitelog_buf_unshift(buf, slog->table,
+                                                    log_entry,
                                                     r->connection->log);
         if (rc_unshift != NGX_OK) {
             ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
                           "sqlitelog: handle n failed to unshift node after "
-                          "overflow on database \"%V\"", &lscf->db.filename);
+                          "overflow on database \"%V\"", &slog->db->filename);
             return NGX_ERROR;
         }
     }
@@ -618,19 +988,26 @@ failed:
  * Create a log entry from this request. The returned value is an array of
  * values to be inserted as a row in the database.
  * 
+ * Each column's value is taken from the request's value cache, and it's only
+ * evaluated if no other sqlitelog has needed it yet. The cache lives in the
+ * request's pool, so if the log entry is allocated elsewhere (i.e. for a worker
+ * thread), the values are copied.
+ * 
  * @param   r           the current request
  * @param   columns     an array of ngx_http_sqlitelog_col_t
+ * @param   values      the request's variable values
  * @param   pool        a pool in which to allocate the log entry
  * @return              an array of ngx_str_t on success, or
  *                      NULL on failure
  */
 static ngx_array_t *
 ngx_http_sqlitelog_log_entry(ngx_http_request_t *r, ngx_array_t columns,
-    ngx_pool_t *pool)
+    ngx_http_sqlitelog_values_t *values, ngx_pool_t *pool)
 {
     u_char                    *buf;
     size_t                     buf_size;
     ngx_str_t                 *s;
+    ngx_str_t                 *v;
     ngx_uint_t                 buf_len;
     ngx_uint_t                 i;
     ngx_uint_t                 n;
@@ -644,6 +1021,15 @@ ngx_http_sqlitelog_log_entry(ngx_http_request_t *r, ngx_array_t columns,
         return NULL;
     }
     
+    /* Value cache */
+    if (values->values == NULL) {
+        values->values = ngx_pcalloc(r->pool, values->n * sizeof(ngx_str_t));
+        values->done = ngx_pcalloc(r->pool, values->n);
+        if (values->values == NULL || values->done == NULL) {
+            return NULL;
+        }
+    }
+    
     c = columns.elts;
     for (i = 0; i < n; i++) {
         /* Push */
@@ -651,30 +1037,50 @@ ngx_http_sqlitelog_log_entry(ngx_http_request_t *r, ngx_array_t columns,
         if (s == NULL) {
             return NULL;
         }
+        v = &values->values[c->value];
         
-        /* Get length */
-        buf_len = c->op.getlen(r, c->op.index);
-        
-        /* Empty */
-        if (buf_len == 0) {
-            s->data = NULL;
-            s->len = 0;
+        /* Evaluate */
+        if (!values->done[c->value]) {
+            
+            /* Get length */
+            buf_len = c->op.getlen(r, c->op.index);
+            
+            /* Empty */
+            if (buf_len == 0) {
+                v->data = NULL;
+                v->len = 0;
+            }
+            
+            /* Get value */
+            else {
+                buf_size = buf_len + 1;
+                buf = ngx_pcalloc(r->pool, buf_size);
+                if (buf == NULL) {
+                    return NULL;
+                }
+                c->op.run(r, buf, &c->op);
+                v->data = buf;
+                if (buf_len > 4096) {
+                    v->len = 4096; /* Truncate large objects */
+                } else {
+                    v->len = buf_len;
+                }
+            }
+            
+            values->done[c->value] = 1;
         }
         
-        /* Get value */
-        else {
-            buf_size = buf_len + 1;
-            buf = ngx_pcalloc(pool, buf_size);
-            if (buf == NULL) {
+        /* Copy */
+        if (pool != r->pool && v->len) {
+            s->data = ngx_pcalloc(pool, v->len + 1);
+            if (s->data == NULL) {
                 return NULL;
             }
-            c->op.run(r, buf, &c->op);
-            s->data = buf;
-            if (buf_len > 4096) {
-                s->len = 4096; /* Truncate large objects */
-            } else {
-                s->len = buf_len;
-            }
+            ngx_memcpy(s->data, v->data, v->len);
+            s->len = v->len;
+        }
+        else {
+            *s = *v;
         }
         c++;
     }
@@ -683,6 +1089,51 @@ ngx_http_sqlitelog_log_entry(ngx_http_request_t *r, ngx_array_t columns,
 }
 
 
+/**
+ * Perform initialization tasks once the configuration has been loaded, in
+ * the master process (i.e. moving the log entries of each resized buffer's
+ * previous zone into its new zone, and marking each buffer's configuration
+ * as the newest one that uses its zone).
+ * 
+ * Nothing fails after this point of a reload, so the log entries can't be
+ * left in a zone that's never used.
+ * 
+ * @param   cycle   the cycle of the current Nginx session
+ * @return          NGX_OK
+ */
+static ngx_int_t
+ngx_http_sqlitelog_init_module(ngx_cycle_t *cycle)
+{
+    ngx_uint_t                        i;
+    ngx_http_sqlitelog_db_t         **dbp;
+    ngx_http_sqlitelog_main_conf_t   *lmcf;
+    
+    lmcf = ngx_http_cycle_get_module_main_conf(cycle,
+                                               ngx_http_sqlitelog_module);
+    if (lmcf == NULL) {
+        return NGX_OK;
+    }
+    dbp = lmcf->dbs.elts;
+    
+    for (i = 0; i < lmcf->dbs.nelts; i++) {
+        if (dbp[i]->buf == NULL) {
+            continue;
+        }
+        
+        if (dbp[i]->buf->old_zone) {
+            (void) ngx_http_sqlitelog_buf_migrate(dbp[i]->buf,
+                                                  dbp[i]->buf->old_zone,
+                                                  cycle->log);
+            dbp[i]->buf->old_zone = NULL;
+        }
+        
+        ngx_http_sqlitelog_buf_adopt(dbp[i]->buf);
+    }
+    
+    return NGX_OK;
+}
+
+
 /**
  * Perform per-worker initalization tasks (i.e. opening/creating the database
  * file and starting the flush timer, if set).
@@ -697,35 +1148,51 @@ ngx_http_sqlitelog_init_worker(ngx_cycle_t *cycle)
 
     int                               rc_init;
     ngx_uint_t                        i;
-    ngx_http_core_srv_conf_t        **cscfp;
-    ngx_http_core_main_conf_t        *cmcf;
-    ngx_http_sqlitelog_srv_conf_t    *lscf;
+    ngx_http_sqlitelog_t            **slogp;
+    ngx_http_sqlitelog_t             *slog;
+    ngx_http_sqlitelog_db_t         **dbp;
+    ngx_http_sqlitelog_db_t          *db;
     ngx_http_sqlitelog_buf_flctx_t   *ctx;
+    ngx_http_sqlitelog_main_conf_t   *lmcf;
     
-    cmcf  = ngx_http_cycle_get_module_main_conf(cycle, ngx_http_core_module);
-    cscfp = cmcf->servers.elts;
-    
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, cycle->log, 0,
+    lmcf = ngx_http_cycle_get_module_main_conf(cycle,
+                                               ngx_http_sqlitelog_module);
+    if (lmcf == NULL) {
+        return NGX_OK;
+    }
+    dbp = lmcf->dbs.elts;
+    slogp = lmcf->logs.elts;
+    
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, cycle->log, 0,
                    "sqlitelog: init worker");
     
     ngx_log_debug1(NGX_LOG_DEBUG_HTTP, cycle->log, 0,
-                   "sqlitelog: init worker cmcf->servers.nelts: %d",
-                   cmcf->servers.nelts);
+                   "sqlitelog: init worker lmcf->dbs.nelts: %d",
+                   lmcf->dbs.nelts);
+    
+    /*
+     * SQLite's memory is configured before any connection is opened. If this
+     * fails, SQLite's defaults are kept and the databases are still used.
+     */
+    if (lmcf->mem) {
+        (void) ngx_http_sqlitelog_mem_init(lmcf->mem, cycle->log);
+    }
     
     /*
-     * Iterate through the server configurations and initialize the database
-     * connection(s) in each one.
-     * https://mailman.nginx.org/pipermail/nginx-devel/2016-October/008882.html
+     * Iterate through the database files and initialize the connection to
+     * each one that's used by at least one context.
      */
-    for (i = 0; i < cmcf->servers.nelts; i++) {
+    for (i = 0; i < lmcf->dbs.nelts; i++) {
         
-        /* Get server configuration */
-        lscf = cscfp[i]->ctx->srv_conf[ngx_http_sqlitelog_module.ctx_index];
-        if (lscf == NULL || lscf->enabled == 0) {
-           
+        db = dbp[i];
+        if (db->enabled == 0) {
             continue;
         }
         
+#if (NGX_THREADS)
+        db->tp = lmcf->tp;
+#endif
+        
         /* 
          * Initialize database connection.
          * 
@@ -739,25 +1206,61 @@ ngx_http_sqlitelog_init_worker(ngx_cycle_t *cycle)
          * To keep things simple, we disable the module for this worker and
          * write a message to error.log.
          */
-        rc_init = ngx_http_sqlitelog_db_init(&lscf->db, cycle->log);
+        rc_init = ngx_http_sqlitelog_db_init(db, cycle->log);
         ngx_log_debug1(NGX_LOG_DEBUG_HTTP, cycle->log, 0,
                        "sqlitelog: init worker, rc_init: %d", rc_init);
         if (rc_init != SQLITE_OK) {
             ngx_log_error(NGX_LOG_ERR, cycle->log, 0,
                           "sqlitelog: worker process %d failed to initialize "
-                          "database \"%V\"", ngx_getpid(), &lscf->db.filename);
-            lscf->enabled = 0;
+                          "database \"%V\"", ngx_getpid(), &db->filename);
+            db->enabled = 0;
             continue;
         }
         
         /* Flush setup */
-        if (lscf->buf && lscf->buf->flush) {
+        if (db->buf && db->buf->flush) {
             ngx_log_debug0(NGX_LOG_DEBUG_HTTP, cycle->log, 0,
                            "sqlitelog: init worker, start flush timer");
-            ngx_http_sqlitelog_buf_timer_start(lscf->buf);
+            ngx_http_sqlitelog_buf_timer_start(db->buf);
             
-            ctx = lscf->buf->event->data;
-            ctx->db = &lscf->db;
+            ctx = db->buf->event->data;
+            ctx->db = db;
+        }
+        
+        /* Log entries recovered from a persistent buffer's journal */
+        if (db->buf && db->buf->persist.data) {
+            ngx_http_sqlitelog_buf_replay(db->buf, db, cycle->log);
+        }
+        
+        /* Periodic checkpoint */
+        if (db->ckpt) {
+            if (ngx_http_sqlitelog_ckpt_start(db->ckpt, db, cycle) != NGX_OK) {
+                ngx_log_error(NGX_LOG_ERR, cycle->log, 0,
+                              "sqlitelog: worker process %d failed to start "
+                              "checkpoints for database \"%V\"",
+                              ngx_getpid(), &db->filename);
+            }
+        }
+    }
+    
+    /* Retention setup */
+    for (i = 0; i < lmcf->logs.nelts; i++) {
+        
+        slog = slogp[i];
+        if (slog->db->enabled == 0) {
+            continue;
+        }
+        
+        if (slog->retention) {
+            if (ngx_http_sqlitelog_retention_start(slog->retention, slog->db,
+                                                   cycle)
+                != NGX_OK)
+            {
+                ngx_log_error(NGX_LOG_ERR, cycle->log, 0,
+                              "sqlitelog: worker process %d failed to start "
+                              "retention for database \"%V\"",
+                              ngx_getpid(), &slog->db->filename);
+            }
         }
     }
     
@@ -768,6 +1271,14 @@ ngx_http_sqlitelog_init_worker(ngx_cycle_t *cycle)
 /**
  * Perform per-worker exit tasks.
  * 
+ * The worker processes exit at once, so they coordinate their work on shared
+ * files. Each worker starts with a different database, so that they drain
+ * different databases in parallel; only one of them drains a shared buffer,
+ * and only that one waits to checkpoint its file. The others attempt a
+ * checkpoint once, since the last connection to close a file checkpoints it
+ * anyway. Once the drain timeout has passed, the remaining databases are
+ * closed without being drained or checkpointed.
+ * 
  * @param   cycle   the cycle of the current Nginx session
  */
 static void
@@ -775,109 +1286,165 @@ ngx_http_sqlitelog_exit_worker(ngx_cycle_t *cycle)
 {
     int                              rc_ckpt;
     int                              rc_close;
-    int                              rc_insert;
-    ngx_int_t                        rc_list;
-    ngx_list_t                       list;
+    ngx_int_t                        rc_drain;
     ngx_uint_t                       i;
-    ngx_slab_pool_t                 *shpool;
-    ngx_http_core_srv_conf_t       **cscfp;
-    ngx_http_core_main_conf_t       *cmcf;
-    ngx_http_sqlitelog_srv_conf_t   *lscf;
+    ngx_uint_t                       n;
+    ngx_msec_t                       deadline;
+    ngx_msec_t                       timeout;
+    ngx_http_sqlitelog_t           **slogp;
+    ngx_http_sqlitelog_db_t        **dbp;
+    ngx_http_sqlitelog_db_t         *db;
+    ngx_http_sqlitelog_main_conf_t  *lmcf;
     
-    cmcf  = ngx_http_cycle_get_module_main_conf(cycle, ngx_http_core_module);
-    cscfp = cmcf->servers.elts;
+    lmcf = ngx_http_cycle_get_module_main_conf(cycle,
+                                               ngx_http_sqlitelog_module);
+    if (lmcf == NULL) {
+        return;
+    }
+    dbp = lmcf->dbs.elts;
+    slogp = lmcf->logs.elts;
     
     ngx_log_debug0(NGX_LOG_DEBUG_HTTP, cycle->log, 0, "sqlitelog: exit worker");
     
+#if (NGX_THREADS)
+    /*
+     * The thread pool has already finished its tasks, since it exits first,
+     * so run the tasks that were still waiting for their connection.
+     */
+    for (i = 0; i < lmcf->dbs.nelts; i++) {
+        if (dbp[i]->enabled && dbp[i]->conn) {
+            ngx_http_sqlitelog_thread_drain(dbp[i], cycle->log);
+        }
+    }
+#endif
+    
+    /* Retention and periodic checkpoints */
+    for (i = 0; i < lmcf->logs.nelts; i++) {
+        if (slogp[i]->retention) {
+            ngx_http_sqlitelog_retention_stop(slogp[i]->retention);
+        }
+    }
+    for (i = 0; i < lmcf->dbs.nelts; i++) {
+        if (dbp[i]->ckpt) {
+            ngx_http_sqlitelog_ckpt_stop(dbp[i]->ckpt);
+        }
+    }
+    
+    /* Deadline */
+    ngx_time_update();
+    deadline = ngx_current_msec + lmcf->drain_timeout;
+    
     /*
-     * Loop through each server configuration and:
-     * - commit any pending buffer transactions
+     * Loop through each database file, starting at this worker's own, and:
+     * - drain the buffer, unless another worker is draining it
      * - perform a WAL checkpoint
      * - close the connection
      */
-    for (i = 0; i < cmcf->servers.nelts; i++) {
-        lscf = cscfp[i]->ctx->srv_conf[ngx_http_sqlitelog_module.ctx_index];
-        if (lscf == NULL || lscf->enabled == 0) {
+    for (n = 0; n < lmcf->dbs.nelts; n++) {
+        db = dbp[(n + ngx_worker) % lmcf->dbs.nelts];
+        if (db->enabled == 0) {
             continue;
         }
         
-        /* Buffered transaction */
-        if (lscf->db.conn && lscf->buf) {
-            /* 1. Lock */
-            shpool = (ngx_slab_pool_t *) lscf->buf->shm_zone->shm.addr;
-            ngx_shmtx_lock(&shpool->mutex);
-            if (ngx_http_sqlitelog_buf_get_len_locked(lscf->buf) == 0) {
-                ngx_log_debug0(NGX_LOG_DEBUG_HTTP, cycle->log, 0,
-                               "sqlitelog: exit worker, buffer empty");
-                ngx_shmtx_unlock(&shpool->mutex);
-                goto checkpoint;
-            }
+        /* Flush lease and timer */
+        if (db->buf && db->buf->flush) {
+            ngx_http_sqlitelog_buf_release(db->buf);
+            ngx_http_sqlitelog_buf_timer_stop(db->buf);
+        }
+        
+        /* Remaining time */
+        timeout = ngx_http_sqlitelog_drain_left(lmcf, deadline);
+        if (timeout == 0) {
+            ngx_log_error(NGX_LOG_WARN, cycle->log, 0,
+                          "sqlitelog: worker process %d exceeded "
+                          "sqlitelog_drain_timeout, closing database \"%V\" "
+                          "without draining it", ngx_getpid(), &db->filename);
+            goto close;
+        }
+        
+        /*
+         * Buffered transaction, unless Nginx is reloading and the new worker
+         * processes take over the buffer
+         */
+        rc_drain = NGX_DECLINED;
+        if (db->buf && ngx_http_sqlitelog_buf_adopted(db->buf)) {
             ngx_log_debug0(NGX_LOG_DEBUG_HTTP, cycle->log, 0,
-                           "sqlitelog: exit worker, execute buffer "
-                           "transaction");
-            
-            /* 2. List */
-            rc_list = ngx_http_sqlitelog_buf_list_locked(lscf->buf, cycle->pool,
-                                            lscf->db.fmt->columns.nelts, &list);
-            if (rc_list != NGX_OK) {
-                ngx_log_error(NGX_LOG_ERR, cycle->log, 0,
-                              "sqlitelog: worker process %d failed to create "
-                              "list for database \"%V\"",
-                              ngx_getpid(), &lscf->db.filename);
-                ngx_shmtx_unlock(&shpool->mutex);
-                goto checkpoint;
-            }
-            
-            /* 3. Reset */
-            if (lscf->buf->flush) {
-                ngx_http_sqlitelog_buf_timer_stop(lscf->buf);
-            }
-            
-            /* 4. Unlock */
-            ngx_shmtx_unlock(&shpool->mutex);
-            
-            /* 5. Insert */
-            rc_insert = ngx_http_sqlitelog_db_insert_list(&lscf->db, &list,
-                                                          cycle->log);
-            if (rc_insert != SQLITE_OK) {
+                           "sqlitelog: exit worker, buffer taken over");
+        }
+        else if (db->conn && db->buf) {
+            rc_drain = ngx_http_sqlitelog_buf_drain(db->buf, db, timeout,
+                                                    cycle->log);
+            if (rc_drain == NGX_ERROR) {
                 ngx_log_error(NGX_LOG_ERR, cycle->log, 0,
                               "sqlitelog: worker process %d failed to execute "
                               "buffered transaction on database \"%V\"",
-                              ngx_getpid(), &lscf->db.filename);
+                              ngx_getpid(), &db->filename);
             }
         }
         
-        /* Checkpoint */
-checkpoint:
-        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, cycle->log, 0,
-                       "sqlitelog: exit worker, checkpoint");
-        rc_ckpt = ngx_http_sqlitelog_db_checkpoint(&lscf->db, cycle->log);
-        if (rc_ckpt != SQLITE_OK) {
-            ngx_log_error(NGX_LOG_ERR, cycle->log, 0,
-                          "sqlitelog: worker process %d failed to execute WAL "
-                          "checkpoint on database \"%V\"",
-                          ngx_getpid(), &lscf->db.filename);
+        /* Checkpoint, waiting for other connections only after a drain */
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, cycle->log, 0,
+                       "sqlitelog: exit worker, checkpoint, drained: %i",
+                       rc_drain);
+        if (db->conn) {
+            timeout = (rc_drain == NGX_OK)
+                      ? ngx_http_sqlitelog_drain_left(lmcf, deadline) : 0;
+            rc_ckpt = ngx_http_sqlitelog_db_checkpoint(db, timeout,
+                                                       cycle->log);
+            if (rc_ckpt != SQLITE_OK) {
+                ngx_log_error(NGX_LOG_ERR, cycle->log, 0,
+                              "sqlitelog: worker process %d failed to "
+                              "execute WAL checkpoint on database \"%V\"",
+                              ngx_getpid(), &db->filename);
+            }
         }
         
         /* Close */
-        if (lscf->db.conn) {
-            rc_close = ngx_http_sqlitelog_db_close(&lscf->db, cycle->log);
+close:
+        if (db->conn) {
+            rc_close = ngx_http_sqlitelog_db_close(db, cycle->log);
             ngx_log_debug1(NGX_LOG_DEBUG_HTTP, cycle->log, 0,
                            "sqlitelog: exit worker, rc_close: %d", rc_close);
             if (rc_close != SQLITE_OK) {
                 ngx_log_error(NGX_LOG_ERR, cycle->log, 0,
                               "sqlitelog: worker process %d failed to close "
                               "database connection on \"%V\"",
-                              ngx_getpid(), &lscf->db.filename);
+                              ngx_getpid(), &db->filename);
             }
             ngx_log_debug1(NGX_LOG_DEBUG_HTTP, cycle->log, 0,
                            "sqlitelog: exit worker, db conn: %p",
-                           lscf->db.conn);
+                           db->conn);
         }
     }
 }
 
 
+/**
+ * Get the time left until an exiting worker process's drain deadline.
+ * 
+ * @param   lmcf        the main configuration
+ * @param   deadline    the deadline, in msec
+ * @return              the time left, in msec, which is 0 once the deadline
+ *                      has passed, or NGX_MAX_INT32_VALUE if there's no
+ *                      sqlitelog_drain_timeout
+ */
+static ngx_msec_t
+ngx_http_sqlitelog_drain_left(ngx_http_sqlitelog_main_conf_t *lmcf,
+    ngx_msec_t deadline)
+{
+    ngx_msec_int_t  left;
+    
+    if (lmcf->drain_timeout == 0) {
+        return (ngx_msec_t) NGX_MAX_INT32_VALUE;
+    }
+    
+    ngx_time_update();
+    left = (ngx_msec_int_t) (deadline - ngx_current_msec);
+    
+    return (left > 0) ? (ngx_msec_t) left : 0;
+}
+
+
 /**
  * Perform master exit tasks.
  * 
@@ -886,14 +1453,70 @@ checkpoint:
 static void
 ngx_http_sqlitelog_exit_master(ngx_cycle_t *cycle)
 {
+    int                              rc_close;
+    int                              rc_index;
+    int                              rc_init;
+    ngx_uint_t                       i;
+    ngx_http_sqlitelog_db_t        **dbp;
+    ngx_http_sqlitelog_db_t         *db;
+    ngx_http_sqlitelog_main_conf_t  *lmcf;
+    
     ngx_log_debug1(NGX_LOG_DEBUG_HTTP, cycle->log, 0,
                    "sqlitelog: sqlite3 %d", SQLITE_VERSION);
     ngx_log_debug0(NGX_LOG_DEBUG_HTTP, cycle->log, 0, "sqlitelog: exit master");
+    
+    lmcf = ngx_http_cycle_get_module_main_conf(cycle,
+                                               ngx_http_sqlitelog_module);
+    if (lmcf == NULL) {
+        return;
+    }
+    dbp = lmcf->dbs.elts;
+    
+    /*
+     * Build deferred indexes. The worker processes have exited, so nothing
+     * else is writing to the files anymore (e.g. they're about to be rotated).
+     */
+    for (i = 0; i < lmcf->dbs.nelts; i++) {
+        db = dbp[i];
+        if (db->enabled == 0 || db->deferred != 1) {
+            continue;
+        }
+        
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, cycle->log, 0,
+                       "sqlitelog: exit master, build indexes on \"%V\"",
+                       &db->filename);
+        
+        rc_init = ngx_http_sqlitelog_db_init(db, cycle->log);
+        if (rc_init == SQLITE_OK) {
+            rc_index = ngx_http_sqlitelog_db_index(db, cycle->log);
+            if (rc_index != SQLITE_OK) {
+                ngx_log_error(NGX_LOG_ERR, cycle->log, 0,
+                              "sqlitelog: master process failed to build "
+                              "deferred indexes on database \"%V\"",
+                              &db->filename);
+            }
+        }
+        else {
+            ngx_log_error(NGX_LOG_ERR, cycle->log, 0,
+                          "sqlitelog: master process failed to open "
+                          "database \"%V\" for deferred indexes",
+                          &db->filename);
+        }
+        
+        if (db->conn) {
+            rc_close = ngx_http_sqlitelog_db_close(db, cycle->log);
+            if (rc_close != SQLITE_OK) {
+                ngx_log_error(NGX_LOG_ERR, cycle->log, 0,
+                              "sqlitelog: master process failed to close "
+                              "database \"%V\"", &db->filename);
+            }
+        }
+    }
 }
 
 
 /**
- * Set up a server configuration from the sqlitelog directive.
+ * Set up a location configuration from the sqlitelog directive.
  * 
  * @param   cf      the current line of the config file
  * @param   cmd     a pointer to the directive object
@@ -904,18 +1527,33 @@ ngx_http_sqlitelog_exit_master(ngx_cycle_t *cycle)
 static char *
 ngx_http_sqlitelog(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 {
-    ngx_http_sqlitelog_srv_conf_t *lscf = conf;
+    ngx_http_sqlitelog_loc_conf_t *llcf = conf;
     
     int                              rc_test;
+    time_t                           ttl;
     ssize_t                          size;
     ngx_int_t                        max;
     ngx_str_t                        path;
+    ngx_str_t                        column;
     ngx_str_t                       *value;
     ngx_msec_t                       flush;
+    ngx_msec_t                       adaptive;
+    ngx_msec_t                       checkpoint;
     ngx_uint_t                       i;
+    ngx_str_t                        script;
+    ngx_str_t                       *scriptp;
     ngx_shm_zone_t                  *shm_zone;
+    ngx_uint_t                       sample;
+    ngx_uint_t                       sample_errors;
+    ngx_flag_t                       deferred;
+    ngx_flag_t                       hugepages;
+    ngx_str_t                        persist;
+    ngx_http_sqlitelog_t           **slogp;
+    ngx_http_sqlitelog_t            *slog;
+    ngx_http_sqlitelog_db_t         *db;
     ngx_http_sqlitelog_buf_t        *buf;
     ngx_http_sqlitelog_fmt_t        *cmb;
+    ngx_http_sqlitelog_rollup_t     *rollup;
     ngx_http_sqlitelog_buf_flctx_t  *ctx;
     ngx_http_sqlitelog_main_conf_t  *lmcf;
     
@@ -924,19 +1562,59 @@ ngx_http_sqlitelog(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     size = 0;
     max = 0;
     flush = 0;
-    
-    /* Duplicate check */
-    if (lscf->db.filename.data != NULL) {
-        return "is duplicate";
-    }
-    
-    /* "off" check */
+    adaptive = 0;
+    hugepages = 0;
+    persist.data = NULL;
+    persist.len = 0;
+    checkpoint = 0;
+    ttl = 0;
+    column.data = NULL;
+    column.len = 0;
+    script.data = NULL;
+    script.len = 0;
+    rollup = NULL;
+    sample = NGX_CONF_UNSET_UINT;
+    sample_errors = NGX_CONF_UNSET_UINT;
+    deferred = NGX_CONF_UNSET;
+    
+    /* "off" check; it can't be combined with other sqlitelogs */
     value = cf->args->elts;
     if (ngx_strcasecmp(value[1].data, (u_char *) "off") == 0) {
-        lscf->enabled = 0;
+        if (llcf->enabled != NGX_CONF_UNSET) {
+            return "is duplicate";
+        }
+        llcf->enabled = 0;
         return NGX_OK;
     }
-    lscf->enabled = 1;
+    if (llcf->enabled == 0) {
+        return "is duplicate";
+    }
+    llcf->enabled = 1;
+    
+    if (llcf->logs == NULL) {
+        llcf->logs = ngx_array_create(cf->pool, 1,
+                                      sizeof(ngx_http_sqlitelog_t *));
+        if (llcf->logs == NULL) {
+            return NGX_CONF_ERROR;
+        }
+    }
+    
+    /* Instance */
+    slog = ngx_pcalloc(cf->pool, sizeof(ngx_http_sqlitelog_t));
+    if (slog == NULL) {
+        return NGX_CONF_ERROR;
+    }
+    slogp = ngx_array_push(&lmcf->logs);
+    if (slogp == NULL) {
+        return NGX_CONF_ERROR;
+    }
+    *slogp = slog;
+    
+    slogp = ngx_array_push(llcf->logs);
+    if (slogp == NULL) {
+        return NGX_CONF_ERROR;
+    }
+    *slogp = slog;
     
     /* Path */
     path = value[1];
@@ -946,7 +1624,13 @@ ngx_http_sqlitelog(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     if (ngx_conf_full_name(cf->cycle, &path, 0) != NGX_OK) {
         return NGX_CONF_ERROR;
     }
-    lscf->db.filename = path;
+    
+    /* Database; every sqlitelog on the same file shares it */
+    db = ngx_http_sqlitelog_add_db(cf, path);
+    if (db == NULL) {
+        return NGX_CONF_ERROR;
+    }
+    slog->db = db;
     
     /* Options */
     for (i = 2; i < cf->args->nelts; i++) {
@@ -975,31 +1659,123 @@ ngx_http_sqlitelog(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
             }
         }
         
+        /* adaptive=time */
+        else if (ngx_has_prefix(&value[i], "adaptive=")) {
+            if (ngx_http_sqlitelog_opt_adaptive(cf, value[i], &adaptive)
+                != NGX_CONF_OK)
+            {
+                return NGX_CONF_ERROR;
+            }
+        }
+        
         /* init=script */
         else if (ngx_has_prefix(&value[i], "init=")) {
-            if (ngx_http_sqlitelog_opt_init(cf, value[i]) != NGX_CONF_OK) {
+            if (ngx_http_sqlitelog_opt_init(cf, value[i], &script)
+                != NGX_CONF_OK)
+            {
                 return NGX_CONF_ERROR;
             }
         }
         
         /* if=condition */
         else if (ngx_has_prefix(&value[i], "if=")) {
-            if (ngx_http_sqlitelog_opt_if(cf, value[i]) != NGX_CONF_OK) {
+            if (ngx_http_sqlitelog_opt_if(cf, value[i], &slog->filter)
+                != NGX_CONF_OK)
+            {
+                return NGX_CONF_ERROR;
+            }
+        }
+        
+        /* retention_column=name */
+        else if (ngx_has_prefix(&value[i], "retention_column=")) {
+            if (ngx_http_sqlitelog_opt_retention_column(cf, value[i], &column)
+                != NGX_CONF_OK)
+            {
+                return NGX_CONF_ERROR;
+            }
+        }
+        
+        /* retention=time */
+        else if (ngx_has_prefix(&value[i], "retention=")) {
+            if (ngx_http_sqlitelog_opt_retention(cf, value[i], &ttl)
+                != NGX_CONF_OK)
+            {
+                return NGX_CONF_ERROR;
+            }
+        }
+        
+        /* rollup=name */
+        else if (ngx_has_prefix(&value[i], "rollup=")) {
+            if (ngx_http_sqlitelog_opt_rollup(cf, value[i], &rollup)
+                != NGX_CONF_OK)
+            {
+                return NGX_CONF_ERROR;
+            }
+        }
+        
+        /* sample_errors=rate */
+        else if (ngx_has_prefix(&value[i], "sample_errors=")) {
+            if (ngx_http_sqlitelog_opt_sample(cf, value[i], &sample_errors)
+                != NGX_CONF_OK)
+            {
+                return NGX_CONF_ERROR;
+            }
+        }
+        
+        /* sample=rate */
+        else if (ngx_has_prefix(&value[i], "sample=")) {
+            if (ngx_http_sqlitelog_opt_sample(cf, value[i], &sample)
+                != NGX_CONF_OK)
+            {
+                return NGX_CONF_ERROR;
+            }
+        }
+        
+        /* index_mode=immediate|deferred */
+        else if (ngx_has_prefix(&value[i], "index_mode=")) {
+            if (ngx_http_sqlitelog_opt_index_mode(cf, value[i], &deferred)
+                != NGX_CONF_OK)
+            {
+                return NGX_CONF_ERROR;
+            }
+        }
+        
+        /* hugepages */
+        else if (ngx_str_eq_cs(&value[i], "hugepages")) {
+            hugepages = 1;
+        }
+        
+        /* persist=path */
+        else if (ngx_has_prefix(&value[i], "persist=")) {
+            if (ngx_http_sqlitelog_opt_persist(cf, value[i], &persist)
+                != NGX_CONF_OK)
+            {
+                return NGX_CONF_ERROR;
+            }
+        }
+        
+        /* checkpoint=time */
+        else if (ngx_has_prefix(&value[i], "checkpoint=")) {
+            if (ngx_http_sqlitelog_opt_checkpoint(cf, value[i], &checkpoint)
+                != NGX_CONF_OK)
+            {
                 return NGX_CONF_ERROR;
             }
         }
         
         /* If none of the above, it must be a format name */
         else {
-            if (ngx_http_sqlitelog_opt_format(cf, value[i]) != NGX_CONF_OK) {
+            if (ngx_http_sqlitelog_opt_format(cf, value[i], &slog->fmt)
+                != NGX_CONF_OK)
+            {
                 return NGX_CONF_ERROR;
             }
         }
     }
     
     /* If no format specified, default to combined */
-    if (lscf->db.fmt == NULL || lscf->db.fmt == cmb) {
-        lscf->db.fmt = cmb;
+    if (slog->fmt == NULL || slog->fmt == cmb) {
+        slog->fmt = cmb;
         if (lmcf->combined_init == 0) {
             if (ngx_http_sqlitelog_fmt_init_combined(cf, cmb) != NGX_OK)
             {
@@ -1009,15 +1785,134 @@ ngx_http_sqlitelog(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
         lmcf->combined_init = 1;
     }
     
+    /* Table */
+    if (ngx_http_sqlitelog_db_table(db, slog->fmt, &slog->table) != NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
+    
+    /* Init script; the same script is only run once per file */
+    if (script.data) {
+        scriptp = db->scripts.elts;
+        for (i = 0; i < db->scripts.nelts; i++) {
+            if (ngx_str_eq(&scriptp[i], &script)) {
+                break;
+            }
+        }
+        if (i == db->scripts.nelts) {
+            scriptp = ngx_array_push(&db->scripts);
+            if (scriptp == NULL) {
+                return NGX_CONF_ERROR;
+            }
+            *scriptp = script;
+        }
+    }
+    
+    /* Retention */
+    if (column.data && ttl == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "retention_column requires retention");
+        return NGX_CONF_ERROR;
+    }
+    if (ttl) {
+        slog->retention = ngx_pcalloc(cf->pool,
+                                      sizeof(ngx_http_sqlitelog_retention_t));
+        if (slog->retention == NULL) {
+            return NGX_CONF_ERROR;
+        }
+        slog->retention->ttl = ttl;
+        slog->retention->column = column;
+        slog->retention->tp = &lmcf->tp;
+        
+        if (ngx_http_sqlitelog_retention_init(cf, slog->retention, slog->fmt)
+            != NGX_OK)
+        {
+            return NGX_CONF_ERROR;
+        }
+        
+        db->vacuum = 1;
+    }
+    
+    /* Index mode; a file's indexes are either all immediate or all deferred */
+    if (deferred != NGX_CONF_UNSET) {
+        if (db->deferred != NGX_CONF_UNSET && db->deferred != deferred) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "index_mode for database \"%V\" is already "
+                               "defined", &path);
+            return NGX_CONF_ERROR;
+        }
+        db->deferred = deferred;
+    }
+    
+    /* Periodic checkpoint; a file has at most one */
+    if (checkpoint) {
+        if (db->ckpt) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "checkpoint for database \"%V\" is already "
+                               "defined", &path);
+            return NGX_CONF_ERROR;
+        }
+        db->ckpt = ngx_pcalloc(cf->pool, sizeof(ngx_http_sqlitelog_ckpt_t));
+        if (db->ckpt == NULL) {
+            return NGX_CONF_ERROR;
+        }
+        db->ckpt->interval = checkpoint;
+        db->ckpt->tp = &lmcf->tp;
+    }
+    
+    /* Sampling; errors follow the general rate unless given their own */
+    ngx_conf_init_uint_value(sample, 10000);
+    ngx_conf_init_uint_value(sample_errors, sample);
+    slog->sample = sample;
+    slog->sample_errors = sample_errors;
+    
+    /* Rollup; a file has at most one */
+    if (rollup) {
+        if (size == 0 && db->buf == NULL) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "rollup \"%V\" requires a buffer",
+                               &rollup->name);
+            return NGX_CONF_ERROR;
+        }
+        if (db->rollup && db->rollup != rollup) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "rollup for database \"%V\" is already "
+                               "defined", &path);
+            return NGX_CONF_ERROR;
+        }
+        db->rollup = rollup;
+        slog->rollup = 1;
+    }
+    
     /* Test */
-    rc_test = ngx_http_sqlitelog_db_test(lscf->db, cf->log);
+    rc_test = ngx_http_sqlitelog_db_test(*db, cf->log);
     if (rc_test != SQLITE_OK) {
         return NGX_CONF_ERROR;
     }
     
-    /* Buffer */
+    /* Buffer; a file has at most one, shared by all of its tables */
+    if (adaptive && size == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "adaptive requires a buffer");
+        return NGX_CONF_ERROR;
+    }
+    if (hugepages && size == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "hugepages requires a buffer");
+        return NGX_CONF_ERROR;
+    }
+    if (persist.data && size == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "persist requires a buffer");
+        return NGX_CONF_ERROR;
+    }
+    if (size && db->buf) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "buffer for database \"%V\" is already defined",
+                           &path);
+        return NGX_CONF_ERROR;
+    }
     if (size) {
-        shm_zone = ngx_http_sqlitelog_shm_zone(cf,size,lscf->db.fmt->name,path);
+        shm_zone = ngx_http_sqlitelog_shm_zone(cf, size, path);
         if (shm_zone == NULL) {
             ngx_conf_log_error(NGX_LOG_ERR, cf, 0,
                                "failed to create shared memory zone "
@@ -1032,6 +1927,22 @@ ngx_http_sqlitelog(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
         }
         buf->shm_zone = shm_zone;
         buf->max = max;
+        buf->hugepages = hugepages;
+        buf->persist = persist;
+        buf->ccf = (ngx_core_conf_t *) ngx_get_conf(cf->cycle->conf_ctx,
+                                                    ngx_core_module);
+        shm_zone->data = buf;
+        
+        /* An adaptive buffer's max and flush are its upper bounds */
+        if (adaptive) {
+            buf->adaptive = adaptive;
+            if (max == 0) {
+                buf->max = NGX_HTTP_SQLITELOG_BUF_ADAPTIVE_MAX;
+            }
+            if (flush == 0) {
+                flush = adaptive;
+            }
+        }
         
         if (flush) {
             buf->flush = flush;
@@ -1054,7 +1965,10 @@ ngx_http_sqlitelog(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
             buf->event->data = ctx;
         }
         
-        lscf->buf = buf;
+        db->buf = buf;
+    }
+    if (db->buf) {
+        db->buf->rollup = db->rollup;
     }
     
     return NGX_CONF_OK;
@@ -1062,22 +1976,80 @@ ngx_http_sqlitelog(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 
 
 /**
- * Parse the format name of the sqlitelog directive.
+ * Get the database for the given file, creating it if no other sqlitelog has
+ * used the file yet.
  * 
- * @param   cf      the current config
- * @param   arg     the format name
- * @return          NGX_CONF_OK on success, or
- *                  NGX_CONF_ERROR on failure
+ * @param   cf          the current configuration
+ * @param   filename    the database's full filename
+ * @return              the database, or
+ *                      NULL on failure
  */
-static char *
-ngx_http_sqlitelog_opt_format(ngx_conf_t *cf, ngx_str_t arg)
+static ngx_http_sqlitelog_db_t *
+ngx_http_sqlitelog_add_db(ngx_conf_t *cf, ngx_str_t filename)
+{
+    ngx_uint_t                        i;
+    ngx_http_sqlitelog_db_t         **dbp;
+    ngx_http_sqlitelog_db_t          *db;
+    ngx_http_sqlitelog_main_conf_t   *lmcf;
+    
+    lmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_sqlitelog_module);
+    
+    /* Existing */
+    dbp = lmcf->dbs.elts;
+    for (i = 0; i < lmcf->dbs.nelts; i++) {
+        if (ngx_str_eq(&dbp[i]->filename, &filename)) {
+            return dbp[i];
+        }
+    }
+    
+    /* New */
+    db = ngx_pcalloc(cf->pool, sizeof(ngx_http_sqlitelog_db_t));
+    if (db == NULL) {
+        return NULL;
+    }
+    db->filename = filename;
+    db->deferred = NGX_CONF_UNSET;
+    
+    if (ngx_array_init(&db->formats, cf->pool, 1,
+                       sizeof(ngx_http_sqlitelog_fmt_t *))
+        != NGX_OK)
+    {
+        return NULL;
+    }
+    
+    if (ngx_array_init(&db->scripts, cf->pool, 1, sizeof(ngx_str_t))
+        != NGX_OK)
+    {
+        return NULL;
+    }
+    
+    dbp = ngx_array_push(&lmcf->dbs);
+    if (dbp == NULL) {
+        return NULL;
+    }
+    *dbp = db;
+    
+    return db;
+}
+
+
+/**
+ * Parse the format name of the sqlitelog directive.
+ * 
+ * @param   cf      the current config
+ * @param   arg     the format name
+ * @param   fmtp    a pointer for storing the format
+ * @return          NGX_CONF_OK on success, or
+ *                  NGX_CONF_ERROR on failure
+ */
+static char *
+ngx_http_sqlitelog_opt_format(ngx_conf_t *cf, ngx_str_t arg,
+    ngx_http_sqlitelog_fmt_t **fmtp)
 {
     ngx_uint_t                       i;
     ngx_http_sqlitelog_fmt_t        *fmt;
-    ngx_http_sqlitelog_srv_conf_t   *lscf;
     ngx_http_sqlitelog_main_conf_t  *lmcf;
     
-    lscf = ngx_http_conf_get_module_srv_conf(cf, ngx_http_sqlitelog_module);
     lmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_sqlitelog_module);
     fmt = lmcf->formats.elts;
     
@@ -1089,20 +2061,20 @@ ngx_http_sqlitelog_opt_format(ngx_conf_t *cf, ngx_str_t arg)
     
     /* Combined check */
     if (ngx_str_eq_cs(&arg, "combined")) {
-        lscf->db.fmt = fmt;
+        *fmtp = fmt;
         return NGX_CONF_OK;
     }
     
     /* Find */
     for (i = 0; i < lmcf->formats.nelts; i++) {
         if (ngx_str_eq(&fmt->name, &arg)) {
-            lscf->db.fmt = fmt;
+            *fmtp = fmt;
             break;
         }
         fmt++;
     }
     
-    if (lscf->db.fmt == NULL) {
+    if (*fmtp == NULL) {
         ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "unknown format \"%V\"", &arg);
         return NGX_CONF_ERROR;
     }
@@ -1223,22 +2195,58 @@ ngx_http_sqlitelog_opt_flush(ngx_conf_t *cf, ngx_str_t arg, ngx_msec_t *flush)
 }
 
 
+/**
+ * Parse the adaptive=time argument from the sqlitelog directive.
+ * 
+ * @param   cf          the current config
+ * @param   arg         adaptive=time
+ * @param   adaptive    a pointer for storing the parsed value
+ * @return              NGX_CONF_OK on success, or
+ *                      NGX_CONF_ERROR on failure
+ */
+static char *
+ngx_http_sqlitelog_opt_adaptive(ngx_conf_t *cf, ngx_str_t arg,
+    ngx_msec_t *adaptive)
+{
+    ngx_str_t   s;
+    ngx_msec_t  t;
+    
+    s.data = arg.data + ngx_strlen("adaptive=");
+    s.len = arg.len - ngx_strlen("adaptive=");
+    
+    t = ngx_parse_time(&s, 0);
+    
+    if (t == (ngx_msec_t) NGX_ERROR) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid adaptive duration \"%V\"", &s);
+        return NGX_CONF_ERROR;
+    }
+    else if (t < 1000) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "adaptive duration \"%V\" is too short; "
+                           "must be at least 1s", &s);
+        return NGX_CONF_ERROR;
+    }
+    
+    *adaptive = t;
+    return NGX_CONF_OK;
+}
+
+
 /**
  * Read the SQL init script from the sqlitelog directive.
  * 
  * @param   cf      the current config
  * @param   arg     init=script
+ * @param   sqlp    a pointer for storing the script's contents
  * @return          NGX_CONF_OK on success, or
  *                  NGX_CONF_ERROR on failure
  */
 static char *
-ngx_http_sqlitelog_opt_init(ngx_conf_t *cf, ngx_str_t arg)
+ngx_http_sqlitelog_opt_init(ngx_conf_t *cf, ngx_str_t arg, ngx_str_t *sqlp)
 {
     ngx_str_t                        s;
     ngx_str_t                        sql;
-    ngx_http_sqlitelog_srv_conf_t   *lscf;
-    
-    lscf = ngx_http_conf_get_module_srv_conf(cf, ngx_http_sqlitelog_module);
     
     s.data = arg.data + ngx_strlen("init=");
     s.len = arg.len - ngx_strlen("init=");
@@ -1254,7 +2262,7 @@ ngx_http_sqlitelog_opt_init(ngx_conf_t *cf, ngx_str_t arg)
         return NGX_CONF_ERROR;
     }
     
-    lscf->db.init_sql = sql;
+    *sqlp = sql;
     return NGX_CONF_OK;
 }
 
@@ -1264,18 +2272,17 @@ ngx_http_sqlitelog_opt_init(ngx_conf_t *cf, ngx_str_t arg)
  * 
  * @param   cf      the current config
  * @param   arg     if=condition
+ * @param   filter  a pointer for storing the compiled condition
  * @return          NGX_CONF_OK on success, or
  *                  NGX_CONF_ERROR on failure
  */
 static char *
-ngx_http_sqlitelog_opt_if(ngx_conf_t *cf, ngx_str_t arg)
+ngx_http_sqlitelog_opt_if(ngx_conf_t *cf, ngx_str_t arg,
+    ngx_http_complex_value_t **filter)
 {
     ngx_str_t                           s;
-    ngx_http_sqlitelog_srv_conf_t      *lscf;
     ngx_http_compile_complex_value_t    ccv;
     
-    lscf = ngx_http_conf_get_module_srv_conf(cf, ngx_http_sqlitelog_module);
-    
     s.data = arg.data + ngx_strlen("if=");
     s.len = arg.len - ngx_strlen("if=");
 
@@ -1295,7 +2302,260 @@ ngx_http_sqlitelog_opt_if(ngx_conf_t *cf, ngx_str_t arg)
         return NGX_CONF_ERROR;
     }
 
-    lscf->filter = ccv.complex_value;
+    *filter = ccv.complex_value;
+    return NGX_CONF_OK;
+}
+
+
+/**
+ * Parse the retention=time argument from the sqlitelog directive.
+ * 
+ * @param   cf      the current config
+ * @param   arg     retention=time
+ * @param   ttl     a pointer for storing the parsed value, in seconds
+ * @return          NGX_CONF_OK on success, or
+ *                  NGX_CONF_ERROR on failure
+ */
+static char *
+ngx_http_sqlitelog_opt_retention(ngx_conf_t *cf, ngx_str_t arg, time_t *ttl)
+{
+    time_t     t;
+    ngx_str_t  s;
+    
+    s.data = arg.data + ngx_strlen("retention=");
+    s.len = arg.len - ngx_strlen("retention=");
+    
+    t = ngx_parse_time(&s, 1);
+    
+    if (t == (time_t) NGX_ERROR) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid retention period \"%V\"", &s);
+        return NGX_CONF_ERROR;
+    }
+    else if (t < 60) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "retention period \"%V\" is too short; "
+                           "must be at least 60s", &s);
+        return NGX_CONF_ERROR;
+    }
+    
+    *ttl = t;
+    return NGX_CONF_OK;
+}
+
+
+/**
+ * Parse the retention_column=name argument from the sqlitelog directive.
+ * 
+ * @param   cf      the current config
+ * @param   arg     retention_column=name
+ * @param   column  a pointer for storing the column name
+ * @return          NGX_CONF_OK on success, or
+ *                  NGX_CONF_ERROR on failure
+ */
+static char *
+ngx_http_sqlitelog_opt_retention_column(ngx_conf_t *cf, ngx_str_t arg,
+    ngx_str_t *column)
+{
+    ngx_str_t  s;
+    
+    s.data = arg.data + ngx_strlen("retention_column=");
+    s.len = arg.len - ngx_strlen("retention_column=");
+    
+    if (s.len == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "empty retention column name");
+        return NGX_CONF_ERROR;
+    }
+    
+    /* Allow the column to be written as a variable, e.g. "$msec" */
+    if (s.data[0] == '$') {
+        s.data++;
+        s.len--;
+    }
+    
+    *column = s;
+    return NGX_CONF_OK;
+}
+
+
+/**
+ * Parse the rollup=name argument from the sqlitelog directive.
+ * 
+ * @param   cf      the current config
+ * @param   arg     rollup=name
+ * @param   rollup  a pointer for storing the rollup
+ * @return          NGX_CONF_OK on success, or
+ *                  NGX_CONF_ERROR on failure
+ */
+static char *
+ngx_http_sqlitelog_opt_rollup(ngx_conf_t *cf, ngx_str_t arg,
+    ngx_http_sqlitelog_rollup_t **rollup)
+{
+    ngx_str_t                        s;
+    ngx_uint_t                       i;
+    ngx_http_sqlitelog_rollup_t     *r;
+    ngx_http_sqlitelog_main_conf_t  *lmcf;
+    
+    lmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_sqlitelog_module);
+    r = lmcf->rollups.elts;
+    
+    s.data = arg.data + ngx_strlen("rollup=");
+    s.len = arg.len - ngx_strlen("rollup=");
+    
+    for (i = 0; i < lmcf->rollups.nelts; i++) {
+        if (ngx_str_eq(&r[i].name, &s)) {
+            *rollup = &r[i];
+            return NGX_CONF_OK;
+        }
+    }
+    
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "unknown rollup \"%V\"", &s);
+    return NGX_CONF_ERROR;
+}
+
+
+/**
+ * Parse the sample=rate or sample_errors=rate argument from the sqlitelog
+ * directive. The rate is a percentage with up to 2 decimal places.
+ * 
+ * @param   cf      the current config
+ * @param   arg     sample=rate or sample_errors=rate
+ * @param   rate    a pointer for storing the parsed value, in 1/10000ths
+ * @return          NGX_CONF_OK on success, or
+ *                  NGX_CONF_ERROR on failure
+ */
+static char *
+ngx_http_sqlitelog_opt_sample(ngx_conf_t *cf, ngx_str_t arg, ngx_uint_t *rate)
+{
+    u_char     *eq;
+    ngx_int_t   n;
+    ngx_str_t   s;
+    
+    eq = ngx_strlchr(arg.data, arg.data + arg.len, '=');
+    s.data = eq + 1;
+    s.len = arg.data + arg.len - s.data;
+    
+    if (s.len < 2 || s.data[s.len - 1] != '%') {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid sampling rate \"%V\"; "
+                           "must be a percentage", &s);
+        return NGX_CONF_ERROR;
+    }
+    
+    n = ngx_atofp(s.data, s.len - 1, 2);
+    if (n == NGX_ERROR || n > 10000) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid sampling rate \"%V\"; "
+                           "must be between 0%% and 100%%", &s);
+        return NGX_CONF_ERROR;
+    }
+    
+    *rate = n;
+    return NGX_CONF_OK;
+}
+
+
+/**
+ * Parse the index_mode=immediate|deferred option of the sqlitelog directive.
+ * 
+ * @param   cf          the current config
+ * @param   arg         the argument
+ * @param   deferred    a pointer for storing 1 if deferred, or 0 if immediate
+ * @return              NGX_CONF_OK on success, or
+ *                      NGX_CONF_ERROR on failure
+ */
+static char *
+ngx_http_sqlitelog_opt_index_mode(ngx_conf_t *cf, ngx_str_t arg,
+    ngx_flag_t *deferred)
+{
+    ngx_str_t  s;
+    
+    s.data = arg.data + ngx_strlen("index_mode=");
+    s.len = arg.len - ngx_strlen("index_mode=");
+    
+    if (ngx_str_eq_cs(&s, "immediate")) {
+        *deferred = 0;
+    }
+    else if (ngx_str_eq_cs(&s, "deferred")) {
+        *deferred = 1;
+    }
+    else {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid index_mode \"%V\", it must be "
+                           "\"immediate\" or \"deferred\"", &s);
+        return NGX_CONF_ERROR;
+    }
+    
+    return NGX_CONF_OK;
+}
+
+
+/**
+ * Parse the persist=path option of the sqlitelog directive.
+ * 
+ * @param   cf      the current config
+ * @param   arg     persist=path
+ * @param   path    a pointer for storing the journal file's full path
+ * @return          NGX_CONF_OK on success, or
+ *                  NGX_CONF_ERROR on failure
+ */
+static char *
+ngx_http_sqlitelog_opt_persist(ngx_conf_t *cf, ngx_str_t arg, ngx_str_t *path)
+{
+    ngx_str_t  s;
+    
+    s.data = arg.data + ngx_strlen("persist=");
+    s.len = arg.len - ngx_strlen("persist=");
+    
+    if (s.len == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "persist path is empty");
+        return NGX_CONF_ERROR;
+    }
+    
+    if (ngx_conf_full_name(cf->cycle, &s, 0) != NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
+    
+    *path = s;
+    return NGX_CONF_OK;
+}
+
+
+/**
+ * Parse the checkpoint=time option of the sqlitelog directive.
+ * 
+ * @param   cf          the current config
+ * @param   arg         checkpoint=time
+ * @param   interval    a pointer for storing the parsed value
+ * @return              NGX_CONF_OK on success, or
+ *                      NGX_CONF_ERROR on failure
+ */
+static char *
+ngx_http_sqlitelog_opt_checkpoint(ngx_conf_t *cf, ngx_str_t arg,
+    ngx_msec_t *interval)
+{
+    ngx_str_t   s;
+    ngx_msec_t  t;
+    
+    s.data = arg.data + ngx_strlen("checkpoint=");
+    s.len = arg.len - ngx_strlen("checkpoint=");
+    
+    t = ngx_parse_time(&s, 0);
+    
+    if (t == (ngx_msec_t) NGX_ERROR) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid checkpoint interval \"%V\"", &s);
+        return NGX_CONF_ERROR;
+    }
+    else if (t < 1000) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "checkpoint interval \"%V\" is too short; "
+                           "must be at least 1s", &s);
+        return NGX_CONF_ERROR;
+    }
+    
+    *interval = t;
     return NGX_CONF_OK;
 }
 
@@ -1305,14 +2565,12 @@ ngx_http_sqlitelog_opt_if(ngx_conf_t *cf, ngx_str_t arg)
  * 
  * @param   cf          the current configuration
  * @param   size        the size of the zone
- * @param   format      the format name
  * @param   filename    the database's filename
  * @return              a shared memory zone (ngx_shm_zone_t), or
  *                      NULL on failure
  */
 ngx_shm_zone_t *
-ngx_http_sqlitelog_shm_zone(ngx_conf_t *cf, ssize_t size, ngx_str_t format,
-    ngx_str_t filename)
+ngx_http_sqlitelog_shm_zone(ngx_conf_t *cf, ssize_t size, ngx_str_t filename)
 {
     u_char          *buf;
     void            *tag;
@@ -1320,17 +2578,15 @@ ngx_http_sqlitelog_shm_zone(ngx_conf_t *cf, ssize_t size, ngx_str_t format,
     ngx_uint_t       name_len;
     ngx_shm_zone_t  *shm_zone;
     
-    /* Name: sqlitelog_<format>_<path> */
+    /* Name: sqlitelog_<path> */
     name_len = 0;
     name_len += ngx_strlen("sqlitelog_");
-    name_len += format.len;
-    name_len += ngx_strlen("_");
     name_len += filename.len;
     buf = ngx_pcalloc(cf->pool, name_len * sizeof(u_char));
     if (buf == NULL) {
         return NULL;
     }
-    ngx_sprintf(buf, "sqlitelog_%V_%V", &format, &filename);
+    ngx_sprintf(buf, "sqlitelog_%V", &filename);
     name.data = buf;
     name.len = name_len;
      
@@ -1413,10 +2669,14 @@ ngx_http_sqlitelog_format(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
         return "doesn't contain any variables";
     }
     
-    /* Dangling type check */
+    /* Dangling type check; words before the first variable are options */
     value = cf->args->elts;
+    n = 0;
     for (i = 0; i < cf->args->nelts; i++) {
-        if (i >= 2 && value->data[0] != '$') {
+        if (i >= 2 && value->data[0] == '$') {
+            n++;
+        }
+        else if (i >= 2 && n > 0) {
             value--;
             if (value->data[0] != '$') {
                 ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
@@ -1443,89 +2703,600 @@ ngx_http_sqlitelog_format(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 
 
 /**
- * Set the thread pool name from the sqlitelog_async directive.
+ * Define a rollup table from the sqlitelog_rollup directive.
  * 
  * @param   cf      the current line of the config file
  * @param   cmd     a pointer to the directive object
- * @param   conf    this module's custom configuration struct
+ * @param   conf    this module's main configuration struct
  * @return          NGX_CONF_OK on success,
  *                  or NGX_CONF_ERROR on failure
  */
-#if (NGX_THREADS)
 static char *
-ngx_http_sqlitelog_async(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+ngx_http_sqlitelog_rollup(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 {
     ngx_http_sqlitelog_main_conf_t *lmcf = conf;
     
-    ngx_str_t   arg;
-    ngx_str_t   default_pool_name;
-    ngx_str_t  *value;
+    char                         *rc;
+    time_t                        interval;
+    ngx_str_t                     s;
+    ngx_str_t                    *value;
+    ngx_uint_t                    i;
+    ngx_http_sqlitelog_fmt_t     *fmt;
+    ngx_http_sqlitelog_rollup_t  *rollup;
     
-    value = cf->args->elts; /* typecast from void* */
-    arg = value[1];
-    ngx_str_set(&default_pool_name, "default");
+    value = cf->args->elts;
+    fmt = lmcf->formats.elts;
+    rollup = lmcf->rollups.elts;
     
-    /* Duplicate check */
-    if (lmcf->tp) {
-        return "is duplicate";
+    /* Empty check */
+    if (value[1].len == 0) {
+        return "has empty table name";
     }
     
-    /* on */
-    if (ngx_str_eq_cs(&arg, "on")) {
-        lmcf->tp = ngx_thread_pool_add(cf, &default_pool_name);
-        if (lmcf->tp == NULL) {
+    /* Duplicate check */
+    for (i = 0; i < lmcf->formats.nelts; i++) {
+        if (ngx_str_eq(&value[1], &fmt[i].name)) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "rollup \"%V\" has the same name as a format",
+                               &value[1]);
             return NGX_CONF_ERROR;
         }
     }
-    
-    /* off */
-    else if (ngx_str_eq_cs(&arg, "off")) {
-        /* void */
-    }
-    
-    /* Pool name */
-    else {
-        lmcf->tp = ngx_thread_pool_get(cf->cycle, &arg);
-        if (lmcf->tp == NULL) {
+    for (i = 0; i < lmcf->rollups.nelts; i++) {
+        if (ngx_str_eq(&value[1], &rollup[i].name)) {
             ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
-                               "unknown thread pool \"%V\"", &arg);
+                               "rollup \"%V\" is duplicate", &value[1]);
             return NGX_CONF_ERROR;
         }
     }
     
-    return NGX_CONF_OK;
-}
-#endif
+    /* Push */
+    rollup = ngx_array_push(&lmcf->rollups);
+    if (rollup == NULL) {
+        return NGX_CONF_ERROR;
+    }
+    ngx_memzero(rollup, sizeof(ngx_http_sqlitelog_rollup_t));
+    
+    rollup->name = value[1];
+    rollup->interval = 60;
+    
+    if (ngx_array_init(&rollup->groups, cf->pool, 4,
+                       sizeof(ngx_http_sqlitelog_rollup_var_t))
+        != NGX_OK
+        || ngx_array_init(&rollup->aggs, cf->pool, 4,
+                          sizeof(ngx_http_sqlitelog_rollup_var_t))
+        != NGX_OK)
+    {
+        return NGX_CONF_ERROR;
+    }
+    
+    /* Arguments */
+    for (i = 2; i < cf->args->nelts; i++) {
+        
+        /* interval=time */
+        if (ngx_has_prefix(&value[i], "interval=")) {
+            s.data = value[i].data + ngx_strlen("interval=");
+            s.len = value[i].len - ngx_strlen("interval=");
+            
+            interval = ngx_parse_time(&s, 1);
+            if (interval == (time_t) NGX_ERROR || interval < 1) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid rollup interval \"%V\"", &s);
+                return NGX_CONF_ERROR;
+            }
+            rollup->interval = interval;
+            rc = NGX_CONF_OK;
+        }
+        
+        /* sum=$var */
+        else if (ngx_has_prefix(&value[i], "sum=")) {
+            rc = ngx_http_sqlitelog_rollup_var(cf, value[i], &rollup->aggs,
+                                               NGX_HTTP_SQLITELOG_ROLLUP_SUM);
+        }
+        
+        /* min=$var */
+        else if (ngx_has_prefix(&value[i], "min=")) {
+            rc = ngx_http_sqlitelog_rollup_var(cf, value[i], &rollup->aggs,
+                                               NGX_HTTP_SQLITELOG_ROLLUP_MIN);
+        }
+        
+        /* max=$var */
+        else if (ngx_has_prefix(&value[i], "max=")) {
+            rc = ngx_http_sqlitelog_rollup_var(cf, value[i], &rollup->aggs,
+                                               NGX_HTTP_SQLITELOG_ROLLUP_MAX);
+        }
+        
+        /* $var */
+        else {
+            rc = ngx_http_sqlitelog_rollup_var(cf, value[i], &rollup->groups,
+                                               0);
+        }
+        
+        if (rc != NGX_CONF_OK) {
+            return rc;
+        }
+    }
+    
+    /* Statements */
+    rollup->sql_create = ngx_http_sqlitelog_sql_rollup_create(rollup,
+                                                              cf->pool);
+    rollup->sql_upsert = ngx_http_sqlitelog_sql_rollup_upsert(rollup,
+                                                              cf->pool);
+    if (rollup->sql_create.data == NULL || rollup->sql_upsert.data == NULL) {
+        return NGX_CONF_ERROR;
+    }
+    
+    return NGX_CONF_OK;
+}
+
+
+/**
+ * Define an index on a format's table from the sqlitelog_index directive.
+ * 
+ * The index is named after its table and columns (e.g. "main_status"), unless
+ * name= is given.
+ * 
+ * @param   cf      the current line of the config file
+ * @param   cmd     a pointer to the directive object
+ * @param   conf    this module's main configuration struct
+ * @return          NGX_CONF_OK on success,
+ *                  or NGX_CONF_ERROR on failure
+ */
+static char *
+ngx_http_sqlitelog_index(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_sqlitelog_main_conf_t *lmcf = conf;
+    
+    u_char                      *p;
+    ngx_str_t                    name;
+    ngx_str_t                    where;
+    ngx_str_t                   *value;
+    ngx_str_t                   *colname;
+    ngx_uint_t                   i;
+    ngx_uint_t                   j;
+    ngx_array_t                  columns;
+    ngx_http_sqlitelog_col_t    *col;
+    ngx_http_sqlitelog_fmt_t    *fmt;
+    ngx_http_sqlitelog_fmt_t    *f;
+    ngx_http_sqlitelog_index_t  *index;
+    
+    value = cf->args->elts;
+    fmt = NULL;
+    name.data = NULL;
+    name.len = 0;
+    where.data = NULL;
+    where.len = 0;
+    
+    /* Position check */
+    if (lmcf->dbs.nelts) {
+        return "must come before \"sqlitelog\" directive";
+    }
+    
+    /* Format */
+    if (ngx_str_eq_cs(&value[1], "combined")) {
+        return "can't be used with the combined format";
+    }
+    f = lmcf->formats.elts;
+    for (i = 0; i < lmcf->formats.nelts; i++) {
+        if (ngx_str_eq(&value[1], &f[i].name)) {
+            fmt = &f[i];
+            break;
+        }
+    }
+    if (fmt == NULL) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "format \"%V\" is not defined", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+    
+    if (ngx_array_init(&columns, cf->pool, 2, sizeof(ngx_str_t)) != NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
+    
+    /* Arguments */
+    for (i = 2; i < cf->args->nelts; i++) {
+        
+        /* name=index */
+        if (ngx_has_prefix(&value[i], "name=")) {
+            name.data = value[i].data + ngx_strlen("name=");
+            name.len = value[i].len - ngx_strlen("name=");
+            if (name.len == 0) {
+                return "has empty index name";
+            }
+        }
+        
+        /* where=expr */
+        else if (ngx_has_prefix(&value[i], "where=")) {
+            where.data = value[i].data + ngx_strlen("where=");
+            where.len = value[i].len - ngx_strlen("where=");
+            if (where.len == 0) {
+                return "has empty where expression";
+            }
+        }
+        
+        /* $var */
+        else if (value[i].len >= 2 && value[i].data[0] == '$') {
+            colname = ngx_array_push(&columns);
+            if (colname == NULL) {
+                return NGX_CONF_ERROR;
+            }
+            colname->data = value[i].data + 1;
+            colname->len = value[i].len - 1;
+            
+            col = fmt->columns.elts;
+            for (j = 0; j < fmt->columns.nelts; j++) {
+                if (ngx_str_eq(&col[j].name, colname)) {
+                    break;
+                }
+            }
+            if (j == fmt->columns.nelts) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "variable \"%V\" is not in format \"%V\"",
+                                   &value[i], &fmt->name);
+                return NGX_CONF_ERROR;
+            }
+        }
+        
+        else {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid index parameter \"%V\"", &value[i]);
+            return NGX_CONF_ERROR;
+        }
+    }
+    
+    if (columns.nelts == 0) {
+        return "doesn't contain any variables";
+    }
+    
+    /* Name: table_col1_col2... */
+    if (name.data == NULL) {
+        name.len = fmt->name.len;
+        colname = columns.elts;
+        for (i = 0; i < columns.nelts; i++) {
+            name.len += 1 + colname[i].len;
+        }
+        name.data = ngx_pnalloc(cf->pool, name.len);
+        if (name.data == NULL) {
+            return NGX_CONF_ERROR;
+        }
+        p = ngx_cpymem(name.data, fmt->name.data, fmt->name.len);
+        for (i = 0; i < columns.nelts; i++) {
+            *p++ = '_';
+            p = ngx_cpymem(p, colname[i].data, colname[i].len);
+        }
+    }
+    
+    /* Duplicate check */
+    for (i = 0; i < lmcf->formats.nelts; i++) {
+        index = f[i].indexes.elts;
+        for (j = 0; j < f[i].indexes.nelts; j++) {
+            if (ngx_str_eq(&name, &index[j].name)) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "index \"%V\" is duplicate", &name);
+                return NGX_CONF_ERROR;
+            }
+        }
+    }
+    
+    /* Push */
+    index = ngx_array_push(&fmt->indexes);
+    if (index == NULL) {
+        return NGX_CONF_ERROR;
+    }
+    index->name = name;
+    index->sql_create = ngx_http_sqlitelog_sql_create_index(name, fmt->name,
+                                                            &columns, where,
+                                                            cf->pool);
+    if (index->sql_create.data == NULL) {
+        return NGX_CONF_ERROR;
+    }
+    
+    return NGX_CONF_OK;
+}
+
+
+/**
+ * Parse a group-by variable ($var) or an aggregate (sum=$var, min=$var, or
+ * max=$var) from the sqlitelog_rollup directive.
+ * 
+ * Group-by columns are named after their variables, while aggregate columns
+ * are named after their type and variable, e.g. "sum_body_bytes_sent".
+ * 
+ * @param   cf      the current config
+ * @param   arg     the argument
+ * @param   vars    the array to push the variable to
+ * @param   type    the aggregate type, if any
+ * @return          NGX_CONF_OK on success, or
+ *                  NGX_CONF_ERROR on failure
+ */
+static char *
+ngx_http_sqlitelog_rollup_var(ngx_conf_t *cf, ngx_str_t arg,
+    ngx_array_t *vars, ngx_uint_t type)
+{
+    u_char                           *p;
+    ngx_str_t                         prefix;
+    ngx_str_t                         var_name;
+    ngx_http_sqlitelog_rollup_var_t  *var;
+    
+    prefix.len = 0;
+    
+    /* Aggregate, i.e. "sum=", "min=", or "max=" */
+    if (arg.len > 4 && arg.data[3] == '=') {
+        prefix.data = arg.data;
+        prefix.len = 3;
+        arg.data += 4;
+        arg.len -= 4;
+    }
+    
+    if (arg.len < 2 || arg.data[0] != '$') {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid rollup variable \"%V\"", &arg);
+        return NGX_CONF_ERROR;
+    }
+    
+    var_name.data = arg.data + 1;
+    var_name.len = arg.len - 1;
+    
+    var = ngx_array_push(vars);
+    if (var == NULL) {
+        return NGX_CONF_ERROR;
+    }
+    
+    var->type = type;
+    var->index = ngx_http_get_variable_index(cf, &var_name);
+    if (var->index == NGX_ERROR) {
+        return NGX_CONF_ERROR;
+    }
+    
+    /* Column name */
+    if (prefix.len == 0) {
+        var->name = var_name;
+    }
+    else {
+        var->name.len = prefix.len + 1 + var_name.len;
+        var->name.data = ngx_pnalloc(cf->pool, var->name.len);
+        if (var->name.data == NULL) {
+            return NGX_CONF_ERROR;
+        }
+        p = ngx_cpymem(var->name.data, prefix.data, prefix.len);
+        *p++ = '_';
+        ngx_memcpy(p, var_name.data, var_name.len);
+    }
+    
+    return NGX_CONF_OK;
+}
 
 
 /**
- * Create a server configuration.
+ * Set SQLite's memory configuration from the sqlitelog_memory directive.
+ * 
+ * @param   cf      the current line of the config file
+ * @param   cmd     a pointer to the directive object
+ * @param   conf    this module's main configuration struct
+ * @return          NGX_CONF_OK on success,
+ *                  or NGX_CONF_ERROR on failure
+ */
+static char *
+ngx_http_sqlitelog_memory(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_sqlitelog_main_conf_t *lmcf = conf;
+    
+    ssize_t                    size;
+    ngx_str_t                  s;
+    ngx_str_t                 *value;
+    ngx_uint_t                 i;
+    ngx_http_sqlitelog_mem_t  *mem;
+    
+    value = cf->args->elts;
+    
+    /* Duplicate check */
+    if (lmcf->mem) {
+        return "is duplicate";
+    }
+    
+    mem = ngx_pcalloc(cf->pool, sizeof(ngx_http_sqlitelog_mem_t));
+    if (mem == NULL) {
+        return NGX_CONF_ERROR;
+    }
+    mem->lookaside_n = NGX_CONF_UNSET_UINT;
+    
+    /* Limit */
+    size = ngx_parse_size(&value[1]);
+    if (size == NGX_ERROR) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid memory limit \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+    else if (size < NGX_HTTP_SQLITELOG_MEM_MIN) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "memory limit \"%V\" is too small; "
+                           "must be at least 1m", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+    mem->limit = size;
+    
+    /* Options */
+    for (i = 2; i < cf->args->nelts; i++) {
+        
+        /* pagecache=size */
+        if (ngx_has_prefix(&value[i], "pagecache=")) {
+            s.data = value[i].data + ngx_strlen("pagecache=");
+            s.len = value[i].len - ngx_strlen("pagecache=");
+            
+            size = ngx_parse_size(&s);
+            if (size == NGX_ERROR) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid page cache size \"%V\"", &s);
+                return NGX_CONF_ERROR;
+            }
+            else if (size < 16 * NGX_HTTP_SQLITELOG_MEM_PAGE) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "page cache size \"%V\" is too small; "
+                                   "must be at least 64k", &s);
+                return NGX_CONF_ERROR;
+            }
+            mem->pagecache = size;
+        }
+        
+        /* lookaside=size:number */
+        else if (ngx_has_prefix(&value[i], "lookaside=")) {
+            if (ngx_http_sqlitelog_opt_lookaside(cf, value[i], mem)
+                != NGX_CONF_OK)
+            {
+                return NGX_CONF_ERROR;
+            }
+        }
+        
+        /* Invalid */
+        else {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid memory parameter \"%V\"", &value[i]);
+            return NGX_CONF_ERROR;
+        }
+    }
+    
+    lmcf->mem = mem;
+    return NGX_CONF_OK;
+}
+
+
+/**
+ * Parse the lookaside=size:number option of the sqlitelog_memory directive.
+ * 
+ * A size or number of 0 disables lookaside.
+ * 
+ * @param   cf      the current config
+ * @param   arg     lookaside=size:number
+ * @param   mem     the memory configuration for storing the parsed values
+ * @return          NGX_CONF_OK on success, or
+ *                  NGX_CONF_ERROR on failure
+ */
+static char *
+ngx_http_sqlitelog_opt_lookaside(ngx_conf_t *cf, ngx_str_t arg,
+    ngx_http_sqlitelog_mem_t *mem)
+{
+    u_char     *colon;
+    ssize_t     size;
+    ngx_int_t   n;
+    ngx_str_t   s;
+    ngx_str_t   num;
+    
+    s.data = arg.data + ngx_strlen("lookaside=");
+    s.len = arg.len - ngx_strlen("lookaside=");
+    
+    colon = ngx_strlchr(s.data, s.data + s.len, ':');
+    if (colon == NULL) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid lookaside \"%V\", it must be "
+                           "size:number", &s);
+        return NGX_CONF_ERROR;
+    }
+    
+    num.data = colon + 1;
+    num.len = s.data + s.len - num.data;
+    s.len = colon - s.data;
+    
+    size = ngx_parse_size(&s);
+    if (size == NGX_ERROR || size > 65536) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid lookaside slot size \"%V\"; "
+                           "must be at most 64k", &s);
+        return NGX_CONF_ERROR;
+    }
+    
+    n = ngx_atoi(num.data, num.len);
+    if (n == NGX_ERROR || n > 65536) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid lookaside slot number \"%V\"; "
+                           "must be at most 65536", &num);
+        return NGX_CONF_ERROR;
+    }
+    
+    mem->lookaside_size = size;
+    mem->lookaside_n = n;
+    return NGX_CONF_OK;
+}
+
+
+/**
+ * Set the thread pool name from the sqlitelog_async directive.
+ * 
+ * @param   cf      the current line of the config file
+ * @param   cmd     a pointer to the directive object
+ * @param   conf    this module's custom configuration struct
+ * @return          NGX_CONF_OK on success,
+ *                  or NGX_CONF_ERROR on failure
+ */
+#if (NGX_THREADS)
+static char *
+ngx_http_sqlitelog_async(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_sqlitelog_main_conf_t *lmcf = conf;
+    
+    ngx_str_t   arg;
+    ngx_str_t   default_pool_name;
+    ngx_str_t  *value;
+    
+    value = cf->args->elts; /* typecast from void* */
+    arg = value[1];
+    ngx_str_set(&default_pool_name, "default");
+    
+    /* Duplicate check */
+    if (lmcf->tp) {
+        return "is duplicate";
+    }
+    
+    /* on */
+    if (ngx_str_eq_cs(&arg, "on")) {
+        lmcf->tp = ngx_thread_pool_add(cf, &default_pool_name);
+        if (lmcf->tp == NULL) {
+            return NGX_CONF_ERROR;
+        }
+    }
+    
+    /* off */
+    else if (ngx_str_eq_cs(&arg, "off")) {
+        /* void */
+    }
+    
+    /* Pool name */
+    else {
+        lmcf->tp = ngx_thread_pool_get(cf->cycle, &arg);
+        if (lmcf->tp == NULL) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "unknown thread pool \"%V\"", &arg);
+            return NGX_CONF_ERROR;
+        }
+    }
+    
+    return NGX_CONF_OK;
+}
+#endif
+
+
+/**
+ * Create a location configuration.
  * 
  * @param   cf      the current Nginx configuration file
  */
 static void *
-ngx_http_sqlitelog_create_srv_conf(ngx_conf_t *cf)
+ngx_http_sqlitelog_create_loc_conf(ngx_conf_t *cf)
 {
-    ngx_http_sqlitelog_srv_conf_t  *lscf;
+    ngx_http_sqlitelog_loc_conf_t  *llcf;
     
-    lscf = ngx_pcalloc(cf->pool, sizeof(ngx_http_sqlitelog_srv_conf_t));
-    if (lscf == NULL) {
+    llcf = ngx_pcalloc(cf->pool, sizeof(ngx_http_sqlitelog_loc_conf_t));
+    if (llcf == NULL) {
         return NULL;
     }
     
     /*
      * set by ngx_pcalloc():
-     *      lscf->db.conn       = NULL;
-     *      lscf->db.filename   = { NULL, 0 };
-     *      lscf->db.fmt        = NULL;
-     *      lscf->db.init_sql   = { NULL, 0 };
-     *      lscf->buffer        = NULL;
-     *      lscf->filter        = NULL;
+     *      llcf->logs          = NULL;
      */
     
-    lscf->enabled = NGX_CONF_UNSET;
+    llcf->enabled = NGX_CONF_UNSET;
     
-    return lscf;
+    return llcf;
 }
 
 
@@ -1549,9 +3320,36 @@ ngx_http_sqlitelog_create_main_conf(ngx_conf_t *cf)
     /*
      * set by ngx_pcalloc():
      *      lmcf->formats       = NULL;
+     *      lmcf->rollups       = NULL;
+     *      lmcf->dbs           = NULL;
+     *      lmcf->logs          = NULL;
+     *      lmcf->nvalues       = 0;
      *      lmcf->combined_init = 0;
      *      lmcf->tp            = NULL;
+     *      lmcf->mem           = NULL;
      */
+    lmcf->drain_timeout = NGX_CONF_UNSET_MSEC;
+    
+    /* Initialize rollups array */
+    init = ngx_array_init(&lmcf->rollups, cf->pool, 1,
+                          sizeof(ngx_http_sqlitelog_rollup_t));
+    if (init != NGX_OK) {
+        return NULL;
+    }
+    
+    /* Initialize databases array */
+    init = ngx_array_init(&lmcf->dbs, cf->pool, 1,
+                          sizeof(ngx_http_sqlitelog_db_t *));
+    if (init != NGX_OK) {
+        return NULL;
+    }
+    
+    /* Initialize sqlitelogs array */
+    init = ngx_array_init(&lmcf->logs, cf->pool, 1,
+                          sizeof(ngx_http_sqlitelog_t *));
+    if (init != NGX_OK) {
+        return NULL;
+    }
     
     /* Initialize formats array */
     init = ngx_array_init(&lmcf->formats, cf->pool, 1,
@@ -1578,19 +3376,42 @@ ngx_http_sqlitelog_create_main_conf(ngx_conf_t *cf)
 
 
 /**
- * Inherit values from the parent server or http block if necessary.
+ * Initialize this module's main configuration with its defaults.
+ * 
+ * @param   cf      the current Nginx configuration file
+ * @param   conf    the main configuration
+ * @return          NGX_CONF_OK
+ */
+static char *
+ngx_http_sqlitelog_init_main_conf(ngx_conf_t *cf, void *conf)
+{
+    ngx_http_sqlitelog_main_conf_t  *lmcf = conf;
+    
+    ngx_conf_init_msec_value(lmcf->drain_timeout,
+                             NGX_HTTP_SQLITELOG_DRAIN_TIMEOUT);
+    
+    return NGX_CONF_OK;
+}
+
+
+/**
+ * Inherit the sqlitelog from the parent http, server, or location block if
+ * necessary.
  * 
  * @param   cf      the current Nginx configuration
- * @param   parent  the srv_conf_t from the parent "http" block
- * @param   child   the srv_conf_t from the current "server" block
+ * @param   parent  the loc_conf_t from the parent block
+ * @param   child   the loc_conf_t from the current block
  * @return          NGX_CONF_OK on success, or
  *                  NGX_CONF_ERROR on failure
  */
 static char *
-ngx_http_sqlitelog_merge_srv_conf(ngx_conf_t *cf, void *parent, void *child)
+ngx_http_sqlitelog_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
 {
-    ngx_http_sqlitelog_srv_conf_t *prev = parent;
-    ngx_http_sqlitelog_srv_conf_t *conf = child;
+    ngx_http_sqlitelog_loc_conf_t *prev = parent;
+    ngx_http_sqlitelog_loc_conf_t *conf = child;
+    
+    ngx_uint_t              i;
+    ngx_http_sqlitelog_t  **slogp;
     
     /* Parent block has "sqlitelog off", so disable current */
     if (prev->enabled == 0) {
@@ -1604,18 +3425,22 @@ ngx_http_sqlitelog_merge_srv_conf(ngx_conf_t *cf, void *parent, void *child)
     
     /* Current block has nothing, but parent has "sqlitelog", so inherit */
     else if (prev->enabled == 1 && conf->enabled == NGX_CONF_UNSET) {
-        conf->enabled     = prev->enabled;
-        conf->db.filename = prev->db.filename;
-        conf->db.fmt      = prev->db.fmt;
-        conf->db.init_sql = prev->db.init_sql;
-        conf->buf         = prev->buf;
-        conf->filter      = prev->filter;
+        conf->enabled = prev->enabled;
+        conf->logs    = prev->logs;
     }
     
-    /* Current block has nothing, and parent block has nothing, so disable */
-    else if (prev->enabled == NGX_CONF_UNSET && conf->enabled == NGX_CONF_UNSET)
-    {
-        conf->enabled = 0;
+    /*
+     * Current block has nothing, and parent block has nothing, so nothing is
+     * logged here, but the block stays unset: it's the parent of its nested
+     * locations, which may still have a sqlitelog of their own
+     */
+    
+    /* Requests can be logged here, so workers must open the database */
+    if (conf->enabled == 1) {
+        slogp = conf->logs->elts;
+        for (i = 0; i < conf->logs->nelts; i++) {
+            slogp[i]->db->enabled = 1;
+        }
     }
     
     return NGX_CONF_OK;
@@ -1633,14 +3458,33 @@ ngx_http_sqlitelog_merge_srv_conf(ngx_conf_t *cf, void *parent, void *child)
 static ngx_int_t
 ngx_http_sqlitelog_init_shm_zone(ngx_shm_zone_t *shm_zone, void *old_data)
 {
+    ngx_int_t                        rc_init;
     ngx_slab_pool_t                 *shpool;
+    ngx_http_sqlitelog_buf_t        *buf;
     ngx_http_sqlitelog_buf_shctx_t  *ctx;
     
     shpool = (ngx_slab_pool_t*) shm_zone->shm.addr;
+    buf = shm_zone->data;
+    
+    /* Huge pages; a reused zone keeps its mapping, so advise it again */
+    if (buf->hugepages) {
+        ngx_http_sqlitelog_buf_hugepages(&shm_zone->shm);
+    }
     
-    /* Reuse shared context from last cycle, if any */
+    /*
+     * Reuse shared context from last cycle, if any; it keeps its shards even
+     * if the worker process count changed, which is only a matter of
+     * contention, since a push to a full shard goes on to the others
+     */
     if (old_data) {
         shm_zone->data = old_data;
+        ctx = old_data;
+        buf->cycle = ngx_atomic_fetch_add(&ctx->cycles, 1) + 1;
+        if (buf->persist.data && ctx->journal == NULL) {
+            ngx_log_error(NGX_LOG_WARN, shm_zone->shm.log, 0,
+                          "sqlitelog: buffer for \"%V\" is persisted once "
+                          "Nginx is restarted", &buf->persist);
+        }
         return NGX_OK;
     }
     
@@ -1649,8 +3493,96 @@ ngx_http_sqlitelog_init_shm_zone(ngx_shm_zone_t *shm_zone, void *old_data)
     if (ctx == NULL) {
         return NGX_ERROR;
     }
-    ngx_queue_init(&ctx->queue);
+    ngx_http_sqlitelog_rollup_init_shctx(&ctx->rollup);
+    
+    /* One shard per worker process */
+    rc_init = ngx_http_sqlitelog_buf_init_shctx(ctx, shpool,
+                                                buf->ccf->worker_processes,
+                                                shm_zone->shm.log);
+    if (rc_init != NGX_OK) {
+        return NGX_ERROR;
+    }
     
     shm_zone->data = ctx;
+    ctx->cycles = 1;
+    buf->cycle = 1;
+    
+    /*
+     * On reload with another size, take the old zone's log entries, but only
+     * once the configuration has been loaded (see
+     * ngx_http_sqlitelog_init_module() ), since they'd be lost if the reload
+     * failed after this
+     */
+    if (!buf->persist.data) {
+        buf->old_zone = ngx_http_sqlitelog_old_shm_zone(shm_zone);
+    }
+    
+    /*
+     * Persistence; the journal is only opened when Nginx starts, since the
+     * previous cycle's workers may still be using it on reload, and never
+     * when the configuration is merely being tested
+     */
+    if (buf->persist.data && !ngx_test_config) {
+        if (!ngx_is_init_cycle(ngx_cycle)) {
+            ngx_log_error(NGX_LOG_WARN, shm_zone->shm.log, 0,
+                          "sqlitelog: buffer for \"%V\" is persisted once "
+                          "Nginx is restarted", &buf->persist);
+            return NGX_OK;
+        }
+        
+        rc_init = ngx_http_sqlitelog_buf_persist(buf, shm_zone->shm.log);
+        if (rc_init != NGX_OK) {
+            return NGX_ERROR;
+        }
+    }
+    
     return NGX_OK;
 }
+
+
+/**
+ * Find the previous cycle's shared memory zone with the same name as a new
+ * zone, if Nginx is reloading.
+ * 
+ * @param   shm_zone    the new zone
+ * @return              the previous cycle's zone, or
+ *                      NULL if there is none
+ */
+static ngx_shm_zone_t *
+ngx_http_sqlitelog_old_shm_zone(ngx_shm_zone_t *shm_zone)
+{
+    ngx_uint_t        i;
+    ngx_shm_zone_t   *old;
+    ngx_list_part_t  *part;
+    
+    if (ngx_is_init_cycle(ngx_cycle)) {
+        return NULL;
+    }
+    
+    part = (ngx_list_part_t *) &ngx_cycle->shared_memory.part;
+    old = part->elts;
+    
+    for (i = 0; /* void */ ; i++) {
+        
+        if (i >= part->nelts) {
+            if (part->next == NULL) {
+                break;
+            }
+            part = part->next;
+            old = part->elts;
+            i = 0;
+        }
+        
+        if (old[i].tag == shm_zone->tag
+            && old[i].data
+            && old[i].shm.name.len == shm_zone->shm.name.len
+            && ngx_strncmp(old[i].shm.name.data, shm_zone->shm.name.data,
+                           shm_zone->shm.name.len)
+               == 0)
+        {
+            return &old[i];
+        }
+    }
+    
+    return NULL;
+}
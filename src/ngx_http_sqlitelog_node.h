@@ -15,18 +15,25 @@
  * ngx_http_sqlitelog_node_t represents a node on the buffer's transaction
  * queue.
  * 
+ * table    the index of the log entry's table in the database
  * elts     a C-style array of strings
  * nelts    the length of elts
+ * seq      the sequence number that orders nodes across the buffer's shards
+ * sig      the signature of the tables of the configuration that pushed it
  * link     the queue that this node is currently on
  */
 typedef struct {
-    ngx_str_t    *elts;
-    ngx_uint_t    nelts;
-    ngx_queue_t   link;
+    ngx_uint_t          table;
+    ngx_str_t          *elts;
+    ngx_uint_t          nelts;
+    ngx_atomic_uint_t   seq;
+    uint32_t            sig;
+    ngx_queue_t         link;
 } ngx_http_sqlitelog_node_t;
 
 ngx_http_sqlitelog_node_t *ngx_http_sqlitelog_node_create_locked(
-    ngx_array_t *values, ngx_slab_pool_t *shpool, ngx_log_t *log);
+    ngx_uint_t table, ngx_array_t *values, ngx_slab_pool_t *shpool,
+    ngx_log_t *log);
 
 void ngx_http_sqlitelog_node_destroy_locked(ngx_http_sqlitelog_node_t *node,
     ngx_slab_pool_t *shpool);
@@ -16,6 +16,13 @@
 
 static uintptr_t ngx_http_sqlitelog_op_escape(u_char *dst, u_char *src,
     size_t size);
+static size_t ngx_http_sqlitelog_op_inet(ngx_http_request_t *r,
+    ngx_uint_t index, u_char *addr);
+
+
+/* The last generated id's timestamp and sequence number */
+static uint64_t  ngx_http_sqlitelog_op_id_msec;
+static uint64_t  ngx_http_sqlitelog_op_id_seq;
 
 
 /**
@@ -68,6 +75,40 @@ ngx_http_sqlitelog_op_compile(ngx_conf_t *cf, ngx_http_sqlitelog_op_t *op,
         run = ngx_http_sqlitelog_op_run_unescaped;
     }
     
+    /* Addresses are stored as 4 or 16 bytes */
+    if (ngx_str_eq_cs(type, "INET")) {
+        if (ngx_str_eq_cs(name, "binary_remote_addr")) {
+            getlen = ngx_http_sqlitelog_op_getlen_unescaped;
+            run = ngx_http_sqlitelog_op_run_unescaped;
+        }
+        else {
+            getlen = ngx_http_sqlitelog_op_getlen_inet;
+            run = ngx_http_sqlitelog_op_run_inet;
+        }
+    }
+    
+    /* Integer timestamps */
+    if (ngx_str_eq_cs(type, "EPOCH_MS") || ngx_str_eq_cs(type, "EPOCH_US")) {
+        if (!ngx_str_eq_cs(name, "msec")
+            && !ngx_str_eq_cs(name, "time_local")
+            && !ngx_str_eq_cs(name, "time_iso8601"))
+        {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "column type \"%V\" requires $msec, "
+                               "$time_local, or $time_iso8601", type);
+            return NGX_ERROR;
+        }
+        
+        if (ngx_str_eq_cs(type, "EPOCH_MS")) {
+            getlen = ngx_http_sqlitelog_op_getlen_epoch_ms;
+            run = ngx_http_sqlitelog_op_run_epoch_ms;
+        }
+        else {
+            getlen = ngx_http_sqlitelog_op_getlen_epoch_us;
+            run = ngx_http_sqlitelog_op_run_epoch_us;
+        }
+    }
+    
     /* Else, use generic functions */
     if (run == NULL && getlen == NULL) {
         getlen = ngx_http_sqlitelog_op_getlen;
@@ -528,3 +569,206 @@ ngx_http_sqlitelog_op_run_request_length(ngx_http_request_t *r, u_char *buf,
 {
     return ngx_sprintf(buf, "%O", r->request_length);
 }
+
+
+/**
+ * Get the length of a generated id.
+ *
+ * @param   r       the current request
+ * @param   index   unused
+ * @return          NGX_HTTP_SQLITELOG_OP_ID_LEN
+ */
+size_t
+ngx_http_sqlitelog_op_getlen_id(ngx_http_request_t *r, ngx_uint_t index)
+{
+    return NGX_HTTP_SQLITELOG_OP_ID_LEN;
+}
+
+
+/**
+ * Generate an id for the id column.
+ * 
+ * Ids increase with time, so rows are appended to the end of the table's
+ * b-tree. When more than 4096 ids are generated within one millisecond, the
+ * sequence carries over into the next millisecond, which keeps ids unique and
+ * increasing at the cost of running slightly ahead of the clock.
+ * 
+ * The middle 10 bits are the process's slot in the master process's process
+ * table (NGX_MAX_PROCESSES, 1024 slots), which no two running processes
+ * share, even while old worker processes are still finishing their requests
+ * after a reload. A process ID would do the same only by chance.
+ *
+ * @param   r       the current request
+ * @param   buf     a buffer in which to write the value
+ * @param   op      this column's operation object
+ * @return          the buffer, after the value has been printed to it
+ */
+u_char *
+ngx_http_sqlitelog_op_run_id(ngx_http_request_t *r, u_char *buf,
+    ngx_http_sqlitelog_op_t *op)
+{
+    uint64_t     id;
+    uint64_t     msec;
+    ngx_time_t  *tp;
+    
+    tp = ngx_timeofday();
+    msec = (uint64_t) tp->sec * 1000 + tp->msec
+           - NGX_HTTP_SQLITELOG_OP_ID_EPOCH;
+    
+    if (msec > ngx_http_sqlitelog_op_id_msec) {
+        ngx_http_sqlitelog_op_id_msec = msec;
+        ngx_http_sqlitelog_op_id_seq = 0;
+    }
+    else if (++ngx_http_sqlitelog_op_id_seq > 0xfff) {
+        ngx_http_sqlitelog_op_id_msec++;
+        ngx_http_sqlitelog_op_id_seq = 0;
+    }
+    
+    id = ngx_http_sqlitelog_op_id_msec << 22
+         | ((uint64_t) ngx_process_slot & 0x3ff) << 12
+         | ngx_http_sqlitelog_op_id_seq;
+    
+    return ngx_sprintf(buf, "%019uL", id);
+}
+
+
+/**
+ * Get the length of an EPOCH_MS timestamp.
+ *
+ * @param   r       the current request
+ * @param   index   unused
+ * @return          NGX_HTTP_SQLITELOG_OP_EPOCH_MS_LEN
+ */
+size_t
+ngx_http_sqlitelog_op_getlen_epoch_ms(ngx_http_request_t *r, ngx_uint_t index)
+{
+    return NGX_HTTP_SQLITELOG_OP_EPOCH_MS_LEN;
+}
+
+
+/**
+ * Get the length of an EPOCH_US timestamp.
+ *
+ * @param   r       the current request
+ * @param   index   unused
+ * @return          NGX_HTTP_SQLITELOG_OP_EPOCH_US_LEN
+ */
+size_t
+ngx_http_sqlitelog_op_getlen_epoch_us(ngx_http_request_t *r, ngx_uint_t index)
+{
+    return NGX_HTTP_SQLITELOG_OP_EPOCH_US_LEN;
+}
+
+
+/**
+ * Evaluate the current time in milliseconds, for an EPOCH_MS column.
+ * 
+ * This is the same instant as $msec, taken from the cached time.
+ *
+ * @param   r       the current request
+ * @param   buf     a buffer in which to write the value
+ * @param   op      this column's operation object
+ * @return          the buffer, after the value has been printed to it
+ */
+u_char *
+ngx_http_sqlitelog_op_run_epoch_ms(ngx_http_request_t *r, u_char *buf,
+    ngx_http_sqlitelog_op_t *op)
+{
+    ngx_time_t  *tp;
+    
+    tp = ngx_timeofday();
+    
+    return ngx_sprintf(buf, "%013uL", (uint64_t) tp->sec * 1000 + tp->msec);
+}
+
+
+/**
+ * Evaluate the current time in microseconds, for an EPOCH_US column.
+ * 
+ * The cached time only has millisecond precision, so the system clock is read.
+ *
+ * @param   r       the current request
+ * @param   buf     a buffer in which to write the value
+ * @param   op      this column's operation object
+ * @return          the buffer, after the value has been printed to it
+ */
+u_char *
+ngx_http_sqlitelog_op_run_epoch_us(ngx_http_request_t *r, u_char *buf,
+    ngx_http_sqlitelog_op_t *op)
+{
+    struct timeval  tv;
+    
+    ngx_gettimeofday(&tv);
+    
+    return ngx_sprintf(buf, "%016uL",
+                       (uint64_t) tv.tv_sec * 1000000 + tv.tv_usec);
+}
+
+
+/**
+ * Get the length of an INET column's value.
+ *
+ * @param   r       the current request
+ * @param   index   the variable's index
+ * @return          4 for IPv4, 16 for IPv6, or 0 if the value isn't an address
+ */
+size_t
+ngx_http_sqlitelog_op_getlen_inet(ngx_http_request_t *r, ngx_uint_t index)
+{
+    u_char  addr[16];
+    
+    return ngx_http_sqlitelog_op_inet(r, index, addr);
+}
+
+
+/**
+ * Evaluate an INET column's value, i.e. the variable's address in network
+ * byte order.
+ *
+ * @param   r       the current request
+ * @param   buf     a buffer in which to write the value
+ * @param   op      this variable's operation object
+ * @return          the buffer, after the value has been printed to it
+ */
+u_char *
+ngx_http_sqlitelog_op_run_inet(ngx_http_request_t *r, u_char *buf,
+    ngx_http_sqlitelog_op_t *op)
+{
+    return buf + ngx_http_sqlitelog_op_inet(r, op->index, buf);
+}
+
+
+/**
+ * Parse a variable's value as an IPv4 or IPv6 address.
+ *
+ * @param   r       the current request
+ * @param   index   the variable's index
+ * @param   addr    a buffer of 16 bytes in which to write the address
+ * @return          4 for IPv4, 16 for IPv6, or 0 if the value isn't an address
+ */
+static size_t
+ngx_http_sqlitelog_op_inet(ngx_http_request_t *r, ngx_uint_t index,
+    u_char *addr)
+{
+    in_addr_t                   inaddr;
+    ngx_http_variable_value_t  *value;
+    
+    value = ngx_http_get_indexed_variable(r, index);
+    if (value == NULL || value->not_found || value->len == 0) {
+        return 0;
+    }
+    
+    inaddr = ngx_inet_addr(value->data, value->len);
+    if (inaddr != INADDR_NONE) {
+        ngx_memcpy(addr, &inaddr, 4);
+        return 4;
+    }
+    
+#if (NGX_HAVE_INET6)
+    if (ngx_inet6_addr(value->data, value->len, addr) == NGX_OK) {
+        return 16;
+    }
+#endif
+    
+    return 0;
+}
@@ -14,6 +14,24 @@
 #include "ngx_http_sqlitelog_fmt.h"
 
 
+/*
+ * Generated ids (see the id format option) are 63-bit integers made of the
+ * milliseconds since NGX_HTTP_SQLITELOG_OP_ID_EPOCH, 10 bits of the process
+ * id, and a 12-bit sequence number. They are printed as 19 zero-padded
+ * decimal digits so that their length is known in advance.
+ */
+#define NGX_HTTP_SQLITELOG_OP_ID_EPOCH  1577836800000   /* 2020-01-01 */
+#define NGX_HTTP_SQLITELOG_OP_ID_LEN    19
+
+/*
+ * Columns of type EPOCH_MS and EPOCH_US hold the current time as an integer
+ * number of milliseconds or microseconds since the Unix epoch. They're printed
+ * zero-padded to a fixed width, which is enough until the year 2286.
+ */
+#define NGX_HTTP_SQLITELOG_OP_EPOCH_MS_LEN  13
+#define NGX_HTTP_SQLITELOG_OP_EPOCH_US_LEN  16
+
+
 typedef struct ngx_http_sqlitelog_op_s ngx_http_sqlitelog_op_t;
 
 /* Compute buffer size for variable's value during request */
@@ -74,6 +92,14 @@ size_t ngx_http_sqlitelog_op_getlen_time_iso8601(ngx_http_request_t *r,
     ngx_uint_t index);
 size_t ngx_http_sqlitelog_op_getlen_status(ngx_http_request_t *r,
     ngx_uint_t index);
+size_t ngx_http_sqlitelog_op_getlen_id(ngx_http_request_t *r,
+    ngx_uint_t index);
+size_t ngx_http_sqlitelog_op_getlen_epoch_ms(ngx_http_request_t *r,
+    ngx_uint_t index);
+size_t ngx_http_sqlitelog_op_getlen_epoch_us(ngx_http_request_t *r,
+    ngx_uint_t index);
+size_t ngx_http_sqlitelog_op_getlen_inet(ngx_http_request_t *r,
+    ngx_uint_t index);
 
 /* Run */
 u_char *ngx_http_sqlitelog_op_run(ngx_http_request_t *r,
@@ -98,3 +124,11 @@ u_char *ngx_http_sqlitelog_op_run_body_bytes_sent(ngx_http_request_t *r,
     u_char *buf, ngx_http_sqlitelog_op_t *op);
 u_char *ngx_http_sqlitelog_op_run_request_length(ngx_http_request_t *r,
     u_char *buf, ngx_http_sqlitelog_op_t *op);
+u_char *ngx_http_sqlitelog_op_run_id(ngx_http_request_t *r,
+    u_char *buf, ngx_http_sqlitelog_op_t *op);
+u_char *ngx_http_sqlitelog_op_run_epoch_ms(ngx_http_request_t *r,
+    u_char *buf, ngx_http_sqlitelog_op_t *op);
+u_char *ngx_http_sqlitelog_op_run_epoch_us(ngx_http_request_t *r,
+    u_char *buf, ngx_http_sqlitelog_op_t *op);
+u_char *ngx_http_sqlitelog_op_run_inet(ngx_http_request_t *r,
+    u_char *buf, ngx_http_sqlitelog_op_t *op);
@@ -0,0 +1,428 @@
+
+/*
+ * Copyright (C) Serope.com
+ */
+
+
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+
+#include "ngx_http_sqlitelog_col.h"
+#include "ngx_http_sqlitelog_db.h"
+#include "ngx_http_sqlitelog_retention.h"
+#include "ngx_http_sqlitelog_sql.h"
+#include "ngx_http_sqlitelog_sqlite3.h"
+#include "ngx_http_sqlitelog_thread.h"
+#include "ngx_http_sqlitelog_util.h"
+
+
+static void ngx_http_sqlitelog_retention_handler(ngx_event_t *ev);
+static ngx_int_t ngx_http_sqlitelog_retention_run(
+    ngx_http_sqlitelog_retention_t *ret, ngx_uint_t chunks, ngx_log_t *log);
+static ngx_int_t ngx_http_sqlitelog_retention_run_once(
+    ngx_http_sqlitelog_retention_t *ret, ngx_log_t *log);
+static void ngx_http_sqlitelog_retention_schedule(
+    ngx_http_sqlitelog_retention_t *ret);
+
+#if (NGX_THREADS)
+static void ngx_http_sqlitelog_retention_thread_handler(void *data,
+    ngx_log_t *log);
+static void ngx_http_sqlitelog_retention_completed_handler(ngx_event_t *ev);
+#endif
+
+
+/**
+ * Set up the retention policy of a database using the given log format.
+ * 
+ * If no column was named by retention_column=, the first $msec, $time_iso8601,
+ * or EPOCH_MS/EPOCH_US column in the format is used.
+ * 
+ * @param   cf      the current configuration
+ * @param   ret     the retention policy, with ttl and column already set
+ * @param   fmt     the database's log format
+ * @return          NGX_OK on success, or
+ *                  NGX_ERROR on failure
+ */
+ngx_int_t
+ngx_http_sqlitelog_retention_init(ngx_conf_t *cf,
+    ngx_http_sqlitelog_retention_t *ret, ngx_http_sqlitelog_fmt_t *fmt)
+{
+    u_char                    *last;
+    ngx_str_t                  ts;
+    ngx_uint_t                 i;
+    ngx_http_sqlitelog_col_t  *col;
+    ngx_http_sqlitelog_col_t  *found;
+    
+    col = fmt->columns.elts;
+    found = NULL;
+    
+    /* Find column */
+    for (i = 0; i < fmt->columns.nelts; i++) {
+        if (ret->column.data) {
+            if (ngx_str_eq(&col[i].name, &ret->column)) {
+                found = &col[i];
+                break;
+            }
+        }
+        else if (ngx_str_eq_cs(&col[i].name, "msec")
+                 || ngx_str_eq_cs(&col[i].name, "time_iso8601")
+                 || col[i].epoch)
+        {
+            found = &col[i];
+            break;
+        }
+    }
+    
+    if (found == NULL) {
+        if (ret->column.data) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "retention column \"%V\" is not in format "
+                               "\"%V\"", &ret->column, &fmt->name);
+        }
+        else {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "retention requires format \"%V\" to have a "
+                               "$msec, $time_iso8601, or integer timestamp "
+                               "column", &fmt->name);
+        }
+        return NGX_ERROR;
+    }
+    
+    /*
+     * Express the column's value in Unix seconds. $msec is stored as a number
+     * already; $time_iso8601 is text that strftime() understands, including
+     * its UTC offset; integer timestamps only need to be scaled.
+     */
+    ts.data = ngx_pnalloc(cf->pool, sizeof("CAST(strftime('%s', ) AS INTEGER)")
+                                    + found->name.len + NGX_INT_T_LEN);
+    if (ts.data == NULL) {
+        return NGX_ERROR;
+    }
+    
+    if (found->epoch) {
+        last = ngx_sprintf(ts.data, "(%V / %ui)", &found->name, found->epoch);
+    }
+    else if (ngx_str_eq_cs(&found->name, "msec")) {
+        last = ngx_sprintf(ts.data, "CAST(%V AS REAL)", &found->name);
+    }
+    else if (ngx_str_eq_cs(&found->name, "time_iso8601")) {
+        last = ngx_sprintf(ts.data, "CAST(strftime('%%s', %V) AS INTEGER)",
+                           &found->name);
+    }
+    else {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "retention column \"%V\" must be $msec, "
+                           "$time_iso8601, or an integer timestamp",
+                           &found->name);
+        return NGX_ERROR;
+    }
+    ts.len = last - ts.data;
+    
+    /* Statement */
+    ret->column = found->name;
+    ret->sql_delete = ngx_http_sqlitelog_sql_retention(fmt->name, fmt->key, ts,
+                                           NGX_HTTP_SQLITELOG_RETENTION_CHUNK,
+                                           cf->pool);
+    if (ret->sql_delete.data == NULL) {
+        return NGX_ERROR;
+    }
+    
+    return NGX_OK;
+}
+
+
+/**
+ * Start the retention timer for a database.
+ * 
+ * Retention only runs in worker process 0, since any one worker can delete
+ * expired rows on behalf of all the others. Calling this more than once for
+ * the same policy (e.g. for servers that inherit it) has no effect.
+ * 
+ * @param   ret     the retention policy
+ * @param   db      the database, with its connection already open
+ * @param   cycle   the current cycle
+ * @return          NGX_OK on success, or
+ *                  NGX_ERROR on failure
+ */
+ngx_int_t
+ngx_http_sqlitelog_retention_start(ngx_http_sqlitelog_retention_t *ret,
+    ngx_http_sqlitelog_db_t *db, ngx_cycle_t *cycle)
+{
+    if (ngx_worker != 0 || ret->db != NULL) {
+        return NGX_OK;
+    }
+    
+    ret->db = db;
+    ret->rc = NGX_OK;
+    ret->busy = 0;
+    
+#if (NGX_THREADS)
+    if (*(ret->tp)) {
+        ret->task = ngx_thread_task_alloc(cycle->pool, 0);
+        if (ret->task == NULL) {
+            ret->db = NULL;
+            return NGX_ERROR;
+        }
+        ret->task->handler = ngx_http_sqlitelog_retention_thread_handler;
+        ret->task->ctx = ret;
+        ret->task->event.handler =
+                               ngx_http_sqlitelog_retention_completed_handler;
+        ret->task->event.data = ret;
+        ret->task->event.log = cycle->log;
+    }
+#endif
+    
+    ngx_memzero(&ret->event, sizeof(ngx_event_t));
+    ret->event.handler = ngx_http_sqlitelog_retention_handler;
+    ret->event.data = ret;
+    ret->event.log = cycle->log;
+    ret->event.cancelable = 1;
+    
+    ngx_add_timer(&ret->event, NGX_HTTP_SQLITELOG_RETENTION_START);
+    
+    return NGX_OK;
+}
+
+
+/**
+ * Stop the retention timer for a database.
+ * 
+ * @param   ret     the retention policy
+ */
+void
+ngx_http_sqlitelog_retention_stop(ngx_http_sqlitelog_retention_t *ret)
+{
+    if (ret->db == NULL) {
+        return;
+    }
+    
+    if (ret->event.timer_set) {
+        ngx_del_timer(&ret->event);
+    }
+    
+    ret->db = NULL;
+}
+
+
+/**
+ * Delete expired rows. This is called when the retention timer has elapsed.
+ * 
+ * @param   ev      the retention event
+ */
+static void
+ngx_http_sqlitelog_retention_handler(ngx_event_t *ev)
+{
+    ngx_http_sqlitelog_retention_t  *ret;
+    
+#if (NGX_THREADS)
+    ngx_int_t                        rc_post;
+#endif
+    
+    ret = ev->data;
+    
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ev->log, 0,
+                   "sqlitelog: retention handler");
+    
+    if (ret->db == NULL || ret->busy) {
+        return;
+    }
+    
+#if (NGX_THREADS)
+    if (ret->task) {
+        ret->busy = 1;
+        rc_post = ngx_http_sqlitelog_thread_post(ret->db, ret->task);
+        if (rc_post == NGX_OK) {
+            return;
+        }
+        ngx_log_error(NGX_LOG_ERR, ev->log, 0,
+                      "sqlitelog: retention failed to post thread task");
+        ret->busy = 0;
+    }
+#endif
+    
+    ret->rc = ngx_http_sqlitelog_retention_run_once(ret, ev->log);
+    ngx_http_sqlitelog_retention_schedule(ret);
+}
+
+
+/**
+ * Delete up to the given amount of chunks of expired rows, then release some
+ * free pages.
+ * 
+ * @param   ret     the retention policy
+ * @param   chunks  the maximum amount of chunks to delete
+ * @param   log     a log for writing error messages
+ * @return          NGX_OK if there are no more expired rows,
+ *                  NGX_AGAIN if there may be more expired rows, or
+ *                  NGX_ERROR on failure
+ */
+static ngx_int_t
+ngx_http_sqlitelog_retention_run(ngx_http_sqlitelog_retention_t *ret,
+    ngx_uint_t chunks, ngx_log_t *log)
+{
+    int            rc_delete;
+    int            rc_vacuum;
+    ngx_int_t      rc;
+    ngx_uint_t     changes;
+    ngx_uint_t     i;
+    sqlite3_int64  cutoff;
+    
+    rc = NGX_AGAIN;
+    cutoff = (sqlite3_int64) (ngx_time() - ret->ttl);
+    
+    for (i = 0; i < chunks; i++) {
+        rc_delete = ngx_http_sqlitelog_db_delete(ret->db, ret->sql_delete,
+                                                 cutoff, &changes, log);
+        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, log, 0,
+                       "sqlitelog: retention run, rc_delete: %d, changes: %ui",
+                       rc_delete, changes);
+    
+        /* Another connection holds the write lock, so try again later */
+        if (rc_delete == SQLITE_BUSY) {
+            break;
+        }
+    
+        if (rc_delete != SQLITE_OK) {
+            ngx_log_error(NGX_LOG_ERR, log, 0,
+                          "sqlitelog: retention failed to delete expired rows "
+                          "from database \"%V\"", &ret->db->filename);
+            return NGX_ERROR;
+        }
+    
+        if (changes < NGX_HTTP_SQLITELOG_RETENTION_CHUNK) {
+            rc = NGX_OK;
+            break;
+        }
+    }
+    
+    /* Vacuum */
+    rc_vacuum = ngx_http_sqlitelog_db_incremental_vacuum(ret->db,
+                                         NGX_HTTP_SQLITELOG_RETENTION_VACUUM,
+                                         log);
+    if (rc_vacuum != SQLITE_OK && rc_vacuum != SQLITE_BUSY) {
+        ngx_log_error(NGX_LOG_ERR, log, 0,
+                      "sqlitelog: retention failed to vacuum database \"%V\"",
+                      &ret->db->filename);
+    }
+    
+    return rc;
+}
+
+
+/**
+ * Delete one chunk of expired rows in the worker process's event loop, then
+ * release some free pages.
+ * 
+ * The connection's busy handler is turned off for the run, as it is for a
+ * checkpoint attempt (see ngx_http_sqlitelog_db_checkpoint_once() ), so a
+ * statement that finds the file locked fails with SQLITE_BUSY at once rather
+ * than wait for the busy timeout, and the run is retried on the next tick.
+ * 
+ * @param   ret     the retention policy
+ * @param   log     a log for writing error messages
+ * @return          NGX_OK if there are no more expired rows,
+ *                  NGX_AGAIN if there may be more expired rows, or
+ *                  NGX_ERROR on failure
+ */
+static ngx_int_t
+ngx_http_sqlitelog_retention_run_once(ngx_http_sqlitelog_retention_t *ret,
+    ngx_log_t *log)
+{
+    int        ms;
+    int        rc_timeout;
+    ngx_int_t  rc;
+    
+    /* Turn off busy handler */
+    ms = 0;
+    rc_timeout = ngx_http_sqlitelog_db_get_busy_timeout(ret->db, &ms, log);
+    if (rc_timeout != SQLITE_OK) {
+        return NGX_ERROR;
+    }
+    
+    rc_timeout = ngx_http_sqlitelog_sqlite3_busy_timeout(ret->db->conn, 0, log);
+    if (rc_timeout != SQLITE_OK) {
+        return NGX_ERROR;
+    }
+    
+    rc = ngx_http_sqlitelog_retention_run(ret, 1, log);
+    
+    /* Restore busy handler */
+    rc_timeout = ngx_http_sqlitelog_sqlite3_busy_timeout(ret->db->conn, ms,
+                                                         log);
+    if (rc_timeout != SQLITE_OK) {
+        return NGX_ERROR;
+    }
+    
+    return rc;
+}
+
+
+/**
+ * Restart the retention timer after a run.
+ * 
+ * @param   ret     the retention policy
+ */
+static void
+ngx_http_sqlitelog_retention_schedule(ngx_http_sqlitelog_retention_t *ret)
+{
+    ngx_msec_t  timer;
+    
+    if (ret->db == NULL || ngx_exiting || ngx_terminate || ngx_quit) {
+        return;
+    }
+    
+    if (ret->rc == NGX_AGAIN) {
+        timer = NGX_HTTP_SQLITELOG_RETENTION_AGAIN;
+    }
+    else {
+        timer = NGX_HTTP_SQLITELOG_RETENTION_INTERVAL;
+    }
+    
+    ngx_add_timer(&ret->event, timer);
+}
+
+
+#if (NGX_THREADS)
+/**
+ * Delete expired rows in a worker thread.
+ * 
+ * @param   data    the retention policy
+ * @param   log     a log for writing error messages
+ */
+static void
+ngx_http_sqlitelog_retention_thread_handler(void *data, ngx_log_t *log)
+{
+    ngx_http_sqlitelog_retention_t  *ret;
+    
+    ret = data;
+    
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, log, 0,
+                   "sqlitelog: retention thread handler");
+    
+    ret->rc = ngx_http_sqlitelog_retention_run(ret,
+                                   NGX_HTTP_SQLITELOG_RETENTION_CHUNKS, log);
+}
+
+
+/**
+ * Restart the retention timer once the worker thread is done.
+ * 
+ * @param   ev      the thread task's event
+ */
+static void
+ngx_http_sqlitelog_retention_completed_handler(ngx_event_t *ev)
+{
+    ngx_http_sqlitelog_retention_t  *ret;
+    
+    ret = ev->data;
+    ret->busy = 0;
+    
+    ngx_http_sqlitelog_thread_next(ret->db, ev->log);
+    
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ev->log, 0,
+                   "sqlitelog: retention completed handler");
+    
+    ngx_http_sqlitelog_retention_schedule(ret);
+}
+#endif
@@ -0,0 +1,86 @@
+
+/*
+ * Copyright (C) Serope.com
+ * 
+ * Retention deletes log entries that are older than a given age. It runs on a
+ * timer in a single worker process, and it deletes expired rows in small
+ * chunks of consecutive rowids (or primary keys, for WITHOUT ROWID tables),
+ * each chunk in its own transaction. This keeps the write lock short enough
+ * that the other workers' inserts and buffered transactions never have to
+ * wait long for it. Without a thread pool, a run deletes a single chunk with
+ * the busy handler turned off, so that it never holds up the worker's event
+ * loop.
+ * 
+ * After deleting, an incremental vacuum returns a bounded amount of free pages
+ * to the filesystem so that the file actually shrinks. This requires the
+ * database to have been created with auto_vacuum=INCREMENTAL, which the module
+ * sets on new databases when retention is enabled.
+ */
+
+
+#pragma once
+
+
+#include <ngx_core.h>
+#include <ngx_thread_pool.h>
+
+
+#include "ngx_http_sqlitelog_db.h"
+#include "ngx_http_sqlitelog_fmt.h"
+
+
+/* Rows examined per chunk */
+#define NGX_HTTP_SQLITELOG_RETENTION_CHUNK      1000
+
+/* Chunks per run in the thread pool; runs in the event loop do one */
+#define NGX_HTTP_SQLITELOG_RETENTION_CHUNKS     16
+
+/* Pages released by the incremental vacuum per run */
+#define NGX_HTTP_SQLITELOG_RETENTION_VACUUM     256
+
+/* Delay before the first run, between runs, and between unfinished runs */
+#define NGX_HTTP_SQLITELOG_RETENTION_START      1000
+#define NGX_HTTP_SQLITELOG_RETENTION_INTERVAL   60000
+#define NGX_HTTP_SQLITELOG_RETENTION_AGAIN      100
+
+
+/*
+ * ngx_http_sqlitelog_retention_t holds the retention policy of a database and
+ * the state of its timer.
+ * 
+ * ttl          the maximum age of a log entry, in seconds
+ * column       the timestamp column that determines a log entry's age
+ * sql_delete   a statement that deletes one chunk of expired rows, given
+ *              the cutoff time as parameter 1
+ * db           the database to delete from
+ * event        the retention timer
+ * rc           the result of the last run: NGX_OK, NGX_AGAIN, or NGX_ERROR
+ * busy         a flag set to 1 while a run is in a worker thread
+ * tp           an optional thread pool
+ * task         a thread task for running asynchronously
+ */
+typedef struct {
+    time_t                     ttl;
+    ngx_str_t                  column;
+    ngx_str_t                  sql_delete;
+    ngx_http_sqlitelog_db_t   *db;
+    ngx_event_t                event;
+    ngx_int_t                  rc;
+    ngx_flag_t                 busy;
+
+#if (NGX_THREADS)
+    ngx_thread_pool_t        **tp;
+    ngx_thread_task_t         *task;
+#else
+    void                     **tp;
+    void                      *task;
+#endif
+} ngx_http_sqlitelog_retention_t;
+
+
+ngx_int_t ngx_http_sqlitelog_retention_init(ngx_conf_t *cf,
+    ngx_http_sqlitelog_retention_t *ret, ngx_http_sqlitelog_fmt_t *fmt);
+ngx_int_t ngx_http_sqlitelog_retention_start(
+    ngx_http_sqlitelog_retention_t *ret, ngx_http_sqlitelog_db_t *db,
+    ngx_cycle_t *cycle);
+void ngx_http_sqlitelog_retention_stop(ngx_http_sqlitelog_retention_t *ret);
@@ -0,0 +1,472 @@
+
+/*
+ * Copyright (C) Serope.com
+ */
+
+
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+#include <math.h>
+#include <stdlib.h>
+
+#include "ngx_http_sqlitelog_rollup.h"
+
+
+static void ngx_http_sqlitelog_rollup_rbtree_insert_value(
+    ngx_rbtree_node_t *temp, ngx_rbtree_node_t *node,
+    ngx_rbtree_node_t *sentinel);
+static ngx_http_sqlitelog_rollup_node_t *ngx_http_sqlitelog_rollup_lookup_locked(
+    ngx_http_sqlitelog_rollup_shctx_t *shctx, ngx_uint_t hash, uint32_t sig,
+    time_t bucket, u_char *key, size_t len);
+static ngx_int_t ngx_http_sqlitelog_rollup_cmp(
+    ngx_http_sqlitelog_rollup_node_t *rn, uint32_t sig, time_t bucket,
+    u_char *key, size_t len);
+static double ngx_http_sqlitelog_rollup_number(ngx_http_variable_value_t *v);
+
+
+/**
+ * Initialize a rollup's shared context.
+ * 
+ * @param   shctx   the shared context, allocated in shared memory
+ */
+void
+ngx_http_sqlitelog_rollup_init_shctx(ngx_http_sqlitelog_rollup_shctx_t *shctx)
+{
+    ngx_rbtree_init(&shctx->rbtree, &shctx->sentinel,
+                    ngx_http_sqlitelog_rollup_rbtree_insert_value);
+    ngx_queue_init(&shctx->queue);
+}
+
+
+/**
+ * Add the current request to its group, creating the group if necessary.
+ * 
+ * The variables are evaluated before the shared pool is locked.
+ * 
+ * @param   rollup  the rollup
+ * @param   shctx   the rollup's shared context
+ * @param   shpool  the shared pool where shctx resides
+ * @param   sig     the signature of this configuration
+ * @param   r       the current request
+ * @return          NGX_OK on success, or
+ *                  NGX_ERROR on failure
+ */
+ngx_int_t
+ngx_http_sqlitelog_rollup_add(ngx_http_sqlitelog_rollup_t *rollup,
+    ngx_http_sqlitelog_rollup_shctx_t *shctx, ngx_slab_pool_t *shpool,
+    uint32_t sig, ngx_http_request_t *r)
+{
+    size_t                             len;
+    size_t                             size;
+    double                            *x;
+    double                            *val;
+    u_char                            *key;
+    u_char                            *p;
+    time_t                             bucket;
+    uint32_t                           hash;
+    ngx_str_t                         *values;
+    ngx_uint_t                         i;
+    ngx_uint_t                         naggs;
+    ngx_uint_t                         ngroups;
+    ngx_http_variable_value_t         *v;
+    ngx_http_sqlitelog_rollup_var_t   *agg;
+    ngx_http_sqlitelog_rollup_var_t   *group;
+    ngx_http_sqlitelog_rollup_node_t  *node;
+    
+    group = rollup->groups.elts;
+    ngroups = rollup->groups.nelts;
+    agg = rollup->aggs.elts;
+    naggs = rollup->aggs.nelts;
+    
+    bucket = ngx_time() - ngx_time() % rollup->interval;
+    
+    /* Group values */
+    values = ngx_palloc(r->pool, (ngroups + 1) * sizeof(ngx_str_t));
+    if (values == NULL) {
+        return NGX_ERROR;
+    }
+    
+    len = 0;
+    for (i = 0; i < ngroups; i++) {
+        v = ngx_http_get_indexed_variable(r, group[i].index);
+        if (v == NULL || v->not_found) {
+            values[i].data = NULL;
+            values[i].len = 0;
+        }
+        else {
+            values[i].data = v->data;
+            values[i].len = ngx_min(v->len, NGX_HTTP_SQLITELOG_ROLLUP_LEN);
+        }
+        len += sizeof(size_t) + values[i].len;
+    }
+    
+    /* Serialize */
+    key = ngx_pnalloc(r->pool, len + 1);
+    if (key == NULL) {
+        return NGX_ERROR;
+    }
+    
+    p = key;
+    for (i = 0; i < ngroups; i++) {
+        p = ngx_cpymem(p, &values[i].len, sizeof(size_t));
+        p = ngx_cpymem(p, values[i].data, values[i].len);
+    }
+    
+    /* Aggregate values */
+    x = ngx_palloc(r->pool, (naggs + 1) * sizeof(double));
+    if (x == NULL) {
+        return NGX_ERROR;
+    }
+    
+    for (i = 0; i < naggs; i++) {
+        v = ngx_http_get_indexed_variable(r, agg[i].index);
+        x[i] = ngx_http_sqlitelog_rollup_number(v);
+    }
+    
+    /* Hash */
+    ngx_crc32_init(hash);
+    ngx_crc32_update(&hash, (u_char *) &sig, sizeof(uint32_t));
+    ngx_crc32_update(&hash, (u_char *) &bucket, sizeof(time_t));
+    ngx_crc32_update(&hash, key, len);
+    ngx_crc32_final(hash);
+    
+    ngx_shmtx_lock(&shpool->mutex);
+    
+    /* Find or create group */
+    node = ngx_http_sqlitelog_rollup_lookup_locked(shctx, hash, sig, bucket,
+                                                   key, len);
+    if (node == NULL) {
+        size = offsetof(ngx_http_sqlitelog_rollup_node_t, vals)
+               + naggs * sizeof(double) + len;
+    
+        node = ngx_slab_alloc_locked(shpool, size);
+        if (node == NULL) {
+            ngx_shmtx_unlock(&shpool->mutex);
+            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                          "sqlitelog: rollup \"%V\" failed to allocate %uz "
+                          "bytes of shared memory", &rollup->name, size);
+            return NGX_ERROR;
+        }
+    
+        node->node.key = hash;
+        node->sig = sig;
+        node->bucket = bucket;
+        node->count = 0;
+        node->key = (u_char *) &node->vals[naggs];
+        node->len = len;
+    
+        for (i = 0; i < naggs; i++) {
+            if (agg[i].type == NGX_HTTP_SQLITELOG_ROLLUP_SUM) {
+                node->vals[i] = 0;
+            } else {
+                node->vals[i] = NAN;
+            }
+        }
+        ngx_memcpy(node->key, key, len);
+    
+        ngx_rbtree_insert(&shctx->rbtree, &node->node);
+        ngx_queue_insert_tail(&shctx->queue, &node->link);
+    }
+    
+    /* Update */
+    node->count++;
+    
+    for (i = 0; i < naggs; i++) {
+        val = &node->vals[i];
+    
+        if (isnan(x[i])) {
+            continue;
+        }
+    
+        switch (agg[i].type) {
+    
+        case NGX_HTTP_SQLITELOG_ROLLUP_SUM:
+            *val += x[i];
+            break;
+    
+        case NGX_HTTP_SQLITELOG_ROLLUP_MIN:
+            if (isnan(*val) || x[i] < *val) {
+                *val = x[i];
+            }
+            break;
+    
+        case NGX_HTTP_SQLITELOG_ROLLUP_MAX:
+            if (isnan(*val) || x[i] > *val) {
+                *val = x[i];
+            }
+            break;
+        }
+    }
+    
+    ngx_shmtx_unlock(&shpool->mutex);
+    
+    return NGX_OK;
+}
+
+
+/**
+ * Move a rollup's groups from shared memory to local memory, removing them
+ * from the tree in the process.
+ * 
+ * Only the groups with this configuration's signature are moved; the others
+ * were made by another configuration, whose columns may differ, and are left
+ * to its worker processes.
+ * 
+ * The shared pool must be locked.
+ * 
+ * @param   rollup  the rollup
+ * @param   shctx   the rollup's shared context
+ * @param   shpool  the shared pool where shctx resides
+ * @param   sig     the signature of this configuration
+ * @param   pool    a pool in which to initialize the array
+ * @param   rows    an uninitialized array to hold the groups
+ *                  (ngx_http_sqlitelog_rollup_row_t)
+ * @return          NGX_OK on success, or
+ *                  NGX_ERROR on failure
+ */
+ngx_int_t
+ngx_http_sqlitelog_rollup_move_locked(ngx_http_sqlitelog_rollup_t *rollup,
+    ngx_http_sqlitelog_rollup_shctx_t *shctx, ngx_slab_pool_t *shpool,
+    uint32_t sig, ngx_pool_t *pool, ngx_array_t *rows)
+{
+    u_char                            *p;
+    ngx_int_t                          rc_init;
+    ngx_uint_t                         i;
+    ngx_uint_t                         naggs;
+    ngx_uint_t                         ngroups;
+    ngx_queue_t                       *q;
+    ngx_queue_t                       *next;
+    ngx_http_sqlitelog_rollup_row_t   *row;
+    ngx_http_sqlitelog_rollup_node_t  *node;
+    
+    ngroups = rollup->groups.nelts;
+    naggs = rollup->aggs.nelts;
+    
+    rc_init = ngx_array_init(rows, pool, 16,
+                             sizeof(ngx_http_sqlitelog_rollup_row_t));
+    if (rc_init != NGX_OK) {
+        return NGX_ERROR;
+    }
+    
+    /* Copy */
+    for (q = ngx_queue_head(&shctx->queue);
+         q != ngx_queue_sentinel(&shctx->queue);
+         q = ngx_queue_next(q))
+    {
+        node = ngx_queue_data(q, ngx_http_sqlitelog_rollup_node_t, link);
+        if (node->sig != sig) {
+            continue;
+        }
+    
+        row = ngx_array_push(rows);
+        if (row == NULL) {
+            return NGX_ERROR;
+        }
+    
+        row->bucket = node->bucket;
+        row->count = node->count;
+    
+        row->vals = ngx_palloc(pool, (naggs + 1) * sizeof(double));
+        row->groups = ngx_palloc(pool, (ngroups + 1) * sizeof(ngx_str_t));
+        if (row->vals == NULL || row->groups == NULL) {
+            return NGX_ERROR;
+        }
+    
+        ngx_memcpy(row->vals, node->vals, naggs * sizeof(double));
+    
+        /*
+         * An empty group value is bound as '' rather than NULL, because NULLs
+         * are distinct from one another in a primary key and would never
+         * conflict.
+         */
+        p = node->key;
+        for (i = 0; i < ngroups; i++) {
+            ngx_memcpy(&row->groups[i].len, p, sizeof(size_t));
+            p += sizeof(size_t);
+    
+            row->groups[i].data = ngx_pnalloc(pool, row->groups[i].len + 1);
+            if (row->groups[i].data == NULL) {
+                return NGX_ERROR;
+            }
+            ngx_memcpy(row->groups[i].data, p, row->groups[i].len);
+            p += row->groups[i].len;
+        }
+    }
+    
+    /* Clear */
+    for (q = ngx_queue_head(&shctx->queue);
+         q != ngx_queue_sentinel(&shctx->queue);
+         q = next)
+    {
+        next = ngx_queue_next(q);
+        node = ngx_queue_data(q, ngx_http_sqlitelog_rollup_node_t, link);
+        if (node->sig != sig) {
+            continue;
+        }
+        ngx_queue_remove(q);
+        ngx_rbtree_delete(&shctx->rbtree, &node->node);
+        ngx_slab_free_locked(shpool, node);
+    }
+    
+    return NGX_OK;
+}
+
+
+/**
+ * Find a group in the tree.
+ * 
+ * The shared pool must be locked.
+ * 
+ * @param   shctx   the rollup's shared context
+ * @param   hash    the hash of the signature, bucket, and key
+ * @param   sig     the group's signature
+ * @param   bucket  the group's time bucket
+ * @param   key     the serialized group values
+ * @param   len     the length of key
+ * @return          the group, or NULL if not found
+ */
+static ngx_http_sqlitelog_rollup_node_t *
+ngx_http_sqlitelog_rollup_lookup_locked(
+    ngx_http_sqlitelog_rollup_shctx_t *shctx, ngx_uint_t hash, uint32_t sig,
+    time_t bucket, u_char *key, size_t len)
+{
+    ngx_int_t                          rc;
+    ngx_rbtree_node_t                 *node;
+    ngx_rbtree_node_t                 *sentinel;
+    ngx_http_sqlitelog_rollup_node_t  *rn;
+    
+    node = shctx->rbtree.root;
+    sentinel = shctx->rbtree.sentinel;
+    
+    while (node != sentinel) {
+    
+        if (hash < node->key) {
+            node = node->left;
+            continue;
+        }
+    
+        if (hash > node->key) {
+            node = node->right;
+            continue;
+        }
+    
+        /* hash == node->key */
+        rn = (ngx_http_sqlitelog_rollup_node_t *) node;
+    
+        rc = ngx_http_sqlitelog_rollup_cmp(rn, sig, bucket, key, len);
+        if (rc == 0) {
+            return rn;
+        }
+    
+        node = (rc < 0) ? node->left : node->right;
+    }
+    
+    return NULL;
+}
+
+
+/**
+ * Insert a node into the tree, ordered by hash, then signature, then bucket,
+ * then key.
+ * 
+ * @param   temp        the tree's root
+ * @param   node        the node to insert
+ * @param   sentinel    the tree's sentinel
+ */
+static void
+ngx_http_sqlitelog_rollup_rbtree_insert_value(ngx_rbtree_node_t *temp,
+    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel)
+{
+    ngx_rbtree_node_t                **p;
+    ngx_http_sqlitelog_rollup_node_t  *rn;
+    ngx_http_sqlitelog_rollup_node_t  *rt;
+    
+    rn = (ngx_http_sqlitelog_rollup_node_t *) node;
+    
+    for ( ;; ) {
+    
+        if (node->key != temp->key) {
+            p = (node->key < temp->key) ? &temp->left : &temp->right;
+        }
+        else {
+            rt = (ngx_http_sqlitelog_rollup_node_t *) temp;
+            p = (ngx_http_sqlitelog_rollup_cmp(rt, rn->sig, rn->bucket,
+                                               rn->key, rn->len) < 0)
+                ? &temp->left : &temp->right;
+        }
+    
+        if (*p == sentinel) {
+            break;
+        }
+    
+        temp = *p;
+    }
+    
+    *p = node;
+    node->parent = temp;
+    node->left = sentinel;
+    node->right = sentinel;
+    ngx_rbt_red(node);
+}
+
+
+/**
+ * Compare a group against a signature, bucket, and key.
+ * 
+ * @param   rn      the group
+ * @param   sig     a signature
+ * @param   bucket  a time bucket
+ * @param   key     serialized group values
+ * @param   len     the length of key
+ * @return          0 if equal, a negative number if the signature, bucket,
+ *                  and key are less than the group's, or a positive number
+ *                  otherwise
+ */
+static ngx_int_t
+ngx_http_sqlitelog_rollup_cmp(ngx_http_sqlitelog_rollup_node_t *rn,
+    uint32_t sig, time_t bucket, u_char *key, size_t len)
+{
+    if (sig != rn->sig) {
+        return (sig < rn->sig) ? -1 : 1;
+    }
+    
+    if (bucket != rn->bucket) {
+        return (bucket < rn->bucket) ? -1 : 1;
+    }
+    
+    if (len != rn->len) {
+        return (len < rn->len) ? -1 : 1;
+    }
+    
+    return ngx_memcmp(key, rn->key, len);
+}
+
+
+/**
+ * Parse a variable's value as a number.
+ * 
+ * @param   v       the variable's value
+ * @return          the value as a number, or NaN if it isn't one
+ */
+static double
+ngx_http_sqlitelog_rollup_number(ngx_http_variable_value_t *v)
+{
+    u_char   buf[NGX_INT64_LEN + 32];
+    char    *end;
+    double   x;
+    
+    if (v == NULL || v->not_found || v->len == 0 || v->len >= sizeof(buf)) {
+        return NAN;
+    }
+    
+    ngx_memcpy(buf, v->data, v->len);
+    buf[v->len] = '\0';
+    
+    x = strtod((char *) buf, &end);
+    if (end != (char *) buf + v->len) {
+        return NAN;
+    }
+    
+    return x;
+}
@@ -0,0 +1,146 @@
+
+/*
+ * Copyright (C) Serope.com
+ * 
+ * A rollup is a summary table that is maintained at ingest time. It groups
+ * requests by time bucket and by the values of some variables, and for each
+ * group it keeps a request count along with the sum, minimum, or maximum of
+ * other (numeric) variables.
+ * 
+ * Rollups live alongside the transaction buffer. While handling a request, the
+ * group's counters are updated in a red-black tree in the buffer's shared
+ * memory zone. When the buffer is listed, the tree is moved into local memory
+ * along with the log entries, and each group is upserted into the rollup table
+ * within the same transaction as the buffered rows:
+ * 
+ *  INSERT INTO name (bucket, group1, ..., count, sum_x, ...)
+ *  VALUES (?, ?, ..., ?, ?, ...)
+ *  ON CONFLICT (bucket, group1, ...) DO UPDATE SET count = count + ..., ...
+ * 
+ * Like log entries, groups carry the signature of their configuration. When
+ * Nginx reloads with other rollup columns, each configuration only moves its
+ * own groups, so the old worker processes still commit theirs.
+ */
+
+
+#pragma once
+
+
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+
+/* Aggregate types */
+#define NGX_HTTP_SQLITELOG_ROLLUP_SUM   0
+#define NGX_HTTP_SQLITELOG_ROLLUP_MIN   1
+#define NGX_HTTP_SQLITELOG_ROLLUP_MAX   2
+
+/* Maximum length of a group value */
+#define NGX_HTTP_SQLITELOG_ROLLUP_LEN   1024
+
+
+/*
+ * ngx_http_sqlitelog_rollup_var_t represents a group-by or aggregate column
+ * of a rollup table.
+ * 
+ * name     the column name
+ * index    the index of the column's variable
+ * type     for aggregates, NGX_HTTP_SQLITELOG_ROLLUP_SUM, _MIN, or _MAX
+ */
+typedef struct {
+    ngx_str_t                  name;
+    ngx_int_t                  index;
+    ngx_uint_t                 type;
+} ngx_http_sqlitelog_rollup_var_t;
+
+
+/*
+ * ngx_http_sqlitelog_rollup_t represents a rollup table defined by the
+ * sqlitelog_rollup directive.
+ * 
+ * name         the table name
+ * interval     the width of a time bucket, in seconds
+ * groups       the group-by columns (ngx_http_sqlitelog_rollup_var_t)
+ * aggs         the aggregate columns (ngx_http_sqlitelog_rollup_var_t)
+ * sql_create   a statement that creates the table
+ * sql_upsert   a statement that merges one group into the table
+ */
+typedef struct {
+    ngx_str_t                  name;
+    time_t                     interval;
+    ngx_array_t                groups;
+    ngx_array_t                aggs;
+    ngx_str_t                  sql_create;
+    ngx_str_t                  sql_upsert;
+} ngx_http_sqlitelog_rollup_t;
+
+
+/*
+ * ngx_http_sqlitelog_rollup_shctx_t holds a rollup's groups in shared memory.
+ * 
+ * rbtree       the groups, keyed by a hash of their bucket and values
+ * sentinel     the tree's sentinel node
+ * queue        the groups, in order of creation
+ */
+typedef struct {
+    ngx_rbtree_t               rbtree;
+    ngx_rbtree_node_t          sentinel;
+    ngx_queue_t                queue;
+} ngx_http_sqlitelog_rollup_shctx_t;
+
+
+/*
+ * ngx_http_sqlitelog_rollup_node_t is a group in shared memory.
+ * 
+ * The node is allocated with room for one value per aggregate, followed by
+ * len bytes of group values. Each group value is stored as its length
+ * (size_t) followed by its data.
+ * 
+ * node         the tree node
+ * link         the queue link
+ * sig          the signature of the configuration that made the group (see
+ *              ngx_http_sqlitelog_db_sig() )
+ * bucket       the start of the group's time bucket
+ * count        the group's request count
+ * key          the serialized group values, right after vals
+ * len          the length of key
+ * vals         the aggregate values; min and max are NaN if unset
+ */
+typedef struct {
+    ngx_rbtree_node_t          node;
+    ngx_queue_t                link;
+    uint32_t                   sig;
+    time_t                     bucket;
+    ngx_uint_t                 count;
+    u_char                    *key;
+    size_t                     len;
+    double                     vals[1];
+} ngx_http_sqlitelog_rollup_node_t;
+
+
+/*
+ * ngx_http_sqlitelog_rollup_row_t is a group in local memory, ready to be
+ * upserted into the database.
+ * 
+ * bucket       the start of the group's time bucket
+ * count        the group's request count
+ * groups       the group values (one ngx_str_t per group-by column)
+ * vals         the aggregate values (one double per aggregate column)
+ */
+typedef struct {
+    time_t                     bucket;
+    ngx_uint_t                 count;
+    ngx_str_t                 *groups;
+    double                    *vals;
+} ngx_http_sqlitelog_rollup_row_t;
+
+
+void ngx_http_sqlitelog_rollup_init_shctx(
+    ngx_http_sqlitelog_rollup_shctx_t *shctx);
+ngx_int_t ngx_http_sqlitelog_rollup_add(ngx_http_sqlitelog_rollup_t *rollup,
+    ngx_http_sqlitelog_rollup_shctx_t *shctx, ngx_slab_pool_t *shpool,
+    uint32_t sig, ngx_http_request_t *r);
+ngx_int_t ngx_http_sqlitelog_rollup_move_locked(
+    ngx_http_sqlitelog_rollup_t *rollup,
+    ngx_http_sqlitelog_rollup_shctx_t *shctx, ngx_slab_pool_t *shpool,
+    uint32_t sig, ngx_pool_t *pool, ngx_array_t *rows);
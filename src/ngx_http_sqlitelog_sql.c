@@ -8,25 +8,34 @@
 
 
 #include "ngx_http_sqlitelog_col.h"
+#include "ngx_http_sqlitelog_rollup.h"
 #include "ngx_http_sqlitelog_util.h"
 
 
 /**
- * Build a string in the form of "CREATE TABLE IF NOT EXISTS table_name (...)".
+ * Build a string in the form of "CREATE TABLE IF NOT EXISTS table_name (...)",
+ * optionally followed by STRICT and/or a WITHOUT ROWID clustering key:
+ * 
+ *  CREATE TABLE IF NOT EXISTS table_name (..., PRIMARY KEY (key))
+ *  STRICT, WITHOUT ROWID
  * 
  * @param   table_name  the table name
  * @param   columns     an array of columns (ngx_http_sqlitelog_col_t)
+ * @param   key         the primary key of a WITHOUT ROWID table, or an empty
+ *                      string for a regular rowid table
+ * @param   strict      1 for a STRICT table, 0 otherwise
  * @param   pool        a pool in which to allocate the string's data
  * @return              a string whose data is allocated in the given pool,
  *                      or a string with NULL data if an error occurs
  */
 ngx_str_t
 ngx_http_sqlitelog_sql_create_table(ngx_str_t table_name, ngx_array_t columns,
-    ngx_pool_t *pool)
+    ngx_str_t key, ngx_flag_t strict, ngx_pool_t *pool)
 {
     size_t                     buf_size;
     size_t                     sql_len;
     u_char                    *buf;
+    u_char                    *last;
     ngx_str_t                  sql;
     ngx_uint_t                 i;
     ngx_uint_t                 j;
@@ -48,7 +57,17 @@ ngx_http_sqlitelog_sql_create_table(ngx_str_t table_name, ngx_array_t columns,
         }
         col++;
     }
+    if (key.len) {
+        sql_len += ngx_strlen(", PRIMARY KEY ()");
+        sql_len += key.len;
+    }
     sql_len += ngx_strlen(")");
+    if (strict) {
+        sql_len += ngx_strlen(" STRICT");
+    }
+    if (key.len) {
+        sql_len += ngx_strlen(", WITHOUT ROWID");
+    }
     
     /* Create buffer */
     buf_size = sql_len + 1;
@@ -72,7 +91,6 @@ ngx_http_sqlitelog_sql_create_table(ngx_str_t table_name, ngx_array_t columns,
         j += col->type.len;
         
         if (i == columns.nelts - 1) {
-            buf[j] = ')';
             break;
             
         } else {
@@ -83,8 +101,24 @@ ngx_http_sqlitelog_sql_create_table(ngx_str_t table_name, ngx_array_t columns,
         col++;
     }
     
+    /* Table options */
+    last = &buf[j];
+    if (key.len) {
+        last = ngx_sprintf(last, ", PRIMARY KEY (%V)", &key);
+    }
+    *last++ = ')';
+    if (strict) {
+        last = ngx_cpymem(last, " STRICT", ngx_strlen(" STRICT"));
+    }
+    if (key.len) {
+        if (strict) {
+            *last++ = ',';
+        }
+        last = ngx_cpymem(last, " WITHOUT ROWID", ngx_strlen(" WITHOUT ROWID"));
+    }
+    
     sql.data = buf;
-    sql.len = sql_len;
+    sql.len = last - buf;
     return sql;
 }
 
@@ -142,3 +176,363 @@ ngx_http_sqlitelog_sql_insert(ngx_str_t table_name, ngx_uint_t n,
     sql.len = sql_len;
     return sql;
 }
+
+
+/**
+ * Build the statements that create a table's batch virtual table and copy the
+ * batch into the table:
+ * 
+ *  CREATE VIRTUAL TABLE IF NOT EXISTS temp.sqlitelog_batch_table_name
+ *  USING sqlitelog_batch(table_name)
+ * 
+ *  INSERT INTO table_name SELECT * FROM temp.sqlitelog_batch_table_name
+ * 
+ * @param   table_name  the name of the table
+ * @param   create      the CREATE VIRTUAL TABLE statement
+ * @param   insert      the INSERT statement
+ * @param   pool        a pool in which to allocate the strings' data
+ * @return              NGX_OK on success, or
+ *                      NGX_ERROR on failure
+ */
+ngx_int_t
+ngx_http_sqlitelog_sql_batch(ngx_str_t table_name, ngx_str_t *create,
+    ngx_str_t *insert, ngx_pool_t *pool)
+{
+    u_char  *last;
+    
+    /* CREATE VIRTUAL TABLE */
+    create->data = ngx_pcalloc(pool,
+                           sizeof("CREATE VIRTUAL TABLE IF NOT EXISTS "
+                                  "temp.sqlitelog_batch_ USING "
+                                  "sqlitelog_batch()")
+                           + table_name.len * 2);
+    if (create->data == NULL) {
+        return NGX_ERROR;
+    }
+    last = ngx_sprintf(create->data, "CREATE VIRTUAL TABLE IF NOT EXISTS "
+                       "temp.sqlitelog_batch_%V USING sqlitelog_batch(%V)",
+                       &table_name, &table_name);
+    create->len = last - create->data;
+    
+    /* INSERT */
+    insert->data = ngx_pcalloc(pool,
+                           sizeof("INSERT INTO  SELECT * FROM "
+                                  "temp.sqlitelog_batch_")
+                           + table_name.len * 2);
+    if (insert->data == NULL) {
+        return NGX_ERROR;
+    }
+    last = ngx_sprintf(insert->data, "INSERT INTO %V SELECT * FROM "
+                       "temp.sqlitelog_batch_%V", &table_name, &table_name);
+    insert->len = last - insert->data;
+    
+    return NGX_OK;
+}
+
+
+/**
+ * Build a string in the form of "CREATE INDEX IF NOT EXISTS index_name ON
+ * table_name (col1, col2, ...) WHERE expr".
+ * 
+ * @param   index_name  the index name
+ * @param   table_name  the table name
+ * @param   columns     an array of column names (ngx_str_t)
+ * @param   where       an optional expression for a partial index
+ * @param   pool        a pool in which to allocate the string's data
+ * @return              a string whose data is allocated in the given pool,
+ *                      or a string with NULL data if an error occurs
+ */
+ngx_str_t
+ngx_http_sqlitelog_sql_create_index(ngx_str_t index_name, ngx_str_t table_name,
+    ngx_array_t *columns, ngx_str_t where, ngx_pool_t *pool)
+{
+    size_t          buf_size;
+    size_t          sql_len;
+    u_char         *buf;
+    u_char         *last;
+    ngx_str_t       sql;
+    ngx_str_t      *col;
+    ngx_uint_t      i;
+    
+    col = columns->elts;
+    
+    /* Compute length */
+    sql_len = 0;
+    sql_len += ngx_strlen("CREATE INDEX IF NOT EXISTS ");
+    sql_len += index_name.len;
+    sql_len += ngx_strlen(" ON ");
+    sql_len += table_name.len;
+    sql_len += ngx_strlen(" (");
+    for (i = 0; i < columns->nelts; i++) {
+        sql_len += col[i].len;
+        sql_len += ngx_strlen(", ");
+    }
+    sql_len += ngx_strlen(")");
+    if (where.len) {
+        sql_len += ngx_strlen(" WHERE ");
+        sql_len += where.len;
+    }
+    
+    /* Create buffer */
+    buf_size = sql_len + 1;
+    buf = ngx_pcalloc(pool, buf_size);
+    if (buf == NULL) {
+        return NGX_NULL_STRING;
+    }
+    
+    /* Build string */
+    last = ngx_sprintf(buf, "CREATE INDEX IF NOT EXISTS %V ON %V (",
+                       &index_name, &table_name);
+    for (i = 0; i < columns->nelts; i++) {
+        if (i > 0) {
+            last = ngx_cpymem(last, ", ", 2);
+        }
+        last = ngx_cpymem(last, col[i].data, col[i].len);
+    }
+    *last++ = ')';
+    if (where.len) {
+        last = ngx_sprintf(last, " WHERE %V", &where);
+    }
+    
+    sql.data = buf;
+    sql.len = last - buf;
+    return sql;
+}
+
+
+/**
+ * Build a statement that deletes one chunk of expired rows, in the form of
+ * "DELETE FROM table_name WHERE (key) IN (SELECT key FROM (SELECT key,
+ * ts AS ts FROM table_name ORDER BY key LIMIT n) WHERE ts < ?1)".
+ * 
+ * Only the first n rows (by key) are examined, so the cost of the statement
+ * is bounded no matter how large the table is. Since rows are appended in
+ * chronological order, expired rows are always at the front of the table.
+ * For WITHOUT ROWID tables, this holds as long as the key starts with a
+ * timestamp.
+ * 
+ * @param   table_name  the table name
+ * @param   key         the table's primary key, e.g. "rowid"
+ * @param   ts          an SQL expression for a row's age in Unix seconds
+ * @param   n           the amount of rows to examine
+ * @param   pool        a pool in which to allocate the string's data
+ * @return              a string whose data is allocated in the given pool,
+ *                      or a string with NULL data if an error occurs
+ */
+ngx_str_t
+ngx_http_sqlitelog_sql_retention(ngx_str_t table_name, ngx_str_t key,
+    ngx_str_t ts, ngx_uint_t n, ngx_pool_t *pool)
+{
+    size_t          buf_size;
+    size_t          sql_len;
+    u_char         *buf;
+    u_char         *last;
+    ngx_str_t       sql;
+    
+    /* Compute length */
+    sql_len = 0;
+    sql_len += ngx_strlen("DELETE FROM ");
+    sql_len += table_name.len;
+    sql_len += ngx_strlen(" WHERE () IN (SELECT  FROM (SELECT , ");
+    sql_len += key.len * 3;
+    sql_len += ts.len;
+    sql_len += ngx_strlen(" AS ts FROM ");
+    sql_len += table_name.len;
+    sql_len += ngx_strlen(" ORDER BY  LIMIT ");
+    sql_len += key.len;
+    sql_len += NGX_INT_T_LEN;
+    sql_len += ngx_strlen(") WHERE ts < ?1)");
+    
+    /* Create buffer */
+    buf_size = sql_len + 1;
+    buf = ngx_pcalloc(pool, buf_size);
+    if (buf == NULL) {
+        return NGX_NULL_STRING;
+    }
+    
+    /* Build string */
+    last = ngx_sprintf(buf, "DELETE FROM %V WHERE (%V) IN (SELECT %V FROM "
+                       "(SELECT %V, %V AS ts FROM %V ORDER BY %V "
+                       "LIMIT %ui) WHERE ts < ?1)",
+                       &table_name, &key, &key, &key, &ts, &table_name, &key,
+                       n);
+    
+    sql.data = buf;
+    sql.len = last - buf;
+    return sql;
+}
+
+
+/**
+ * Build a statement that creates a rollup table, in the form of
+ * "CREATE TABLE IF NOT EXISTS name (bucket INTEGER NOT NULL, g1 TEXT NOT NULL,
+ * ..., count INTEGER NOT NULL, sum_x REAL, ..., PRIMARY KEY (bucket, g1, ...))".
+ * 
+ * @param   rollup      the rollup
+ * @param   pool        a pool in which to allocate the string's data
+ * @return              a string whose data is allocated in the given pool,
+ *                      or a string with NULL data if an error occurs
+ */
+ngx_str_t
+ngx_http_sqlitelog_sql_rollup_create(ngx_http_sqlitelog_rollup_t *rollup,
+    ngx_pool_t *pool)
+{
+    size_t                            buf_size;
+    u_char                           *buf;
+    u_char                           *p;
+    ngx_str_t                         sql;
+    ngx_uint_t                        i;
+    ngx_http_sqlitelog_rollup_var_t  *agg;
+    ngx_http_sqlitelog_rollup_var_t  *group;
+    
+    group = rollup->groups.elts;
+    agg = rollup->aggs.elts;
+    
+    /* Compute length */
+    buf_size = 0;
+    buf_size += ngx_strlen("CREATE TABLE IF NOT EXISTS ");
+    buf_size += rollup->name.len;
+    buf_size += ngx_strlen(" (bucket INTEGER NOT NULL, ");
+    for (i = 0; i < rollup->groups.nelts; i++) {
+        buf_size += group[i].name.len * 2;
+        buf_size += ngx_strlen(" TEXT NOT NULL, , ");
+    }
+    buf_size += ngx_strlen("count INTEGER NOT NULL");
+    for (i = 0; i < rollup->aggs.nelts; i++) {
+        buf_size += ngx_strlen(", ");
+        buf_size += agg[i].name.len;
+        buf_size += ngx_strlen(" REAL");
+    }
+    buf_size += ngx_strlen(", PRIMARY KEY (bucket))");
+    buf_size += 1;
+    
+    /* Create buffer */
+    buf = ngx_pcalloc(pool, buf_size);
+    if (buf == NULL) {
+        return NGX_NULL_STRING;
+    }
+    
+    /* Build string */
+    p = ngx_sprintf(buf, "CREATE TABLE IF NOT EXISTS %V (bucket INTEGER "
+                    "NOT NULL, ", &rollup->name);
+    for (i = 0; i < rollup->groups.nelts; i++) {
+        p = ngx_sprintf(p, "%V TEXT NOT NULL, ", &group[i].name);
+    }
+    p = ngx_sprintf(p, "count INTEGER NOT NULL");
+    for (i = 0; i < rollup->aggs.nelts; i++) {
+        p = ngx_sprintf(p, ", %V REAL", &agg[i].name);
+    }
+    p = ngx_sprintf(p, ", PRIMARY KEY (bucket");
+    for (i = 0; i < rollup->groups.nelts; i++) {
+        p = ngx_sprintf(p, ", %V", &group[i].name);
+    }
+    p = ngx_sprintf(p, "))");
+    
+    sql.data = buf;
+    sql.len = p - buf;
+    return sql;
+}
+
+
+/**
+ * Build a statement that merges one group into a rollup table, in the form of
+ * "INSERT INTO name (bucket, g1, ..., count, sum_x, ...) VALUES (?, ?, ...)
+ * ON CONFLICT (bucket, g1, ...) DO UPDATE SET count = count + excluded.count,
+ * sum_x = ..., ...".
+ * 
+ * Minimums and maximums may be NULL on either side, in which case the other
+ * side is kept.
+ * 
+ * @param   rollup      the rollup
+ * @param   pool        a pool in which to allocate the string's data
+ * @return              a string whose data is allocated in the given pool,
+ *                      or a string with NULL data if an error occurs
+ */
+ngx_str_t
+ngx_http_sqlitelog_sql_rollup_upsert(ngx_http_sqlitelog_rollup_t *rollup,
+    ngx_pool_t *pool)
+{
+    size_t                            buf_size;
+    u_char                           *buf;
+    u_char                           *p;
+    ngx_str_t                        *name;
+    ngx_str_t                         sql;
+    ngx_uint_t                        i;
+    ngx_uint_t                        n;
+    ngx_http_sqlitelog_rollup_var_t  *agg;
+    ngx_http_sqlitelog_rollup_var_t  *group;
+    
+    group = rollup->groups.elts;
+    agg = rollup->aggs.elts;
+    n = 2 + rollup->groups.nelts + rollup->aggs.nelts;
+    
+    /* Compute length */
+    buf_size = 0;
+    buf_size += ngx_strlen("INSERT INTO  (bucket, count) VALUES () "
+                           "ON CONFLICT (bucket) DO UPDATE SET "
+                           "count = count + excluded.count");
+    buf_size += rollup->name.len;
+    buf_size += n * ngx_strlen("?, ");
+    for (i = 0; i < rollup->groups.nelts; i++) {
+        buf_size += (group[i].name.len + ngx_strlen(", ")) * 2;
+    }
+    for (i = 0; i < rollup->aggs.nelts; i++) {
+        buf_size += ngx_strlen(", ");
+        buf_size += agg[i].name.len * 6;
+        buf_size += ngx_strlen(",  = coalesce(max(, excluded.), , excluded.)");
+    }
+    buf_size += 1;
+    
+    /* Create buffer */
+    buf = ngx_pcalloc(pool, buf_size);
+    if (buf == NULL) {
+        return NGX_NULL_STRING;
+    }
+    
+    /* Columns */
+    p = ngx_sprintf(buf, "INSERT INTO %V (bucket", &rollup->name);
+    for (i = 0; i < rollup->groups.nelts; i++) {
+        p = ngx_sprintf(p, ", %V", &group[i].name);
+    }
+    p = ngx_sprintf(p, ", count");
+    for (i = 0; i < rollup->aggs.nelts; i++) {
+        p = ngx_sprintf(p, ", %V", &agg[i].name);
+    }
+    
+    /* Values */
+    p = ngx_sprintf(p, ") VALUES (");
+    for (i = 0; i < n; i++) {
+        p = ngx_sprintf(p, (i < n - 1) ? "?, " : "?");
+    }
+    
+    /* Conflict */
+    p = ngx_sprintf(p, ") ON CONFLICT (bucket");
+    for (i = 0; i < rollup->groups.nelts; i++) {
+        p = ngx_sprintf(p, ", %V", &group[i].name);
+    }
+    p = ngx_sprintf(p, ") DO UPDATE SET count = count + excluded.count");
+    for (i = 0; i < rollup->aggs.nelts; i++) {
+        name = &agg[i].name;
+        
+        switch (agg[i].type) {
+        
+        case NGX_HTTP_SQLITELOG_ROLLUP_SUM:
+            p = ngx_sprintf(p, ", %V = %V + excluded.%V", name, name, name);
+            break;
+        
+        case NGX_HTTP_SQLITELOG_ROLLUP_MIN:
+            p = ngx_sprintf(p, ", %V = coalesce(min(%V, excluded.%V), %V, "
+                            "excluded.%V)", name, name, name, name, name);
+            break;
+        
+        case NGX_HTTP_SQLITELOG_ROLLUP_MAX:
+            p = ngx_sprintf(p, ", %V = coalesce(max(%V, excluded.%V), %V, "
+                            "excluded.%V)", name, name, name, name, name);
+            break;
+        }
+    }
+    
+    sql.data = buf;
+    sql.len = p - buf;
+    return sql;
+}
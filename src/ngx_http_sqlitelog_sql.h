@@ -10,7 +10,21 @@
 #include <ngx_core.h>
 
 
+#include "ngx_http_sqlitelog_rollup.h"
+
+
 ngx_str_t ngx_http_sqlitelog_sql_create_table(ngx_str_t table_name,
-    ngx_array_t columns, ngx_pool_t *pool);
+    ngx_array_t columns, ngx_str_t key, ngx_flag_t strict, ngx_pool_t *pool);
 ngx_str_t ngx_http_sqlitelog_sql_insert(ngx_str_t table, ngx_uint_t n,
     ngx_pool_t *pool);
+ngx_int_t ngx_http_sqlitelog_sql_batch(ngx_str_t table_name,
+    ngx_str_t *create, ngx_str_t *insert, ngx_pool_t *pool);
+ngx_str_t ngx_http_sqlitelog_sql_create_index(ngx_str_t index_name,
+    ngx_str_t table_name, ngx_array_t *columns, ngx_str_t where,
+    ngx_pool_t *pool);
+ngx_str_t ngx_http_sqlitelog_sql_retention(ngx_str_t table_name,
+    ngx_str_t key, ngx_str_t ts, ngx_uint_t n, ngx_pool_t *pool);
+ngx_str_t ngx_http_sqlitelog_sql_rollup_create(
+    ngx_http_sqlitelog_rollup_t *rollup, ngx_pool_t *pool);
+ngx_str_t ngx_http_sqlitelog_sql_rollup_upsert(
+    ngx_http_sqlitelog_rollup_t *rollup, ngx_pool_t *pool);
@@ -239,6 +239,108 @@ ngx_http_sqlitelog_sqlite3_bind_null(sqlite3 *db, sqlite3_stmt *stmt,
 }
 
 
+/**
+ * Bind a 64-bit integer to a SQLite3 prepared statement.
+ * 
+ * @param   db              a database connection
+ * @param   stmt            the SQLite3 statement to bind to
+ * @param   position        the position to bind to
+ * @param   val             the value to bind
+ * @param   log             an Nginx log for writing errors
+ * @return                  the return code of sqlite3_bind_int64()
+ */
+int
+ngx_http_sqlitelog_sqlite3_bind_int64(sqlite3 *db, sqlite3_stmt *stmt,
+    int position, sqlite3_int64 val, ngx_log_t *log)
+{
+    int          rc_extended;
+    int          rc_primary;
+    ngx_str_t    error_message;
+    ngx_str_t    rc_extended_name;
+    ngx_str_t    rc_primary_name;
+    
+    rc_primary = sqlite3_bind_int64(stmt, position, val);
+    
+    /* OK */
+    if (rc_primary == SQLITE_OK) {
+        return rc_primary;
+    }
+    
+    /* Error */
+    error_message = ngx_http_sqlitelog_errmsg(db);
+    rc_primary_name = ngx_http_sqlitelog_rcname(rc_primary);
+    rc_extended = sqlite3_extended_errcode(db);
+    
+    if (rc_primary == rc_extended) {
+        ngx_log_error(NGX_LOG_ERR, log, 0,
+                      "sqlitelog: sqlite3 failed to bind integer %L to "
+                      "prepared statement due to %V (%d): \"%V\"",
+                      (int64_t) val, &rc_primary_name, rc_primary,
+                      &error_message);
+    }
+    else {
+        rc_extended_name = ngx_http_sqlitelog_rcname(rc_extended);
+        ngx_log_error(NGX_LOG_ERR, log, 0,
+                      "sqlitelog: sqlite3 failed to bind integer %L to "
+                      "prepared statement due to %V (%d): \"%V\"",
+                      (int64_t) val, &rc_extended_name, rc_extended,
+                      &error_message);
+    }
+    return rc_primary;
+}
+
+
+/**
+ * Bind a floating point number to a SQLite3 prepared statement.
+ * 
+ * @param   db              a database connection
+ * @param   stmt            the SQLite3 statement to bind to
+ * @param   position        the position to bind to
+ * @param   val             the value to bind
+ * @param   log             an Nginx log for writing errors
+ * @return                  the return code of sqlite3_bind_double()
+ */
+int
+ngx_http_sqlitelog_sqlite3_bind_double(sqlite3 *db, sqlite3_stmt *stmt,
+    int position, double val, ngx_log_t *log)
+{
+    int          rc_extended;
+    int          rc_primary;
+    ngx_str_t    error_message;
+    ngx_str_t    rc_extended_name;
+    ngx_str_t    rc_primary_name;
+    
+    rc_primary = sqlite3_bind_double(stmt, position, val);
+    
+    /* OK */
+    if (rc_primary == SQLITE_OK) {
+        return rc_primary;
+    }
+    
+    /* Error */
+    error_message = ngx_http_sqlitelog_errmsg(db);
+    rc_primary_name = ngx_http_sqlitelog_rcname(rc_primary);
+    rc_extended = sqlite3_extended_errcode(db);
+    
+    if (rc_primary == rc_extended) {
+        ngx_log_error(NGX_LOG_ERR, log, 0,
+                      "sqlitelog: sqlite3 failed to bind number %f to "
+                      "prepared statement due to %V (%d): \"%V\"",
+                      val, &rc_primary_name, rc_primary,
+                      &error_message);
+    }
+    else {
+        rc_extended_name = ngx_http_sqlitelog_rcname(rc_extended);
+        ngx_log_error(NGX_LOG_ERR, log, 0,
+                      "sqlitelog: sqlite3 failed to bind number %f to "
+                      "prepared statement due to %V (%d): \"%V\"",
+                      val, &rc_extended_name, rc_extended,
+                      &error_message);
+    }
+    return rc_primary;
+}
+
+
 /**
  * 
  * Bind a blob (ngx_str_t with blob data and length) to a SQLite3 prepared
@@ -35,6 +35,11 @@ int ngx_http_sqlitelog_sqlite3_bind_text(sqlite3 *db, sqlite3_stmt *stmt,
 int ngx_http_sqlitelog_sqlite3_bind_null(sqlite3 *db, sqlite3_stmt *stmt,
     int position, ngx_log_t *log);
 
+int ngx_http_sqlitelog_sqlite3_bind_int64(sqlite3 *db, sqlite3_stmt *stmt,
+    int position, sqlite3_int64 val, ngx_log_t *log);
+
+int ngx_http_sqlitelog_sqlite3_bind_double(sqlite3 *db, sqlite3_stmt *stmt,
+    int position, double val, ngx_log_t *log);
 int ngx_http_sqlitelog_sqlite3_bind_blob(sqlite3 *db, sqlite3_stmt *stmt,
     int position, ngx_str_t val, sqlite3_destructor_type val_destructor,
     ngx_log_t *log);
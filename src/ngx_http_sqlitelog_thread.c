@@ -13,8 +13,12 @@
 #include "ngx_http_sqlitelog_thread.h"
 
 
+static ngx_str_t *ngx_http_sqlitelog_thread_copy(ngx_pool_t *pool,
+    ngx_array_t *log_entry);
+
+
 /**
- * Insert a log entry into the database.
+ * Insert a group of log entries into the database in one transaction.
  * 
  * @param  data    the thread context data
  * @param  log     a log for writing error messages
@@ -27,11 +31,12 @@ ngx_http_sqlitelog_thread_insert_1_handler(void *data, ngx_log_t *log)
     
     ctx = data;
     
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, log, 0,
-                   "sqlitelog: thread insert 1 handler");
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, log, 0,
+                   "sqlitelog: thread insert 1 handler, entries: %ui",
+                   ctx->n);
     
-    rc_insert = ngx_http_sqlitelog_db_insert(&ctx->db, ctx->log_entry->elts,
-                                             ctx->log_entry->nelts, log);
+    rc_insert = ngx_http_sqlitelog_db_insert_list(ctx->db, ctx->list, NULL,
+                                                  log);
     
     ngx_log_debug1(NGX_LOG_DEBUG_HTTP, log, 0,
                    "sqlitelog: thread insert 1 handler, rc_insert: %d",
@@ -40,7 +45,7 @@ ngx_http_sqlitelog_thread_insert_1_handler(void *data, ngx_log_t *log)
     if (rc_insert != SQLITE_OK) {
         ngx_log_error(NGX_LOG_ERR, log, 0,
                       "sqlitelog: thread insert 1 handler failed to insert "
-                      "log entry into database \"%V\"", &ctx->db.filename);
+                      "log entries into database \"%V\"", &ctx->db->filename);
     }
 }
 
@@ -57,30 +62,29 @@ ngx_http_sqlitelog_thread_insert_n_handler(void *data, ngx_log_t *log)
     int                               rc_insert;
     ngx_int_t                         rc_list;
     ngx_int_t                         rc_unshift;
+    ngx_uint_t                        half;
     ngx_list_t                        list;
     ngx_pool_t                       *pool;
-    ngx_uint_t                        n;
-    ngx_slab_pool_t                  *shpool;
+    ngx_array_t                       rollup;
     ngx_http_sqlitelog_thread_ctx_t  *ctx;
     
     ctx = data;
     pool = ctx->pool;
-    shpool = (ngx_slab_pool_t *) ctx->buf->shm_zone->shm.addr;
-    n = ctx->db.fmt->columns.nelts;
     
     ngx_log_debug0(NGX_LOG_DEBUG_HTTP, log, 0,
                    "sqlitelog: thread insert n handler");
     
     /* 1. Lock */
-    ngx_shmtx_lock(&shpool->mutex);
+    ngx_http_sqlitelog_buf_lock(ctx->buf);
     
     /* 2. List */
-    rc_list = ngx_http_sqlitelog_buf_list_locked(ctx->buf, pool, n, &list);
+    rc_list = ngx_http_sqlitelog_buf_list_locked(ctx->buf, pool, &list,
+                                                 &rollup, &half);
     if (rc_list != NGX_OK) {
         ngx_log_error(NGX_LOG_ERR, log, 0,
                       "sqlitelog: thread insert n handler failed to create "
-                      "list for database \"%V\"", &ctx->db.filename);
-        ngx_shmtx_unlock(&shpool->mutex);
+                      "list for database \"%V\"", &ctx->db->filename);
+        ngx_http_sqlitelog_buf_unlock(ctx->buf);
         return;
     }
     
@@ -92,25 +96,26 @@ ngx_http_sqlitelog_thread_insert_n_handler(void *data, ngx_log_t *log)
     }
     
     /* 4. Unlock */
-    ngx_shmtx_unlock(&shpool->mutex);
+    ngx_http_sqlitelog_buf_unlock(ctx->buf);
     
     /* 5. Insert */
-    rc_insert = ngx_http_sqlitelog_db_insert_list(&ctx->db, &list, log);
+    rc_insert = ngx_http_sqlitelog_buf_commit(ctx->buf, ctx->db, &list,
+                                              &rollup, half, log);
     if (rc_insert != NGX_OK) {
         ngx_log_error(NGX_LOG_ERR, log, 0,
                       "sqlitelog: thread n handler failed to insert list into "
-                      "database \"%V\"", &ctx->db.filename);
+                      "database \"%V\"", &ctx->db->filename);
         return;
     }
     
     /* Unshift */
     if (ctx->log_entry) {
-        rc_unshift = ngx_http_sqlitelog_buf_unshift(ctx->buf,
+        rc_unshift = ngx_http_sqlitelog_buf_unshift(ctx->buf, ctx->table,
                                                     ctx->log_entry, log);
         if (rc_unshift != NGX_OK) {
             ngx_log_error(NGX_LOG_ERR, log, 0,
                           "sqlitelog: thread n handler failed to unshift log "
-                          "entry for database \"%V\"", &ctx->db.filename);
+                          "entry for database \"%V\"", &ctx->db->filename);
         }
     }
 }
@@ -129,41 +134,40 @@ ngx_http_sqlitelog_thread_flush_handler(void *data, ngx_log_t *log)
     ngx_int_t                         rc_list;
     ngx_list_t                        list;
     ngx_pool_t                       *pool;
+    ngx_uint_t                        half;
     ngx_uint_t                        buffer_len;
-    ngx_uint_t                        n;
-    ngx_slab_pool_t                  *shpool;
+    ngx_array_t                       rollup;
     ngx_http_sqlitelog_db_t          *db;
     ngx_http_sqlitelog_buf_flctx_t   *flctx;
     ngx_http_sqlitelog_thread_ctx_t  *thctx;
     
     thctx = data;
     pool = thctx->pool;
-    shpool = (ngx_slab_pool_t *) thctx->buf->shm_zone->shm.addr;
     flctx = thctx->buf->event->data;
     db = flctx->db;
-    n = db->fmt->columns.nelts;
     
     ngx_log_debug0(NGX_LOG_DEBUG_HTTP, log, 0,
                    "sqlitelog: thread flush handler");
     
     /* 1. Lock */
-    ngx_shmtx_lock(&shpool->mutex);
+    ngx_http_sqlitelog_buf_lock(thctx->buf);
     buffer_len = ngx_http_sqlitelog_buf_get_len_locked(thctx->buf);
     if (buffer_len == 0) {
         ngx_log_debug0(NGX_LOG_DEBUG_HTTP, log, 0,
                        "sqlitelog: thread flush handler, already flushed");
         ngx_http_sqlitelog_buf_timer_reset(thctx->buf);
-        ngx_shmtx_unlock(&shpool->mutex);
+        ngx_http_sqlitelog_buf_unlock(thctx->buf);
         return;
     }
     
     /* 2. List */
-    rc_list = ngx_http_sqlitelog_buf_list_locked(thctx->buf, pool, n, &list);
+    rc_list = ngx_http_sqlitelog_buf_list_locked(thctx->buf, pool, &list,
+                                                 &rollup, &half);
     if (rc_list != NGX_OK) {
         ngx_log_error(NGX_LOG_ERR, log, 0,
                       "sqlitelog: thread flush handler failed to create list "
-                      "for database \"%V\"", &thctx->db.filename);
-        ngx_shmtx_unlock(&shpool->mutex);
+                      "for database \"%V\"", &db->filename);
+        ngx_http_sqlitelog_buf_unlock(thctx->buf);
         goto failed;
     }
     
@@ -175,10 +179,11 @@ ngx_http_sqlitelog_thread_flush_handler(void *data, ngx_log_t *log)
     }
     
     /* 4. Unlock */
-    ngx_shmtx_unlock(&shpool->mutex);
+    ngx_http_sqlitelog_buf_unlock(thctx->buf);
     
     /* 5. Insert */
-    rc_insert = ngx_http_sqlitelog_db_insert_list(db, &list, log);
+    rc_insert = ngx_http_sqlitelog_buf_commit(thctx->buf, db, &list, &rollup,
+                                              half, log);
     if (rc_insert != NGX_OK) {
         ngx_log_error(NGX_LOG_ERR, log, 0,
                       "sqlitelog: thread flush handler failed to insert list "
@@ -203,16 +208,354 @@ failed:
 void
 ngx_http_sqlitelog_thread_completed_handler(ngx_event_t *ev)
 {
-    ngx_pool_t                       *pool;
+#if (NGX_THREADS)
     ngx_http_sqlitelog_thread_ctx_t  *ctx;
+#endif
     
     ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ev->log, 0,
                    "sqlitelog: thread completed handler");
     
+#if (NGX_THREADS)
     ctx = ev->data;
-    pool = ctx->pool;
     
-    if (pool) {
+    ngx_http_sqlitelog_thread_next(ctx->db, ev->log);
+    ngx_http_sqlitelog_thread_task_free(ctx->db, ctx->task);
+#endif
+}
+
+
+/**
+ * Add a copy of a log entry to a thread context's list of log entries.
+ * 
+ * @param   ctx         the thread context
+ * @param   table       the index of the log entry's table in the database
+ * @param   log_entry   the log entry
+ * @return              NGX_OK on success, or
+ *                      NGX_ERROR on failure
+ */
+ngx_int_t
+ngx_http_sqlitelog_thread_push(ngx_http_sqlitelog_thread_ctx_t *ctx,
+    ngx_uint_t table, ngx_array_t *log_entry)
+{
+    ngx_http_sqlitelog_entry_t  *entry;
+    
+    entry = ngx_list_push(ctx->list);
+    if (entry == NULL) {
+        return NGX_ERROR;
+    }
+    
+    entry->table = table;
+    entry->nelts = log_entry->nelts;
+    entry->elts = ngx_http_sqlitelog_thread_copy(ctx->pool, log_entry);
+    if (entry->elts == NULL) {
+        return NGX_ERROR;
+    }
+    
+    ctx->n++;
+    
+    return NGX_OK;
+}
+
+
+/**
+ * Keep a copy of a log entry in a thread context, to be unshifted in the
+ * buffer after the task has committed it.
+ * 
+ * @param   ctx         the thread context
+ * @param   table       the index of the log entry's table in the database
+ * @param   log_entry   the log entry
+ * @return              NGX_OK on success, or
+ *                      NGX_ERROR on failure
+ */
+ngx_int_t
+ngx_http_sqlitelog_thread_keep(ngx_http_sqlitelog_thread_ctx_t *ctx,
+    ngx_uint_t table, ngx_array_t *log_entry)
+{
+    ngx_array_t  *copy;
+    
+    copy = ngx_palloc(ctx->pool, sizeof(ngx_array_t));
+    if (copy == NULL) {
+        return NGX_ERROR;
+    }
+    
+    copy->elts = ngx_http_sqlitelog_thread_copy(ctx->pool, log_entry);
+    if (copy->elts == NULL) {
+        return NGX_ERROR;
+    }
+    
+    copy->nelts = log_entry->nelts;
+    copy->size = sizeof(ngx_str_t);
+    copy->nalloc = log_entry->nelts;
+    copy->pool = ctx->pool;
+    
+    ctx->table = table;
+    ctx->log_entry = copy;
+    
+    return NGX_OK;
+}
+
+
+/**
+ * Copy a log entry's values into a pool.
+ * 
+ * @param   pool        the pool
+ * @param   log_entry   the log entry
+ * @return              a C-style array of log_entry->nelts strings, or
+ *                      NULL on failure
+ */
+static ngx_str_t *
+ngx_http_sqlitelog_thread_copy(ngx_pool_t *pool, ngx_array_t *log_entry)
+{
+    ngx_str_t   *elt;
+    ngx_str_t   *elts;
+    ngx_str_t   *s;
+    ngx_uint_t   i;
+    
+    elts = ngx_palloc(pool, log_entry->nelts * sizeof(ngx_str_t));
+    if (elts == NULL) {
+        return NULL;
+    }
+    
+    elt = log_entry->elts;
+    for (i = 0; i < log_entry->nelts; i++) {
+        
+        s = &elts[i];
+        s->len = elt[i].len;
+        
+        if (elt[i].data == NULL) {
+            s->data = NULL;
+            continue;
+        }
+        
+        s->data = ngx_pnalloc(pool, elt[i].len);
+        if (s->data == NULL) {
+            return NULL;
+        }
+        ngx_memcpy(s->data, elt[i].data, elt[i].len);
+    }
+    
+    return elts;
+}
+
+
+#if (NGX_THREADS)
+/**
+ * Get a thread task for inserting into, or flushing the buffer of, a
+ * database. The task is taken from the database's freelist, if there is one,
+ * or else allocated along with a new pool.
+ * 
+ * The task's context has its db, pool, and task fields set, and its
+ * completion handler is ngx_http_sqlitelog_thread_completed_handler(), which
+ * recycles it.
+ * 
+ * @param   db      the database
+ * @param   log     a log for writing error messages
+ * @return          a thread task, or
+ *                  NULL on failure
+ */
+ngx_thread_task_t *
+ngx_http_sqlitelog_thread_task(ngx_http_sqlitelog_db_t *db, ngx_log_t *log)
+{
+    ngx_pool_t                       *pool;
+    ngx_thread_task_t                *task;
+    ngx_http_sqlitelog_thread_ctx_t  *ctx;
+    
+    /* Recycled */
+    if (db->free) {
+        task = db->free;
+        db->free = task->next;
+        db->nfree--;
+        pool = ((ngx_http_sqlitelog_thread_ctx_t *) task->ctx)->pool;
+        
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, log, 0,
+                       "sqlitelog: thread task, recycled: %p", task);
+        goto init;
+    }
+    
+    /* New; its pool outlives the request, so it logs to the cycle's log */
+    pool = ngx_create_pool(NGX_DEFAULT_POOL_SIZE, ngx_cycle->log);
+    if (pool == NULL) {
+        ngx_log_error(NGX_LOG_ERR, log, 0,
+                      "sqlitelog: failed to create pool of %z bytes for "
+                      "thread task", NGX_DEFAULT_POOL_SIZE);
+        return NULL;
+    }
+    
+    task = ngx_alloc(sizeof(ngx_thread_task_t)
+                     + sizeof(ngx_http_sqlitelog_thread_ctx_t), log);
+    if (task == NULL) {
+        ngx_destroy_pool(pool);
+        return NULL;
+    }
+    
+    ngx_memzero(task, sizeof(ngx_thread_task_t));
+    task->ctx = task + 1;
+    
+init:
+    
+    ctx = task->ctx;
+    ngx_memzero(ctx, sizeof(ngx_http_sqlitelog_thread_ctx_t));
+    ctx->db = db;
+    ctx->pool = pool;
+    ctx->task = task;
+    
+    task->next = NULL;
+    task->event.handler = ngx_http_sqlitelog_thread_completed_handler;
+    task->event.data = ctx;
+    task->event.log = ngx_cycle->log;
+    
+    return task;
+}
+
+
+/**
+ * Return a thread task that's done with to its database's freelist, with its
+ * pool reset. If the freelist is full, the task is destroyed instead.
+ * 
+ * @param   db      the database
+ * @param   task    a task from ngx_http_sqlitelog_thread_task()
+ */
+void
+ngx_http_sqlitelog_thread_task_free(ngx_http_sqlitelog_db_t *db,
+    ngx_thread_task_t *task)
+{
+    ngx_pool_t  *pool;
+    
+    pool = ((ngx_http_sqlitelog_thread_ctx_t *) task->ctx)->pool;
+    
+    if (db->nfree >= NGX_HTTP_SQLITELOG_THREAD_FREE) {
         ngx_destroy_pool(pool);
+        ngx_free(task);
+        return;
+    }
+    
+    ngx_reset_pool(pool);
+    
+    task->next = db->free;
+    db->free = task;
+    db->nfree++;
+}
+
+
+/**
+ * Post a thread task that uses a database's connection. If another task is
+ * using the connection, the task waits until that one has completed.
+ * 
+ * @param   db      the database
+ * @param   task    the thread task
+ * @return          NGX_OK if the task was posted or queued, or
+ *                  NGX_ERROR if it couldn't be posted
+ */
+ngx_int_t
+ngx_http_sqlitelog_thread_post(ngx_http_sqlitelog_db_t *db,
+    ngx_thread_task_t *task)
+{
+    if (db->writing) {
+        task->next = NULL;
+        if (db->last) {
+            db->last->next = task;
+        } else {
+            db->waiting = task;
+        }
+        db->last = task;
+        
+        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                       "sqlitelog: thread post, task: %p, behind: %p",
+                       task, db->writing);
+        return NGX_OK;
     }
+    
+    if (ngx_thread_task_post(db->tp, task) != NGX_OK) {
+        return NGX_ERROR;
+    }
+    
+    db->writing = task;
+    
+    if (db->pending == task) {
+        db->pending = NULL;
+    }
+    
+    return NGX_OK;
+}
+
+
+/**
+ * Release a database's connection after a thread task has completed, and
+ * post the next waiting task, if any.
+ * 
+ * A waiting task that can't be posted is completed without being run, so
+ * that its completion handler can release its resources.
+ * 
+ * @param   db      the database
+ * @param   log     a log for writing error messages
+ */
+void
+ngx_http_sqlitelog_thread_next(ngx_http_sqlitelog_db_t *db, ngx_log_t *log)
+{
+    ngx_thread_task_t  *task;
+    
+    db->writing = NULL;
+    
+    task = db->waiting;
+    if (task == NULL) {
+        return;
+    }
+    
+    db->waiting = task->next;
+    if (db->waiting == NULL) {
+        db->last = NULL;
+    }
+    
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, log, 0,
+                   "sqlitelog: thread next, task: %p, waiting: %p",
+                   task, db->waiting);
+    
+    /* A waiting insert task stops taking log entries once it's posted */
+    if (db->pending == task) {
+        db->pending = NULL;
+    }
+    
+    if (ngx_thread_task_post(db->tp, task) == NGX_OK) {
+        db->writing = task;
+        return;
+    }
+    
+    ngx_log_error(NGX_LOG_ERR, log, 0,
+                  "sqlitelog: failed to post thread task for database \"%V\"",
+                  &db->filename);
+    
+    /* Calls ngx_http_sqlitelog_thread_next() again for the rest */
+    db->writing = task;
+    task->event.handler(&task->event);
+}
+
+
+/**
+ * Run a database's waiting thread tasks in the calling thread. This is called
+ * when a worker process exits, after the thread pool has finished its own
+ * tasks, so that no log entries are lost.
+ * 
+ * @param   db      the database
+ * @param   log     a log for writing error messages
+ */
+void
+ngx_http_sqlitelog_thread_drain(ngx_http_sqlitelog_db_t *db, ngx_log_t *log)
+{
+    ngx_thread_task_t  *task;
+    
+    db->writing = NULL;
+    db->pending = NULL;
+    
+    while (db->waiting) {
+        task = db->waiting;
+        db->waiting = task->next;
+        
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, log, 0,
+                       "sqlitelog: thread drain, task: %p", task);
+        
+        task->handler(task->ctx, log);
+    }
+    
+    db->last = NULL;
 }
+#endif
@@ -1,6 +1,25 @@
 
 /*
  * Copyright (C) Serope.com
+ * 
+ * A database connection must never be used by two threads at once, so each
+ * database has a queue of thread tasks. A task is posted to the thread pool
+ * only when no other task is using the connection; otherwise, it waits in the
+ * queue until the task before it has completed. Every task that goes through
+ * ngx_http_sqlitelog_thread_post() must call ngx_http_sqlitelog_thread_next()
+ * in its completion handler.
+ * 
+ * Without a buffer, log entries are grouped while they wait: an entry joins
+ * the insert task that's waiting for the connection, if there is one, so
+ * every entry that arrives during a commit is written by the next commit. A
+ * group takes at most NGX_HTTP_SQLITELOG_THREAD_GROUP entries; the entries
+ * after that start a new group behind it. The queue itself isn't limited, so
+ * if the disk can't keep up with the requests, the waiting groups grow in
+ * memory until it does.
+ * 
+ * Insert and flush tasks are recycled: a completed task goes back to its
+ * database's freelist with its pool reset, rather than being destroyed, so
+ * that the next task reuses the memory that the pool has already allocated.
  */
 
 
@@ -8,26 +27,49 @@
 
 
 #include <ngx_core.h>
+#include <ngx_thread_pool.h>
 
 
 #include "ngx_http_sqlitelog_buf.h"
 #include "ngx_http_sqlitelog_db.h"
 
 
+/* Completed thread tasks kept for reuse per database */
+#define NGX_HTTP_SQLITELOG_THREAD_FREE   8
+
+/* Log entries inserted by one task without a buffer */
+#define NGX_HTTP_SQLITELOG_THREAD_GROUP  1024
+
+
 /*
  * ngx_http_sqlitelog_thread_ctx_t is the data that is passed to a worker thread
  * so that SQLite insertions can be done asynchronously.
  * 
  * db           the database to be written to
- * log_entry    a log entry to insert or unshift in the buffer
+ * table        the index of the log entry's table in the database
+ * log_entry    a log entry to unshift in the buffer
+ * list         log entries to insert in one transaction
+ *              (ngx_http_sqlitelog_entry_t)
+ * n            the amount of log entries in list
  * buf          a buffer to commit
- * pool         a pool for allocating objects, including the context itself
+ * pool         a pool for the task's objects, which is reset when the task is
+ *              recycled
+ * task         the thread task that holds this context
  */
 typedef struct {
-    ngx_http_sqlitelog_db_t       db;
+    ngx_http_sqlitelog_db_t      *db;
+    ngx_uint_t                    table;
     ngx_array_t                  *log_entry;
+    ngx_list_t                   *list;
+    ngx_uint_t                    n;
     ngx_http_sqlitelog_buf_t     *buf;
     ngx_pool_t                   *pool;
+    
+#if (NGX_THREADS)
+    ngx_thread_task_t            *task;
+#else
+    void                         *task;
+#endif
 } ngx_http_sqlitelog_thread_ctx_t;
 
 
@@ -35,3 +77,20 @@ void ngx_http_sqlitelog_thread_insert_1_handler(void *data, ngx_log_t *log);
 void ngx_http_sqlitelog_thread_insert_n_handler(void *data, ngx_log_t *log);
 void ngx_http_sqlitelog_thread_flush_handler(void *data, ngx_log_t *log);
 void ngx_http_sqlitelog_thread_completed_handler(ngx_event_t *ev);
+ngx_int_t ngx_http_sqlitelog_thread_push(ngx_http_sqlitelog_thread_ctx_t *ctx,
+    ngx_uint_t table, ngx_array_t *log_entry);
+ngx_int_t ngx_http_sqlitelog_thread_keep(ngx_http_sqlitelog_thread_ctx_t *ctx,
+    ngx_uint_t table, ngx_array_t *log_entry);
+
+#if (NGX_THREADS)
+ngx_thread_task_t *ngx_http_sqlitelog_thread_task(ngx_http_sqlitelog_db_t *db,
+    ngx_log_t *log);
+void ngx_http_sqlitelog_thread_task_free(ngx_http_sqlitelog_db_t *db,
+    ngx_thread_task_t *task);
+ngx_int_t ngx_http_sqlitelog_thread_post(ngx_http_sqlitelog_db_t *db,
+    ngx_thread_task_t *task);
+void ngx_http_sqlitelog_thread_next(ngx_http_sqlitelog_db_t *db,
+    ngx_log_t *log);
+void ngx_http_sqlitelog_thread_drain(ngx_http_sqlitelog_db_t *db,
+    ngx_log_t *log);
+#endif
@@ -0,0 +1,16 @@
+CREATE TABLE IF NOT EXISTS inet_checks (
+    remote_addr_text    TEXT,
+    binary_addr_text    TEXT,
+    in_loopback         INTEGER,
+    in_private          INTEGER
+);
+
+CREATE TRIGGER IF NOT EXISTS inet_checks_insert AFTER INSERT ON addrs
+BEGIN
+    INSERT INTO inet_checks VALUES (
+        inet_ntop(NEW.remote_addr),
+        inet_ntop(NEW.binary_remote_addr),
+        inet_in_cidr(NEW.remote_addr, '127.0.0.0/8'),
+        inet_in_cidr(NEW.remote_addr, '10.0.0.0/8')
+    );
+END;
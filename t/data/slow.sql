@@ -0,0 +1,14 @@
+
+CREATE TABLE IF NOT EXISTS slow (
+    n   INTEGER
+);
+
+INSERT INTO slow
+WITH RECURSIVE c(n) AS (SELECT 1 UNION ALL SELECT n + 1 FROM c WHERE n < 1000)
+SELECT n FROM c WHERE (SELECT COUNT(*) FROM slow) = 0;
+
+CREATE TRIGGER IF NOT EXISTS slow_insert
+AFTER INSERT ON combined
+BEGIN
+    SELECT COUNT(*) FROM slow a, slow b;
+END;
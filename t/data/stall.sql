@@ -0,0 +1,15 @@
+
+CREATE TABLE IF NOT EXISTS stall (
+    n   INTEGER
+);
+
+INSERT INTO stall
+WITH RECURSIVE c(n) AS (SELECT 1 UNION ALL SELECT n + 1 FROM c WHERE n < 1000)
+SELECT n FROM c WHERE (SELECT COUNT(*) FROM stall) = 0;
+
+CREATE TRIGGER IF NOT EXISTS stall_insert
+AFTER INSERT ON combined
+BEGIN
+    SELECT COUNT(*) FROM stall c CROSS JOIN stall a CROSS JOIN stall b
+    WHERE c.n <= 20;
+END;
@@ -0,0 +1,68 @@
+#!/usr/bin/perl
+
+# (C) Serope.com
+
+# In this test, a small buffer overflows every few requests in async mode.
+# Each overflow posts a thread task that commits the buffer and then unshifts
+# its own copy of the log entry that didn't fit, so no log entry may be lost
+# or reordered, and the tasks must be recycled rather than allocated anew.
+
+use warnings;
+use strict;
+
+use Test::More;
+BEGIN { use FindBin; chdir($FindBin::Bin); }
+
+use lib 'lib';
+use Test::Nginx;
+
+use DBI;
+use Util;
+use File::Spec;
+
+select STDERR; $| = 1;
+select STDOUT; $| = 1;
+
+
+# Set up
+my $total_tests = 5;
+my $requests = 100;
+my $conf = Util::read_file("conf/sqlitelog_async_buffer_overflow.conf");
+my $t = Test::Nginx->new()->has(qw/http rewrite/)->plan($total_tests)->write_file_expand('nginx.conf', $conf);
+Util::link_module($t->testdir());
+
+
+###############################################################################
+$t->run();
+
+# Each log entry takes a 2K slot, so the buffer holds only a few of them
+my $pad = "x" x 1000;
+for my $i (1..$requests) {
+	http_get("/$i/$pad");
+}
+
+$t->stop();
+###############################################################################
+
+
+# Every request is logged, in order
+my $path = File::Spec->catfile($t->testdir(), "access.db");
+my $dbh = DBI->connect("dbi:SQLite:dbname=${path}", "", "", undef);
+
+my @arr = $dbh->selectrow_array("SELECT COUNT(*) FROM combined");
+is($arr[0], $requests, "Count records");
+
+my $rows = $dbh->selectcol_arrayref("SELECT request FROM combined ORDER BY rowid");
+my @order = map { m{^GET /(\d+)/} ? $1 : 0 } @$rows;
+is_deeply(\@order, [1..$requests], "Check order of records");
+
+
+# The buffer overflowed, and the overflow tasks were recycled
+my $log = $t->read_file('error.log');
+like($log, qr/\[debug\] .* sqlitelog: buffer overflow/, "Check for overflows in error.log");
+like($log, qr/\[debug\] .* sqlitelog: thread task, recycled: /, "Check for recycled tasks in error.log");
+unlike($log, qr/failed to unshift/, "Check for unshift errors in error.log");
+
+
+# End
+$dbh->disconnect;
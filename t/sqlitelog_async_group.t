@@ -0,0 +1,84 @@
+#!/usr/bin/perl
+
+# (C) Serope.com
+
+# In this test, several clients send requests at once without a buffer, and
+# every insert runs a slow trigger. The log entries that arrive while an insert
+# is running must join the next one, so there are fewer inserts than requests,
+# and at least one of them writes more than one entry.
+
+use warnings;
+use strict;
+
+use Test::More;
+BEGIN { use FindBin; chdir($FindBin::Bin); }
+
+use lib 'lib';
+use Test::Nginx;
+
+use DBI;
+use Util;
+use File::Spec;
+
+select STDERR; $| = 1;
+select STDOUT; $| = 1;
+
+
+# Set up
+my $total_tests = 5;
+my $clients = 8;
+my $requests = 20;
+my $conf = Util::read_file("conf/sqlitelog_async_group.conf");
+my $t = Test::Nginx->new()->has(qw/http rewrite/)->plan($total_tests);
+Util::link_module($t->testdir());
+Util::link_data("slow.sql", $t->testdir());
+$t->write_file_expand('nginx.conf', $conf);
+
+
+###############################################################################
+$t->run();
+
+my @pids;
+for my $c (1..$clients) {
+	my $pid = fork();
+	die "fork failed" unless defined $pid;
+	if ($pid == 0) {
+		for my $i (1..$requests) {
+			http_get("/client-$c/$i");
+		}
+		exit 0;
+	}
+	push @pids, $pid;
+}
+waitpid($_, 0) for @pids;
+
+$t->stop();
+###############################################################################
+
+
+# Every request is logged
+my $path = File::Spec->catfile($t->testdir(), "access.db");
+my $dbh = DBI->connect("dbi:SQLite:dbname=${path}", "", "", undef);
+
+my @arr = $dbh->selectrow_array("SELECT COUNT(*) FROM combined");
+is($arr[0], $clients * $requests, "Count records");
+
+
+# The inserts wrote the entries in groups
+my $log = $t->read_file('error.log');
+my @groups = ($log =~ /\[debug\] .* sqlitelog: thread insert 1 handler, entries: (\d+)/g);
+my $sum = 0;
+my $max = 0;
+for my $n (@groups) {
+	$sum += $n;
+	$max = $n if $n > $max;
+}
+
+is($sum, $clients * $requests, "Count grouped entries in error.log");
+ok(@groups < $clients * $requests, "Count inserts in error.log");
+ok($max > 1, "Check for a group of several entries in error.log");
+unlike($log, qr/\[(error|alert|crit)\]/, "Check for errors in error.log");
+
+
+# End
+$dbh->disconnect;
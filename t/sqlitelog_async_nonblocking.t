@@ -0,0 +1,68 @@
+#!/usr/bin/perl
+
+# (C) Serope.com
+
+# In this test, every insert runs a trigger that takes a good fraction of a
+# second. Without a buffer in async mode, the requests must be answered right
+# away rather than wait for their log entries to be written, so they all
+# return before the last of their log entries is committed.
+
+use warnings;
+use strict;
+
+use Test::More;
+BEGIN { use FindBin; chdir($FindBin::Bin); }
+
+use lib 'lib';
+use Test::Nginx;
+
+use DBI;
+use Util;
+use File::Spec;
+
+select STDERR; $| = 1;
+select STDOUT; $| = 1;
+
+
+# Set up
+my $total_tests = 3;
+my $requests = 5;
+my $conf = Util::read_file("conf/sqlitelog_async_nonblocking.conf");
+my $t = Test::Nginx->new()->has(qw/http rewrite/)->plan($total_tests);
+Util::link_module($t->testdir());
+Util::link_data("stall.sql", $t->testdir());
+$t->write_file_expand('nginx.conf', $conf);
+
+my $dbpath = File::Spec->catfile($t->testdir(), "access.db");
+
+
+###############################################################################
+$t->run();
+
+my $answered = 0;
+for my $i (1..$requests) {
+	$answered++ if http_get("/$i") =~ /^HTTP\/1\.1 200/;
+}
+
+# Count right after the last response, while the triggers are still running
+my $dbh = DBI->connect("dbi:SQLite:dbname=${dbpath}", "", "", undef);
+my @arr = $dbh->selectrow_array("SELECT COUNT(*) FROM combined");
+my $during = $arr[0];
+$dbh->disconnect;
+
+$t->stop();
+###############################################################################
+
+
+is($answered, $requests, "Check responses");
+ok($during < $requests, "Check that the requests didn't wait for their inserts");
+
+
+# Every log entry is still written by the time the worker exits
+$dbh = DBI->connect("dbi:SQLite:dbname=${dbpath}", "", "", undef);
+@arr = $dbh->selectrow_array("SELECT COUNT(*) FROM combined");
+is($arr[0], $requests, "Count records after exit");
+
+
+# End
+$dbh->disconnect;
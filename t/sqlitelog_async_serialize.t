@@ -0,0 +1,77 @@
+#!/usr/bin/perl
+
+# (C) Serope.com
+
+# In this test, several clients send requests at once to a worker process with
+# 4 threads, and every insert runs a slow trigger. The inserts into the same
+# database must wait for each other instead of running in parallel threads, so
+# none of them may fail with SQLITE_BUSY or SQLITE_MISUSE, and none may be lost.
+
+use warnings;
+use strict;
+
+use Test::More;
+BEGIN { use FindBin; chdir($FindBin::Bin); }
+
+use lib 'lib';
+use Test::Nginx;
+
+use DBI;
+use Util;
+use File::Spec;
+
+select STDERR; $| = 1;
+select STDOUT; $| = 1;
+
+
+# Set up
+my $total_tests = 4;
+my $clients = 8;
+my $requests = 20;
+my $conf = Util::read_file("conf/sqlitelog_async_serialize.conf");
+my $t = Test::Nginx->new()->has(qw/http rewrite/)->plan($total_tests);
+Util::link_module($t->testdir());
+Util::link_data("slow.sql", $t->testdir());
+$t->write_file_expand('nginx.conf', $conf);
+
+
+###############################################################################
+$t->run();
+
+my @pids;
+for my $c (1..$clients) {
+	my $pid = fork();
+	die "fork failed" unless defined $pid;
+	if ($pid == 0) {
+		for my $i (1..$requests) {
+			http_get("/client-$c/$i");
+		}
+		exit 0;
+	}
+	push @pids, $pid;
+}
+waitpid($_, 0) for @pids;
+
+$t->stop();
+###############################################################################
+
+
+# Every request is logged
+my $path = File::Spec->catfile($t->testdir(), "access.db");
+my $dbh = DBI->connect("dbi:SQLite:dbname=${path}", "", "", undef);
+
+my @arr = $dbh->selectrow_array("SELECT COUNT(*) FROM combined");
+is($arr[0], $clients * $requests, "Count records");
+
+@arr = $dbh->selectrow_array("SELECT COUNT(DISTINCT request) FROM combined");
+is($arr[0], $clients * $requests, "Count distinct requests");
+
+
+# At least one task had to wait for another, and none failed
+my $log = $t->read_file('error.log');
+like($log, qr/\[debug\] .* sqlitelog: thread post, task: \S+, behind: /, "Check for a waiting task in error.log");
+unlike($log, qr/\[(error|alert|crit)\]/, "Check for errors in error.log");
+
+
+# End
+$dbh->disconnect;
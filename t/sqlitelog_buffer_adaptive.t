@@ -0,0 +1,68 @@
+#!/usr/bin/perl
+
+# (C) Serope.com
+
+# In this test, we test an adaptive buffer at adaptive=2s, which commits log
+# entries within 2s without any max or flush being given.
+
+use warnings;
+use strict;
+
+use Test::More;
+BEGIN { use FindBin; chdir($FindBin::Bin); }
+
+use lib 'lib';
+use Test::Nginx;
+
+use DBI;
+use Util;
+use File::Spec;
+
+select STDERR; $| = 1;
+select STDOUT; $| = 1;
+
+
+# Set up
+my $total_tests = 2;
+my $conf = Util::read_file("conf/sqlitelog_buffer_adaptive.conf");
+my $t = Test::Nginx->new()->has(qw/http rewrite/)->plan($total_tests)->write_file_expand('nginx.conf', $conf);
+Util::link_module($t->testdir());
+
+
+###############################################################################
+$t->run();
+
+# Open database
+my $dbpath = File::Spec->catfile($t->testdir(), "access.db");
+my $db = DBI->connect("dbi:SQLite:dbname=${dbpath}", "", "", undef);
+my $stmt = $db->prepare("SELECT COUNT(*) FROM combined");
+
+my @counts = ();
+for (1..2) {
+	# Send a few requests
+	for (1..3) {
+		http_get('/hello');
+	}
+	
+	# Sleep past the adaptive time (adaptive=2s)
+	sleep(4);
+	
+	# Count how many records are currently in the database
+	$stmt->execute;
+	my @arr = $stmt->fetchrow_array;
+	push(@counts, $arr[0]);
+}
+$stmt->finish;
+
+$t->stop();
+###############################################################################
+
+
+# Confirm that the buffer was committed within the adaptive time, both before
+# and after its first commit was measured
+is($counts[0], 3, "Check if table had 3 records after the first commit");
+is($counts[1], 6, "Check if table had 6 records after the second commit");
+
+
+# End
+$db->disconnect;
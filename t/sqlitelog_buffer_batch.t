@@ -0,0 +1,73 @@
+#!/usr/bin/perl
+
+# (C) Serope.com
+
+# In this test, two tables of the same database share a buffer, so their log
+# entries are committed in one transaction, each table's rows copied from its
+# batch virtual table. The rows must arrive in order, with their column types.
+
+use warnings;
+use strict;
+
+use Test::More;
+BEGIN { use FindBin; chdir($FindBin::Bin); }
+
+use lib 'lib';
+use Test::Nginx;
+
+use DBI;
+use Util;
+use File::Spec;
+
+select STDERR; $| = 1;
+select STDOUT; $| = 1;
+
+
+# Set up
+my $total_tests = 8;
+my $conf = Util::read_file("conf/sqlitelog_buffer_batch.conf");
+my $t = Test::Nginx->new()->has(qw/ http map rewrite /)->plan($total_tests)->write_file_expand('nginx.conf', $conf);
+Util::link_module($t->testdir());
+
+
+###############################################################################
+$t->run();
+
+for (1..10) {
+	http_get("/ok/$_");
+	http_get("/missing/$_") if $_ % 2 == 0;
+}
+
+# Nothing is committed until the buffer is flushed
+my $dbpath = File::Spec->catfile($t->testdir(), "batch.db");
+my $db = DBI->connect("dbi:SQLite:dbname=${dbpath}", "", "", undef);
+my @arr = $db->selectrow_array("SELECT COUNT(*) FROM requests");
+is($arr[0], 0, "Check if requests is empty before the flush");
+
+$t->stop();
+###############################################################################
+
+
+# Every entry is in its table
+@arr = $db->selectrow_array("SELECT COUNT(*) FROM requests");
+is($arr[0], 15, "Count records in requests");
+@arr = $db->selectrow_array("SELECT COUNT(*) FROM errors");
+is($arr[0], 5, "Count records in errors");
+
+# In order
+my $requests = $db->selectcol_arrayref("SELECT request FROM errors ORDER BY rowid");
+is_deeply($requests, [map { "GET /missing/" . ($_ * 2) . " HTTP/1.0" } 1..5], "Check order of errors");
+
+# With their types
+@arr = $db->selectrow_array("SELECT COUNT(*) FROM requests WHERE typeof(status) = 'integer'");
+is($arr[0], 15, "Check type of status");
+@arr = $db->selectrow_array("SELECT COUNT(*) FROM requests WHERE typeof(request_time) = 'real'");
+is($arr[0], 15, "Check type of request_time");
+@arr = $db->selectrow_array("SELECT COUNT(*) FROM requests WHERE typeof(binary_remote_addr) = 'blob' AND length(binary_remote_addr) = 4");
+is($arr[0], 15, "Check type of binary_remote_addr");
+
+unlike($t->read_file('error.log'), qr/\[error\]/, "Check for errors in error.log");
+
+
+# End
+$db->disconnect;
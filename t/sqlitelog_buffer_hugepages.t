@@ -0,0 +1,76 @@
+#!/usr/bin/perl
+
+# (C) Serope.com
+
+# In this test, we test a buffer with hugepages, which logs the same whether or
+# not the system gives the zone huge pages.
+
+use warnings;
+use strict;
+
+use Test::More;
+BEGIN { use FindBin; chdir($FindBin::Bin); }
+
+use lib 'lib';
+use Test::Nginx;
+
+use DBI;
+use Util;
+use File::Spec;
+
+select STDERR; $| = 1;
+select STDOUT; $| = 1;
+
+
+# Set up
+my $total_tests = 5;
+my $conf = Util::read_file("conf/sqlitelog_buffer_hugepages.conf");
+my $t = Test::Nginx->new()->has(qw/http rewrite/)->plan($total_tests)->write_file_expand('nginx.conf', $conf);
+Util::link_module($t->testdir());
+
+
+###############################################################################
+$t->run();
+
+# Send a few requests
+for (my $i = 1; $i <= 3; $i++) {
+	http_get("/hello-$i");
+}
+
+# Open database
+my $dbpath = File::Spec->catfile($t->testdir(), "access.db");
+my $db = DBI->connect("dbi:SQLite:dbname=${dbpath}", "", "", undef);
+
+# Confirm table is empty
+my $stmt = $db->prepare("SELECT COUNT(*) FROM combined");
+$stmt->execute;
+my @arr = $stmt->fetchrow_array;
+is($arr[0], 0, "Check if table is empty");
+$stmt->finish;
+
+$t->stop();
+###############################################################################
+
+
+# Get count
+$stmt = $db->prepare("SELECT COUNT(*) FROM combined");
+$stmt->execute;
+@arr = $stmt->fetchrow_array;
+is($arr[0], 3, "Check table count");
+$stmt->finish;
+
+
+# Check records, which are stored as one block per log entry
+$stmt = $db->prepare("SELECT request FROM combined ORDER BY rowid");
+$stmt->execute;
+
+my $i = 1;
+while (my @row = $stmt->fetchrow_array) {
+	is($row[0], "GET /hello-$i HTTP/1.0", "Check request $i");
+	$i += 1;
+}
+
+
+# End
+$stmt->finish;
+$db->disconnect;
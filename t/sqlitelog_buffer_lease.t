@@ -0,0 +1,75 @@
+#!/usr/bin/perl
+
+# (C) Serope.com
+
+# In this test, 4 worker processes share a buffer with a flush time. Only one
+# of them may hold the flush lease at a time. Once that worker is killed, one
+# of the others must take the lease over and keep flushing the buffer.
+
+use warnings;
+use strict;
+
+use Test::More;
+BEGIN { use FindBin; chdir($FindBin::Bin); }
+
+use lib 'lib';
+use Test::Nginx;
+
+use DBI;
+use Util;
+use File::Spec;
+
+select STDERR; $| = 1;
+select STDOUT; $| = 1;
+
+
+# Set up
+my $total_tests = 5;
+my $conf = Util::read_file("conf/sqlitelog_buffer_lease.conf");
+my $t = Test::Nginx->new()->has(qw/http rewrite/)->plan($total_tests)->write_file_expand('nginx.conf', $conf);
+Util::link_module($t->testdir());
+
+my $dbpath = File::Spec->catfile($t->testdir(), "access.db");
+
+sub count_records {
+	my $dbh = DBI->connect("dbi:SQLite:dbname=${dbpath}", "", "", undef);
+	my @arr = $dbh->selectrow_array("SELECT COUNT(*) FROM combined");
+	$dbh->disconnect;
+	return $arr[0];
+}
+
+
+###############################################################################
+$t->run();
+
+# Sleep past a few flush intervals (flush=1s), so that every worker has tried
+# to take the lease
+for (1..10) {
+	http_get("/before");
+}
+sleep(4);
+
+is(count_records(), 10, "Check records flushed by the lease holder");
+
+my @holders = ($t->read_file('error.log') =~ /\[debug\] (\d+)#\d+: .*sqlitelog: flush lease taken/g);
+is(scalar(@holders), 1, "Check that one worker took the lease");
+
+# Kill the holder without letting it release the lease, and wait for it to
+# expire (3 flush intervals) and be taken over
+kill('KILL', $holders[0]);
+sleep(1);
+
+for (1..10) {
+	http_get("/after");
+}
+sleep(8);
+
+is(count_records(), 20, "Check records flushed after failover");
+
+$t->stop();
+###############################################################################
+
+
+my $log = $t->read_file('error.log');
+like($log, qr/\[debug\] (?!$holders[0]#)\d+#\d+: .*sqlitelog: flush lease taken, previous: $holders[0]\b/, "Check that another worker took over the lease");
+like($log, qr/sqlitelog: flush handler, not the flusher/, "Check that the other workers didn't flush");
@@ -0,0 +1,88 @@
+#!/usr/bin/perl
+
+# (C) Serope.com
+
+# In this test, we kill Nginx while log entries are still in a persistent
+# buffer, then start it again and check that they were recovered from the
+# journal and committed in order.
+
+use warnings;
+use strict;
+
+use Test::More;
+BEGIN { use FindBin; chdir($FindBin::Bin); }
+
+use lib 'lib';
+use Test::Nginx;
+
+use DBI;
+use Util;
+use File::Spec;
+
+select STDERR; $| = 1;
+select STDOUT; $| = 1;
+
+
+# Set up
+my $total_tests = 7;
+my $conf = Util::read_file("conf/sqlitelog_buffer_persist.conf");
+my $t = Test::Nginx->new()->has(qw/http rewrite/)->plan($total_tests)->write_file_expand('nginx.conf', $conf);
+Util::link_module($t->testdir());
+
+
+###############################################################################
+$t->run();
+
+# Send a few requests
+for (my $i = 1; $i <= 5; $i++) {
+	http_get("/hello-$i");
+}
+
+# Open database
+my $dbpath = File::Spec->catfile($t->testdir(), "access.db");
+my $db = DBI->connect("dbi:SQLite:dbname=${dbpath}", "", "", undef);
+
+# Confirm table is empty
+my $stmt = $db->prepare("SELECT COUNT(*) FROM combined");
+$stmt->execute;
+my @arr = $stmt->fetchrow_array;
+is($arr[0], 0, "Check if table is empty");
+$stmt->finish;
+
+# Kill the master process and its workers, so that the buffer isn't commited;
+# the master is stopped first so that it doesn't respawn the workers
+my $pid = $t->read_file('nginx.pid');
+chomp $pid;
+kill 'STOP', $pid;
+system("pkill -KILL -P $pid");
+kill 'KILL', $pid;
+$t->stop();
+unlink(File::Spec->catfile($t->testdir(), "nginx.pid"));
+
+# Confirm table is still empty
+$stmt = $db->prepare("SELECT COUNT(*) FROM combined");
+$stmt->execute;
+@arr = $stmt->fetchrow_array;
+is($arr[0], 0, "Check if table is empty after kill");
+$stmt->finish;
+
+# Start again, which recovers the journal
+$t->run();
+$t->stop();
+###############################################################################
+
+
+# Check records
+$stmt = $db->prepare("SELECT request FROM combined ORDER BY rowid");
+$stmt->execute;
+
+my $i = 1;
+while (my @row = $stmt->fetchrow_array) {
+	is($row[0], "GET /hello-$i HTTP/1.0", "Check request $i");
+	$i += 1;
+}
+
+
+# End
+$stmt->finish;
+$db->disconnect;
@@ -0,0 +1,92 @@
+#!/usr/bin/perl
+
+# (C) Serope.com
+
+# In this test, we reload Nginx twice while log entries are in the buffer,
+# first with the same buffer size and then with a larger one, and check that
+# neither reload commits the buffer nor loses any of its log entries.
+
+use warnings;
+use strict;
+
+use Test::More;
+BEGIN { use FindBin; chdir($FindBin::Bin); }
+
+use lib 'lib';
+use Test::Nginx;
+
+use DBI;
+use Util;
+use File::Spec;
+
+select STDERR; $| = 1;
+select STDOUT; $| = 1;
+
+
+# Set up
+my $total_tests = 8;
+my $conf = Util::read_file("conf/sqlitelog_buffer_reload.conf");
+my $resized = Util::read_file("conf/sqlitelog_buffer_reload_resized.conf");
+my $t = Test::Nginx->new()->has(qw/http rewrite/)->plan($total_tests)->write_file_expand('nginx.conf', $conf);
+Util::link_module($t->testdir());
+
+
+###############################################################################
+$t->run();
+
+# Open database
+my $dbpath = File::Spec->catfile($t->testdir(), "access.db");
+my $db = DBI->connect("dbi:SQLite:dbname=${dbpath}", "", "", undef);
+
+# Reload with the same buffer size, which takes over the zone
+http_get("/hello-1");
+http_get("/hello-2");
+$t->reload();
+select undef, undef, undef, 2;
+
+my $stmt = $db->prepare("SELECT COUNT(*) FROM combined");
+$stmt->execute;
+my @arr = $stmt->fetchrow_array;
+is($arr[0], 0, "Check if table is empty after reload");
+$stmt->finish;
+
+# Reload with a larger buffer, which moves the log entries to the new zone
+http_get("/hello-3");
+http_get("/hello-4");
+$t->write_file_expand('nginx.conf', $resized);
+$t->reload();
+select undef, undef, undef, 2;
+
+$stmt = $db->prepare("SELECT COUNT(*) FROM combined");
+$stmt->execute;
+@arr = $stmt->fetchrow_array;
+is($arr[0], 0, "Check if table is empty after resizing reload");
+$stmt->finish;
+
+http_get("/hello-5");
+$t->stop();
+###############################################################################
+
+
+# Get count
+$stmt = $db->prepare("SELECT COUNT(*) FROM combined");
+$stmt->execute;
+@arr = $stmt->fetchrow_array;
+is($arr[0], 5, "Check table count");
+$stmt->finish;
+
+
+# Check records, which are still in request order
+$stmt = $db->prepare("SELECT request FROM combined ORDER BY rowid");
+$stmt->execute;
+
+my $i = 1;
+while (my @row = $stmt->fetchrow_array) {
+	is($row[0], "GET /hello-$i HTTP/1.0", "Check request $i");
+	$i += 1;
+}
+
+
+# End
+$stmt->finish;
+$db->disconnect;
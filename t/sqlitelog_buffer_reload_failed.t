@@ -0,0 +1,74 @@
+#!/usr/bin/perl
+
+# (C) Serope.com
+
+# In this test, Nginx reloads with a larger buffer, but the reload fails after
+# the new zone was created, because one of the new listening ports is taken.
+# The old configuration keeps running, and its log entries must still be in
+# its own zone rather than in the new zone, which is discarded.
+
+use warnings;
+use strict;
+
+use Test::More;
+BEGIN { use FindBin; chdir($FindBin::Bin); }
+
+use lib 'lib';
+use Test::Nginx;
+
+use DBI;
+use Util;
+use File::Spec;
+use IO::Socket::INET;
+
+select STDERR; $| = 1;
+select STDOUT; $| = 1;
+
+
+# Set up
+my $total_tests = 4;
+my $conf = Util::read_file("conf/sqlitelog_buffer_reload.conf");
+my $failed = Util::read_file("conf/sqlitelog_buffer_reload_failed.conf");
+my $t = Test::Nginx->new()->has(qw/http rewrite/)->plan($total_tests)->write_file_expand('nginx.conf', $conf);
+Util::link_module($t->testdir());
+
+
+###############################################################################
+$t->run();
+
+http_get("/hello-1");
+http_get("/hello-2");
+
+# Take the new configuration's second port, so that it fails to load
+my $taken = IO::Socket::INET->new(
+	LocalAddr => '127.0.0.1:8081',
+	Listen    => 1,
+	ReuseAddr => 1
+) or die "Can't listen on 127.0.0.1:8081: $!";
+
+$t->write_file_expand('nginx.conf', $failed);
+$t->reload();
+select undef, undef, undef, 5;
+
+http_get("/hello-3");
+$t->stop();
+close($taken);
+###############################################################################
+
+
+# Every log entry is committed by the old configuration's workers
+my $dbpath = File::Spec->catfile($t->testdir(), "access.db");
+my $db = DBI->connect("dbi:SQLite:dbname=${dbpath}", "", "", undef);
+
+my $rows = $db->selectcol_arrayref("SELECT request FROM combined ORDER BY rowid");
+is(scalar(@$rows), 3, "Check table count");
+
+my $i = 1;
+for my $request (@$rows) {
+	is($request, "GET /hello-$i HTTP/1.0", "Check request $i");
+	$i += 1;
+}
+
+
+# End
+$db->disconnect;
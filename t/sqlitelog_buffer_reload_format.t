@@ -0,0 +1,85 @@
+#!/usr/bin/perl
+
+# (C) Serope.com
+
+# In this test, we reload Nginx with a different format but the same buffer
+# size, so the new configuration takes over the zone, while a slow response
+# keeps the old worker process alive. The old worker must give up the flush
+# lease, since it only lists its own format's log entries, so that the new
+# worker takes it and flushes the new log entries on its timer. The old
+# worker's log entries are committed when it exits.
+
+use warnings;
+use strict;
+
+use Test::More;
+BEGIN { use FindBin; chdir($FindBin::Bin); }
+
+use lib 'lib';
+use Test::Nginx;
+
+use DBI;
+use Util;
+use File::Spec;
+
+select STDERR; $| = 1;
+select STDOUT; $| = 1;
+
+
+# Set up
+my $total_tests = 5;
+my $conf = Util::read_file("conf/sqlitelog_buffer_reload_format.conf");
+my $changed = Util::read_file("conf/sqlitelog_buffer_reload_format_changed.conf");
+my $t = Test::Nginx->new()->has(qw/http rewrite/)->plan($total_tests)->write_file_expand('nginx.conf', $conf);
+Util::link_module($t->testdir());
+
+# At 8 KB/s, the slow response takes about 12 seconds
+$t->write_file('slow', 'x' x 98304);
+
+my $dbpath = File::Spec->catfile($t->testdir(), "access.db");
+
+sub count_records {
+	my ($table) = @_;
+	my $dbh = DBI->connect("dbi:SQLite:dbname=${dbpath}", "", "", undef);
+	my @arr = $dbh->selectrow_array("SELECT COUNT(*) FROM ${table}");
+	$dbh->disconnect;
+	return $arr[0];
+}
+
+
+###############################################################################
+$t->run();
+
+# Let the old worker take the lease and flush
+http_get("/hello-0");
+sleep(2);
+
+# Keep the old worker busy, then reload with the changed format
+my $s = http_get("/slow", start => 1);
+select undef, undef, undef, 0.5;
+
+$t->write_file_expand('nginx.conf', $changed);
+$t->reload();
+sleep(1);
+
+# Sleep past the old worker's next flush interval (flush=1s) and the new
+# worker's next lease check (3 flush intervals)
+for (1..3) {
+	http_get("/hello-new");
+}
+sleep(5);
+
+is(count_records("b"), 3, "Check records flushed while the old worker is alive");
+is(count_records("a"), 1, "Check that the old worker is still alive");
+
+my @holders = ($t->read_file('error.log') =~ /\[debug\] (\d+)#\d+: .*sqlitelog: flush lease taken/g);
+is(scalar(@holders), 2, "Check that the lease was taken twice");
+isnt($holders[0], $holders[1], "Check that the new worker took the lease");
+
+# Let the old worker finish and exit
+close($s);
+$t->stop();
+###############################################################################
+
+
+is(count_records("a"), 2, "Check records committed by the old worker");
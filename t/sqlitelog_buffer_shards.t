@@ -0,0 +1,68 @@
+#!/usr/bin/perl
+
+# (C) Serope.com
+
+# In this test, we confirm that a buffer divided into one shard per worker
+# process still inserts log entries in the same order their requests arrived.
+
+use warnings;
+use strict;
+
+use Test::More;
+BEGIN { use FindBin; chdir($FindBin::Bin); }
+
+use lib 'lib';
+use Test::Nginx;
+
+use DBI;
+use Util;
+use File::Spec;
+
+select STDERR; $| = 1;
+select STDOUT; $| = 1;
+
+
+# Set up
+my $total_tests = 101;
+my $conf = Util::read_file("conf/sqlitelog_buffer_shards.conf");
+my $t = Test::Nginx->new()->has(qw/http rewrite/)->plan($total_tests)->write_file_expand('nginx.conf', $conf);
+Util::link_module($t->testdir());
+
+
+###############################################################################
+$t->run();
+
+for (my $i = 1; $i <= 100; $i++) {
+	http_get("/hello-$i");
+}
+
+$t->stop();
+###############################################################################
+
+
+# Open database
+my $dbpath = File::Spec->catfile($t->testdir(), "access.db");
+my $db = DBI->connect("dbi:SQLite:dbname=${dbpath}", "", "", undef);
+
+# Get count
+my $stmt = $db->prepare("SELECT COUNT(*) FROM combined");
+$stmt->execute;
+my @arr = $stmt->fetchrow_array;
+is($arr[0], 100, "Check table count");
+$stmt->finish;
+
+
+# Check order
+$stmt = $db->prepare("SELECT request FROM combined ORDER BY rowid");
+$stmt->execute;
+
+my $i = 1;
+while (my @row = $stmt->fetchrow_array) {
+	is($row[0], "GET /hello-$i HTTP/1.0", "Check request $i");
+	$i += 1;
+}
+
+
+# End
+$stmt->finish;
+$db->disconnect;
@@ -0,0 +1,65 @@
+#!/usr/bin/perl
+
+# (C) Serope.com
+
+# In this test, the buffer is divided into 4 shards of about 48K, and a single
+# keepalive connection, i.e. a single worker process, pushes about 120K of log
+# entries. Once its own shard is full, the worker must push to the others, so
+# the buffer isn't committed until Nginx exits.
+
+use warnings;
+use strict;
+
+use Test::More;
+BEGIN { use FindBin; chdir($FindBin::Bin); }
+
+use lib 'lib';
+use Test::Nginx;
+
+use DBI;
+use Util;
+use File::Spec;
+
+select STDERR; $| = 1;
+select STDOUT; $| = 1;
+
+
+# Set up
+my $total_tests = 4;
+my $requests = 60;
+my $conf = Util::read_file("conf/sqlitelog_buffer_shards_share.conf");
+my $t = Test::Nginx->new()->has(qw/http rewrite/)->plan($total_tests)->write_file_expand('nginx.conf', $conf);
+Util::link_module($t->testdir());
+
+my $dbpath = File::Spec->catfile($t->testdir(), "access.db");
+
+sub count_records {
+	my $dbh = DBI->connect("dbi:SQLite:dbname=${dbpath}", "", "", undef);
+	my @arr = $dbh->selectrow_array("SELECT COUNT(*) FROM combined");
+	$dbh->disconnect;
+	return $arr[0];
+}
+
+
+###############################################################################
+$t->run();
+
+# Pipeline the requests on one connection; each log entry takes a 2K slot
+my $pad = "x" x 1000;
+my $pipeline = "";
+for my $i (1..$requests) {
+	my $connection = ($i == $requests) ? "close" : "keep-alive";
+	$pipeline .= "GET /$i/$pad HTTP/1.1\r\nHost: localhost\r\nConnection: $connection\r\n\r\n";
+}
+my $response = http($pipeline);
+
+my @statuses = ($response =~ /^HTTP\/1\.1 200/mg);
+is(scalar(@statuses), $requests, "Check responses");
+is(count_records(), 0, "Check that the buffer wasn't committed yet");
+
+$t->stop();
+###############################################################################
+
+
+is(count_records(), $requests, "Check records after exit");
+unlike($t->read_file('error.log'), qr/failed to allocate/, "Check for overflows in error.log");
@@ -0,0 +1,57 @@
+#!/usr/bin/perl
+
+# (C) Serope.com
+
+# In this test, a database in WAL mode is checkpointed periodically, so its WAL
+# file is truncated while Nginx is still running.
+
+use warnings;
+use strict;
+
+use Test::More;
+BEGIN { use FindBin; chdir($FindBin::Bin); }
+
+use lib 'lib';
+use Test::Nginx;
+
+use DBI;
+use Util;
+use File::Spec;
+
+select STDERR; $| = 1;
+select STDOUT; $| = 1;
+
+
+# Set up
+my $total_tests = 3;
+my $conf = Util::read_file("conf/sqlitelog_checkpoint.conf");
+my $t = Test::Nginx->new()->has(qw/http rewrite/)->plan($total_tests)->write_file_expand('nginx.conf', $conf);
+Util::link_module($t->testdir());
+Util::link_data("wal.sql", $t->testdir());
+
+
+###############################################################################
+$t->run();
+
+# Send a few requests
+for (my $i = 1; $i <= 3; $i++) {
+	http_get("/hello-$i");
+}
+
+# The WAL file exists, but the first checkpoint truncates it
+my $dbpath = File::Spec->catfile($t->testdir(), "access.db");
+ok(-e "${dbpath}-wal", "Check if WAL file exists");
+sleep(3);
+ok(-e "${dbpath}-wal" && !-s "${dbpath}-wal", "Check if WAL file is truncated");
+
+# The rows are in the database file itself
+my $db = DBI->connect("dbi:SQLite:dbname=${dbpath}", "", "", undef);
+my $stmt = $db->prepare("SELECT COUNT(*) FROM combined");
+$stmt->execute;
+my @arr = $stmt->fetchrow_array;
+is($arr[0], 3, "Check table count");
+$stmt->finish;
+$db->disconnect;
+
+$t->stop();
+###############################################################################
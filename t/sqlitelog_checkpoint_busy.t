@@ -0,0 +1,71 @@
+#!/usr/bin/perl
+
+# (C) Serope.com
+
+# In this test, a reader holds the WAL file for a few seconds, so every
+# periodic checkpoint is busy. Each attempt must return at once rather than
+# wait for the connection's busy timeout (1 second), so the requests served
+# meanwhile aren't held up by the checkpoints.
+
+use warnings;
+use strict;
+
+use Test::More;
+BEGIN { use FindBin; chdir($FindBin::Bin); }
+
+use lib 'lib';
+use Test::Nginx;
+
+use DBI;
+use Util;
+use File::Spec;
+use Time::HiRes qw(time sleep);
+
+select STDERR; $| = 1;
+select STDOUT; $| = 1;
+
+
+# Set up
+my $total_tests = 3;
+my $conf = Util::read_file("conf/sqlitelog_checkpoint.conf");
+my $t = Test::Nginx->new()->has(qw/http rewrite/)->plan($total_tests)->write_file_expand('nginx.conf', $conf);
+Util::link_module($t->testdir());
+Util::link_data("wal.sql", $t->testdir());
+
+
+###############################################################################
+$t->run();
+
+http_get("/hello-0");
+
+# Hold a read transaction, which keeps the WAL file from being truncated
+my $dbpath = File::Spec->catfile($t->testdir(), "access.db");
+my $reader = DBI->connect("dbi:SQLite:dbname=${dbpath}", "", "", undef);
+$reader->begin_work;
+$reader->selectrow_array("SELECT COUNT(*) FROM combined");
+
+# Time the requests while the checkpoints are busy
+my $slowest = 0;
+for my $i (1..30) {
+	my $start = time();
+	http_get("/hello-$i");
+	my $elapsed = time() - $start;
+	$slowest = $elapsed if $elapsed > $slowest;
+	sleep(0.1);
+}
+
+$reader->commit;
+$reader->disconnect;
+
+$t->stop();
+###############################################################################
+
+
+ok($slowest < 0.5, "Check that no request waited for a checkpoint");
+
+my $db = DBI->connect("dbi:SQLite:dbname=${dbpath}", "", "", undef);
+my @arr = $db->selectrow_array("SELECT COUNT(*) FROM combined");
+is($arr[0], 31, "Check table count");
+$db->disconnect;
+
+like($t->read_file('error.log'), qr/periodic checkpoint of database ".*" concluded with SQLITE_BUSY/, "Check that the checkpoints were busy");
@@ -0,0 +1,76 @@
+#!/usr/bin/perl
+
+# (C) Serope.com
+
+# In this test, several worker processes exit at once with two buffered
+# databases in WAL mode. Each buffer is drained by one of them, and each file
+# is checkpointed, within the drain timeout.
+
+use warnings;
+use strict;
+
+use Test::More;
+BEGIN { use FindBin; chdir($FindBin::Bin); }
+
+use lib 'lib';
+use Test::Nginx;
+
+use DBI;
+use Util;
+use File::Spec;
+
+select STDERR; $| = 1;
+select STDOUT; $| = 1;
+
+
+# Set up
+my $total_tests = 10;
+my $conf = Util::read_file("conf/sqlitelog_drain_timeout.conf");
+my $t = Test::Nginx->new()->has(qw/http rewrite/)->plan($total_tests)->write_file_expand('nginx.conf', $conf);
+Util::link_module($t->testdir());
+Util::link_data("wal.sql", $t->testdir());
+
+
+###############################################################################
+$t->run();
+
+# Send a few requests to each database
+for (my $i = 1; $i <= 3; $i++) {
+	http_get("/a/hello-$i");
+	http_get("/b/hello-$i");
+}
+
+$t->stop();
+###############################################################################
+
+
+foreach my $name ("a", "b") {
+	my $dbpath = File::Spec->catfile($t->testdir(), "${name}.db");
+	
+	# WAL file should be checkpointed
+	ok(!-s "${dbpath}-wal", "Check WAL file of ${name}.db");
+	
+	# Open database
+	my $db = DBI->connect("dbi:SQLite:dbname=${dbpath}", "", "", undef);
+	
+	# Get count
+	my $stmt = $db->prepare("SELECT COUNT(*) FROM combined");
+	$stmt->execute;
+	my @arr = $stmt->fetchrow_array;
+	is($arr[0], 3, "Check table count of ${name}.db");
+	$stmt->finish;
+	
+	# Check records, which are committed once each
+	$stmt = $db->prepare("SELECT request FROM combined ORDER BY rowid");
+	$stmt->execute;
+	
+	my $i = 1;
+	while (my @row = $stmt->fetchrow_array) {
+		is($row[0], "GET /${name}/hello-$i HTTP/1.0", "Check request $i of ${name}.db");
+		$i += 1;
+	}
+	
+	# End
+	$stmt->finish;
+	$db->disconnect;
+}
@@ -0,0 +1,73 @@
+#!/usr/bin/perl
+
+# (C) Serope.com
+
+# In this test, 4 worker processes generate ids for the same table at once.
+# Every id must be unique, and the middle 10 bits of each id must hold the
+# worker's process slot rather than its process ID.
+
+use warnings;
+use strict;
+
+use Test::More;
+BEGIN { use FindBin; chdir($FindBin::Bin); }
+
+use lib 'lib';
+use Test::Nginx;
+
+use DBI;
+use Util;
+use File::Spec;
+
+select STDERR; $| = 1;
+select STDOUT; $| = 1;
+
+
+# Set up
+my $total_tests = 3;
+my $clients = 8;
+my $requests = 50;
+my $conf = Util::read_file("conf/sqlitelog_format_id_workers.conf");
+my $t = Test::Nginx->new()->has(qw/http rewrite/)->plan($total_tests)->write_file_expand('nginx.conf', $conf);
+Util::link_module($t->testdir());
+
+
+###############################################################################
+$t->run();
+
+# Send the requests from several clients at once, so that the workers generate
+# ids within the same milliseconds
+my @pids;
+for my $c (1..$clients) {
+	my $pid = fork();
+	die "fork failed" unless defined $pid;
+	if ($pid == 0) {
+		for my $i (1..$requests) {
+			http_get("/client-$c/$i");
+		}
+		exit 0;
+	}
+	push @pids, $pid;
+}
+waitpid($_, 0) for @pids;
+
+$t->stop();
+###############################################################################
+
+
+# Every request is logged, with no constraint error
+my $path = File::Spec->catfile($t->testdir(), "ids.db");
+my $dbh = DBI->connect("dbi:SQLite:dbname=${path}", "", "", undef);
+
+my @arr = $dbh->selectrow_array("SELECT COUNT(DISTINCT id) FROM ids");
+is($arr[0], $clients * $requests, "Count distinct ids");
+
+unlike($t->read_file('error.log'), qr/SQLITE_CONSTRAINT/, "Check for constraint errors in error.log");
+
+# The workers have slots 0 to 3
+@arr = $dbh->selectrow_array("SELECT MAX((id >> 12) & 1023) FROM ids");
+ok($arr[0] < 4, "Check process slots in ids");
+
+
+# End
+$dbh->disconnect;
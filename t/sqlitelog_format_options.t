@@ -0,0 +1,75 @@
+#!/usr/bin/perl
+
+# (C) Serope.com
+
+# In this test, we use table options to create a STRICT table with an id column
+# in strict_id.db, and a WITHOUT ROWID table clustered on $msec and $request_id
+# in clustered.db.
+
+use warnings;
+use strict;
+
+use Test::More;
+BEGIN { use FindBin; chdir($FindBin::Bin); }
+
+use lib 'lib';
+use Test::Nginx;
+
+use DBI;
+use Util;
+use File::Spec;
+
+select STDERR; $| = 1;
+select STDOUT; $| = 1;
+
+
+# Set up
+my $total_tests = 7;
+my $conf = Util::read_file("conf/sqlitelog_format_options.conf");
+my $t = Test::Nginx->new()->has(qw/http rewrite/)->plan($total_tests)->write_file_expand('nginx.conf', $conf);
+Util::link_module($t->testdir());
+
+
+###############################################################################
+$t->run();
+
+http_get('/a');
+http_get('/b');
+http_get('/c');
+
+$t->stop();
+###############################################################################
+
+
+# strict_id.db
+my $path = File::Spec->catfile($t->testdir(), "strict_id.db");
+my $dbh = DBI->connect("dbi:SQLite:dbname=${path}", "", "", undef);
+
+my @arr = $dbh->selectrow_array("SELECT sql FROM sqlite_master WHERE name = 'strict_id'");
+like($arr[0], qr/\bid INTEGER PRIMARY KEY\b/, "Check id column in strict_id");
+like($arr[0], qr/\) STRICT$/, "Check STRICT in strict_id");
+
+@arr = $dbh->selectrow_array("SELECT COUNT(*) FROM strict_id WHERE typeof(id) = 'integer' AND id = rowid");
+is($arr[0], 3, "Check ids are rowids");
+
+my $ids = $dbh->selectcol_arrayref("SELECT id FROM strict_id ORDER BY rowid");
+ok($ids->[0] < $ids->[1] && $ids->[1] < $ids->[2], "Check ids increase");
+$dbh->disconnect;
+
+# clustered.db
+$path = File::Spec->catfile($t->testdir(), "clustered.db");
+$dbh = DBI->connect("dbi:SQLite:dbname=${path}", "", "", undef);
+
+@arr = $dbh->selectrow_array("SELECT sql FROM sqlite_master WHERE name = 'clustered'");
+like($arr[0], qr/PRIMARY KEY \(msec, request_id\)\) WITHOUT ROWID$/, "Check WITHOUT ROWID in clustered");
+
+@arr = $dbh->selectrow_array("SELECT COUNT(*) FROM clustered");
+is($arr[0], 3, "Count records in clustered");
+
+# Both variables make up the key
+@arr = $dbh->selectrow_array("SELECT COUNT(*) FROM pragma_table_info('clustered') WHERE pk > 0");
+is($arr[0], 2, "Check primary key columns in clustered");
+
+
+# End
+$dbh->disconnect;
@@ -0,0 +1,79 @@
+#!/usr/bin/perl
+
+# (C) Serope.com
+
+# In this test, we store $msec as EPOCH_MS and $time_iso8601 as EPOCH_US. Both
+# should be integers that agree with the time of the request.
+
+use warnings;
+use strict;
+
+use Test::More;
+BEGIN { use FindBin; chdir($FindBin::Bin); }
+
+use lib 'lib';
+use Test::Nginx;
+
+use DBI;
+use Util;
+use File::Spec;
+
+select STDERR; $| = 1;
+select STDOUT; $| = 1;
+
+
+# Set up
+my $total_tests = 7;
+my $conf = Util::read_file("conf/sqlitelog_format_types_epoch.conf");
+my $t = Test::Nginx->new()->has(qw/ http /)->plan($total_tests)->write_file_expand('nginx.conf', $conf);
+Util::link_module($t->testdir());
+
+
+###############################################################################
+$t->run();
+
+my $before = time();
+http_get('/hello');
+my $after = time();
+
+$t->stop();
+###############################################################################
+
+
+# Open database
+my $dbpath = File::Spec->catfile($t->testdir(), "access.db");
+my $db = DBI->connect("dbi:SQLite:dbname=${dbpath}", "", "", undef);
+
+
+# Check types
+my @row = $db->selectrow_array("SELECT typeof(msec), typeof(time_iso8601), msec, time_iso8601 FROM epochs");
+is($row[0], "integer", "Check type of msec (integer)");
+is($row[1], "integer", "Check type of time_iso8601 (integer)");
+
+
+# Check values
+ok($row[2] >= $before * 1000 && $row[2] < ($after + 1) * 1000, "Check msec is in milliseconds");
+ok($row[3] >= $before * 1000000 && $row[3] < ($after + 1) * 1000000, "Check time_iso8601 is in microseconds");
+
+
+# Check declared type
+@row = $db->selectrow_array("SELECT type FROM pragma_table_info('epochs') WHERE name = 'msec'");
+is($row[0], "INTEGER", "Check declared type of msec");
+
+
+# Retention uses the EPOCH_MS column; add an expired row and start again,
+# past the first retention run
+my $expired = (time() - 2 * 86400) * 1000;
+$db->do("INSERT INTO epochs VALUES (${expired}, ${expired}000, 200)");
+$t->run();
+sleep(3);
+$t->stop();
+
+@row = $db->selectrow_array("SELECT COUNT(*) FROM epochs WHERE msec = ${expired}");
+is($row[0], 0, "Check expired row is deleted");
+@row = $db->selectrow_array("SELECT COUNT(*) FROM epochs");
+is($row[0], 1, "Check recent row is kept");
+
+
+# End
+$db->disconnect;
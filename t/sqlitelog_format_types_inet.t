@@ -0,0 +1,89 @@
+#!/usr/bin/perl
+
+# (C) Serope.com
+
+# In this test, we store addresses in INET columns.
+# 
+# $remote_addr and $binary_remote_addr should both be the integer 2130706433
+# (127.0.0.1). $http_x_addr is an IPv6 address, a mapped IPv4 address, or not
+# an address at all. A trigger from inet.sql checks the SQL functions.
+
+use warnings;
+use strict;
+
+use Test::More;
+BEGIN { use FindBin; chdir($FindBin::Bin); }
+
+use lib 'lib';
+use Test::Nginx;
+
+use DBI;
+use Util;
+use File::Spec;
+
+select STDERR; $| = 1;
+select STDOUT; $| = 1;
+
+
+# Set up
+my $total_tests = 10;
+my $conf = Util::read_file("conf/sqlitelog_format_types_inet.conf");
+my $t = Test::Nginx->new()->has(qw/ http /)->plan($total_tests);
+Util::link_module($t->testdir());
+Util::link_data("inet.sql", $t->testdir());
+$t->write_file_expand('nginx.conf', $conf);
+
+
+###############################################################################
+$t->run();
+
+http(<<EOF);
+GET /v6 HTTP/1.0
+Host: localhost
+X-Addr: 2001:db8::1
+
+EOF
+
+http(<<EOF);
+GET /mapped HTTP/1.0
+Host: localhost
+X-Addr: ::ffff:10.1.2.3
+
+EOF
+
+http(<<EOF);
+GET /text HTTP/1.0
+Host: localhost
+X-Addr: example.com
+
+EOF
+
+$t->stop();
+###############################################################################
+
+
+# Open database
+my $dbpath = File::Spec->catfile($t->testdir(), "access.db");
+my $db = DBI->connect("dbi:SQLite:dbname=${dbpath}", "", "", undef);
+
+
+# Check values
+my $rows = $db->selectall_arrayref("SELECT remote_addr, binary_remote_addr, typeof(http_x_addr), length(http_x_addr), http_x_addr FROM addrs ORDER BY rowid");
+is($rows->[0][0], 2130706433, "Check remote_addr");
+is($rows->[0][1], 2130706433, "Check binary_remote_addr");
+is($rows->[0][2], "blob", "Check type of IPv6 address");
+is($rows->[0][3], 16, "Check length of IPv6 address");
+is($rows->[1][4], 167838211, "Check mapped IPv4 address");
+is($rows->[2][2], "null", "Check text that isn't an address");
+
+
+# Check functions
+$rows = $db->selectall_arrayref("SELECT * FROM inet_checks");
+is($rows->[0][0], "127.0.0.1", "Check inet_ntop of remote_addr");
+is($rows->[0][1], "127.0.0.1", "Check inet_ntop of binary_remote_addr");
+is($rows->[0][2], 1, "Check inet_in_cidr in network");
+is($rows->[0][3], 0, "Check inet_in_cidr not in network");
+
+
+# End
+$db->disconnect;
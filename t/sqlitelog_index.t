@@ -0,0 +1,71 @@
+#!/usr/bin/perl
+
+# (C) Serope.com
+
+# In this test, we define two indexes on a format, one of them partial. They're
+# created along with the table in immediate.db, while in deferred.db they're
+# only built once Nginx stops.
+
+use warnings;
+use strict;
+
+use Test::More;
+BEGIN { use FindBin; chdir($FindBin::Bin); }
+
+use lib 'lib';
+use Test::Nginx;
+
+use DBI;
+use Util;
+use File::Spec;
+
+select STDERR; $| = 1;
+select STDOUT; $| = 1;
+
+
+# Set up
+my $total_tests = 5;
+my $conf = Util::read_file("conf/sqlitelog_index.conf");
+my $t = Test::Nginx->new()->has(qw/http rewrite/)->plan($total_tests)->write_file_expand('nginx.conf', $conf);
+Util::link_module($t->testdir());
+
+my $sql = "SELECT COUNT(*) FROM sqlite_master WHERE type = 'index' AND name IN ('main_msec', 'errors')";
+
+
+###############################################################################
+$t->run();
+
+http_get('/ok');
+http_get('/missing');
+
+# While running
+my $immpath = File::Spec->catfile($t->testdir(), "immediate.db");
+my $defpath = File::Spec->catfile($t->testdir(), "deferred.db");
+my $imm = DBI->connect("dbi:SQLite:dbname=${immpath}", "", "", undef);
+my $def = DBI->connect("dbi:SQLite:dbname=${defpath}", "", "", undef);
+
+my @arr = $imm->selectrow_array($sql);
+is($arr[0], 2, "Check indexes in immediate.db while running");
+@arr = $def->selectrow_array($sql);
+is($arr[0], 0, "Check indexes in deferred.db while running");
+$def->disconnect;
+
+$t->stop();
+###############################################################################
+
+
+# After stopping
+$def = DBI->connect("dbi:SQLite:dbname=${defpath}", "", "", undef);
+@arr = $def->selectrow_array($sql);
+is($arr[0], 2, "Check indexes in deferred.db after stopping");
+@arr = $def->selectrow_array("SELECT COUNT(*) FROM main");
+is($arr[0], 2, "Count records in deferred.db");
+
+# The partial index is used for errors
+@arr = $imm->selectrow_array("EXPLAIN QUERY PLAN SELECT msec FROM main WHERE status >= 400 AND status = 404");
+like($arr[3], qr/errors/, "Check partial index in immediate.db");
+
+
+# End
+$imm->disconnect;
+$def->disconnect;
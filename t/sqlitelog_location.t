@@ -0,0 +1,86 @@
+#!/usr/bin/perl
+
+# (C) Serope.com
+
+# In this test, sqlitelog is used in location contexts. Requests to /api (and
+# its nested location) are logged to api.db, requests to /health aren't logged,
+# and all other requests are logged to server.db.
+
+use warnings;
+use strict;
+
+use Test::More;
+BEGIN { use FindBin; chdir($FindBin::Bin); }
+
+use lib 'lib';
+use Test::Nginx;
+
+use DBI;
+use Util;
+use File::Spec;
+
+select STDERR; $| = 1;
+select STDOUT; $| = 1;
+
+
+# Set up
+my $total_tests = 6;
+my $conf = Util::read_file("conf/sqlitelog_location.conf");
+my $t = Test::Nginx->new()->has(qw/ http rewrite /)->plan($total_tests)->write_file_expand('nginx.conf', $conf);
+Util::link_module($t->testdir());
+
+
+###############################################################################
+$t->run();
+
+http_get('/api/users');
+http_get('/api/nested/1');
+http_get('/api/nested/2');
+http_get('/health');
+http_get('/health');
+http_get('/other');
+
+$t->stop();
+###############################################################################
+
+
+# Check databases
+my $apipath = File::Spec->catfile($t->testdir(), "api.db");
+my $serverpath = File::Spec->catfile($t->testdir(), "server.db");
+is(-f $apipath, 1, "Check if api.db exists");
+is(-f $serverpath, 1, "Check if server.db exists");
+
+
+# api.db should have 3 records
+my $db = DBI->connect("dbi:SQLite:dbname=${apipath}", "", "", undef);
+my $stmt = $db->prepare("SELECT COUNT(*) FROM main");
+$stmt->execute;
+my @arr = $stmt->fetchrow_array;
+is($arr[0], 3, "Count records in api.db");
+$stmt->finish;
+
+$stmt = $db->prepare("SELECT COUNT(*) FROM main WHERE request LIKE 'GET /api/%'");
+$stmt->execute;
+@arr = $stmt->fetchrow_array;
+is($arr[0], 3, "Count /api records in api.db");
+$stmt->finish;
+$db->disconnect;
+
+
+# server.db should have 1 record, for /other
+$db = DBI->connect("dbi:SQLite:dbname=${serverpath}", "", "", undef);
+$stmt = $db->prepare("SELECT COUNT(*) FROM main");
+$stmt->execute;
+@arr = $stmt->fetchrow_array;
+is($arr[0], 1, "Count records in server.db");
+$stmt->finish;
+
+$stmt = $db->prepare("SELECT request FROM main");
+$stmt->execute;
+@arr = $stmt->fetchrow_array;
+is($arr[0], "GET /other HTTP/1.0", "Check request in server.db");
+
+
+# End
+$stmt->finish;
+$db->disconnect;
@@ -0,0 +1,81 @@
+#!/usr/bin/perl
+
+# (C) Serope.com
+
+# In this test, there's no sqlitelog at the http or server level, only in
+# locations. Requests to /api and its nested location are logged to api.db,
+# requests to /other/nested are logged to nested.db, and requests to /other
+# aren't logged at all.
+
+use warnings;
+use strict;
+
+use Test::More;
+BEGIN { use FindBin; chdir($FindBin::Bin); }
+
+use lib 'lib';
+use Test::Nginx;
+
+use DBI;
+use Util;
+use File::Spec;
+
+select STDERR; $| = 1;
+select STDOUT; $| = 1;
+
+
+# Set up
+my $total_tests = 4;
+my $conf = Util::read_file("conf/sqlitelog_location_only.conf");
+my $t = Test::Nginx->new()->has(qw/ http rewrite /)->plan($total_tests)->write_file_expand('nginx.conf', $conf);
+Util::link_module($t->testdir());
+
+
+###############################################################################
+$t->run();
+
+http_get('/api/users');
+http_get('/api/nested/1');
+http_get('/other');
+http_get('/other/nested/1');
+http_get('/other/nested/2');
+
+$t->stop();
+###############################################################################
+
+
+# api.db should have 2 records
+my $apipath = File::Spec->catfile($t->testdir(), "api.db");
+my $db = DBI->connect("dbi:SQLite:dbname=${apipath}", "", "", undef);
+my $stmt = $db->prepare("SELECT COUNT(*) FROM main");
+$stmt->execute;
+my @arr = $stmt->fetchrow_array;
+is($arr[0], 2, "Count records in api.db");
+$stmt->finish;
+$db->disconnect;
+
+
+# nested.db should have 2 records, both for /other/nested
+my $nestedpath = File::Spec->catfile($t->testdir(), "nested.db");
+$db = DBI->connect("dbi:SQLite:dbname=${nestedpath}", "", "", undef);
+$stmt = $db->prepare("SELECT COUNT(*) FROM main");
+$stmt->execute;
+@arr = $stmt->fetchrow_array;
+is($arr[0], 2, "Count records in nested.db");
+$stmt->finish;
+
+$stmt = $db->prepare("SELECT COUNT(*) FROM main WHERE request LIKE 'GET /other/nested/%'");
+$stmt->execute;
+@arr = $stmt->fetchrow_array;
+is($arr[0], 2, "Count /other/nested records in nested.db");
+$stmt->finish;
+
+$stmt = $db->prepare("SELECT COUNT(*) FROM main WHERE request = 'GET /other HTTP/1.0'");
+$stmt->execute;
+@arr = $stmt->fetchrow_array;
+is($arr[0], 0, "Check that /other isn't logged");
+
+
+# End
+$stmt->finish;
+$db->disconnect;
@@ -0,0 +1,57 @@
+#!/usr/bin/perl
+
+# (C) Serope.com
+
+# In this test, SQLite's memory is limited and counted by the module, and the
+# amount in use is read from $sqlitelog_mem_used.
+
+use warnings;
+use strict;
+
+use Test::More;
+BEGIN { use FindBin; chdir($FindBin::Bin); }
+
+use lib 'lib';
+use Test::Nginx;
+
+use DBI;
+use Util;
+use File::Spec;
+
+select STDERR; $| = 1;
+select STDOUT; $| = 1;
+
+
+# Set up
+my $total_tests = 3;
+my $conf = Util::read_file("conf/sqlitelog_memory.conf");
+my $t = Test::Nginx->new()->has(qw/http rewrite/)->plan($total_tests)->write_file_expand('nginx.conf', $conf);
+Util::link_module($t->testdir());
+
+
+###############################################################################
+$t->run();
+
+# Send a few requests
+for (my $i = 1; $i <= 3; $i++) {
+	http_get("/hello-$i");
+}
+
+# The worker's connection holds some memory, within the limit
+my $r = http_get("/mem");
+my ($used) = $r =~ /\x0d\x0a\x0d\x0a(\d+)/;
+ok(defined $used && $used > 0, "Check if memory is counted");
+ok(defined $used && $used <= 4 * 1024 * 1024, "Check if memory is within the limit");
+
+# The rows are in the database
+my $dbpath = File::Spec->catfile($t->testdir(), "access.db");
+my $db = DBI->connect("dbi:SQLite:dbname=${dbpath}", "", "", undef);
+my $stmt = $db->prepare("SELECT COUNT(*) FROM combined");
+$stmt->execute;
+my @arr = $stmt->fetchrow_array;
+is($arr[0], 3, "Check table count");
+$stmt->finish;
+$db->disconnect;
+
+$t->stop();
+###############################################################################
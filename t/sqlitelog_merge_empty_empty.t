@@ -4,8 +4,8 @@
 
 # In this scenario, both the http and server blocks are empty of sqlitelog
 # directives.
-# At merge time, the implicit ngx_http_sqlitelog_srv_conf_t objects that were
-# created in both blocks should be set to off.
+# At merge time, the implicit configurations that were created in both blocks
+# stay unset, so nothing is logged.
 
 use warnings;
 use strict;
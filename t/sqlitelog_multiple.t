@@ -0,0 +1,86 @@
+#!/usr/bin/perl
+
+# (C) Serope.com
+
+# In this test, a server has three sqlitelogs: every request is logged to
+# requests.db, and errors.db has a table of every request plus a table of
+# errors only. The variables shared by the formats are evaluated once per
+# request, so an error's $request_id is the same wherever it's logged.
+
+use warnings;
+use strict;
+
+use Test::More;
+BEGIN { use FindBin; chdir($FindBin::Bin); }
+
+use lib 'lib';
+use Test::Nginx;
+
+use DBI;
+use Util;
+use File::Spec;
+
+select STDERR; $| = 1;
+select STDOUT; $| = 1;
+
+
+# Set up
+my $total_tests = 6;
+my $conf = Util::read_file("conf/sqlitelog_multiple.conf");
+my $t = Test::Nginx->new()->has(qw/ http map rewrite /)->plan($total_tests)->write_file_expand('nginx.conf', $conf);
+Util::link_module($t->testdir());
+
+
+###############################################################################
+$t->run();
+
+http_get('/ok/1');
+http_get('/ok/2');
+http_get('/missing/1');
+http_get('/ok/3');
+http_get('/missing/2');
+
+$t->stop();
+###############################################################################
+
+
+# Check databases
+my $reqpath = File::Spec->catfile($t->testdir(), "requests.db");
+my $errpath = File::Spec->catfile($t->testdir(), "errors.db");
+is(-f $reqpath, 1, "Check if requests.db exists");
+is(-f $errpath, 1, "Check if errors.db exists");
+
+
+# requests.db should have every request
+my $db = DBI->connect("dbi:SQLite:dbname=${reqpath}", "", "", undef);
+my $stmt = $db->prepare("SELECT COUNT(*) FROM requests");
+$stmt->execute;
+my @arr = $stmt->fetchrow_array;
+is($arr[0], 5, "Count records in requests.db");
+$stmt->finish;
+$db->disconnect;
+
+
+# errors.db should have every request, and the errors
+$db = DBI->connect("dbi:SQLite:dbname=${errpath}", "", "", undef);
+$stmt = $db->prepare("SELECT COUNT(*) FROM requests");
+$stmt->execute;
+@arr = $stmt->fetchrow_array;
+is($arr[0], 5, "Count records in errors.db requests table");
+$stmt->finish;
+
+$stmt = $db->prepare("SELECT COUNT(*) FROM errors WHERE status = 404");
+$stmt->execute;
+@arr = $stmt->fetchrow_array;
+is($arr[0], 2, "Count records in errors.db errors table");
+$stmt->finish;
+
+$stmt = $db->prepare("SELECT COUNT(DISTINCT request_id) FROM errors");
+$stmt->execute;
+@arr = $stmt->fetchrow_array;
+is($arr[0], 2, "Check request ids in errors.db errors table");
+
+
+# End
+$stmt->finish;
+$db->disconnect;
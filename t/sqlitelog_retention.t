@@ -0,0 +1,91 @@
+#!/usr/bin/perl
+
+# (C) Serope.com
+
+# In this test, we use the retention=time option to delete old log entries.
+# Before starting Nginx, old.db is seeded with 2500 log entries from a day ago
+# (more than one chunk) and 5 log entries from a minute ago. The retention
+# timer should delete the former and keep the latter. We also check that
+# new.db, which is created by the module, uses incremental auto vacuum.
+
+use warnings;
+use strict;
+
+use Test::More;
+BEGIN { use FindBin; chdir($FindBin::Bin); }
+
+use lib 'lib';
+use Test::Nginx;
+
+use DBI;
+use Util;
+use File::Spec;
+
+select STDERR; $| = 1;
+select STDOUT; $| = 1;
+
+
+# Set up
+my $total_tests = 5;
+my $conf = Util::read_file("conf/sqlitelog_retention.conf");
+my $t = Test::Nginx->new()->has(qw/http/)->plan($total_tests);
+Util::link_module($t->testdir());
+$t->write_file_expand('nginx.conf', $conf);
+
+
+# Seed old.db
+my $oldpath = File::Spec->catfile($t->testdir(), "old.db");
+my $db = DBI->connect("dbi:SQLite:dbname=${oldpath}", "", "", undef);
+$db->do("CREATE TABLE main (msec REAL, request TEXT)");
+$db->begin_work;
+my $insert = $db->prepare("INSERT INTO main VALUES (?, ?)");
+for (1..2500) {
+	$insert->execute(time() - 86400 + $_ / 1000, "GET /expired HTTP/1.0");
+}
+for (1..5) {
+	$insert->execute(time() - 60, "GET /recent HTTP/1.0");
+}
+$db->commit;
+$insert->finish;
+$db->disconnect;
+
+
+###############################################################################
+$t->run();
+
+http_get_port("/hello", 8080);
+http_get_port("/hello", 8081);
+
+# Sleep past the first retention run
+sleep(3);
+
+$t->stop();
+###############################################################################
+
+
+# Count
+sub count {
+	my ($db, $where) = @_;
+	my $stmt = $db->prepare("SELECT COUNT(*) FROM main WHERE ${where}");
+	$stmt->execute;
+	my @arr = $stmt->fetchrow_array;
+	$stmt->finish;
+	return $arr[0];
+}
+
+
+# Check old.db
+$db = DBI->connect("dbi:SQLite:dbname=${oldpath}", "", "", undef);
+is(count($db, "request = 'GET /expired HTTP/1.0'"), 0, "Expired rows should be deleted");
+is(count($db, "request = 'GET /recent HTTP/1.0'"), 5, "Recent rows should be kept");
+is(count($db, "request = 'GET /hello HTTP/1.0'"), 1, "New row should be kept");
+$db->disconnect;
+
+
+# Check new.db
+my $newpath = File::Spec->catfile($t->testdir(), "new.db");
+$db = DBI->connect("dbi:SQLite:dbname=${newpath}", "", "", undef);
+is(count($db, "1"), 1, "New database should have 1 row");
+my @arr = $db->selectrow_array("PRAGMA auto_vacuum");
+is($arr[0], 2, "New database should use incremental auto vacuum");
+$db->disconnect;
@@ -0,0 +1,87 @@
+#!/usr/bin/perl
+
+# (C) Serope.com
+
+# In this test, old.db is seeded with expired log entries, and another
+# connection holds its write lock for a few seconds, spanning the first
+# retention runs. Without sqlitelog_async, each run is made in the worker's
+# event loop, so it must give up at once rather than wait for the connection's
+# busy timeout (1 second), and the requests served meanwhile by the other
+# server aren't held up. Once the lock is released, the expired rows are
+# deleted.
+
+use warnings;
+use strict;
+
+use Test::More;
+BEGIN { use FindBin; chdir($FindBin::Bin); }
+
+use lib 'lib';
+use Test::Nginx;
+
+use DBI;
+use Util;
+use File::Spec;
+use Time::HiRes qw(time sleep);
+
+select STDERR; $| = 1;
+select STDOUT; $| = 1;
+
+
+# Set up
+my $total_tests = 3;
+my $conf = Util::read_file("conf/sqlitelog_retention.conf");
+my $t = Test::Nginx->new()->has(qw/http/)->plan($total_tests);
+Util::link_module($t->testdir());
+$t->write_file_expand('nginx.conf', $conf);
+
+
+# Seed old.db
+my $oldpath = File::Spec->catfile($t->testdir(), "old.db");
+my $db = DBI->connect("dbi:SQLite:dbname=${oldpath}", "", "", undef);
+$db->do("CREATE TABLE main (msec REAL, request TEXT)");
+$db->begin_work;
+my $insert = $db->prepare("INSERT INTO main VALUES (?, ?)");
+for (1..2500) {
+	$insert->execute(time() - 86400 + $_ / 1000, "GET /expired HTTP/1.0");
+}
+$db->commit;
+$insert->finish;
+
+
+###############################################################################
+$t->run();
+
+# Hold the write lock past the first retention run
+$db->do("BEGIN IMMEDIATE");
+
+# Time the requests to new.db while the retention runs are busy
+my $slowest = 0;
+for my $i (1..25) {
+	my $start = time();
+	http_get_port("/hello-$i", 8081);
+	my $elapsed = time() - $start;
+	$slowest = $elapsed if $elapsed > $slowest;
+	sleep(0.1);
+}
+
+$db->do("COMMIT");
+
+# Sleep past the next retention runs
+sleep(1);
+
+$t->stop();
+###############################################################################
+
+
+ok($slowest < 0.5, "Check that no request waited for a retention run");
+
+my @arr = $db->selectrow_array("SELECT COUNT(*) FROM main");
+is($arr[0], 0, "Expired rows should be deleted");
+$db->disconnect;
+
+my $newpath = File::Spec->catfile($t->testdir(), "new.db");
+$db = DBI->connect("dbi:SQLite:dbname=${newpath}", "", "", undef);
+@arr = $db->selectrow_array("SELECT COUNT(*) FROM main");
+is($arr[0], 25, "New database should have 25 rows");
+$db->disconnect;
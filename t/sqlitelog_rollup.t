@@ -0,0 +1,81 @@
+#!/usr/bin/perl
+
+# (C) Serope.com
+
+# In this test, we use the sqlitelog_rollup directive to count requests by
+# status. The rollup table should be written in the same transaction as the
+# buffered log entries when Nginx exits.
+
+use warnings;
+use strict;
+
+use Test::More;
+BEGIN { use FindBin; chdir($FindBin::Bin); }
+
+use lib 'lib';
+use Test::Nginx;
+
+use DBI;
+use Util;
+use File::Spec;
+
+select STDERR; $| = 1;
+select STDOUT; $| = 1;
+
+
+# Set up
+my $total_tests = 8;
+my $conf = Util::read_file("conf/sqlitelog_rollup.conf");
+my $t = Test::Nginx->new()->has(qw/http rewrite/)->plan($total_tests)->write_file_expand('nginx.conf', $conf);
+Util::link_module($t->testdir());
+
+
+###############################################################################
+$t->run();
+
+for (1..5) {
+	http_get('/ok');
+}
+for (1..3) {
+	http_get('/missing');
+}
+
+$t->stop();
+###############################################################################
+
+
+# Open database
+my $dbpath = File::Spec->catfile($t->testdir(), "access.db");
+my $db = DBI->connect("dbi:SQLite:dbname=${dbpath}", "", "", undef);
+
+
+# Raw log entries
+my @arr = $db->selectrow_array("SELECT COUNT(*) FROM combined");
+is($arr[0], 8, "Check log entry count");
+
+
+# Rollup, summed over buckets in case the requests straddled a minute
+my $stmt = $db->prepare("SELECT SUM(count), SUM(sum_body_bytes_sent), "
+                      . "MIN(min_request_length), MAX(max_request_length), "
+                      . "MIN(bucket % 60) "
+                      . "FROM per_status WHERE status = ?");
+
+$stmt->execute("200");
+my @ok = $stmt->fetchrow_array;
+is($ok[0], 5, "Check count for status 200");
+is($ok[1], 25, "Check sum of body_bytes_sent for status 200");
+ok($ok[2] > 0 && $ok[2] <= $ok[3], "Check min and max of request_length for status 200");
+is($ok[4], 0, "Check bucket alignment for status 200");
+
+$stmt->execute("404");
+my @missing = $stmt->fetchrow_array;
+is($missing[0], 3, "Check count for status 404");
+ok($missing[1] > 0, "Check sum of body_bytes_sent for status 404");
+
+@arr = $db->selectrow_array("SELECT COUNT(*) FROM per_status WHERE status NOT IN ('200', '404')");
+is($arr[0], 0, "Check there are no other groups");
+
+
+# End
+$stmt->finish;
+$db->disconnect;
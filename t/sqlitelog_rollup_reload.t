@@ -0,0 +1,75 @@
+#!/usr/bin/perl
+
+# (C) Serope.com
+
+# In this test, Nginx reloads with another rollup while rollup groups are still
+# in the buffer's zone, which the new configuration takes over. The old groups
+# have another layout, so the new worker processes must leave them to the old
+# ones, which upsert them into the old rollup table as they exit.
+
+use warnings;
+use strict;
+
+use Test::More;
+BEGIN { use FindBin; chdir($FindBin::Bin); }
+
+use lib 'lib';
+use Test::Nginx;
+
+use DBI;
+use Util;
+use File::Spec;
+
+select STDERR; $| = 1;
+select STDOUT; $| = 1;
+
+
+# Set up
+my $total_tests = 5;
+my $conf = Util::read_file("conf/sqlitelog_rollup_reload.conf");
+my $changed = Util::read_file("conf/sqlitelog_rollup_reload_changed.conf");
+my $t = Test::Nginx->new()->has(qw/http rewrite/)->plan($total_tests)->write_file_expand('nginx.conf', $conf);
+Util::link_module($t->testdir());
+
+
+###############################################################################
+$t->run();
+
+for (1..3) {
+	http_get('/ok');
+}
+
+$t->write_file_expand('nginx.conf', $changed);
+$t->reload();
+select undef, undef, undef, 2;
+
+for (1..2) {
+	http_get('/ok');
+}
+
+$t->stop();
+###############################################################################
+
+
+# Open database
+my $dbpath = File::Spec->catfile($t->testdir(), "access.db");
+my $db = DBI->connect("dbi:SQLite:dbname=${dbpath}", "", "", undef);
+
+my @arr = $db->selectrow_array("SELECT COUNT(*) FROM combined");
+is($arr[0], 5, "Check log entry count");
+
+
+# Groups made before the reload
+@arr = $db->selectrow_array("SELECT SUM(count), SUM(sum_body_bytes_sent) FROM per_status WHERE status = '200'");
+is($arr[0], 3, "Check count of the old rollup");
+is($arr[1], 15, "Check sum of body_bytes_sent of the old rollup");
+
+
+# Groups made after the reload
+@arr = $db->selectrow_array("SELECT SUM(count), MIN(max_request_length) FROM per_method WHERE request_method = 'GET' AND status = '200'");
+is($arr[0], 2, "Check count of the new rollup");
+ok($arr[1] > 0, "Check max of request_length of the new rollup");
+
+
+# End
+$db->disconnect;
@@ -0,0 +1,82 @@
+#!/usr/bin/perl
+
+# (C) Serope.com
+
+# In this test, we use sample=0% with sample_errors=100%. Successful requests
+# should never be logged, while every 4xx and 5xx request should be logged.
+
+use warnings;
+use strict;
+
+use Test::More;
+BEGIN { use FindBin; chdir($FindBin::Bin); }
+
+use lib 'lib';
+use Test::Nginx;
+
+use DBI;
+use Util;
+use File::Spec;
+
+select STDERR; $| = 1;
+select STDOUT; $| = 1;
+
+
+# Set up
+my $total_tests = 4;
+my $conf = Util::read_file("conf/sqlitelog_sample.conf");
+my $t = Test::Nginx->new()->has(qw/ http rewrite /)->plan($total_tests)->write_file_expand('nginx.conf', $conf);
+Util::link_module($t->testdir());
+
+
+###############################################################################
+$t->run();
+
+# Not logged
+for (1..10) {
+	http_get("/ok/$_");
+}
+
+# Logged
+for (1..3) {
+	http_get("/missing/$_");
+}
+for (1..2) {
+	http_get("/error/$_");
+}
+
+$t->stop();
+###############################################################################
+
+
+# Check database
+my $dbpath = File::Spec->catfile($t->testdir(), "sample.db");
+is(-f $dbpath, 1, "Check if sample.db exists");
+
+
+# Open database
+my $db = DBI->connect("dbi:SQLite:dbname=${dbpath}", "", "", undef);
+
+
+# Table should have 5 records, all of them errors
+my $stmt = $db->prepare("SELECT COUNT(*) FROM main");
+$stmt->execute;
+my @arr = $stmt->fetchrow_array;
+is($arr[0], 5, "Count records in sample.db");
+$stmt->finish;
+
+$stmt = $db->prepare("SELECT COUNT(*) FROM main WHERE status = 404");
+$stmt->execute;
+@arr = $stmt->fetchrow_array;
+is($arr[0], 3, "Count 404 records in sample.db");
+$stmt->finish;
+
+$stmt = $db->prepare("SELECT COUNT(*) FROM main WHERE status = 500");
+$stmt->execute;
+@arr = $stmt->fetchrow_array;
+is($arr[0], 2, "Count 500 records in sample.db");
+
+
+# End
+$stmt->finish;
+$db->disconnect;
@@ -0,0 +1,70 @@
+#!/usr/bin/perl
+
+# (C) Serope.com
+
+# In this test, we use sample=50%. About half of the requests should be logged,
+# the same requests should be logged when they're sent again in the same order
+# to a fresh Nginx, and the rollup should count every request.
+
+use warnings;
+use strict;
+
+use Test::More;
+BEGIN { use FindBin; chdir($FindBin::Bin); }
+
+use lib 'lib';
+use Test::Nginx;
+
+use DBI;
+use Util;
+use File::Spec;
+
+select STDERR; $| = 1;
+select STDOUT; $| = 1;
+
+
+# Set up
+my $total_tests = 5;
+my $requests = 200;
+my $conf = Util::read_file("conf/sqlitelog_sample_rate.conf");
+my $t = Test::Nginx->new()->has(qw/ http rewrite /)->plan($total_tests)->write_file_expand('nginx.conf', $conf);
+Util::link_module($t->testdir());
+my $dbpath = File::Spec->catfile($t->testdir(), "sample.db");
+
+
+# Send the requests to a fresh Nginx, one connection each, and get the logged
+# requests and the rollup's count
+sub run_once {
+	unlink($dbpath);
+	$t->run();
+	for (1..$requests) {
+		http_get("/ok/$_");
+	}
+	$t->stop();
+	
+	my $db = DBI->connect("dbi:SQLite:dbname=${dbpath}", "", "", undef);
+	my $logged = $db->selectcol_arrayref("SELECT request FROM main ORDER BY request");
+	my ($count) = $db->selectrow_array("SELECT SUM(count) FROM per_status");
+	$db->disconnect;
+	
+	return ($logged, $count);
+}
+
+
+###############################################################################
+my ($first, $first_count) = run_once();
+my ($second, $second_count) = run_once();
+###############################################################################
+
+
+# Roughly half of the requests are logged
+my $n = scalar(@$first);
+ok($n > $requests * 0.3 && $n < $requests * 0.7, "Check if about half of the requests are logged ($n)");
+
+# The same requests get the same decision
+is(scalar(@$second), $n, "Check if both runs log the same number of requests");
+is_deeply($second, $first, "Check if both runs log the same requests");
+
+# The rollup isn't sampled
+is($first_count, $requests, "Check rollup count of the first run");
+is($second_count, $requests, "Check rollup count of the second run");
@@ -0,0 +1,80 @@
+#!/usr/bin/perl
+
+# (C) Serope.com
+
+# In this test, two servers write to the same file with different formats. The
+# file has one connection and one buffer, which is only declared by the first
+# server, so the second server's log entries are buffered too. Both tables
+# should be empty until Nginx stops, when they are committed together.
+
+use warnings;
+use strict;
+
+use Test::More;
+BEGIN { use FindBin; chdir($FindBin::Bin); }
+
+use lib 'lib';
+use Test::Nginx;
+
+use DBI;
+use Util;
+use File::Spec;
+
+select STDERR; $| = 1;
+select STDOUT; $| = 1;
+
+
+# Set up
+my $total_tests = 4;
+my $conf = Util::read_file("conf/sqlitelog_shared.conf");
+my $t = Test::Nginx->new()->has(qw/http rewrite/)->plan($total_tests)->write_file_expand('nginx.conf', $conf);
+Util::link_module($t->testdir());
+
+
+###############################################################################
+$t->run();
+
+for (1..3) {
+	http_get_port("/api", 8080);
+}
+for (1..2) {
+	http_get_port("/web", 8081);
+}
+
+# Both tables are still buffered
+my $dbpath = File::Spec->catfile($t->testdir(), "shared.db");
+my $db = DBI->connect("dbi:SQLite:dbname=${dbpath}", "", "", undef);
+my $stmt = $db->prepare("SELECT (SELECT COUNT(*) FROM api) + (SELECT COUNT(*) FROM web)");
+$stmt->execute;
+my @arr = $stmt->fetchrow_array;
+is($arr[0], 0, "Check if tables are empty");
+$stmt->finish;
+
+$t->stop();
+###############################################################################
+
+
+# api table
+$stmt = $db->prepare("SELECT COUNT(*) FROM api WHERE request LIKE 'GET /api %'");
+$stmt->execute;
+@arr = $stmt->fetchrow_array;
+is($arr[0], 3, "Count records in api table");
+$stmt->finish;
+
+# web table
+$stmt = $db->prepare("SELECT COUNT(*) FROM web WHERE request LIKE 'GET /web %'");
+$stmt->execute;
+@arr = $stmt->fetchrow_array;
+is($arr[0], 2, "Count records in web table");
+$stmt->finish;
+
+# No other tables
+$stmt = $db->prepare("SELECT COUNT(*) FROM sqlite_master WHERE type = 'table'");
+$stmt->execute;
+@arr = $stmt->fetchrow_array;
+is($arr[0], 2, "Count tables");
+
+
+# End
+$stmt->finish;
+$db->disconnect;
@@ -0,0 +1,148 @@
+
+/*
+ * Copyright (C) Serope.com
+ * 
+ * Insert benchmark for comparing SQLite builds (see bench.sh). It inserts
+ * combined-format log entries into a database in WAL mode, the way the
+ * module does: a prepared statement per row, and a transaction per batch of
+ * rows, as a buffer commits them.
+ * 
+ * Usage: bench PATH ROWS BATCH
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <sqlite3.h>
+
+
+static const char  *sql_create =
+    "CREATE TABLE IF NOT EXISTS combined (remote_addr TEXT, remote_user TEXT, "
+    "time_local TEXT, request TEXT, status INTEGER, body_bytes_sent INTEGER, "
+    "http_referer TEXT, http_user_agent TEXT)";
+
+static const char  *sql_insert =
+    "INSERT INTO combined VALUES (?, ?, ?, ?, ?, ?, ?, ?)";
+
+
+/**
+ * Execute a statement, exiting on failure.
+ * 
+ * @param   db      a database connection
+ * @param   sql     the statement
+ */
+static void
+bench_exec(sqlite3 *db, const char *sql)
+{
+    char  *err;
+    
+    if (sqlite3_exec(db, sql, NULL, NULL, &err) != SQLITE_OK) {
+        fprintf(stderr, "bench: \"%s\" failed: %s\n", sql, err);
+        exit(1);
+    }
+}
+
+
+/**
+ * Get the current time in seconds.
+ * 
+ * @return          the monotonic time, in seconds
+ */
+static double
+bench_now(void)
+{
+    struct timespec  ts;
+    
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+/**
+ * Insert ROWS log entries into the database at PATH, BATCH per transaction,
+ * and print the insert rate.
+ */
+int
+main(int argc, char **argv)
+{
+    int            i;
+    int            rows;
+    int            batch;
+    char           request[64];
+    double         start;
+    double         elapsed;
+    sqlite3       *db;
+    sqlite3_stmt  *stmt;
+    
+    if (argc != 4) {
+        fprintf(stderr, "usage: bench PATH ROWS BATCH\n");
+        return 1;
+    }
+    rows = atoi(argv[2]);
+    batch = atoi(argv[3]);
+    if (rows <= 0 || batch <= 0) {
+        fprintf(stderr, "bench: ROWS and BATCH must be positive\n");
+        return 1;
+    }
+    
+    /* Set up */
+    if (sqlite3_open_v2(argv[1], &db,
+                        SQLITE_OPEN_READWRITE|SQLITE_OPEN_CREATE, NULL)
+        != SQLITE_OK)
+    {
+        fprintf(stderr, "bench: failed to open \"%s\"\n", argv[1]);
+        return 1;
+    }
+    bench_exec(db, "PRAGMA journal_mode=wal");
+    bench_exec(db, sql_create);
+    
+    if (sqlite3_prepare_v2(db, sql_insert, -1, &stmt, NULL) != SQLITE_OK) {
+        fprintf(stderr, "bench: failed to prepare insert: %s\n",
+                sqlite3_errmsg(db));
+        return 1;
+    }
+    
+    /* Insert */
+    start = bench_now();
+    
+    for (i = 0; i < rows; i++) {
+        if (i % batch == 0) {
+            bench_exec(db, "BEGIN");
+        }
+        
+        snprintf(request, sizeof(request), "GET /hello-%d HTTP/1.1", i);
+        
+        sqlite3_bind_text(stmt, 1, "127.0.0.1", -1, SQLITE_STATIC);
+        sqlite3_bind_null(stmt, 2);
+        sqlite3_bind_text(stmt, 3, "18/Oct/2026:12:00:00 +0000", -1,
+                          SQLITE_STATIC);
+        sqlite3_bind_text(stmt, 4, request, -1, SQLITE_STATIC);
+        sqlite3_bind_int(stmt, 5, 200);
+        sqlite3_bind_int(stmt, 6, 612);
+        sqlite3_bind_null(stmt, 7);
+        sqlite3_bind_text(stmt, 8, "curl/8.0", -1, SQLITE_STATIC);
+        
+        if (sqlite3_step(stmt) != SQLITE_DONE) {
+            fprintf(stderr, "bench: insert failed: %s\n", sqlite3_errmsg(db));
+            return 1;
+        }
+        sqlite3_reset(stmt);
+        
+        if (i % batch == batch - 1 || i == rows - 1) {
+            bench_exec(db, "COMMIT");
+        }
+    }
+    
+    elapsed = bench_now() - start;
+    
+    printf("%s: %d rows, %d per transaction, %.3f s, %.0f rows/s\n",
+           sqlite3_libversion(), rows, batch, elapsed, rows / elapsed);
+    
+    sqlite3_finalize(stmt);
+    sqlite3_close(db);
+    
+    return 0;
+}
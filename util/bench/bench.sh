@@ -0,0 +1,37 @@
+# Compare the system's SQLite, the amalgamation with its default options, and
+# the amalgamation with the bundled build's tuned options (see
+# src/ngx_http_sqlitelog_amalgamation.c). The difference between the last two
+# is the effect of the options alone.
+
+if [ $# -lt 1 ]; then
+   echo "Usage: sh bench.sh AMALGAMATION_DIR [ROWS] [\"BATCH...\"]"
+   exit
+fi
+
+amalgamation=$(cd $1 && pwd) || exit 1
+rows=${2:-200000}
+batches=${3:-1 100 10000}
+
+dir=$(cd $(dirname $0) && pwd)
+src=$(dirname $(dirname $dir))/src
+tmp=$(mktemp -d)
+
+# The bundled build sees the same configuration as Nginx with thread pools
+printf "#define NGX_HTTP_SQLITELOG_AMALGAMATION 1\n#define NGX_THREADS 1\n" \
+    > $tmp/ngx_auto_config.h
+
+cc -O2 -o $tmp/bench-system $dir/bench.c -lsqlite3 || exit 1
+cc -O2 -o $tmp/bench-default -I$amalgamation \
+    $dir/bench.c $amalgamation/sqlite3.c -lpthread -ldl -lm || exit 1
+cc -O2 -o $tmp/bench-tuned -I$tmp -I$amalgamation \
+    $dir/bench.c $src/ngx_http_sqlitelog_amalgamation.c -lpthread -lm || exit 1
+
+for batch in $batches; do
+    for build in system default tuned; do
+        rm -f $tmp/bench.db*
+        printf "%-8s " $build
+        $tmp/bench-$build $tmp/bench.db $rows $batch
+    done
+done
+
+rm -r $tmp